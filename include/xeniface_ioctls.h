@@ -43,6 +43,111 @@ DEFINE_GUID(GUID_INTERFACE_XENIFACE, \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_XENIFACE_STORE_REMOVE \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_CACHE_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_TRACE_DUMP \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_LATENCY_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_LATENCY_RESET \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_CONTENTION_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_CONTENTION_RESET \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_POOL_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_POOL_OUTSTANDING \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _XENIFACE_CACHE_STATISTICS {
+    ULONGLONG   Hits;
+    ULONGLONG   Misses;
+    ULONGLONG   Invalidations;
+    ULONG       Prefixes;
+    ULONG       Entries;
+} XENIFACE_CACHE_STATISTICS, *PXENIFACE_CACHE_STATISTICS;
+
+typedef enum _XENIFACE_LATENCY_OPERATION {
+    XENIFACE_LATENCY_IOCTL_READ = 0,
+    XENIFACE_LATENCY_IOCTL_WRITE,
+    XENIFACE_LATENCY_IOCTL_DIRECTORY,
+    XENIFACE_LATENCY_IOCTL_REMOVE,
+    XENIFACE_LATENCY_WMI_METHOD,        // Any CitrixXenStoreSession method
+    XENIFACE_LATENCY_SESSION_LOCK,      // Wait to acquire the session lock
+    XENIFACE_LATENCY_STORE_WATCH,
+    XENIFACE_LATENCY_WATCH_DELIVERY,    // Watch signalled to WMI event fired
+    XENIFACE_LATENCY_SUSPEND,
+    XENIFACE_LATENCY_RESUME,
+    XENIFACE_LATENCY_OPERATIONS
+} XENIFACE_LATENCY_OPERATION;
+
+// Latencies are in nanoseconds. Values below 4 have a bucket each; above
+// that, bucket b (b >= 4) counts values from (4 + b % 4) << (b / 4 - 1)
+// up to the start of bucket b + 1, i.e. four buckets per power of two.
+// The last bucket also counts everything beyond it.
+#define XENIFACE_LATENCY_BUCKETS    128
+
+typedef struct _XENIFACE_LATENCY_STATISTICS {
+    ULONG       Operations;
+    ULONG       Buckets;
+    ULONG       Samples;    // Operations * Buckets
+    ULONGLONG   Count[XENIFACE_LATENCY_OPERATIONS];
+    ULONGLONG   Total[XENIFACE_LATENCY_OPERATIONS];
+    ULONGLONG   Maximum[XENIFACE_LATENCY_OPERATIONS];
+    ULONGLONG   Histogram[XENIFACE_LATENCY_OPERATIONS][XENIFACE_LATENCY_BUCKETS];
+} XENIFACE_LATENCY_STATISTICS, *PXENIFACE_LATENCY_STATISTICS;
+
+typedef enum _XENIFACE_LOCK_CLASS {
+    XENIFACE_LOCK_SESSION = 0,      // The FDO's session list lock
+    XENIFACE_LOCK_WATCH_MAP,        // Every session's watch list lock
+    XENIFACE_LOCK_FDO_MUTEX,        // The FDO's XENIFACE_MUTEX
+    XENIFACE_LOCK_MIRROR,           // The registry mirror's lock
+    XENIFACE_LOCK_CLASSES
+} XENIFACE_LOCK_CLASS;
+
+// Times are in nanoseconds
+typedef struct _XENIFACE_CONTENTION_STATISTICS {
+    ULONG       Classes;
+    ULONGLONG   Acquisitions[XENIFACE_LOCK_CLASSES];
+    ULONGLONG   Contended[XENIFACE_LOCK_CLASSES];
+    ULONGLONG   WaitTime[XENIFACE_LOCK_CLASSES];
+    ULONGLONG   MaximumHold[XENIFACE_LOCK_CLASSES];   // Over contended and sampled acquisitions
+} XENIFACE_CONTENTION_STATISTICS, *PXENIFACE_CONTENTION_STATISTICS;
+
+typedef enum _XENIFACE_POOL_CLASS {
+    XENIFACE_POOL_SESSION = 0,      // 'XenP': sessions, watches, paths
+    XENIFACE_POOL_EVENT,            // 'XIEV': WMI event buffers
+    XENIFACE_POOL_FDO,              // 'ODF': FDO and its device objects
+    XENIFACE_POOL_CLASSES
+} XENIFACE_POOL_CLASS;
+
+// HighWaterBytes is sampled, so may lag a short-lived peak
+typedef struct _XENIFACE_POOL_STATISTICS {
+    ULONG       Classes;
+    ULONG       Tag[XENIFACE_POOL_CLASSES];
+    ULONGLONG   Allocations[XENIFACE_POOL_CLASSES];
+    ULONGLONG   LiveObjects[XENIFACE_POOL_CLASSES];
+    ULONGLONG   LiveBytes[XENIFACE_POOL_CLASSES];
+    ULONGLONG   HighWaterBytes[XENIFACE_POOL_CLASSES];
+} XENIFACE_POOL_STATISTICS, *PXENIFACE_POOL_STATISTICS;
+
+// IOCTL_XENIFACE_POOL_OUTSTANDING returns one of these for each live
+// allocation, when tracking is enabled by the PoolTrack registry value.
+// A zero length request returns the size required.
+//
+// This request, IOCTL_XENIFACE_LATENCY_RESET and
+// IOCTL_XENIFACE_CONTENTION_RESET fail with STATUS_PRIVILEGE_NOT_HELD
+// unless the caller has SeDebugPrivilege enabled.
+typedef struct _XENIFACE_POOL_ALLOCATION {
+    ULONGLONG   Caller;     // Offset into the driver image, or 0
+    ULONG       Class;
+    ULONG       Length;
+} XENIFACE_POOL_ALLOCATION, *PXENIFACE_POOL_ALLOCATION;
+
+// IOCTL_XENIFACE_TRACE_DUMP returns an XENIFACE_TRACE_HEADER followed by
+// the trace records; see xeniface_trace.h. Like the pool listing, it
+// needs SeDebugPrivilege.
 
 #endif // _XENIFACE_IOCTLS_H_
 
@@ -0,0 +1,90 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_TRACE_FORMAT_H_
+#define _XENIFACE_TRACE_FORMAT_H_
+
+// Binary trace records, as returned by IOCTL_XENIFACE_TRACE_DUMP. This
+// header is also read by xentrace.py, which takes the format strings
+// from the table below, so keep each entry on one line and use only
+// %d, %u and %x conversions (with optional width) and one %s, which
+// stands for Text. Arguments never hold kernel addresses; sessions and
+// watches are named by their ids.
+
+#define XENIFACE_TRACE_EVENTS                                                           \
+    XENIFACE_TRACE_EVENT(IoctlRead,     "IoctlRead %s: length %u out %u status %08x")   \
+    XENIFACE_TRACE_EVENT(IoctlWrite,    "IoctlWrite %s: length %u status %08x")         \
+    XENIFACE_TRACE_EVENT(IoctlDirectory, "IoctlDirectory %s: length %u count %u status %08x") \
+    XENIFACE_TRACE_EVENT(IoctlRemove,   "IoctlRemove %s: status %08x")                  \
+    XENIFACE_TRACE_EVENT(StartWatch,    "StartWatch %s: watch %u status %08x")          \
+    XENIFACE_TRACE_EVENT(AddWatch,      "AddWatch %s: session %x watch %u count %u")    \
+    XENIFACE_TRACE_EVENT(RemoveWatch,   "RemoveWatch %s: session %x watch %u")          \
+    XENIFACE_TRACE_EVENT(FireWatch,     "FireWatch %s: flags %x")                       \
+    XENIFACE_TRACE_EVENT(DropEvent,     "DropEvent: session %x pending %u")
+
+#define XENIFACE_TRACE_EVENT(_Name, _Format)    XENIFACE_TRACE_ ## _Name,
+
+typedef enum _XENIFACE_TRACE_EVENT {
+    XENIFACE_TRACE_INVALID = 0,
+    XENIFACE_TRACE_EVENTS
+    XENIFACE_TRACE_EVENT_COUNT
+} XENIFACE_TRACE_EVENT;
+
+#undef XENIFACE_TRACE_EVENT
+
+#define XENIFACE_TRACE_VERSION      2
+#define XENIFACE_TRACE_ARGUMENTS    3
+#define XENIFACE_TRACE_TEXT         24
+
+// One 64 byte record. Sequence is written last; a record whose
+// Sequence is zero was never completed.
+typedef struct _XENIFACE_TRACE_RECORD {
+    ULONGLONG   Timestamp;      // KeQueryPerformanceCounter() ticks
+    ULONG       Sequence;
+    USHORT      Event;
+    USHORT      Cpu;
+    ULONGLONG   Argument[XENIFACE_TRACE_ARGUMENTS];
+    CHAR        Text[XENIFACE_TRACE_TEXT];  // Tail of a path, not terminated if full
+} XENIFACE_TRACE_RECORD, *PXENIFACE_TRACE_RECORD;
+
+// The dump is this header followed by Cpus * RecordsPerCpu records, in
+// ring order for each processor. The same layout is written to crash
+// dumps as secondary data tagged {A3B9F0C2-61D4-4E8A-9C3E-5B7D12E4F086}
+// (retrieve it with the debugger's .enumtag command).
+typedef struct _XENIFACE_TRACE_HEADER {
+    ULONG       Version;
+    ULONG       Cpus;
+    ULONG       RecordsPerCpu;
+    ULONG       RecordSize;
+    ULONGLONG   Frequency;
+} XENIFACE_TRACE_HEADER, *PXENIFACE_TRACE_HEADER;
+
+#endif // _XENIFACE_TRACE_FORMAT_H_
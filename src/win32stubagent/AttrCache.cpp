@@ -0,0 +1,308 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include "stdafx.h"
+#include "XSAccessor.h"
+#include "WMIAccessor.h"
+#include "XService.h"
+#include "AttrCache.h"
+
+//
+// Attributes published at registration change only with a reboot or a
+// hotfix install, yet re-registration used to rewrite every one of them
+// and re-enumerate Win32_QuickFixEngineering.  The hotfix list and a
+// hash of the last published set are kept in the registry so that an
+// unchanged set is not written again, even across agent restarts.
+//
+
+#define ATTR_CACHE_KEY \
+    "SYSTEM\\CurrentControlSet\\Services\\" SVC_NAME "\\Parameters"
+
+static CRITICAL_SECTION AttrCacheLock;
+static vector<string> AttrCacheHotFixes;
+static ULONGLONG AttrCachePublished;
+static HANDLE AttrCacheScanThread;
+
+struct AttrCacheScan {
+    WMIAccessor *wmi;
+    void (*Changed)(void *);
+    void *Ctx;
+};
+
+void
+AttrSetPrintf(AttrSet& attrs, const char *path, const char *fmt, ...)
+{
+    va_list args;
+    char buf[4096];
+
+    va_start(args, fmt);
+    _vsnprintf(buf, sizeof (buf), fmt, args);
+    va_end(args);
+    buf[sizeof (buf) - 1] = '\0';
+
+    attrs[path] = buf;
+}
+
+// FNV-1a over every path and value, in path order
+static ULONGLONG
+AttrSetHash(const AttrSet& attrs)
+{
+    ULONGLONG hash = 14695981039346656037ULL;
+    AttrSet::const_iterator it;
+
+    for (it = attrs.begin(); it != attrs.end(); it++) {
+        const string *parts[2] = { &it->first, &it->second };
+        unsigned x;
+
+        for (x = 0; x < 2; x++) {
+            const char *c = parts[x]->c_str();
+            size_t len = parts[x]->length() + 1;    // and the terminator
+
+            while (len--) {
+                hash ^= (unsigned char)*c++;
+                hash *= 1099511628211ULL;
+            }
+        }
+    }
+
+    return hash;
+}
+
+static void
+AttrCacheLoad(void)
+{
+    HKEY key;
+    DWORD type;
+    DWORD size;
+    char *buf;
+    const char *c;
+
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, ATTR_CACHE_KEY, 0, KEY_READ,
+                     &key) != ERROR_SUCCESS)
+        return;
+
+    size = sizeof (AttrCachePublished);
+    if (RegQueryValueEx(key, "AttrHash", NULL, &type,
+                        (LPBYTE)&AttrCachePublished, &size) != ERROR_SUCCESS ||
+        type != REG_BINARY || size != sizeof (AttrCachePublished))
+        AttrCachePublished = 0;
+
+    size = 0;
+    if (RegQueryValueEx(key, "HotFixes", NULL, &type, NULL,
+                        &size) != ERROR_SUCCESS || type != REG_MULTI_SZ)
+        goto done;
+
+    buf = (char *)calloc(1, size + 2);
+    if (buf == NULL)
+        goto done;
+
+    if (RegQueryValueEx(key, "HotFixes", NULL, &type, (LPBYTE)buf,
+                        &size) == ERROR_SUCCESS) {
+        for (c = buf; *c != '\0'; c += strlen(c) + 1)
+            AttrCacheHotFixes.push_back(c);
+    }
+    free(buf);
+
+done:
+    RegCloseKey(key);
+}
+
+static void
+AttrCacheSave(BOOL hotfixes)
+{
+    HKEY key;
+    string multi;
+    size_t x;
+
+    if (RegCreateKeyEx(HKEY_LOCAL_MACHINE, ATTR_CACHE_KEY, 0, NULL, 0,
+                       KEY_WRITE, NULL, &key, NULL) != ERROR_SUCCESS) {
+        PrintError("RegCreateKeyEx(" ATTR_CACHE_KEY ")");
+        return;
+    }
+
+    RegSetValueEx(key, "AttrHash", 0, REG_BINARY,
+                  (const BYTE *)&AttrCachePublished,
+                  sizeof (AttrCachePublished));
+
+    if (hotfixes) {
+        for (x = 0; x < AttrCacheHotFixes.size(); x++) {
+            multi += AttrCacheHotFixes[x];
+            multi += '\0';
+        }
+        multi += '\0';
+
+        RegSetValueEx(key, "HotFixes", 0, REG_MULTI_SZ,
+                      (const BYTE *)multi.data(), (DWORD)multi.length());
+    }
+
+    RegCloseKey(key);
+}
+
+void
+AttrCacheInit(void)
+{
+    InitializeCriticalSection(&AttrCacheLock);
+    AttrCacheLoad();
+}
+
+static DWORD WINAPI
+AttrCacheScanHotFixes(LPVOID arg)
+{
+    struct AttrCacheScan *scan = (struct AttrCacheScan *)arg;
+    vector<string> hotfixes;
+    BOOL changed = FALSE;
+    HRESULT hr;
+
+    hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    if (GetHotFixInfo(scan->wmi, hotfixes)) {
+        EnterCriticalSection(&AttrCacheLock);
+        if (hotfixes != AttrCacheHotFixes) {
+            AttrCacheHotFixes = hotfixes;
+            AttrCacheSave(TRUE);
+            changed = TRUE;
+        }
+        LeaveCriticalSection(&AttrCacheLock);
+    }
+
+    XsLog("hotfix scan found %d hotfixes%s", (int)hotfixes.size(),
+          (changed) ? " (changed)" : "");
+    if (changed)
+        scan->Changed(scan->Ctx);
+
+    if (SUCCEEDED(hr))
+        CoUninitialize();
+    delete scan;
+    return 0;
+}
+
+void
+AttrCacheStartHotFixScan(WMIAccessor *wmi, void (*Changed)(void *),
+                         void *Ctx)
+{
+    struct AttrCacheScan *scan;
+
+    // A scan still running is left to finish; a finished one is reaped
+    // so that another can start.
+    if (AttrCacheScanThread != NULL) {
+        if (WaitForSingleObject(AttrCacheScanThread, 0) != WAIT_OBJECT_0)
+            return;
+        CloseHandle(AttrCacheScanThread);
+        AttrCacheScanThread = NULL;
+    }
+
+    scan = new AttrCacheScan;
+    scan->wmi = wmi;
+    scan->Changed = Changed;
+    scan->Ctx = Ctx;
+
+    AttrCacheScanThread = CreateThread(NULL, 0, AttrCacheScanHotFixes,
+                                       scan, 0, NULL);
+    if (AttrCacheScanThread == NULL) {
+        PrintError("CreateThread(AttrCacheScanHotFixes)");
+        delete scan;
+    }
+}
+
+// Wait for the scan, which uses the WMI accessor and the caller's
+// context, before either goes away.
+void
+AttrCacheStopHotFixScan(void)
+{
+    if (AttrCacheScanThread == NULL)
+        return;
+
+    WaitForSingleObject(AttrCacheScanThread, INFINITE);
+    CloseHandle(AttrCacheScanThread);
+    AttrCacheScanThread = NULL;
+}
+
+void
+AttrCacheGetHotFixes(AttrSet& attrs)
+{
+    size_t x;
+
+    EnterCriticalSection(&AttrCacheLock);
+    for (x = 0; x < AttrCacheHotFixes.size(); x++) {
+        char path[MAX_XENBUS_PATH];
+
+        _snprintf(path, sizeof (path), "attr/os/hotfixes/%d", (int)x);
+        path[sizeof (path) - 1] = '\0';
+        attrs[path] = AttrCacheHotFixes[x];
+    }
+    LeaveCriticalSection(&AttrCacheLock);
+}
+
+static int
+AttrCacheWrite(void *ctx)
+{
+    const AttrSet *attrs = (const AttrSet *)ctx;
+    AttrSet::const_iterator it;
+
+    // Drop hotfixes beyond the end of a shorter list
+    XenstoreRemove("attr/os/hotfixes");
+
+    for (it = attrs->begin(); it != attrs->end(); it++) {
+        if (XenstoreWrite(it->first.c_str(), it->second.c_str(),
+                          it->second.length()) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int
+AttrCachePublish(const AttrSet& attrs)
+{
+    ULONGLONG hash = AttrSetHash(attrs);
+    char *value;
+
+    // The toolstack wipes attr/ wholesale, so one key tells whether the
+    // last published set is still there.
+    if (hash == AttrCachePublished &&
+        XenstoreRead("attr/os/class", &value) >= 0) {
+        XenstoreFree(value);
+        return 0;
+    }
+
+    if (XenstoreTransaction(AttrCacheWrite, (void *)&attrs) < 0) {
+        XsLog("failed to publish %d attributes", (int)attrs.size());
+        return -1;
+    }
+
+    EnterCriticalSection(&AttrCacheLock);
+    AttrCachePublished = hash;
+    AttrCacheSave(FALSE);
+    LeaveCriticalSection(&AttrCacheLock);
+
+    return 1;
+}
@@ -0,0 +1,68 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ATTRCACHE_H
+#define _ATTRCACHE_H
+
+#include <windows.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct WMIAccessor;
+
+// Store path -> value of everything published when the agent registers
+typedef map<string, string> AttrSet;
+
+void AttrSetPrintf(AttrSet& attrs, const char *path, const char *fmt, ...);
+
+// Load the hotfix list and the hash of the last published set from the
+// registry.
+void AttrCacheInit(void);
+
+// Enumerate hotfixes on a background thread.  If the list differs from
+// the cached one, the cache is updated and Changed(Ctx) is called from
+// that thread.
+void AttrCacheStartHotFixScan(WMIAccessor *wmi, void (*Changed)(void *),
+                              void *Ctx);
+void AttrCacheStopHotFixScan(void);
+
+// Add attr/os/hotfixes/N for the cached hotfix list.
+void AttrCacheGetHotFixes(AttrSet& attrs);
+
+// Write the set in one transaction unless it is what was last published
+// and the store still holds it.  Returns 1 if the store was written, 0 if
+// it already held the set, and -1 if the transaction failed.
+int AttrCachePublish(const AttrSet& attrs);
+
+#endif
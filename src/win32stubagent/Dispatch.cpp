@@ -0,0 +1,98 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <windows.h>
+#include "Dispatch.h"
+
+static const struct dispatch_hooks *DispatchHooks = NULL;
+
+void
+InitDispatchContext(struct dispatch_context *dc)
+{
+    InitializeCriticalSection(&dc->lock);
+}
+
+void
+ReleaseDispatchContext(struct dispatch_context *dc)
+{
+    DeleteCriticalSection(&dc->lock);
+}
+
+void
+SetDispatchHooks(const struct dispatch_hooks *hooks)
+{
+    DispatchHooks = hooks;
+}
+
+static VOID CALLBACK
+DispatchCallback(PVOID param, BOOLEAN timedOut)
+{
+    struct dispatch_handler *dh = (struct dispatch_handler *)param;
+    const struct dispatch_hooks *hooks = DispatchHooks;
+
+    if (hooks != NULL && hooks->enter != NULL && !hooks->enter(dh))
+        return;
+
+    EnterCriticalSection(&dh->context->lock);
+    dh->handler(dh->ctx);
+    LeaveCriticalSection(&dh->context->lock);
+
+    if (hooks != NULL && hooks->leave != NULL)
+        hooks->leave(dh);
+}
+
+BOOL
+RegisterDispatch(struct dispatch_handler *dh, HANDLE event,
+                 const char *name, void (*handler)(void *), void *ctx,
+                 struct dispatch_context *context)
+{
+    dh->name = name;
+    dh->handler = handler;
+    dh->ctx = ctx;
+    InitDispatchContext(&dh->own_context);
+    dh->context = (context != NULL) ? context : &dh->own_context;
+
+    if (!RegisterWaitForSingleObject(&dh->wait, event, DispatchCallback, dh,
+                                     INFINITE,
+                                     WT_EXECUTEDEFAULT |
+                                     WT_EXECUTELONGFUNCTION)) {
+        ReleaseDispatchContext(&dh->own_context);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void
+UnregisterDispatch(struct dispatch_handler *dh)
+{
+    UnregisterWaitEx(dh->wait, INVALID_HANDLE_VALUE);
+    ReleaseDispatchContext(&dh->own_context);
+}
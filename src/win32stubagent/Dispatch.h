@@ -0,0 +1,76 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _DISPATCH_H
+#define _DISPATCH_H
+
+#include <windows.h>
+
+/* Callbacks sharing a dispatch context never run concurrently.  Each
+ * handler gets its own unless it touches state shared with other
+ * callbacks, in which case they share the owner's context. */
+struct dispatch_context {
+    CRITICAL_SECTION lock;
+};
+
+void InitDispatchContext(struct dispatch_context *dc);
+void ReleaseDispatchContext(struct dispatch_context *dc);
+
+/* A handler run on a thread pool thread each time its event is
+ * signalled.  With an auto-reset event the wait re-arms itself, and
+ * signals arriving while the handler runs are coalesced. */
+struct dispatch_handler {
+    HANDLE wait;
+    struct dispatch_context *context;
+    struct dispatch_context own_context;
+    const char *name;
+    void (*handler)(void *);
+    void *ctx;
+};
+
+/* Called on the pool thread around each run, outside the context.
+ * When enter returns FALSE the run is skipped (and leave not called):
+ * the handler runs again the next time the event is signalled. */
+struct dispatch_hooks {
+    BOOL (*enter)(struct dispatch_handler *dh);
+    void (*leave)(struct dispatch_handler *dh);
+};
+
+void SetDispatchHooks(const struct dispatch_hooks *hooks);
+
+BOOL RegisterDispatch(struct dispatch_handler *dh, HANDLE event,
+                      const char *name, void (*handler)(void *), void *ctx,
+                      struct dispatch_context *context);
+
+/* Waits for a running handler to finish. */
+void UnregisterDispatch(struct dispatch_handler *dh);
+
+#endif
@@ -0,0 +1,261 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include "stdafx.h"
+#include "XSAccessor.h"
+#include "WMIAccessor.h"
+#include "XService.h"
+#include "LogBuffer.h"
+
+//
+// Agent log messages are collected in a ring buffer and written to the
+// store in batches by a flusher thread, one Log call per interval,
+// instead of one WMI method call per message.
+//
+
+#define LOG_SLOTS               256
+#define LOG_MESSAGE_MAX         256
+#define LOG_BATCH_MAX           4096
+#define LOG_FLUSH_INTERVAL_MS   1000
+#define LOG_DUMP_TIMEOUT_MS     5000
+
+static struct {
+    CRITICAL_SECTION lock;
+    char messages[LOG_SLOTS][LOG_MESSAGE_MAX];
+    ULONG head;             // next slot to fill
+    ULONG tail;             // next slot to flush
+    LONG volatile dropped;
+    LONG volatile flushed;  // bumped after every flush
+    HANDLE pending;         // set when the buffer goes non-empty
+    HANDLE urgent;          // flush without waiting for the interval
+    HANDLE done;            // set after every flush
+    HANDLE stop;
+    HANDLE thread;
+    BOOL volatile running;
+} LogBuffer;
+
+BOOL
+LogBufferAppend(const char *fmt, va_list args)
+{
+    char message[LOG_MESSAGE_MAX];
+    BOOL wake;
+
+    if (!LogBuffer.running)
+        return FALSE;
+
+    _vsnprintf(message, sizeof (message), fmt, args);
+    message[sizeof (message) - 1] = '\0';
+
+    // The lock only ever covers a copy, never a store operation
+    EnterCriticalSection(&LogBuffer.lock);
+    if (!LogBuffer.running) {
+        LeaveCriticalSection(&LogBuffer.lock);
+        return FALSE;
+    }
+    if (LogBuffer.head - LogBuffer.tail == LOG_SLOTS) {
+        LeaveCriticalSection(&LogBuffer.lock);
+        InterlockedIncrement(&LogBuffer.dropped);
+        return TRUE;
+    }
+
+    wake = (LogBuffer.head == LogBuffer.tail);
+    memcpy(LogBuffer.messages[LogBuffer.head % LOG_SLOTS], message,
+           sizeof (message));
+    LogBuffer.head++;
+    LeaveCriticalSection(&LogBuffer.lock);
+
+    if (wake)
+        SetEvent(LogBuffer.pending);
+    return TRUE;
+}
+
+// Returns FALSE if nothing could be written yet (WMI not connected)
+static BOOL
+LogBufferFlush(void)
+{
+    char batch[LOG_BATCH_MAX];
+    size_t used;
+    LONG dropped;
+
+    if (wmi == NULL)
+        return FALSE;
+
+    dropped = InterlockedExchange(&LogBuffer.dropped, 0);
+    if (dropped != 0)
+        XsLogFlush("%d log messages dropped", dropped);
+
+    for (;;) {
+        used = 0;
+
+        EnterCriticalSection(&LogBuffer.lock);
+        while (LogBuffer.tail != LogBuffer.head) {
+            const char *message = LogBuffer.messages[LogBuffer.tail % LOG_SLOTS];
+            size_t len = strlen(message);
+
+            if (used + len + 2 > sizeof (batch))
+                break;
+
+            if (used != 0)
+                batch[used++] = '\n';
+            memcpy(batch + used, message, len);
+            used += len;
+            LogBuffer.tail++;
+        }
+        LeaveCriticalSection(&LogBuffer.lock);
+
+        if (used == 0)
+            break;
+
+        batch[used] = '\0';
+        XsLogFlush("%s", batch);
+    }
+
+    InterlockedIncrement(&LogBuffer.flushed);
+    SetEvent(LogBuffer.done);
+    return TRUE;
+}
+
+static DWORD WINAPI
+LogBufferThread(LPVOID arg)
+{
+    HANDLE wake[3];
+    HRESULT hr;
+    BOOL stopping = FALSE;
+
+    hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    wake[0] = LogBuffer.stop;
+    wake[1] = LogBuffer.urgent;
+    wake[2] = LogBuffer.pending;
+
+    while (!stopping) {
+        DWORD status;
+
+        // Sleep until there is something to write...
+        status = WaitForMultipleObjects(3, wake, FALSE, INFINITE);
+        if (status == WAIT_OBJECT_0) {
+            stopping = TRUE;
+        } else if (status == WAIT_OBJECT_0 + 2) {
+            // ...then let the batch fill for an interval
+            status = WaitForMultipleObjects(2, wake, FALSE,
+                                            LOG_FLUSH_INTERVAL_MS);
+            if (status == WAIT_OBJECT_0)
+                stopping = TRUE;
+        } else if (status != WAIT_OBJECT_0 + 1) {
+            break;
+        }
+
+        if (!LogBufferFlush() && !stopping)
+            SetEvent(LogBuffer.pending);
+    }
+
+    if (SUCCEEDED(hr))
+        CoUninitialize();
+    return 0;
+}
+
+void
+XsInitPerThreadLogging(void)
+{
+    InitializeCriticalSection(&LogBuffer.lock);
+
+    LogBuffer.pending = CreateEvent(NULL, FALSE, FALSE, NULL);
+    LogBuffer.urgent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    LogBuffer.done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    LogBuffer.stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!LogBuffer.pending || !LogBuffer.urgent || !LogBuffer.done ||
+        !LogBuffer.stop)
+        goto fail;
+
+    LogBuffer.running = TRUE;
+    LogBuffer.thread = CreateThread(NULL, 0, LogBufferThread, NULL, 0, NULL);
+    if (LogBuffer.thread == NULL) {
+        LogBuffer.running = FALSE;
+        goto fail;
+    }
+    return;
+
+fail:
+    PrintError("XsInitPerThreadLogging()");
+}
+
+// Stop the flusher after writing out whatever is queued.  Messages
+// logged afterwards are written synchronously.
+void
+XsStopLogging(void)
+{
+    if (LogBuffer.thread == NULL)
+        return;
+
+    SetEvent(LogBuffer.stop);
+    WaitForSingleObject(LogBuffer.thread, INFINITE);
+    CloseHandle(LogBuffer.thread);
+    LogBuffer.thread = NULL;
+
+    EnterCriticalSection(&LogBuffer.lock);
+    LogBuffer.running = FALSE;
+    LeaveCriticalSection(&LogBuffer.lock);
+
+    // Anything that raced in after the final flush
+    LogBufferFlush();
+}
+
+// Write out everything queued so far, waiting (a bounded time, since
+// this is also used from exception filters) for the flusher.
+void
+XsDumpLogThisThread(void)
+{
+    LONG flushed;
+    DWORD start;
+
+    if (!LogBuffer.running)
+        return;
+
+    flushed = LogBuffer.flushed;
+    start = GetTickCount();
+    SetEvent(LogBuffer.urgent);
+
+    while (LogBuffer.flushed == flushed &&
+           GetTickCount() - start < LOG_DUMP_TIMEOUT_MS)
+        WaitForSingleObject(LogBuffer.done, 100);
+}
+
+void
+XsLogMsg(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    XsLogV(fmt, args);
+    va_end(args);
+}
@@ -0,0 +1,119 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <windows.h>
+#include <psapi.h>
+#include "stdafx.h"
+#include "XSAccessor.h"
+#include "WMIAccessor.h"
+#include "MemStats.h"
+
+#pragma comment(lib, "psapi.lib")
+
+struct MemStatsProvider {
+    const char *name;
+    BOOL (*sample)(VMData& data);
+};
+
+static BOOL
+MemStatsNativeSample(VMData& data)
+{
+    MEMORYSTATUSEX status;
+    PERFORMANCE_INFORMATION perf;
+
+    status.dwLength = sizeof (status);
+    if (!GlobalMemoryStatusEx(&status))
+        return FALSE;
+
+    data.meminfo_free = status.ullAvailPhys >> 10;
+    data.meminfo_total = status.ullTotalPhys >> 10;
+
+    memset(&perf, 0, sizeof (perf));
+    perf.cb = sizeof (perf);
+    if (GetPerformanceInfo(&perf, sizeof (perf))) {
+        int64_t page = perf.PageSize;
+
+        data.meminfo_commit = (perf.CommitTotal * page) >> 10;
+        data.meminfo_commit_limit = (perf.CommitLimit * page) >> 10;
+        data.meminfo_cache = (perf.SystemCache * page) >> 10;
+    } else {
+        data.meminfo_commit =
+            (status.ullTotalPageFile - status.ullAvailPageFile) >> 10;
+        data.meminfo_commit_limit = status.ullTotalPageFile >> 10;
+        data.meminfo_cache = -1;
+    }
+
+    // The commit limit is physical memory plus the paging files
+    data.meminfo_pagefile = data.meminfo_commit_limit - data.meminfo_total;
+    if (data.meminfo_pagefile < 0)
+        data.meminfo_pagefile = 0;
+
+    return TRUE;
+}
+
+static BOOL
+MemStatsWmiSample(VMData& data)
+{
+    if (wmi == NULL)
+        return FALSE;
+
+    GetWMIData(wmi, data);
+    return (data.meminfo_total != 0) ? TRUE : FALSE;
+}
+
+static const struct MemStatsProvider MemStatsProviders[] = {
+    { "native", MemStatsNativeSample },
+    { "wmi", MemStatsWmiSample },
+};
+
+#define MEMSTATS_PROVIDERS \
+    (sizeof (MemStatsProviders) / sizeof (MemStatsProviders[0]))
+
+// Index of the provider in use; a provider that fails is not retried.
+static unsigned MemStatsCurrent;
+
+BOOL
+GetMemoryData(VMData& data)
+{
+    while (MemStatsCurrent < MEMSTATS_PROVIDERS) {
+        const struct MemStatsProvider *provider =
+            &MemStatsProviders[MemStatsCurrent];
+
+        if (provider->sample(data))
+            return TRUE;
+
+        XsLog("memory statistics provider %s failed (%d)", provider->name,
+              GetLastError());
+        MemStatsCurrent++;
+    }
+
+    return FALSE;
+}
@@ -36,7 +36,8 @@
 #include <winsock2.h>
 #include <Iphlpapi.h>
 
-NicInfo::NicInfo() : netif_data(NULL), nr_netifs_found(0)
+NicInfo::NicInfo() : netif_data(NULL), nr_netifs_found(0),
+    published_data(NULL), nr_published(0)
 {
     NicChangeEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
     if (!NicChangeEvent) {
@@ -53,6 +54,8 @@ NicInfo::NicInfo() : netif_data(NULL), nr_netifs_found(0)
 NicInfo::~NicInfo()
 {
     //CancelIPChangeNotify(&Overlap); <--- Function does not exist in 2k
+    Invalidate();
+    free(netif_data);
 }
 
 void NicInfo::Prime()
@@ -76,10 +79,46 @@ again:
     }
 }
 
-void NicInfo::Refresh()
+//
+// Publish the current NIC set, writing only what changed since the last
+// successful publication.  Returns whether the store was touched, so the
+// caller knows whether xapi needs a kick.
+//
+bool NicInfo::Refresh()
 {
+    int changes;
+
     GetNicInfo();
-    XenstoreDoNicDump(nr_netifs_found, netif_data);
+    changes = XenstoreDoNicDump(nr_netifs_found, netif_data,
+                                nr_published, published_data);
+    if (changes == 0)
+        return false;
+
+    Invalidate();
+    if (changes < 0)
+        return true;
+
+    // Always allocate at least one entry: a NULL set means unknown
+    published_data = (VIFData *)calloc(sizeof(VIFData),
+                                       nr_netifs_found ? nr_netifs_found : 1);
+    if (published_data) {
+        if (nr_netifs_found)
+            memcpy(published_data, netif_data,
+                   sizeof(VIFData) * nr_netifs_found);
+        nr_published = nr_netifs_found;
+    }
+    return true;
+}
+
+//
+// Forget what was last published, e.g. after the toolstack wiped the
+// store, so that the next Refresh() rewrites everything.
+//
+void NicInfo::Invalidate()
+{
+    free(published_data);
+    published_data = NULL;
+    nr_published = 0;
 }
 
 void NicInfo::GetNicInfo()
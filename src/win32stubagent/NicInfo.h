@@ -46,7 +46,8 @@ public:
     NicInfo();
     ~NicInfo();
 
-    void Refresh();
+    bool Refresh();
+    void Invalidate();
     void Prime();
     HANDLE NicChangeEvent;
 
@@ -55,6 +56,8 @@ private:
 
     int nr_netifs_found;
     VIFData *netif_data;
+    int nr_published;
+    VIFData *published_data;
     HANDLE hAddrChange;
     OVERLAPPED Overlap;
 };
@@ -0,0 +1,235 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <windows.h>
+#include <string.h>
+#include "stdafx.h"
+#include "XSAccessor.h"
+#include "Startup.h"
+
+enum {
+    STARTUP_WAITING,
+    STARTUP_QUEUED,
+    STARTUP_RUNNING,
+    STARTUP_DONE
+};
+
+StartupGraph::StartupGraph(StartupTask *Tasks, unsigned Count) :
+    tasks(Tasks), count(Count), finished(0)
+{
+    unsigned x;
+
+    InitializeCriticalSection(&lock);
+    MainEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    DoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    for (x = 0; x < count; x++) {
+        tasks[x].graph = this;
+        tasks[x].state = STARTUP_WAITING;
+    }
+}
+
+StartupGraph::~StartupGraph()
+{
+    if (MainEvent)
+        CloseHandle(MainEvent);
+    if (DoneEvent)
+        CloseHandle(DoneEvent);
+    DeleteCriticalSection(&lock);
+}
+
+// Called with the lock held
+BOOL StartupGraph::Ready(StartupTask *Task)
+{
+    unsigned x;
+    unsigned y;
+
+    for (x = 0; x < STARTUP_MAX_DEPS && Task->deps[x] != NULL; x++) {
+        for (y = 0; y < count; y++) {
+            if (!strcmp(tasks[y].name, Task->deps[x]))
+                break;
+        }
+        // An unknown name is a bug in the table; don't hang on it
+        if (y == count) {
+            XsLog("startup: %s depends on unknown task %s", Task->name,
+                  Task->deps[x]);
+            continue;
+        }
+        if (tasks[y].state != STARTUP_DONE)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// Called with the lock held
+void StartupGraph::Dispatch()
+{
+    BOOL main = FALSE;
+    unsigned x;
+
+    for (x = 0; x < count; x++) {
+        StartupTask *task = &tasks[x];
+
+        if (task->state != STARTUP_WAITING || !Ready(task))
+            continue;
+
+        task->state = STARTUP_QUEUED;
+        if (task->main) {
+            main = TRUE;
+        } else if (!QueueUserWorkItem(Worker, task, WT_EXECUTELONGFUNCTION)) {
+            XsLog("startup: cannot queue %s (%d), running it on the main thread",
+                  task->name, GetLastError());
+            task->main = TRUE;
+            main = TRUE;
+        }
+    }
+
+    if (main)
+        SetEvent(MainEvent);
+}
+
+void StartupGraph::Execute(StartupTask *Task)
+{
+    DWORD start = GetTickCount();
+    DWORD now;
+
+    Task->fn(Task->ctx);
+
+    now = GetTickCount();
+    XsLog("startup: %s took %u ms, done at +%u ms", Task->name,
+          now - start, now - startTick);
+
+    Complete(Task);
+}
+
+void StartupGraph::Complete(StartupTask *Task)
+{
+    EnterCriticalSection(&lock);
+    Task->state = STARTUP_DONE;
+    if (++finished == count)
+        SetEvent(DoneEvent);
+    else
+        Dispatch();
+    LeaveCriticalSection(&lock);
+}
+
+DWORD WINAPI StartupGraph::Worker(LPVOID Arg)
+{
+    StartupTask *task = (StartupTask *)Arg;
+    HRESULT hr;
+
+    hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    // Workers use the session the helper threads share; without it the
+    // task goes back to the main thread, as when it cannot be queued
+    if (InitXSAccessorShared() < 0) {
+        EnterCriticalSection(&task->graph->lock);
+        task->main = TRUE;
+        LeaveCriticalSection(&task->graph->lock);
+        SetEvent(task->graph->MainEvent);
+        goto done;
+    }
+
+    EnterCriticalSection(&task->graph->lock);
+    task->state = STARTUP_RUNNING;
+    LeaveCriticalSection(&task->graph->lock);
+
+    task->graph->Execute(task);
+
+done:
+    if (SUCCEEDED(hr))
+        CoUninitialize();
+    return 0;
+}
+
+void StartupGraph::Start()
+{
+    startTick = GetTickCount();
+
+    EnterCriticalSection(&lock);
+    if (count == 0)
+        SetEvent(DoneEvent);
+    else
+        Dispatch();
+    LeaveCriticalSection(&lock);
+}
+
+// Run every main thread task that is ready, including any that become
+// ready as a result.
+void StartupGraph::RunMainTasks()
+{
+    for (;;) {
+        StartupTask *task = NULL;
+        unsigned x;
+
+        EnterCriticalSection(&lock);
+        for (x = 0; x < count; x++) {
+            if (tasks[x].main && tasks[x].state == STARTUP_QUEUED) {
+                task = &tasks[x];
+                task->state = STARTUP_RUNNING;
+                break;
+            }
+        }
+        LeaveCriticalSection(&lock);
+
+        if (task == NULL)
+            break;
+
+        Execute(task);
+    }
+}
+
+BOOL StartupGraph::Finished()
+{
+    BOOL done;
+
+    EnterCriticalSection(&lock);
+    done = (finished == count);
+    LeaveCriticalSection(&lock);
+
+    return done;
+}
+
+// Wait for the whole graph, running main thread tasks meanwhile
+void StartupGraph::Wait()
+{
+    HANDLE handles[2];
+
+    handles[0] = DoneEvent;
+    handles[1] = MainEvent;
+
+    for (;;) {
+        RunMainTasks();
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) !=
+            WAIT_OBJECT_0 + 1)
+            break;
+    }
+}
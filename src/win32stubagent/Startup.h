@@ -0,0 +1,85 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _STARTUP_H
+#define _STARTUP_H
+
+#include <windows.h>
+
+#define STARTUP_MAX_DEPS 4
+
+class StartupGraph;
+
+// One step of agent startup.  A task runs once every task named in deps
+// has finished: on the thread pool, or on the main loop's thread if
+// main is set (for work that must own the main thread's WMI session,
+// such as establishing watches).
+struct StartupTask {
+    const char *name;
+    void (*fn)(void *ctx);
+    void *ctx;
+    BOOL main;
+    const char *deps[STARTUP_MAX_DEPS];
+
+    // Private to StartupGraph
+    StartupGraph *graph;
+    int state;
+};
+
+class StartupGraph
+{
+public:
+    StartupGraph(StartupTask *Tasks, unsigned Count);
+    ~StartupGraph();
+
+    void Start();
+    void RunMainTasks();
+    BOOL Finished();
+    void Wait();
+
+    HANDLE MainEvent;   // a main thread task is ready
+    HANDLE DoneEvent;   // every task has finished
+
+private:
+    BOOL Ready(StartupTask *Task);
+    void Dispatch();
+    void Execute(StartupTask *Task);
+    void Complete(StartupTask *Task);
+    static DWORD WINAPI Worker(LPVOID Arg);
+
+    CRITICAL_SECTION lock;
+    StartupTask *tasks;
+    unsigned count;
+    unsigned finished;
+    DWORD startTick;
+};
+
+#endif
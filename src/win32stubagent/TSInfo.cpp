@@ -44,7 +44,7 @@ using namespace std;
 
 #pragma comment(lib, "wbemuuid.lib")
 
-TSInfo::TSInfo()
+TSInfo::TSInfo() : Published(-1)
 {
    
     Init();
@@ -408,7 +408,15 @@ TSInfo::Refresh()
     if (FAILED(Result))
         goto fail1;
 
-    XenstorePrintf("data/ts", "%d", (Enabled) ? 1 : 0);
+    // Only write when the state changes; Invalidate() forces the next
+    // refresh to republish (e.g. after the toolstack removed the key).
+    if (Published == ((Enabled) ? 1 : 0))
+        return;
+
+    if (XenstorePrintf("data/ts", "%d", (Enabled) ? 1 : 0) < 0)
+        return;
+
+    Published = (Enabled) ? 1 : 0;
 
     return;
 
@@ -416,6 +424,12 @@ fail1:
     XsLog("%s: fail1 (%08x)\n", __FUNCTION__, Result);
 }
 
+VOID
+TSInfo::Invalidate()
+{
+    Published = -1;
+}
+
 VOID
 TSInfo::ProcessControl()
 {
@@ -43,6 +43,7 @@ public:
     ~TSInfo();
 
     VOID    Refresh(VOID);
+    VOID    Invalidate(VOID);
     VOID    ProcessControl(VOID);
 
 private:
@@ -51,6 +52,7 @@ private:
 
     void Init();
     BOOLEAN Ready;
+    LONG    Published;
 
     HRESULT Query(BOOLEAN *);
     HRESULT Set(BOOLEAN);
@@ -0,0 +1,193 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <windows.h>
+#include "stdafx.h"
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel(DWORD TickMs) : tickMs(TickMs)
+{
+    unsigned x;
+
+    if (tickMs == 0)
+        tickMs = 1;
+
+    for (x = 0; x < SLOTS; x++)
+        slots[x].next = slots[x].prev = &slots[x];
+
+    lastTick = GetTickCount() / tickMs;
+
+    InitializeCriticalSection(&lock);
+    ChangeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+TimerWheel::~TimerWheel()
+{
+    unsigned x;
+
+    for (x = 0; x < SLOTS; x++) {
+        while (slots[x].next != &slots[x])
+            CancelLocked(slots[x].next);
+    }
+
+    if (ChangeEvent)
+        CloseHandle(ChangeEvent);
+    DeleteCriticalSection(&lock);
+}
+
+void TimerWheel::Init(TimerWheelEntry *Timer, void (*Handler)(void *),
+                      void *Ctx)
+{
+    memset(Timer, 0, sizeof (*Timer));
+    Timer->handler = Handler;
+    Timer->ctx = Ctx;
+}
+
+unsigned TimerWheel::Slot(DWORD Time)
+{
+    return (Time / tickMs) % SLOTS;
+}
+
+void TimerWheel::Schedule(TimerWheelEntry *Timer, DWORD DelayMs)
+{
+    TimerWheelEntry *head;
+
+    EnterCriticalSection(&lock);
+    CancelLocked(Timer);
+
+    Timer->due = GetTickCount() + DelayMs;
+    head = &slots[Slot(Timer->due)];
+
+    Timer->next = head;
+    Timer->prev = head->prev;
+    head->prev->next = Timer;
+    head->prev = Timer;
+    Timer->armed = TRUE;
+    LeaveCriticalSection(&lock);
+
+    if (ChangeEvent)
+        SetEvent(ChangeEvent);
+}
+
+void TimerWheel::Cancel(TimerWheelEntry *Timer)
+{
+    EnterCriticalSection(&lock);
+    CancelLocked(Timer);
+    LeaveCriticalSection(&lock);
+}
+
+void TimerWheel::CancelLocked(TimerWheelEntry *Timer)
+{
+    if (!Timer->armed)
+        return;
+
+    Timer->prev->next = Timer->next;
+    Timer->next->prev = Timer->prev;
+    Timer->next = Timer->prev = NULL;
+    Timer->armed = FALSE;
+}
+
+// Milliseconds until the earliest armed timer is due, 0 if one is
+// already overdue, or INFINITE if none is armed.
+DWORD TimerWheel::Timeout()
+{
+    DWORD now = GetTickCount();
+    DWORD timeout = INFINITE;
+    unsigned x;
+
+    EnterCriticalSection(&lock);
+    for (x = 0; x < SLOTS && timeout != 0; x++) {
+        TimerWheelEntry *head = &slots[x];
+        TimerWheelEntry *t;
+
+        for (t = head->next; t != head; t = t->next) {
+            LONG remaining = (LONG)(t->due - now);
+
+            if (remaining <= 0) {
+                timeout = 0;
+                break;
+            }
+            if ((DWORD)remaining < timeout)
+                timeout = (DWORD)remaining;
+        }
+    }
+    LeaveCriticalSection(&lock);
+
+    return timeout;
+}
+
+// Run the handlers of every timer that is due.  Due timers are moved
+// to a private list (linked through 'fired', so that another thread
+// may re-arm them meanwhile) and run without the lock held.
+void TimerWheel::Expire()
+{
+    TimerWheelEntry *fired = NULL;
+    TimerWheelEntry **tail = &fired;
+    DWORD now = GetTickCount();
+    DWORD tick = now / tickMs;
+    DWORD count;
+    DWORD x;
+
+    EnterCriticalSection(&lock);
+
+    // Every slot passed since the last call; all of them if the
+    // wheel has turned a full revolution (or the tick count wrapped).
+    count = tick - lastTick + 1;
+    if (count > SLOTS)
+        count = SLOTS;
+
+    for (x = 0; x < count; x++) {
+        TimerWheelEntry *head = &slots[(lastTick + x) % SLOTS];
+        TimerWheelEntry *t = head->next;
+
+        while (t != head) {
+            TimerWheelEntry *next = t->next;
+
+            if ((LONG)(t->due - now) <= 0) {
+                CancelLocked(t);
+
+                t->fired = NULL;
+                *tail = t;
+                tail = &t->fired;
+            }
+            t = next;
+        }
+    }
+    lastTick = tick;
+    LeaveCriticalSection(&lock);
+
+    while (fired != NULL) {
+        TimerWheelEntry *t = fired;
+
+        fired = t->fired;
+        t->handler(t->ctx);
+    }
+}
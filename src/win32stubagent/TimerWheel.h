@@ -0,0 +1,82 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TIMERWHEEL_H
+#define _TIMERWHEEL_H
+
+#include <windows.h>
+
+// A timer owned by the caller and linked into a TimerWheel slot while
+// armed.  The handler runs on the thread calling TimerWheel::Expire().
+struct TimerWheelEntry {
+    TimerWheelEntry *next;
+    TimerWheelEntry *prev;
+    TimerWheelEntry *fired;
+    DWORD due;
+    BOOL armed;
+    void (*handler)(void *);
+    void *ctx;
+};
+
+// Hashed timer wheel driven by the agent's main loop: the loop waits
+// for Timeout() milliseconds and then calls Expire().  Nothing is
+// polled while no timer is due.  Timers may be scheduled from any
+// thread; ChangeEvent is signalled so the loop recomputes its timeout.
+class TimerWheel
+{
+public:
+    TimerWheel(DWORD TickMs);
+    ~TimerWheel();
+
+    static void Init(TimerWheelEntry *Timer, void (*Handler)(void *),
+                     void *Ctx);
+
+    void Schedule(TimerWheelEntry *Timer, DWORD DelayMs);
+    void Cancel(TimerWheelEntry *Timer);
+    DWORD Timeout();
+    void Expire();
+
+    HANDLE ChangeEvent;
+
+private:
+    enum { SLOTS = 64 };
+
+    unsigned Slot(DWORD Time);
+    void CancelLocked(TimerWheelEntry *Timer);
+
+    CRITICAL_SECTION lock;
+
+    TimerWheelEntry slots[SLOTS];
+    DWORD tickMs;
+    DWORD lastTick;
+};
+
+#endif
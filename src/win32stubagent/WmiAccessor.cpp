@@ -39,6 +39,7 @@
 #include "WMIAccessor.h"
 #include "XService.h"
 #include "NicInfo.h"
+#include "WmiString.h"
 
 //#include "xs_private.h"
 #include <wbemidl.h>
@@ -47,73 +48,6 @@
 #pragma comment(lib, "uuid.lib")
 
 
-BSTR mkBstr(const char *string, size_t len) {
-    BSTR res = NULL;
-    size_t returned;
-    wchar_t* wstring = new wchar_t[len+1];
-    if (wstring == NULL) {
-        goto malloc_wstring;
-    }
-    mbstowcs_s(&returned, wstring, len+1, string, len);
-    res = SysAllocString(wstring);
-    delete wstring;
-malloc_wstring:
-    return res;
-}
-
-char * formatCharStrInt(const char *fmt, va_list l) {
-    char *buf = NULL;
-    int cnt = _vscprintf(fmt, l);
-    buf = (char *)XsAlloc(cnt+1);
-    if (buf == NULL) {
-        goto malloc_buf;
-    }
-    _vsnprintf(buf, cnt+1, fmt, l);
-malloc_buf:
-    return buf;
-}
-
-char * formatCharStr(const char *fmt, ... ) {
-    char *buf =NULL;
-    va_list l;
-    va_start(l, fmt);
-    buf = formatCharStrInt(fmt, l);
-    va_end(l);
-    return buf;
-}
-
-BSTR formatBstr(const char *fmt, ...) 
-{
-    char *buf;
-    va_list l;  
-    BSTR res = NULL;
-    va_start(l, fmt);
-    buf = formatCharStrInt(fmt, l);
-    va_end(l);
-    res = mkBstr(buf, strlen(buf));
-    XsFree(buf);
-    return res;
-}
-
-int setVariantString(VARIANT* var, const char *data, size_t len) {
-    int err=-1;
-    VariantInit(var);
-    var->vt=VT_BSTR;
-    var->bstrVal = mkBstr(data, len);
-    if (var->bstrVal == NULL) {
-        goto sysalloc;
-    }
-    err=0;
-sysalloc:
-    return err;
-}
-
-
-int setVariantString(VARIANT* var, const char *string) {
-    return setVariantString(var, string, strlen(string));
-}
-
-
 
 class WatchSink : public IWbemObjectSink
 {
@@ -207,48 +141,57 @@ HRESULT WatchSink::SetStatus(
 
 
 
+/* In-parameter template of one xeniface method, spawned once and
+   cloned for each call. */
+struct WmiMethodTemplate
+{
+    const wchar_t *classname;
+    const wchar_t *methodname;
+    IWbemClassObject *in;
+};
+
+#define WMI_METHOD_CACHE_SIZE 16
+
 struct WMIAccessor
 {
     IWbemServices *mpSvc;
     IWbemServices *mpXSSvc;
     BOOLEAN com_initialized;
     HANDLE owning_thread;
+
+    /* Class objects and method templates, fetched on first use and
+       kept until the accessor is released. */
+    CRITICAL_SECTION cache_lock;
+    BOOLEAN cache_initialized;
+    IWbemClassObject *base;
+    IWbemClassObject *baseClass;
+    IWbemClassObject *sessionClass;
+    struct WmiMethodTemplate methods[WMI_METHOD_CACHE_SIZE];
+    unsigned nr_methods;
 };
 
 struct WMIAccessor *wmi = NULL;
 
-static string wstring2string(const wstring& wstr)
-{ 
-    int len;
-
-    len = WideCharToMultiByte(CP_UTF8,
-                              0,
-                              wstr.c_str(),
-                              -1,
-                              NULL,
-                              0,
-                              NULL,
-                              NULL);
-
-    string str(len, 0);
-
-    len = WideCharToMultiByte(CP_UTF8,
-                              0,
-                              wstr.c_str(),
-                              -1,
-                              &str[0],
-                              str.length(),
-                              NULL,
-                              NULL);
-
-	return str;
-}
-
 static string bstr2string(const BSTR& bstr)
 {
-	wstring wstr(bstr);
+    char *buf;
+    size_t mark;
+    int n;
+
+    n = bstrToScratch(bstr, &buf, &mark);
+    if (n < 0) {
+        int len = (int)SysStringLen(bstr);
+
+        n = WideCharToMultiByte(CP_UTF8, 0, bstr, len, NULL, 0, NULL, NULL);
+        string str(n, 0);
+        if (n != 0)
+            WideCharToMultiByte(CP_UTF8, 0, bstr, len, &str[0], n, NULL, NULL);
+        return str;
+    }
 
-	return wstring2string(wstr);
+    string str(buf, n);
+    ScratchReset(mark);
+    return str;
 }
 
 IWbemClassObject *getClass(WMIAccessor *wmi, BSTR path) {
@@ -295,40 +238,36 @@ HRESULT methodExec(WMIAccessor* wmi,  IWbemClassObject* instance, const wchar_t
     HRESULT hres=E_FAIL ;
 
     IWbemClassObject *outstore=NULL;
-    BSTR bpathname = SysAllocString(L"__PATH");
-    if (bpathname == NULL){
-        goto allocpathname;
+    // Method names are short literals, so lay the BSTR out on the stack
+    struct {
+        DWORD prefix;
+        WCHAR text[64];
+    } bmethodname;
+    size_t len = wcslen(methodname);
+    if (outMethodInst != NULL) {
+        *outMethodInst = NULL;
     }
-
+    if (len >= ARRAYSIZE(bmethodname.text)) {
+        goto allocmethodname;
+    }
+    memcpy(bmethodname.text, methodname, (len + 1) * sizeof(WCHAR));
+    bmethodname.prefix = (DWORD)(len * sizeof(WCHAR));
 
     VARIANT instancepath;
     VariantInit(&instancepath);
-    hres = instance->Get(bpathname, 0, &instancepath, NULL, NULL);
+    hres = instance->Get(L"__PATH", 0, &instancepath, NULL, NULL);
     if (FAILED(hres)) {
         goto getclassname;
     }
 
-
-    BSTR bmethodname = SysAllocString(methodname);
-    if (bmethodname == NULL){
-        goto allocmethodname;
+    hres = wmi->mpXSSvc->ExecMethod(instancepath.bstrVal, bmethodname.text, 0, NULL,inMethodInst, &outstore, NULL);
+    if (outMethodInst != NULL && !FAILED(hres)) {
+        *outMethodInst = outstore;
     }
 
-    hres = wmi->mpXSSvc->ExecMethod(instancepath.bstrVal, bmethodname, 0, NULL,inMethodInst, &outstore, NULL);
-    if (outMethodInst != NULL) {
-        *outMethodInst = NULL;
-        if (!FAILED(hres)){
-            *outMethodInst = outstore;
-        }
-    }
-
-    SysFreeString(bmethodname);
-allocmethodname:
-
 getclassname:
     VariantClear(&instancepath);
-    SysFreeString(bpathname);
-allocpathname:
+allocmethodname:
     return hres;
 }
 static IEnumWbemClassObject* runXSQuery(WMIAccessor *wmi, BSTR query)
@@ -376,21 +315,19 @@ static IEnumWbemClassObject* runQuery(WMIAccessor *wmi, BSTR query)
 	return pEnumerator;
 }
 
-VOID
-AddHotFixInfoToStore(WMIAccessor* wmi)
+BOOL
+GetHotFixInfo(WMIAccessor* wmi, vector<string>& hotfixes)
 {
     IEnumWbemClassObject *pEnum;
-    char buffer2[4096];
-    DWORD index;
     ULONG uReturn;
     IWbemClassObject *pclsObj;
     HRESULT hr;
     VARIANT vtData;
 
-    index = 0;
+    hotfixes.clear();
     pEnum = runQuery(wmi, L"SELECT HotFixID FROM Win32_QuickFixEngineering");
     if (pEnum == NULL)
-        return;
+        return FALSE;
 
     while (1) {
         hr = pEnum->Next(WBEM_INFINITE, 1, &pclsObj, &uReturn);
@@ -406,10 +343,7 @@ AddHotFixInfoToStore(WMIAccessor* wmi)
                 // replaced by a newer hotfix, so just ignore these.
                 //
                 if (_wcsicmp(vtData.bstrVal, L"File 1")) {
-                    string str = bstr2string(vtData.bstrVal);
-                    sprintf(buffer2, "attr/os/hotfixes/%d", index);
-                    XenstoreWrite(buffer2, str.c_str(), str.length());
-                    index++;
+                    hotfixes.push_back(bstr2string(vtData.bstrVal));
                 }
             }
             VariantClear(&vtData);
@@ -418,6 +352,7 @@ AddHotFixInfoToStore(WMIAccessor* wmi)
         pclsObj->Release();
     }
     pEnum->Release ();
+    return TRUE;
 }
 
 void ConnectToWMI(void)
@@ -431,6 +366,8 @@ void ConnectToWMI(void)
         return;
     }
     memset(wmi, 0, sizeof(*wmi));
+    InitializeCriticalSection(&wmi->cache_lock);
+    wmi->cache_initialized = TRUE;
 
     hres = CoInitializeEx(0, COINIT_MULTITHREADED);
     if (FAILED(hres)) {
@@ -551,6 +488,7 @@ void ConnectToWMI(void)
 
 err_out:
     ReleaseWMIAccessor(wmi);
+    wmi = NULL;
     return;
 }
 
@@ -558,8 +496,22 @@ err_out:
    allocated them. */
 void ReleaseWMIAccessor(struct WMIAccessor *wmi)
 {
+    unsigned x;
+
     if (wmi == NULL)
         return;
+    for (x = 0; x < wmi->nr_methods; x++) {
+        if (wmi->methods[x].in != NULL)
+            wmi->methods[x].in->Release();
+    }
+    if (wmi->sessionClass != NULL)
+        wmi->sessionClass->Release();
+    if (wmi->baseClass != NULL)
+        wmi->baseClass->Release();
+    if (wmi->base != NULL)
+        wmi->base->Release();
+    if (wmi->cache_initialized)
+        DeleteCriticalSection(&wmi->cache_lock);
     if (wmi->mpXSSvc != NULL)
         wmi->mpXSSvc->Release();
     if (wmi->mpSvc != NULL)
@@ -703,9 +655,15 @@ void GetWMIData(WMIAccessor *wmi, VMData& data)
         meminfo_total >>= 10;
     }
     data.meminfo_total = meminfo_total;
+
+    /* Not worth another enumeration each; the native collector has them */
+    data.meminfo_commit = -1;
+    data.meminfo_commit_limit = -1;
+    data.meminfo_cache = -1;
+    data.meminfo_pagefile = -1;
 }
 
-void DumpOSData(WMIAccessor *wmi)
+void GetOSData(WMIAccessor *wmi, AttrSet& attrs)
 {
     BSTR os_name;
     BSTR host_name;
@@ -713,24 +671,18 @@ void DumpOSData(WMIAccessor *wmi)
 
     os_name = QueryBstr(wmi, L"Name", L"Win32_OperatingSystem");
     if (os_name != NULL) {
-        string str = bstr2string(os_name);
+        attrs["data/os_name"] = bstr2string(os_name);
         SysFreeString(os_name);
-
-        XenstoreWrite("data/os_name", str.c_str(), str.length());
     }
     host_name = QueryBstr(wmi, L"Name", L"Win32_ComputerSystem");
     if (host_name != NULL) {
-        string str = bstr2string(host_name);
+        attrs["data/host_name"] = bstr2string(host_name);
         SysFreeString(host_name);
-
-        XenstoreWrite("data/host_name", str.c_str(), str.length());
     }
     domain = QueryBstr(wmi, L"Domain", L"Win32_ComputerSystem");
     if (domain != NULL) {
-        string str = bstr2string(domain);
+        attrs["data/domain"] = bstr2string(domain);
         SysFreeString(domain);
-
-        XenstoreWrite("data/domain", str.c_str(), str.length());
     }
 }
 
@@ -779,13 +731,94 @@ public:
 };
 
 
+/* Return a cached object, fetching it on first use.  The caller does
+   not own the reference. */
+static IWbemClassObject *getCached(WMIAccessor *wmi, IWbemClassObject **slot,
+                                   BSTR path, BOOL instance)
+{
+    IWbemClassObject *obj;
+
+    if (wmi == NULL)
+        return NULL;
+
+    EnterCriticalSection(&wmi->cache_lock);
+    if (*slot == NULL)
+        *slot = (instance) ? getObject(wmi, path) : getClass(wmi, path);
+    obj = *slot;
+    LeaveCriticalSection(&wmi->cache_lock);
+
+    return obj;
+}
+
+/* The base instance is only used for its __PATH; its properties (e.g.
+   XenTime) go stale, so WmiGetXenTime fetches a fresh one. */
 IWbemClassObject *getBase(WMIAccessor* wmi) 
 {
-    return getObject(wmi, L"CitrixXenStoreBase");
+    if (wmi == NULL)
+        return NULL;
+    return getCached(wmi, &wmi->base, L"CitrixXenStoreBase", TRUE);
 }
 IWbemClassObject *getBaseClass(WMIAccessor* wmi) 
 {
-    return getClass(wmi, L"CitrixXenStoreBase");
+    if (wmi == NULL)
+        return NULL;
+    return getCached(wmi, &wmi->baseClass, L"CitrixXenStoreBase", FALSE);
+}
+
+/* Return a new in-parameter instance for classname.methodname (NULL if
+   the method takes none), cloned from a template spawned on first use.
+   This saves the GetObject and GetMethod round trips on every call. */
+static IWbemClassObject *methodStart(WMIAccessor *wmi, IWbemClassObject *cls,
+                                     const wchar_t *classname,
+                                     const wchar_t *methodname)
+{
+    IWbemClassObject *inMethod = NULL;
+    IWbemClassObject *outMethod = NULL;
+    IWbemClassObject *tmpl = NULL;
+    IWbemClassObject *inst = NULL;
+    BOOL cached = FALSE;
+    unsigned x;
+
+    if (wmi == NULL || cls == NULL)
+        return NULL;
+
+    EnterCriticalSection(&wmi->cache_lock);
+    for (x = 0; x < wmi->nr_methods; x++) {
+        if (!wcscmp(wmi->methods[x].classname, classname) &&
+            !wcscmp(wmi->methods[x].methodname, methodname)) {
+            tmpl = wmi->methods[x].in;
+            cached = TRUE;
+            goto found;
+        }
+    }
+
+    if (FAILED(cls->GetMethod(methodname, 0, &inMethod, &outMethod)))
+        goto out;
+    if (inMethod != NULL && FAILED(inMethod->SpawnInstance(0, &tmpl)))
+        goto out;
+
+    if (wmi->nr_methods < WMI_METHOD_CACHE_SIZE) {
+        wmi->methods[wmi->nr_methods].classname = classname;
+        wmi->methods[wmi->nr_methods].methodname = methodname;
+        wmi->methods[wmi->nr_methods].in = tmpl;
+        wmi->nr_methods++;
+        cached = TRUE;
+    }
+
+found:
+    if (tmpl != NULL && FAILED(tmpl->Clone(&inst)))
+        inst = NULL;
+
+out:
+    LeaveCriticalSection(&wmi->cache_lock);
+
+    if (!cached && tmpl != NULL)
+        tmpl->Release();
+    if (inMethod != NULL)
+        inMethod->Release();
+    if (outMethod != NULL)
+        outMethod->Release();
+    return inst;
 }
 
 ULONGLONG get64BitUnsigned(VARIANT *var) {
@@ -809,7 +842,7 @@ ULONGLONG get64BitUnsigned(VARIANT *var) {
 
 FILETIME WmiGetXenTime(WMIAccessor *wmi) {
      FILETIME out;
-     IWbemClassObject *base = getBase(wmi);
+     IWbemClassObject *base = getObject(wmi, L"CitrixXenStoreBase");
      if (base == NULL) {
          DBGPRINT(("Unable to find base WMI session\n"));
          out.dwLowDateTime = 0;
@@ -821,6 +854,9 @@ FILETIME WmiGetXenTime(WMIAccessor *wmi) {
      base->Get(timename, 0, &timevar, NULL, NULL);
 
      ULONGLONG time =get64BitUnsigned(&timevar);;
+     VariantClear(&timevar);
+     SysFreeString(timename);
+     base->Release();
 
      out.dwLowDateTime = (DWORD)time;
      out.dwHighDateTime = (DWORD)(time>>32);
@@ -857,20 +893,50 @@ IWbemClassObject *openSession(WMIAccessor* wmi, const char *sessionname)
         return NULL;
     }
     IWbemClassObject *baseclass = getBaseClass(wmi);
-    IWbemClassObject *inMethod;
-    IWbemClassObject *outMethod;
     IWbemClassObject *inMethodInst;
     IWbemClassObject *outMethodInst;
-    baseclass->GetMethod(L"AddSession",0,&inMethod, &outMethod);
+    const wchar_t *addsession = L"AddSessionEx";
+
+    /* The agent's sessions can sit idle (the shared helper session, the
+       log flusher's) and must not be ended by the driver for it, so ask
+       for a persistent session where the driver knows how.  They also
+       carry the guest's own control traffic, so ask for them not to be
+       rate limited; a driver which predates that flag refuses it, and
+       is asked again for a persistent session alone. */
+    inMethodInst = methodStart(wmi, baseclass, L"CitrixXenStoreBase",
+                               addsession);
+    if (inMethodInst == NULL) {
+        addsession = L"AddSession";
+        inMethodInst = methodStart(wmi, baseclass, L"CitrixXenStoreBase",
+                                   addsession);
+    }
+    if (inMethodInst == NULL) {
+        DBGPRINT(("Unable to start AddSession\n"));
+        return NULL;
+    }
 
-    inMethod->SpawnInstance(0, &inMethodInst);
     VARIANT var;
+    if (!wcscmp(addsession, L"AddSessionEx")) {
+        var.vt = VT_I4;
+        var.lVal = 3;   /* persistent, unlimited */
+        inMethodInst->Put(L"Flags", 0, &var, 0);
+    }
     var.vt = VT_BSTR;
     var.bstrVal=formatBstr("Citrix Xen Win32 Service : %s", sessionname);
     inMethodInst->Put(L"Id", 0, &var, 0);
-    methodExec(wmi, base, L"AddSession", inMethodInst, &outMethodInst);
     VariantClear(&var);
+    methodExec(wmi, base, addsession, inMethodInst, &outMethodInst);
+    if (outMethodInst == NULL && !wcscmp(addsession, L"AddSessionEx")) {
+        var.vt = VT_I4;
+        var.lVal = 1;   /* persistent */
+        inMethodInst->Put(L"Flags", 0, &var, 0);
+        methodExec(wmi, base, addsession, inMethodInst, &outMethodInst);
+    }
+    inMethodInst->Release();
+    if (outMethodInst == NULL)
+        return NULL;
     outMethodInst->Get(L"SessionId", 0, &var, NULL, NULL);
+    outMethodInst->Release();
 
     ULONG query_len;
     query_len = strlen("SELECT * FROM CitrixXenStoreSession WHERE SessionId=")+10;
@@ -890,53 +956,47 @@ IWbemClassObject *openSession(WMIAccessor* wmi, const char *sessionname)
         sessions->Release();
     }
 
-    base->Release();
     return NULL;
 }
 
 IWbemClassObject* sessionMethodStart(WMIAccessor*wmi,  
                                      const wchar_t *methodname)
 {
-    IWbemClassObject *inMethod;
-    IWbemClassObject *outMethod;
-    IWbemClassObject *inMethodInst = NULL;
     IWbemClassObject *sessionClass;
-    sessionClass = getClass(wmi, L"CitrixXenStoreSession");
-    if (sessionClass!=NULL) {
-      sessionClass->GetMethod(methodname,0,&inMethod, &outMethod);
-      inMethod->SpawnInstance(0, &inMethodInst);
-    }
-    return inMethodInst;
+    if (wmi == NULL)
+        return NULL;
+    sessionClass = getCached(wmi, &wmi->sessionClass,
+                             L"CitrixXenStoreSession", FALSE);
+    return methodStart(wmi, sessionClass, L"CitrixXenStoreSession",
+                       methodname);
 }
 
 
-char * bstrToChar(BSTR bst) {
-    size_t size = wcslen(bst);
-    char *space = (char *)XsAlloc(size+1);
-    wcstombs_s(&size, space, size+1, bst,  _TRUNCATE);
-    return space;
-}
-
 void WmiSessionLog(WMIAccessor* wmi,  void **sessionhandle,const char *fmt, va_list args) {
     IWbemClassObject **session = (IWbemClassObject **)sessionhandle;
     
-    char* message = formatCharStrInt(fmt,args);
+    size_t mark = ScratchMark();
+    char* message = formatScratchStr(fmt,args);
+    if (message == NULL)
+        return;
     
-    VARIANT vmessage;
-    if (setVariantString(&vmessage, message))
+    struct WmiStringArg vmessage;
+    if (setStringArg(&vmessage, message))
         goto setvmessage;
 
     IWbemClassObject *inMethodInst = sessionMethodStart( wmi, L"Log");
     if (!inMethodInst)
         goto sessionstart;
     
-     inMethodInst->Put(L"Message",0,&vmessage,0);
+     inMethodInst->Put(L"Message",0,&vmessage.var,0);
 
      methodExec(wmi,*session, L"Log", inMethodInst, NULL);
+     inMethodInst->Release();
 
 sessionstart:
-    VariantClear(&vmessage);
+    releaseStringArg(&vmessage);
 setvmessage:
+    freeScratchStr(message, mark);
     return;
 }
 
@@ -947,16 +1007,17 @@ char **WmiSessionGetChildren(WMIAccessor* wmi, void **sessionhandle,
     IWbemClassObject **session = (IWbemClassObject **)sessionhandle;
      
 
-    VARIANT vpath;
-    if (setVariantString(&vpath, path)){
+    struct WmiStringArg vpath;
+    if (setStringArg(&vpath, path)){
         goto setvpath;
     }
     IWbemClassObject *outMethodInst;
     IWbemClassObject *inMethodInst = sessionMethodStart( wmi, L"GetChildren");
     if (!inMethodInst)
         goto sessionstart;
-    inMethodInst->Put(L"PathName",0,&vpath,0);
+    inMethodInst->Put(L"PathName",0,&vpath.var,0);
     methodExec(wmi,*session, L"GetChildren", inMethodInst, &outMethodInst);
+    inMethodInst->Release();
     if (outMethodInst==NULL) {
         *numentries = 0;
         goto sessionExec;
@@ -979,17 +1040,19 @@ char **WmiSessionGetChildren(WMIAccessor* wmi, void **sessionhandle,
     LONG i;
     *numentries = -1;
     if (noOfChildren.lVal >0) {
-        outarray = (char **)XsAlloc(sizeof(char *) * noOfChildren.lVal);
-        for (i = 0; i< noOfChildren.lVal; i++) {
-            
-            BSTR arrayentry;
-            HRESULT hres = SafeArrayGetElement(childNodeArray.parray, &i, &arrayentry);
-            if (FAILED(hres)) {
+        BSTR *arrayentries;
+        // Read the entries in place rather than copying each BSTR out
+        HRESULT hres = SafeArrayAccessData(childNodeArray.parray,
+                                           (void **)&arrayentries);
+        if (!FAILED(hres)) {
+            outarray = (char **)XsAlloc(sizeof(char *) * noOfChildren.lVal);
+            for (i = 0; outarray != NULL && i< noOfChildren.lVal; i++) {
+                outarray[i] = bstrToChar(arrayentries[i]);
             }
-            outarray[i] = bstrToChar(arrayentry);
+            SafeArrayUnaccessData(childNodeArray.parray);
+            if (outarray != NULL)
+                *numentries = noOfChildren.lVal;
         }
-
-        *numentries = noOfChildren.lVal;
     }
     VariantClear(&childNodeArray);
     VariantClear(&noOfChildren);
@@ -1001,6 +1064,7 @@ char **WmiSessionGetChildren(WMIAccessor* wmi, void **sessionhandle,
     }
 sessionExec:
 sessionstart:
+    releaseStringArg(&vpath);
 setvpath:
    
     return outarray;
@@ -1013,14 +1077,17 @@ char* WmiSessionGetEntry(WMIAccessor* wmi, void **sessionhandle,
 {
     IWbemClassObject **session = (IWbemClassObject **)sessionhandle;
 
-    VARIANT vpath;
-    if (setVariantString(&vpath, path)){
+    struct WmiStringArg vpath;
+    if (setStringArg(&vpath, path)){
         goto setvpath;
     }
     IWbemClassObject *outMethodInst;
     IWbemClassObject *inMethodInst = sessionMethodStart( wmi, L"GetValue");
-    inMethodInst->Put(L"PathName",0,&vpath,0);
+    if (!inMethodInst)
+        goto sessionExec;
+    inMethodInst->Put(L"PathName",0,&vpath.var,0);
     methodExec(wmi,*session, L"GetValue", inMethodInst, &outMethodInst);
+    inMethodInst->Release();
     if (outMethodInst==NULL)
         goto sessionExec;
 
@@ -1029,12 +1096,15 @@ char* WmiSessionGetEntry(WMIAccessor* wmi, void **sessionhandle,
 
     outMethodInst->Get(L"value", 0, &outval, NULL, NULL);
 
-    char *space = bstrToChar(outval.bstrVal);
+    char *space = bstrToChar(outval.bstrVal, len);
     
     VariantClear(&outval); 
+    outMethodInst->Release();
+    releaseStringArg(&vpath);
     return space;
-setvpath:
 sessionExec:
+    releaseStringArg(&vpath);
+setvpath:
     *len = 0;
     return NULL;
 }
@@ -1045,20 +1115,21 @@ int WmiSessionSetEntry(WMIAccessor* wmi,  void **sessionhandle,
     int err = -1;
     IWbemClassObject **session = (IWbemClassObject **)sessionhandle;
 
-    VARIANT vpath;
-    if (setVariantString(&vpath, path)){
+    struct WmiStringArg vpath;
+    if (setStringArg(&vpath, path)){
         goto setvpath;
     }
-    VARIANT vvalue;
-    if (setVariantString(&vvalue, value))
+    struct WmiStringArg vvalue;
+    if (setStringArg(&vvalue, value, len))
         goto setvvalue;
     IWbemClassObject *outMethodInst;
     IWbemClassObject *inMethodInst = sessionMethodStart( wmi, L"SetValue");
     if (!inMethodInst)
         goto sessionstart;
-    inMethodInst->Put(L"PathName",0,&vpath,0);
-    inMethodInst->Put(L"value",0,&vvalue,0);
+    inMethodInst->Put(L"PathName",0,&vpath.var,0);
+    inMethodInst->Put(L"value",0,&vvalue.var,0);
     methodExec(wmi,*session, L"SetValue", inMethodInst, &outMethodInst);
+    inMethodInst->Release();
     if (outMethodInst==NULL)
         goto sessionExec;
 
@@ -1069,10 +1140,10 @@ int WmiSessionSetEntry(WMIAccessor* wmi,  void **sessionhandle,
 sessionExec:     
 sessionstart:
 
-    SysFreeString(vvalue.bstrVal);
+    releaseStringArg(&vvalue);
 setvvalue:
 
-    SysFreeString(vpath.bstrVal);
+    releaseStringArg(&vpath);
 setvpath:
     return err;
 }
@@ -1087,24 +1158,25 @@ int WmiSessionRemoveEntry(WMIAccessor* wmi,  void **sessionhandle,
     int err = -1;
     IWbemClassObject **session = (IWbemClassObject **)sessionhandle;
 
-    VARIANT vpath;
-    if (setVariantString(&vpath, path)){
+    struct WmiStringArg vpath;
+    if (setStringArg(&vpath, path)){
         goto setvpath;
     }
     IWbemClassObject *inMethodInst = sessionMethodStart( wmi, L"RemoveValue");
     if (!inMethodInst)
         goto sessionstart;
-    inMethodInst->Put(L"PathName",0,&vpath,0);
+    inMethodInst->Put(L"PathName",0,&vpath.var,0);
     IWbemClassObject* outMethodInst;
     methodExec(wmi,*session, L"RemoveValue", inMethodInst, &outMethodInst);
+    inMethodInst->Release();
     if (outMethodInst==NULL)
         goto sessionExec;
     outMethodInst->Release();
 
     err=0;
-sessionstart:
-    VariantClear(&vpath);
 sessionExec:
+sessionstart:
+    releaseStringArg(&vpath);
 setvpath:
     return err; 
 }
@@ -1146,15 +1218,15 @@ void WmiSessionUnwatch(WMIAccessor* wmi,  void **sessionhandle,
 
     WatchSink * sink = (WatchSink *)watchhandle;
 
-    VARIANT vpath;
-    if (setVariantString(&vpath, sink->path)){
+    struct WmiStringArg vpath;
+    if (setStringArg(&vpath, sink->path)){
         goto setvpath;
     }
     IWbemClassObject *outMethodInst;
     IWbemClassObject *inMethodInst = sessionMethodStart( wmi, L"RemoveWatch");
     if (!inMethodInst)
         goto sessionstart;
-    inMethodInst->Put(L"PathName",0,&vpath,0);
+    inMethodInst->Put(L"PathName",0,&vpath.var,0);
     methodExec(wmi,*session, L"RemoveWatch", inMethodInst, &outMethodInst);
     if (outMethodInst==NULL)
         goto sessionExec;
@@ -1162,6 +1234,7 @@ void WmiSessionUnwatch(WMIAccessor* wmi,  void **sessionhandle,
 sessionExec:
     inMethodInst->Release();
 sessionstart:
+    releaseStringArg(&vpath);
 setvpath:
     sink->Release();
 }
@@ -1194,23 +1267,26 @@ void *WmiSessionWatch(WMIAccessor* wmi,  void **sessionhandle,
     BSTR query=formatBstr("SELECT * from CitrixXenStoreWatchEvent WHERE EventId=\"%s\"", path);
 
     wmi->mpXSSvc->ExecNotificationQueryAsync(L"WQL", query,0,NULL, sink);
+    SysFreeString(query);
 
 
-    VARIANT vpath;
-    if (setVariantString(&vpath, path)){
+    struct WmiStringArg vpath;
+    if (setStringArg(&vpath, path)){
         goto setvpath;
     }
     IWbemClassObject *outMethodInst;
     IWbemClassObject *inMethodInst = sessionMethodStart( wmi, L"SetWatch");
     if (!inMethodInst)
         goto sessionstart;
-    inMethodInst->Put(L"PathName",0,&vpath,0);
+    inMethodInst->Put(L"PathName",0,&vpath.var,0);
     methodExec(wmi,*session, L"SetWatch", inMethodInst, &outMethodInst);
+    inMethodInst->Release();
     if (outMethodInst==NULL)
         goto sessionExec;
     outMethodInst->Release();
 sessionExec:
 sessionstart:
+    releaseStringArg(&vpath);
 setvpath:
     return sink;
 }
@@ -1221,6 +1297,7 @@ void *WmiUnsuspendedEventWatch(WMIAccessor *wmi, HANDLE event)
     BSTR query=formatBstr("SELECT * from CitrixXenStoreUnsuspendedEvent");
 
     wmi->mpXSSvc->ExecNotificationQueryAsync(L"WQL", query,0,NULL, sink);
+    SysFreeString(query);
     return sink;
 }
 
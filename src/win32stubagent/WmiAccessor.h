@@ -40,6 +40,7 @@
 
 #include "vm_stats.h"
 #include "XSAccessor.h"
+#include "AttrCache.h"
 
 using namespace std;
 
@@ -53,9 +54,9 @@ void ConnectToWMI(void);
 void ReleaseWMIAccessor(struct WMIAccessor *);
 
 void GetWMIData(WMIAccessor *wmi, VMData& data);
-void DumpOSData(WMIAccessor *wmi);
+void GetOSData(WMIAccessor *wmi, AttrSet& attrs);
 
-VOID AddHotFixInfoToStore(WMIAccessor* wmi);
+BOOL GetHotFixInfo(WMIAccessor* wmi, vector<string>& hotfixes);
 void UpdateProcessListInStore(WMIAccessor *wmi);
 
 int WmiSessionSetEntry(WMIAccessor* wmi,  void **sessionhandle, 
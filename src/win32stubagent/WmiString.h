@@ -0,0 +1,293 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _WMISTRING_H
+#define _WMISTRING_H
+
+#include <windows.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// String marshalling for WmiAccessor.cpp, kept apart from the COM code so
+// that it can be built and measured on its own (see test/).  Include it
+// after XSAccessor.h, which provides XsAlloc and MAX_XENBUS_PATH.
+
+//
+// Per-thread scratch arena for marshalling strings to and from WMI.
+// Space is handed out by bumping ScratchUsed and given back by resetting
+// it to a mark taken before the allocation, so the store operations below
+// convert their arguments and results without touching the heap.  A
+// request that does not fit returns NULL and the caller falls back to the
+// heap.
+//
+#define WMI_SCRATCH_SIZE (16 * 1024)
+
+static __declspec(thread) ULONGLONG ScratchArena[WMI_SCRATCH_SIZE / sizeof(ULONGLONG)];
+static __declspec(thread) size_t ScratchUsed;
+
+static size_t ScratchMark(void)
+{
+    return ScratchUsed;
+}
+
+static void *ScratchAlloc(size_t size)
+{
+    void *p;
+
+    size = (size + sizeof(ULONGLONG) - 1) & ~(sizeof(ULONGLONG) - 1);
+    if (size > WMI_SCRATCH_SIZE - ScratchUsed)
+        return NULL;
+    p = (BYTE *)ScratchArena + ScratchUsed;
+    ScratchUsed += size;
+    return p;
+}
+
+static void ScratchReset(size_t mark)
+{
+    // Only ever move backwards, so releasing several strings taken in
+    // one call works in any order.
+    if (mark < ScratchUsed)
+        ScratchUsed = mark;
+}
+
+//
+// Lay a BSTR out in place: the byte length prefix followed by the UTF-16
+// text and a terminator.  capacity is in WCHARs, excluding the prefix.
+// Such strings are fine as [in] arguments (WMI copies them) but must
+// never reach SysFreeString or VariantClear.
+//
+static BSTR Utf8ToBstrIn(void *space, size_t capacity, const char *string,
+                         size_t len)
+{
+    DWORD *prefix = (DWORD *)space;
+    WCHAR *text = (WCHAR *)(prefix + 1);
+    int n = 0;
+
+    if (len != 0) {
+        n = MultiByteToWideChar(CP_UTF8, 0, string, (int)len,
+                                text, (int)capacity - 1);
+        if (n == 0)
+            return NULL;
+    }
+    text[n] = L'\0';
+    *prefix = n * sizeof(WCHAR);
+    return text;
+}
+
+//
+// Small-string buffer, big enough for any xenstore path.  Arguments that
+// fit are built on the caller's stack; longer ones go to the scratch arena
+// and only spill to a real BSTR if that is exhausted.
+//
+#define WMI_SMALL_STRING MAX_XENBUS_PATH
+
+struct WmiStringArg {
+    VARIANT var;
+    BSTR heap;
+    size_t mark;
+    struct {
+        DWORD prefix;
+        WCHAR text[WMI_SMALL_STRING + 1];
+    } local;
+};
+
+static BSTR mkBstr(const char *string, size_t len) {
+    BSTR res = NULL;
+    int n = 0;
+
+    if (len != 0) {
+        n = MultiByteToWideChar(CP_UTF8, 0, string, (int)len, NULL, 0);
+        if (n == 0) {
+            goto convert;
+        }
+    }
+    res = SysAllocStringLen(NULL, n);
+    if (res == NULL) {
+        goto convert;
+    }
+    if (n != 0) {
+        MultiByteToWideChar(CP_UTF8, 0, string, (int)len, res, n);
+    }
+convert:
+    return res;
+}
+
+static int setStringArg(struct WmiStringArg *arg, const char *data, size_t len)
+{
+    BSTR bstr;
+    void *space;
+
+    VariantInit(&arg->var);
+    arg->heap = NULL;
+    arg->mark = ScratchMark();
+
+    if (len <= WMI_SMALL_STRING) {
+        bstr = Utf8ToBstrIn(&arg->local, WMI_SMALL_STRING + 1, data, len);
+    } else if ((space = ScratchAlloc(sizeof(DWORD) +
+                                     (len + 1) * sizeof(WCHAR))) != NULL) {
+        bstr = Utf8ToBstrIn(space, len + 1, data, len);
+    } else {
+        bstr = arg->heap = mkBstr(data, len);
+    }
+    if (bstr == NULL) {
+        goto convert;
+    }
+
+    arg->var.vt = VT_BSTR;
+    arg->var.bstrVal = bstr;
+    return 0;
+
+convert:
+    ScratchReset(arg->mark);
+    return -1;
+}
+
+static int setStringArg(struct WmiStringArg *arg, const char *string)
+{
+    return setStringArg(arg, string, strlen(string));
+}
+
+static void releaseStringArg(struct WmiStringArg *arg)
+{
+    if (arg->heap != NULL)
+        SysFreeString(arg->heap);
+    arg->heap = NULL;
+    ScratchReset(arg->mark);
+}
+
+// Format into the scratch arena, falling back to the heap; release with
+// freeScratchStr.
+static char *formatScratchStr(const char *fmt, va_list l)
+{
+    char *buf;
+    int cnt = _vscprintf(fmt, l);
+
+    if (cnt < 0)
+        return NULL;
+    buf = (char *)ScratchAlloc(cnt + 1);
+    if (buf == NULL) {
+        buf = (char *)XsAlloc(cnt + 1);
+        if (buf == NULL)
+            return NULL;
+    }
+    _vsnprintf(buf, cnt + 1, fmt, l);
+    return buf;
+}
+
+static void freeScratchStr(char *buf, size_t mark)
+{
+    BYTE *p = (BYTE *)buf;
+
+    if (p != NULL &&
+        (p < (BYTE *)ScratchArena ||
+         p >= (BYTE *)ScratchArena + WMI_SCRATCH_SIZE))
+        XsFree(buf);
+    ScratchReset(mark);
+}
+
+static BSTR formatBstr(const char *fmt, ...)
+{
+    char *buf;
+    va_list l;  
+    BSTR res = NULL;
+    size_t mark = ScratchMark();
+    va_start(l, fmt);
+    buf = formatScratchStr(fmt, l);
+    va_end(l);
+    if (buf == NULL)
+        return NULL;
+    res = mkBstr(buf, strlen(buf));
+    freeScratchStr(buf, mark);
+    return res;
+}
+
+//
+// Convert a BSTR to UTF-8 in the scratch arena.  Returns the length, or
+// -1 if the result does not fit (or does not convert); *mark is where to
+// reset the arena once the caller has copied the text out.
+//
+static int bstrToScratch(BSTR bst, char **out, size_t *mark)
+{
+    int len = (int)SysStringLen(bst);
+    size_t avail;
+    int n;
+
+    *mark = ScratchMark();
+    avail = WMI_SCRATCH_SIZE - *mark;
+    if (avail == 0)
+        return -1;
+    *out = (char *)ScratchAlloc(avail);
+    n = 0;
+    if (len != 0) {
+        n = WideCharToMultiByte(CP_UTF8, 0, bst, len, *out, (int)avail - 1,
+                                NULL, NULL);
+        if (n == 0) {
+            ScratchReset(*mark);
+            return -1;
+        }
+    }
+    (*out)[n] = '\0';
+    return n;
+}
+
+// Returns an XsAlloc'd UTF-8 copy; the only allocation is the result.
+static char *bstrToChar(BSTR bst, size_t *len = NULL) {
+    char *buf;
+    char *space;
+    size_t mark;
+    int n;
+
+    n = bstrToScratch(bst, &buf, &mark);
+    if (n < 0) {
+        int wlen = (int)SysStringLen(bst);
+
+        n = WideCharToMultiByte(CP_UTF8, 0, bst, wlen, NULL, 0, NULL, NULL);
+        space = (char *)XsAlloc(n + 1);
+        if (space == NULL)
+            return NULL;
+        if (n != 0)
+            WideCharToMultiByte(CP_UTF8, 0, bst, wlen, space, n, NULL, NULL);
+        space[n] = '\0';
+    } else {
+        space = (char *)XsAlloc(n + 1);
+        if (space != NULL)
+            memcpy(space, buf, n + 1);
+        ScratchReset(mark);
+        if (space == NULL)
+            return NULL;
+    }
+    if (len != NULL)
+        *len = n;
+    return space;
+}
+
+#endif
@@ -30,13 +30,66 @@
  */
 
 #include <windows.h>
+#include <winioctl.h>
+#include <setupapi.h>
 #include "stdafx.h"
 #include "XSAccessor.h"
 //#include "xs_private.h"
 #include "WMIAccessor.h"
+#include "LogBuffer.h"
+#include <initguid.h>
+#include "..\..\include\xeniface_ioctls.h"
+
+#pragma comment(lib, "setupapi.lib")
 
 static __declspec(thread) void *WmiSessionHandle = NULL;
 
+// Helper threads (thread pool callbacks, startup workers) share one
+// session rather than each leaving a session of its own behind.  The
+// session, and so the transaction state it holds, is only used by one
+// of them at a time: XsSessionEnter takes XsSharedLock on those threads,
+// and a transaction holds it from start to commit.
+static void *XsSharedSession = NULL;
+static CRITICAL_SECTION XsSharedLock;
+static __declspec(thread) BOOL XsShared = FALSE;
+
+static void XsSessionEnter(void)
+{
+    if (XsShared)
+        EnterCriticalSection(&XsSharedLock);
+}
+
+static void XsSessionLeave(void)
+{
+    if (XsShared)
+        LeaveCriticalSection(&XsSharedLock);
+}
+
+// Reads, writes, listings and removals go straight to xeniface with
+// IOCTL_XENIFACE_STORE_* when its device can be opened, and through the
+// WMI session otherwise. Everything else (watches, transactions, logging,
+// the suspend event) needs the session, and so does anything done inside
+// a transaction, which belongs to the session.
+struct XsBackend {
+    const char *name;
+    ssize_t (*read)(const char *path, char **value);
+    int (*write)(const char *path, const char *data, size_t len);
+    int (*list)(const char *path, char ***entries, unsigned *numEntries);
+    int (*remove)(const char *path);
+};
+
+// XsDevice is retired (set back to INVALID_HANDLE_VALUE) when the device
+// goes away, but is only closed once the last call using it returns:
+// XsDeviceRefs counts one for XsDevice itself and one per call in flight.
+static HANDLE volatile XsDevice = INVALID_HANDLE_VALUE;
+static LONG volatile XsDeviceOpened = 0;
+static CRITICAL_SECTION XsDeviceLock;
+static LONG XsDeviceRefs;
+static __declspec(thread) BOOL XsInTransaction = FALSE;
+
+// Big enough for any xenstore value, or listing, and its terminators
+#define XS_IOCTL_BUFFER (4096 + 2)
+
 static LONG volatile threadcount = 0;
 static __declspec(thread) LONG localthreadcount = 0;
 
@@ -82,7 +135,345 @@ int ListenSuspend(HANDLE event)
         return 0;
 }
 
-void InitXSAccessor()
+static ssize_t WmiBackendRead(const char *path, char **value)
+{
+    size_t len = 0;
+
+    XsSessionEnter();
+    *value = WmiSessionGetEntry(wmi, &WmiSessionHandle, path, &len);
+    XsSessionLeave();
+    if (*value == NULL)
+        return -1;
+    return len;
+}
+
+static int WmiBackendWrite(const char *path, const char *data, size_t len)
+{
+    int ret;
+
+    XsSessionEnter();
+    ret = WmiSessionSetEntry(wmi, &WmiSessionHandle, path, data, len);
+    XsSessionLeave();
+    return ret;
+}
+
+static int WmiBackendList(const char *path, char ***entries, unsigned *numEntries)
+{
+    XsSessionEnter();
+    *entries = WmiSessionGetChildren(wmi, &WmiSessionHandle, path, numEntries);
+    XsSessionLeave();
+    if (*entries == NULL)
+        return -1;
+    return 0;
+}
+
+static int WmiBackendRemove(const char *path)
+{
+    int ret;
+
+    XsSessionEnter();
+    ret = WmiSessionRemoveEntry(wmi, &WmiSessionHandle, path);
+    XsSessionLeave();
+    if (ret)
+        return -1;
+    return 0;
+}
+
+static const XsBackend XsWmiBackend = {
+    "WMI",
+    WmiBackendRead,
+    WmiBackendWrite,
+    WmiBackendList,
+    WmiBackendRemove
+};
+
+static HANDLE XsDeviceOpen(void)
+{
+    HDEVINFO devs;
+    SP_DEVICE_INTERFACE_DATA iface;
+    PSP_DEVICE_INTERFACE_DETAIL_DATA detail;
+    DWORD size = 0;
+    HANDLE device = INVALID_HANDLE_VALUE;
+
+    devs = SetupDiGetClassDevs(&GUID_INTERFACE_XENIFACE, NULL, NULL,
+                               DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    if (devs == INVALID_HANDLE_VALUE)
+        goto getclassdevs;
+
+    iface.cbSize = sizeof(iface);
+    if (!SetupDiEnumDeviceInterfaces(devs, NULL, &GUID_INTERFACE_XENIFACE, 0, &iface))
+        goto enuminterfaces;
+
+    SetupDiGetDeviceInterfaceDetail(devs, &iface, NULL, 0, &size, NULL);
+    detail = (PSP_DEVICE_INTERFACE_DETAIL_DATA)malloc(size);
+    if (detail == NULL)
+        goto allocdetail;
+
+    detail->cbSize = sizeof(*detail);
+    if (!SetupDiGetDeviceInterfaceDetail(devs, &iface, detail, size, NULL, NULL))
+        goto getdetail;
+
+    device = CreateFile(detail->DevicePath,
+                        GENERIC_READ | GENERIC_WRITE,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE,
+                        NULL,
+                        OPEN_EXISTING,
+                        0,
+                        NULL);
+
+getdetail:
+    free(detail);
+allocdetail:
+enuminterfaces:
+    SetupDiDestroyDeviceInfoList(devs);
+getclassdevs:
+    return device;
+}
+
+static HANDLE XsDeviceGet(void)
+{
+    HANDLE device;
+
+    EnterCriticalSection(&XsDeviceLock);
+    device = XsDevice;
+    if (device != INVALID_HANDLE_VALUE)
+        XsDeviceRefs++;
+    LeaveCriticalSection(&XsDeviceLock);
+
+    return device;
+}
+
+static void XsDevicePut(HANDLE device)
+{
+    LONG refs;
+
+    EnterCriticalSection(&XsDeviceLock);
+    refs = --XsDeviceRefs;
+    LeaveCriticalSection(&XsDeviceLock);
+
+    if (refs == 0)
+        CloseHandle(device);
+}
+
+// Failures which mean the device, rather than the request, is the
+// problem: xeniface has gone, or is too old to have the IOCTLs
+static BOOL XsDeviceLost(DWORD err)
+{
+    HANDLE device;
+
+    switch (err) {
+    case ERROR_INVALID_HANDLE:
+    case ERROR_INVALID_FUNCTION:
+    case ERROR_NOT_SUPPORTED:
+    case ERROR_DEVICE_NOT_CONNECTED:
+    case ERROR_DEVICE_REMOVED:
+        break;
+    default:
+        return FALSE;
+    }
+
+    EnterCriticalSection(&XsDeviceLock);
+    device = XsDevice;
+    XsDevice = INVALID_HANDLE_VALUE;
+    LeaveCriticalSection(&XsDeviceLock);
+
+    if (device != INVALID_HANDLE_VALUE) {
+        DBGPRINT(("XSAccessor: IOCTLs failed (%d), using WMI\n", err));
+        XsDevicePut(device);
+    }
+    return TRUE;
+}
+
+// Returns ERROR_SUCCESS, or the error. Requests the driver turns down
+// (a value it cannot pass, or a result too big) come back as
+// ERROR_INVALID_PARAMETER, and are worth retrying through WMI.  A device
+// retired since the caller chose this backend gives ERROR_INVALID_HANDLE,
+// which sends the request to WMI too.
+static DWORD XsIoctl(DWORD code, const char *in, DWORD inlen,
+                     char *out, DWORD outlen, DWORD *returned)
+{
+    HANDLE device;
+    DWORD dummy;
+    DWORD err;
+
+    if (returned == NULL)
+        returned = &dummy;
+    *returned = 0;
+
+    device = XsDeviceGet();
+    if (device == INVALID_HANDLE_VALUE)
+        return ERROR_INVALID_HANDLE;
+
+    err = ERROR_SUCCESS;
+    if (!DeviceIoControl(device, code, (LPVOID)in, inlen, out, outlen,
+                         returned, NULL))
+        err = GetLastError();
+
+    XsDevicePut(device);
+    return err;
+}
+
+static BOOL XsIoctlRetry(DWORD err)
+{
+    return XsDeviceLost(err) || err == ERROR_INVALID_PARAMETER;
+}
+
+static ssize_t IoctlBackendRead(const char *path, char **value)
+{
+    DWORD returned;
+    DWORD err;
+
+    *value = (char *)XsAlloc(XS_IOCTL_BUFFER);
+    if (*value == NULL)
+        return -1;
+
+    err = XsIoctl(IOCTL_XENIFACE_STORE_READ, path, (DWORD)strlen(path) + 1,
+                  *value, XS_IOCTL_BUFFER, &returned);
+    if (err != ERROR_SUCCESS || returned == 0) {
+        XsFree(*value);
+        *value = NULL;
+        if (XsIoctlRetry(err))
+            return XsWmiBackend.read(path, value);
+        return -1;
+    }
+
+    return returned - 1;
+}
+
+static int IoctlBackendWrite(const char *path, const char *data, size_t len)
+{
+    size_t pathlen = strlen(path) + 1;
+    char *buf;
+    DWORD err;
+
+    buf = (char *)malloc(pathlen + len + 1);
+    if (buf == NULL)
+        return -1;
+
+    memcpy(buf, path, pathlen);
+    memcpy(buf + pathlen, data, len);
+    buf[pathlen + len] = 0;
+
+    err = XsIoctl(IOCTL_XENIFACE_STORE_WRITE, buf, (DWORD)(pathlen + len + 1),
+                  NULL, 0, NULL);
+    free(buf);
+
+    if (err != ERROR_SUCCESS) {
+        if (XsIoctlRetry(err))
+            return XsWmiBackend.write(path, data, len);
+        return -1;
+    }
+    return 0;
+}
+
+// Children are returned as full paths, as GetChildren does
+static int IoctlBackendList(const char *path, char ***entries, unsigned *numEntries)
+{
+    char *buf;
+    char *child;
+    size_t pathlen = strlen(path);
+    unsigned count;
+    unsigned i;
+    DWORD err;
+
+    *entries = NULL;
+    *numEntries = 0;
+
+    buf = (char *)malloc(XS_IOCTL_BUFFER);
+    if (buf == NULL)
+        return -1;
+
+    err = XsIoctl(IOCTL_XENIFACE_STORE_DIRECTORY, path, (DWORD)pathlen + 1,
+                  buf, XS_IOCTL_BUFFER, NULL);
+    if (err != ERROR_SUCCESS) {
+        free(buf);
+        if (XsIoctlRetry(err))
+            return XsWmiBackend.list(path, entries, numEntries);
+        return -1;
+    }
+
+    count = 0;
+    for (child = buf; *child; child += strlen(child) + 1)
+        count++;
+
+    // As through WMI, a node with no children is reported as a failure
+    if (count == 0)
+        goto empty;
+
+    *entries = (char **)XsAlloc(sizeof(char *) * count);
+    if (*entries == NULL)
+        goto allocentries;
+
+    for (i = 0, child = buf; i < count; i++, child += strlen(child) + 1) {
+        size_t size = pathlen + 1 + strlen(child) + 1;
+
+        (*entries)[i] = (char *)XsAlloc(size);
+        if ((*entries)[i] == NULL)
+            goto allocentry;
+        _snprintf((*entries)[i], size, "%s/%s", path, child);
+    }
+
+    *numEntries = count;
+    free(buf);
+    return 0;
+
+allocentry:
+    while (i-- > 0)
+        XsFree((*entries)[i]);
+    XsFree(*entries);
+    *entries = NULL;
+allocentries:
+empty:
+    free(buf);
+    return -1;
+}
+
+static int IoctlBackendRemove(const char *path)
+{
+    DWORD err;
+
+    err = XsIoctl(IOCTL_XENIFACE_STORE_REMOVE, path, (DWORD)strlen(path) + 1,
+                  NULL, 0, NULL);
+    if (err != ERROR_SUCCESS) {
+        if (XsIoctlRetry(err))
+            return XsWmiBackend.remove(path);
+        return -1;
+    }
+    return 0;
+}
+
+static const XsBackend XsIoctlBackend = {
+    "IOCTL",
+    IoctlBackendRead,
+    IoctlBackendWrite,
+    IoctlBackendList,
+    IoctlBackendRemove
+};
+
+static const XsBackend *XsBackendGet(void)
+{
+    if (XsInTransaction || XsDevice == INVALID_HANDLE_VALUE)
+        return &XsWmiBackend;
+    return &XsIoctlBackend;
+}
+
+// Everything shared by the threads is set up by the first call, which
+// the service makes on its main thread before starting any other.
+static void XsInitShared(void)
+{
+    if (InterlockedCompareExchange(&XsDeviceOpened, 1, 0) == 0) {
+        HANDLE device = XsDeviceOpen();
+
+        InitializeCriticalSection(&XsSharedLock);
+        InitializeCriticalSection(&XsDeviceLock);
+        XsDeviceRefs = (device != INVALID_HANDLE_VALUE) ? 1 : 0;
+        XsDevice = device;
+        DBGPRINT(("XSAccessor: using %s\n", XsBackendGet()->name));
+    }
+}
+
+// Open this thread's own session.  Returns -1 if it cannot be opened.
+int InitXSAccessor()
 {
     DBGPRINT(("XSAccessor"));
     if (WmiSessionHandle == NULL) {
@@ -94,26 +485,98 @@ void InitXSAccessor()
         WmiSessionStart(wmi, &WmiSessionHandle, wminame);
     }
     if (WmiSessionHandle == NULL)
-        exit(1);
+        return -1;
+
+    XsInitShared();
+    return 0;
+}
+
+// Attach a helper thread to the shared session, opening it on first
+// use.  Returns -1 if it cannot be opened; the next call tries again.
+int InitXSAccessorShared()
+{
+    void *session;
+
+    if (WmiSessionHandle != NULL)
+        return 0;
+
+    XsInitShared();
+
+    EnterCriticalSection(&XsSharedLock);
+    if (XsSharedSession == NULL)
+        WmiSessionStart(wmi, &XsSharedSession, "XSshared");
+    session = XsSharedSession;
+    LeaveCriticalSection(&XsSharedLock);
+
+    if (session == NULL)
+        return -1;
+
+    WmiSessionHandle = session;
+    XsShared = TRUE;
+    return 0;
+}
+
+// Messages are queued for the log flusher (LogBuffer.cpp) while it
+// runs, and written straight through the session otherwise.  Once WMI
+// has been released they only go to the debugger.
+void XsLogV(const char *fmt, va_list args)
+{
+    if (LogBufferAppend(fmt, args))
+        return;
+
+    if (wmi == NULL) {
+        char message[256];
+
+        _vsnprintf(message, sizeof(message), fmt, args);
+        message[sizeof(message) - 1] = '\0';
+        OutputDebugString(message);
+        return;
+    }
+
+    if (!WmiSessionHandle && InitXSAccessorShared() < 0)
+        return;
+
+    XsSessionEnter();
+    WmiSessionLog(wmi, &WmiSessionHandle, fmt, args);
+    XsSessionLeave();
 }
 
 void XsLog(const char *fmt, ...)
 {
     va_list args;
-    if (!WmiSessionHandle) {
-        InitXSAccessor();
-    }
 
     va_start(args, fmt);
+    XsLogV(fmt, args);
+    va_end(args);
+}
+
+// Used by the log flusher to write a batch through the shared session
+void XsLogFlush(const char *fmt, ...)
+{
+    va_list args;
+    if (!WmiSessionHandle && InitXSAccessorShared() < 0)
+        return;
+
+    va_start(args, fmt);
+    XsSessionEnter();
     WmiSessionLog(wmi, &WmiSessionHandle, fmt, args);
+    XsSessionLeave();
     va_end(args);
 }
 
 
+// Call before releasing WMI, after the log flusher has stopped
 void ShutdownXSAccessor(void)
 {
-    WmiSessionEnd(wmi, WmiSessionHandle);
+    if (WmiSessionHandle != NULL) {
+        WmiSessionEnd(wmi, WmiSessionHandle);
+        WmiSessionHandle = NULL;
+    }
 
+    if (XsSharedSession != NULL) {
+        WmiSessionEnd(wmi, XsSharedSession);
+        XsSharedSession = NULL;
+    }
 }
 
 int XenstorePrintf(const char *path, const char *fmt, ...)
@@ -132,18 +595,18 @@ int XenstorePrintf(const char *path, const char *fmt, ...)
     }
 
     /* Now have the thing we're trying to write. */
-    return WmiSessionSetEntry(wmi, &WmiSessionHandle, path, buf);
+    return XsBackendGet()->write(path, buf, strlen(buf));
 }
 
 int XenstoreWrite(const char *path, const void *data, size_t len)
 {
-    return WmiSessionSetEntry(wmi, &WmiSessionHandle, path, (const char *)data, len);
+    return XsBackendGet()->write(path, (const char *)data, len);
 }
 
 void XenstoreKickXapi()
 {
     /* Old protocol */
-    WmiSessionSetEntry(wmi, &WmiSessionHandle, "data/updated", "1");
+    XenstoreWrite("data/updated", "1", 1);
     /* New protocol */
     XenstorePrintf("data/update_cnt", "%I64d", update_cnt);
 
@@ -154,118 +617,261 @@ void XenstoreDoDump(VMData *data)
 {
     XenstorePrintf("data/meminfo_free", "%I64d", data->meminfo_free);
     XenstorePrintf("data/meminfo_total", "%I64d", data->meminfo_total);
+    XenstoreDoDumpDetail(data);
 }
 
+/* The figures xapi does not report, which need no kick */
+void XenstoreDoDumpDetail(VMData *data)
+{
+    if (data->meminfo_commit >= 0)
+        XenstorePrintf("data/meminfo_commit", "%I64d", data->meminfo_commit);
+    if (data->meminfo_commit_limit >= 0)
+        XenstorePrintf("data/meminfo_commit_limit", "%I64d",
+                       data->meminfo_commit_limit);
+    if (data->meminfo_cache >= 0)
+        XenstorePrintf("data/meminfo_cache", "%I64d", data->meminfo_cache);
+    if (data->meminfo_pagefile >= 0)
+        XenstorePrintf("data/meminfo_pagefile", "%I64d", data->meminfo_pagefile);
+}
+
+static VIFData *
+XsFindVif(
+    uint32_t num_vif,
+    VIFData *vif,
+    uint32_t ethnum
+    )
+{
+    uint32_t i;
+
+    for (i = 0; i < num_vif; i++) {
+        if (vif[i].ethnum == ethnum)
+            return &vif[i];
+    }
+    return NULL;
+}
+
+//
+// Walk the difference between the vif set last published (old) and the
+// current one, counting the keys that need to change.  With apply set
+// the changes are also made.  A NULL old set means nothing is known to
+// be in the store, so every key is written.
+//
+static int
+XsNicDiff(
+    uint32_t num_vif,
+    VIFData *vif,
+    uint32_t num_old,
+    VIFData *old,
+    BOOL apply,
+    int *ret
+    )
+{
+    char path[MAX_CHAR_LEN] = "";
+    int changes = 0;
+    uint32_t i;
+
+    if (old == NULL || num_old != num_vif) {
+        changes++;
+        if (apply)
+            *ret |= XenstorePrintf("data/num_vif", "%d", num_vif);
+    }
+
+    for (i = 0; old != NULL && i < num_old; i++) {
+        if (old[i].ethnum == -1 ||
+            XsFindVif(num_vif, vif, old[i].ethnum) != NULL)
+            continue;
+
+        changes++;
+        if (!apply)
+            continue;
+
+        _snprintf(path, MAX_CHAR_LEN, "data/vif/%d", old[i].ethnum);
+        path[MAX_CHAR_LEN-1] = 0;
+        XenstoreRemove(path);
+        _snprintf(path, MAX_CHAR_LEN, "attr/eth%d", old[i].ethnum);
+        path[MAX_CHAR_LEN-1] = 0;
+        XenstoreRemove(path);
+    }
+
+    for (i = 0; i < num_vif; i++) {
+        VIFData *prev;
+
+        if (vif[i].ethnum == -1)
+            continue;
+
+        prev = (old != NULL) ? XsFindVif(num_old, old, vif[i].ethnum) : NULL;
+
+        if (prev == NULL || strcmp(prev->name, vif[i].name) != 0) {
+            changes++;
+            if (apply) {
+                _snprintf(path, MAX_CHAR_LEN, "data/vif/%d/name" , vif[i].ethnum);
+                path[MAX_CHAR_LEN-1] = 0;
+                *ret |= XenstorePrintf(path, "%s", vif[i].name);
+            }
+        }
+
+        //
+        // IP address is dumped to /attr/eth[x]/ip
+        //
+        if (prev == NULL || strcmp(prev->ip, vif[i].ip) != 0) {
+            changes++;
+            if (apply) {
+                _snprintf (path, MAX_CHAR_LEN, "attr/eth%d/ip", vif[i].ethnum);
+                path[MAX_CHAR_LEN-1] = 0;
+                *ret |= XenstorePrintf (path, "%s", vif[i].ip);
+            }
+        }
+    }
+
+    return changes;
+}
+
+//
+// Publish the vif set, writing only what differs from the set last
+// published (old, or NULL if unknown) and removing only the vifs that
+// have gone.  Returns the number of keys changed, or -1 on failure.
+//
 int XenstoreDoNicDump(
     uint32_t num_vif,
-    VIFData *vif
+    VIFData *vif,
+    uint32_t num_old,
+    VIFData *old
     )
 {
     DWORD hStatus;
-    unsigned int i;
     int ret = 0;
+    int changes;
     char path[MAX_CHAR_LEN] = "";
     const char* domainVifPath = "data/vif";
     unsigned int entry;     
     unsigned int numEntries;
     char** vifEntries = NULL;
-    char vifNode[MAX_XENBUS_PATH];
-
-    //
-    // Do any cleanup first outside of a transaction since failures are allowed
-    // and in some cases expected.
-    //
-    // Remove all of the old vif entries in case the nics have been
-    // disabled.  Otherwise they will have old stale data in xenstore.
-    //
-    if (XenstoreList(domainVifPath, &vifEntries, &numEntries) >= 0) {
-        for (entry = 0; entry < numEntries; entry++) {
-            _snprintf(path, MAX_CHAR_LEN, "%s", vifEntries[entry]);
-            WmiSessionRemoveEntry(wmi, &WmiSessionHandle, path);
-            _snprintf(path, MAX_CHAR_LEN, "attr/eth%s", vifEntries[entry]+9);
-            WmiSessionRemoveEntry(wmi, &WmiSessionHandle, path);
-            XsFree(vifEntries[entry]);
+
+    if (old == NULL) {
+        //
+        // Nothing is known about what is in the store, so do the cleanup
+        // first outside of a transaction since failures are allowed and in
+        // some cases expected.
+        //
+        // Remove all of the old vif entries in case the nics have been
+        // disabled.  Otherwise they will have old stale data in xenstore.
+        //
+        if (XenstoreList(domainVifPath, &vifEntries, &numEntries) >= 0) {
+            for (entry = 0; entry < numEntries; entry++) {
+                _snprintf(path, MAX_CHAR_LEN, "%s", vifEntries[entry]);
+                XenstoreRemove(path);
+                _snprintf(path, MAX_CHAR_LEN, "attr/eth%s", vifEntries[entry]+9);
+                XenstoreRemove(path);
+                XsFree(vifEntries[entry]);
+            }
+            XsFree(vifEntries);
         }
-        XsFree(vifEntries);
+    } else {
+        changes = XsNicDiff(num_vif, vif, num_old, old, FALSE, &ret);
+        if (changes == 0)
+            return 0;
     }
+
+    XsSessionEnter();
     do 
     {
         hStatus = ERROR_SUCCESS;
+        ret = 0;
         WmiSessionTransactionStart(wmi, &WmiSessionHandle );
-        ret |= XenstorePrintf("data/num_vif", "%d", num_vif);
+        XsInTransaction = TRUE;
+        changes = XsNicDiff(num_vif, vif, num_old, old, TRUE, &ret);
+        XsInTransaction = FALSE;
+        if(!WmiSessionTransactionCommit(wmi, &WmiSessionHandle))
+        {
+            hStatus = GetLastError ();
+            if (hStatus != ERROR_RETRY)
+            {
+                ret = -1;
+                break;
+            }
+        }
 
-        for( i = 0; i < num_vif; i++ ){
-            if (vif[i].ethnum != -1) {
-                _snprintf(path, MAX_CHAR_LEN, "data/vif/%d/name" , vif[i].ethnum);
-                path[MAX_CHAR_LEN-1] = 0;
-                ret |= XenstorePrintf(path, "%s", vif[i].name);
+    } while (hStatus == ERROR_RETRY);
+    XsSessionLeave();
 
+    return (ret < 0) ? -1 : changes;
+}
 
-                //
-                // IP address is dumped to /attr/eth[x]/ip
-                //
-                _snprintf (path, MAX_CHAR_LEN, "attr/eth%d/ip", vif[i].ethnum);
-                path[MAX_CHAR_LEN-1] = 0;
-                ret |= XenstorePrintf (path, "%s", vif[i].ip);
+//
+// Run body inside a store transaction, retrying it for as long as the
+// commit asks to.  Returns -1 if the body or the commit failed.
+//
+int XenstoreTransaction(
+    int (*body)(void *ctx),
+    void *ctx
+    )
+{
+    DWORD hStatus;
+    int ret;
 
-            }
+    XsSessionEnter();
+    do
+    {
+        hStatus = ERROR_SUCCESS;
+        WmiSessionTransactionStart(wmi, &WmiSessionHandle );
+        XsInTransaction = TRUE;
+        ret = body(ctx);
+        XsInTransaction = FALSE;
+        if (ret < 0) {
+            WmiSessionTransactionAbort(wmi, &WmiSessionHandle);
+            break;
         }
         if(!WmiSessionTransactionCommit(wmi, &WmiSessionHandle))
         {
             hStatus = GetLastError ();
             if (hStatus != ERROR_RETRY)
             {
-                return -1;
+                ret = -1;
+                break;
             }
         }
 
     } while (hStatus == ERROR_RETRY);
-	return ret;
+    XsSessionLeave();
+
+    return (ret < 0) ? -1 : 0;
 }
 
 int
 XenstoreList(const char *path, char ***entries, unsigned *numEntries)
 {
-    *entries = WmiSessionGetChildren(wmi, &WmiSessionHandle, path, numEntries);
-    if (*entries) {
-        return 0;
-    }
-    else {
-        return -1;
-    }
+    return XsBackendGet()->list(path, entries, numEntries);
 }
 
 int
 XenstoreRemove(const char *path)
 {
-    if (WmiSessionRemoveEntry(wmi, &WmiSessionHandle, path))
-        return -1;
-    else
-        return 0;
+    return XsBackendGet()->remove(path);
 }
 
 ssize_t
 XenstoreRead(const char* path, char** value)
 {
-    size_t len;
-    *value =WmiSessionGetEntry(wmi, &WmiSessionHandle, path, &len);
-    if (*value)
-        return len;
-    else
-        return -1;
+    return XsBackendGet()->read(path, value);
 }
 
 void *
 XenstoreWatch(const char *path, HANDLE event)
 {
- 
-    return WmiSessionWatch(wmi, &WmiSessionHandle, path, event);
+    void *watch;
+
+    XsSessionEnter();
+    watch = WmiSessionWatch(wmi, &WmiSessionHandle, path, event);
+    XsSessionLeave();
+    return watch;
 }
 
 void
 XenstoreUnwatch(void *watch)
 {
-    return WmiSessionUnwatch(wmi, &WmiSessionHandle, watch);
+    XsSessionEnter();
+    WmiSessionUnwatch(wmi, &WmiSessionHandle, watch);
+    XsSessionLeave();
 }
 
 void 
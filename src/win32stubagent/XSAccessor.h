@@ -34,6 +34,7 @@
 #define _XSACCESSOR_H
 
 #include <string>
+#include <stdarg.h>
 
 #include "vm_stats.h"
 
@@ -47,7 +48,8 @@ typedef long long ssize_t;
 typedef long ssize_t;
 #endif
 
-void InitXSAccessor();
+int InitXSAccessor();
+int InitXSAccessorShared();
 void ShutdownXSAccessor();
 int XenstoreList(const char *path, char ***entries, unsigned *numEntries);
 ssize_t XenstoreRead(const char *path, char **value);
@@ -56,12 +58,17 @@ int XenstorePrintf(const char *path, const char *fmt, ...);
 int XenstoreWrite(const char *path, const void *data, size_t len);
 void XenstoreKickXapi(void);
 void XenstoreDoDump(VMData *data);
-int XenstoreDoNicDump(uint32_t num_vif, VIFData *vif);
+void XenstoreDoDumpDetail(VMData *data);
+int XenstoreDoNicDump(uint32_t num_vif, VIFData *vif,
+                      uint32_t num_old, VIFData *old);
+int XenstoreTransaction(int (*body)(void *ctx), void *ctx);
 void *XenstoreWatch(const char *path, HANDLE event);
 void XenstoreUnwatch(void *watch);
 int ListenSuspend(HANDLE event);
 void GetXenTime(FILETIME *res);
 void XsLog(const char *fmt, ...);
+void XsLogV(const char *fmt, va_list args);
+void XsLogFlush(const char *fmt, ...);
 void XenstoreFree(void *tofree);
 void *XsAlloc(size_t size);
 void XsFree(const void *buf);
@@ -45,6 +45,11 @@
 #include "version.h"
 #include "messages.h"
 #include "TSInfo.h"
+#include "TimerWheel.h"
+#include "Dispatch.h"
+#include "MemStats.h"
+#include "AttrCache.h"
+#include "Startup.h"
 
 #include <setupapi.h>
 #include <cfgmgr32.h>
@@ -128,21 +133,22 @@ typedef HRESULT (WINAPI *SL_IS_GENUINE_LOCAL)(
     __inout_opt VOID                        *pUnused
     );
 
-/* Add operating system version, service pack, etc. to store. */
+/* Collect operating system version, service pack, etc. */
 static VOID
-AddSystemInfoToStore(
-    WMIAccessor* wmi
+GetSystemInfo(
+    WMIAccessor* wmi,
+    AttrSet& attrs
     )
 {
     OSVERSIONINFOEX info;
     char buf[MAX_PATH];
     
-    XenstorePrintf("attr/os/class", "windows NT");
+    AttrSetPrintf(attrs, "attr/os/class", "windows NT");
     /* Windows version, service pack, build number */
     info.dwOSVersionInfoSize = sizeof(info);
     if (GetVersionEx((LPOSVERSIONINFO)&info)) {
 #define do_field(name, field) \
-        XenstorePrintf("attr/os/" #name , "%d", info. field)
+        AttrSetPrintf(attrs, "attr/os/" #name , "%d", info. field)
         do_field(major, dwMajorVersion);
         do_field(minor, dwMinorVersion);
         do_field(build, dwBuildNumber);
@@ -153,17 +159,17 @@ AddSystemInfoToStore(
         do_field(type, wProductType);
 #undef do_field
 
-        XenstorePrintf("data/os_distro", "windows");
-        XenstorePrintf("data/os_majorver", "%d", info.dwMajorVersion);
-        XenstorePrintf("data/os_minorver", "%d", info.dwMinorVersion);
+        AttrSetPrintf(attrs, "data/os_distro", "windows");
+        AttrSetPrintf(attrs, "data/os_majorver", "%d", info.dwMajorVersion);
+        AttrSetPrintf(attrs, "data/os_minorver", "%d", info.dwMinorVersion);
     } else {
         /* Flag that we couldn't collect this information. */
-        XenstorePrintf("attr/os/major", "-1");
+        AttrSetPrintf(attrs, "attr/os/major", "-1");
     }
 
-    DumpOSData(wmi);
+    GetOSData(wmi, attrs);
 
-    XenstorePrintf("attr/os/boottype", "%d", GetSystemMetrics(SM_CLEANBOOT));
+    AttrSetPrintf(attrs, "attr/os/boottype", "%d", GetSystemMetrics(SM_CLEANBOOT));
     /* HAL version in use */
     if (SUCCEEDED(SHGetFolderPath(NULL, CSIDL_SYSTEM, NULL, SHGFP_TYPE_CURRENT, buf))) {
         DWORD tmp;
@@ -177,16 +183,16 @@ AddSystemInfoToStore(
         } *trans;
         UINT trans_size;
 
-        XenstorePrintf("attr/os/system32_dir", "%s", buf);
+        AttrSetPrintf(attrs, "attr/os/system32_dir", "%s", buf);
         strcat(buf, "\\hal.dll");
         versize = GetFileVersionInfoSize(buf, &tmp);
         if (versize == 0) {
-            XenstorePrintf("attr/os/hal", "<unknown versize=0>");
+            AttrSetPrintf(attrs, "attr/os/hal", "<unknown versize=0>");
             goto done_hal;
         }
         buffer = malloc(versize);
         if (!buffer) {
-            XenstorePrintf("attr/os/hal", "<unknown versize=%d>", versize);
+            AttrSetPrintf(attrs, "attr/os/hal", "<unknown versize=%d>", versize);
             goto done_hal;
         }
         if (GetFileVersionInfo(buf, tmp, versize, buffer) == 0) {
@@ -199,14 +205,14 @@ AddSystemInfoToStore(
             goto done_hal;
         }
         if (trans_size < sizeof(*trans)) {
-            XenstorePrintf("attr/os/hal", "<no translations>");
+            AttrSetPrintf(attrs, "attr/os/hal", "<no translations>");
             goto done_hal;
         }
         sprintf(buffer2, "\\StringFileInfo\\%04x%04x\\InternalName",
                 trans->language, trans->code_page);
         if (VerQueryValue(buffer, buffer2, (LPVOID *)&halname,
                           &halnamelen)) {
-            XenstorePrintf("attr/os/hal", "%s", halname);
+            AttrSetPrintf(attrs, "attr/os/hal", "%s", halname);
 
             if (!lstrcmpi(halname, "hal.dll")) {
                 LegacyHal = TRUE;
@@ -235,16 +241,41 @@ AddSystemInfoToStore(
         if (res != ERROR_SUCCESS) {
             PrintError("RegQueryValue(SystemStartOptions)");
         } else if (keyType != REG_SZ) {
-            XenstorePrintf("attr/os/boot_options", "<not string>");
+            AttrSetPrintf(attrs, "attr/os/boot_options", "<not string>");
         } else {
-            XenstorePrintf("attr/os/boot_options", buf);
+            AttrSetPrintf(attrs, "attr/os/boot_options", "%s", buf);
         }
         RegCloseKey(regKey);
         regKey = NULL;
     }
+}
+
+/* Publish the system information and the cached hotfix list.  Nothing
+   here changes without a reboot, so it is only collected once per run,
+   and it is only written when it differs from what was last published.
+   Returns as AttrCachePublish. */
+static int
+AddSystemInfoToStore(
+    WMIAccessor* wmi
+    )
+{
+    static AttrSet system;
+    static BOOL collected;
+    AttrSet attrs;
+    int published;
+
+    if (!collected) {
+        GetSystemInfo(wmi, system);
+        collected = TRUE;
+    }
 
-    AddHotFixInfoToStore(wmi);
+    attrs = system;
+    AttrCacheGetHotFixes(attrs);
+    published = AttrCachePublish(attrs);
+    if (published > 0)
+        XsLogMsg("published %d system attributes", (int)attrs.size());
 
+    return published;
 }
 
 struct watch_event {
@@ -290,50 +321,131 @@ EstablishWatch(const char *path)
 }
 
 struct watch_feature {
+    struct watch_feature *next;
     struct watch_event *watch;
+    struct dispatch_handler dispatch;
     const char *feature_flag;
-    const char *name;
-    void (*handler)(void *);
-    void *ctx;
 };
 
-#define MAX_FEATURES 10
 struct watch_feature_set {
-    struct watch_feature features[MAX_FEATURES];
-    unsigned nr_features;
+    CRITICAL_SECTION lock;
+    struct watch_feature *features;
+};
+
+/* Every feature handler runs on a thread pool thread, against the
+ * session the helper threads share (see InitXSAccessorShared). */
+static __declspec(thread) HRESULT FeatureComStatus;
+
+static BOOL
+FeatureEnter(struct dispatch_handler *dh)
+{
+    FeatureComStatus = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    if (InitXSAccessorShared() < 0) {
+        DBGPRINT(("XenSvc: no store session for feature %s\n", dh->name));
+        if (SUCCEEDED(FeatureComStatus))
+            CoUninitialize();
+        return FALSE;
+    }
+
+    XsLogMsg("fire feature %s", dh->name);
+    return TRUE;
+}
+
+static void
+FeatureLeave(struct dispatch_handler *dh)
+{
+    XsLogMsg("fired feature %s", dh->name);
+
+    if (SUCCEEDED(FeatureComStatus))
+        CoUninitialize();
+}
+
+static const struct dispatch_hooks FeatureHooks = {
+    FeatureEnter,
+    FeatureLeave
 };
 
+static void
+InitFeatures(struct watch_feature_set *wfs)
+{
+    InitializeCriticalSection(&wfs->lock);
+    wfs->features = NULL;
+    SetDispatchHooks(&FeatureHooks);
+}
+
 static void
 AddFeature(struct watch_feature_set *wfs, const char *path,
            const char *flag, const char *name,
-           void (*handler)(void *), void *ctx)
+           void (*handler)(void *), void *ctx,
+           struct dispatch_context *context)
 {
-    unsigned n;
-    if (wfs->nr_features == MAX_FEATURES) {
-        PrintError("Too many features!", ERROR_INVALID_FUNCTION);
+    struct watch_feature *wf;
+
+    wf = (struct watch_feature *)malloc(sizeof(*wf));
+    if (wf == NULL) {
+        PrintError("malloc() for AddFeature()", ERROR_NOT_ENOUGH_MEMORY);
         return;
     }
-    n = wfs->nr_features;
-    wfs->features[n].watch = EstablishWatch(path);
-    if (wfs->features[n].watch == NULL) {
+    memset(wf, 0, sizeof(*wf));
+
+    wf->feature_flag = flag;
+
+    wf->watch = EstablishWatch(path);
+    if (wf->watch == NULL) {
         PrintError("EstablishWatch() for AddFeature()");
-        return;
+        goto fail;
+    }
+
+    if (!RegisterDispatch(&wf->dispatch, wf->watch->event, name, handler,
+                          ctx, context)) {
+        PrintError("RegisterWaitForSingleObject() for AddFeature()");
+        goto fail;
+    }
+
+    EnterCriticalSection(&wfs->lock);
+    wf->next = wfs->features;
+    wfs->features = wf;
+    LeaveCriticalSection(&wfs->lock);
+    return;
+
+fail:
+    ReleaseWatch(wf->watch);
+    free(wf);
+}
+
+/* Waits for any running handler to finish before tearing down. */
+static void
+ReleaseFeatures(struct watch_feature_set *wfs)
+{
+    struct watch_feature *wf;
+
+    EnterCriticalSection(&wfs->lock);
+    while ((wf = wfs->features) != NULL) {
+        wfs->features = wf->next;
+        LeaveCriticalSection(&wfs->lock);
+
+        UnregisterDispatch(&wf->dispatch);
+        ReleaseWatch(wf->watch);
+        free(wf);
+
+        EnterCriticalSection(&wfs->lock);
     }
-    wfs->features[n].feature_flag = flag;
-    wfs->features[n].handler = handler;
-    wfs->features[n].ctx = ctx;
-    wfs->features[n].name = name;
-    wfs->nr_features++;
+    LeaveCriticalSection(&wfs->lock);
+    DeleteCriticalSection(&wfs->lock);
 }
 
 static void
 AdvertiseFeatures(struct watch_feature_set *wfs)
 {
-    unsigned x;
-    for (x = 0; x < wfs->nr_features; x++) {
-        if (wfs->features[x].feature_flag != NULL)
-            XenstorePrintf(wfs->features[x].feature_flag, "1");
+    struct watch_feature *wf;
+
+    EnterCriticalSection(&wfs->lock);
+    for (wf = wfs->features; wf != NULL; wf = wf->next) {
+        if (wf->feature_flag != NULL)
+            XenstorePrintf(wf->feature_flag, "1");
     }
+    LeaveCriticalSection(&wfs->lock);
 }
 
 int isBetterAgentInstalled() {
@@ -461,20 +573,22 @@ void ServiceUninstall()
 
          /* Tell dom0 that we're no longer installed.  This is a bit
             of a hack. */
-         InitXSAccessor();
-
-         XenstorePrintf("attr/PVAddons/Installed", "0");
-         XenstorePrintf("attr/PVAddons/MajorVersion", "0");
-         XenstorePrintf("attr/PVAddons/MinorVersion", "0");
-         XenstorePrintf("attr/PVAddons/BuildVersion", "0");
-
-         /* Crank the update number so xapi notices it. */
-         char *v;
-         XenstoreRead("data/update_cnt", &v);
-         if (v) {
-             int cnt = atoi(v);
-             XenstorePrintf("data/update_cnt", "%d", cnt + 1);
-             XenstoreFree(v);
+         if (InitXSAccessor() < 0) {
+             printf("Unable to open a store session\n");
+         } else {
+             XenstorePrintf("attr/PVAddons/Installed", "0");
+             XenstorePrintf("attr/PVAddons/MajorVersion", "0");
+             XenstorePrintf("attr/PVAddons/MinorVersion", "0");
+             XenstorePrintf("attr/PVAddons/BuildVersion", "0");
+
+             /* Crank the update number so xapi notices it. */
+             char *v;
+             XenstoreRead("data/update_cnt", &v);
+             if (v) {
+                 int cnt = atoi(v);
+                 XenstorePrintf("data/update_cnt", "%d", cnt + 1);
+                 XenstoreFree(v);
+             }
          }
       }
       else
@@ -740,69 +854,214 @@ finishSuspend(void)
     }
 }
 
+/* Periods of the memory and terminal services samples.  Everything
+ * else the agent publishes is driven by watches, so an idle guest
+ * makes no store calls between these.  Memory sampling is native and
+ * cheap, so it is the writes that are rationed: free and total memory,
+ * which xapi reports, are written (and xapi kicked) when they move by
+ * more than MEMINFO_SLACK KiB or 1/256 of total memory; the commit,
+ * cache and pagefile figures swing far more, and are only written,
+ * without a kick, when they move by more than MEMINFO_DETAIL_SLACK KiB
+ * or an eighth of their value. */
+#define MEMINFO_PERIOD_MS (5 * 1000)
+#define MEMINFO_SLACK     1024
+#define MEMINFO_DETAIL_SLACK (64 * 1024)
+#define TS_PERIOD_MS      (120 * 1000)
+#define ATTR_RETRY_MS     (30 * 1000)
+
+/* Memory and NIC publication run under store_context, terminal
+ * services under ts_context, whichever thread they are called on. */
+struct store_state {
+    struct dispatch_context store_context;
+    struct dispatch_context ts_context;
+    NicInfo *nicInfo;
+    TSInfo *tsInfo;
+    HANDLE suspendEvent;
+    struct watch_feature_set *wfs;
+    TimerWheel *timers;
+    TimerWheelEntry meminfoTimer;
+    TimerWheelEntry tsTimer;
+    TimerWheelEntry attrTimer;
+    BOOL meminfo_valid;
+    VMData last_meminfo;
+};
+
+static BOOL
+meminfoMoved(int64_t now, int64_t last, int64_t slack)
+{
+    return (now - last > slack || now - last < -slack);
+}
+
+static int64_t
+meminfoSlack(int64_t scale, int shift, int64_t minimum)
+{
+    int64_t slack = scale >> shift;
+
+    return (slack > minimum) ? slack : minimum;
+}
+
+static BOOL
+meminfoDetailMoved(int64_t now, int64_t last)
+{
+    return meminfoMoved(now, last, meminfoSlack(last, 3, MEMINFO_DETAIL_SLACK));
+}
+
 static void
-refreshStoreData(WMIAccessor *wmi, NicInfo *nicInfo,
-                 TSInfo *tsInfo, struct watch_feature_set *wfs)
+sampleMemory(void *ctx)
 {
-    PCHAR buffer = NULL;
-    static int64_t last_meminfo_free;
-    static int cntr;
-    unsigned need_kick;
-
-    need_kick = 0;
-    if (XenstoreRead("attr/PVAddons/Installed",
-                     &buffer) < 0) {
-        if (GetLastError() == ERROR_NO_SYSTEM_RESOURCES)
-            return;
-
-        XsLogMsg("register ourself in the store");
-        RegisterPVAddOns(wmi);
-        nicInfo->Refresh();
-        AdvertiseFeatures(wfs);
-        need_kick = 1;
-    } else {
-        XenstoreFree(buffer);
+    struct store_state *state = (struct store_state *)ctx;
+    VMData *last = &state->last_meminfo;
+    VMData data;
+    int64_t slack;
+
+    EnterCriticalSection(&state->store_context.lock);
+
+    memset(&data, 0, sizeof(VMData));
+    if (!GetMemoryData(data))
+        goto done;
+
+    slack = meminfoSlack(data.meminfo_total, 8, MEMINFO_SLACK);
+
+    if (!state->meminfo_valid ||
+        meminfoMoved(data.meminfo_free, last->meminfo_free, slack) ||
+        meminfoMoved(data.meminfo_total, last->meminfo_total, slack)) {
+        XsLogMsg("update memory data in store");
+        XenstoreDoDump(&data);
+        XenstoreKickXapi();
+        *last = data;
+        state->meminfo_valid = TRUE;
+    } else if (meminfoDetailMoved(data.meminfo_commit, last->meminfo_commit) ||
+               meminfoDetailMoved(data.meminfo_commit_limit,
+                                  last->meminfo_commit_limit) ||
+               meminfoDetailMoved(data.meminfo_cache, last->meminfo_cache) ||
+               meminfoDetailMoved(data.meminfo_pagefile,
+                                  last->meminfo_pagefile)) {
+        XenstoreDoDumpDetail(&data);
+        last->meminfo_commit = data.meminfo_commit;
+        last->meminfo_commit_limit = data.meminfo_commit_limit;
+        last->meminfo_cache = data.meminfo_cache;
+        last->meminfo_pagefile = data.meminfo_pagefile;
     }
 
-    if (XenstoreRead("data/meminfo_free", &buffer) < 0) {
-        cntr = 0;
-        last_meminfo_free = 0;
-    } else {
+done:
+    LeaveCriticalSection(&state->store_context.lock);
+
+    state->timers->Schedule(&state->meminfoTimer, MEMINFO_PERIOD_MS);
+}
+
+static void
+sampleTs(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+
+    EnterCriticalSection(&state->ts_context.lock);
+    XsLogMsg("Refresh terminal services status");
+    state->tsInfo->Refresh();
+    LeaveCriticalSection(&state->ts_context.lock);
+
+    state->timers->Schedule(&state->tsTimer, TS_PERIOD_MS);
+}
+
+/* The watches below also fire for our own writes, so each handler
+ * reads its key once to see whether the toolstack actually wiped it. */
+static void
+processInstalled(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+    PCHAR buffer;
+
+    if (XenstoreRead("attr/PVAddons/Installed", &buffer) >= 0) {
         XenstoreFree(buffer);
+        return;
     }
+    if (GetLastError() == ERROR_NO_SYSTEM_RESOURCES)
+        return;
 
-    if (XenstoreRead("data/ts", &buffer) < 0) {
-        cntr = 0;
-    } else {
+    XsLogMsg("register ourself in the store");
+    RegisterPVAddOns(wmi);
+    state->nicInfo->Invalidate();
+    state->nicInfo->Refresh();
+    AdvertiseFeatures(state->wfs);
+    XenstoreKickXapi();
+}
+
+static void
+processMeminfo(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+    PCHAR buffer;
+
+    if (XenstoreRead("data/meminfo_free", &buffer) >= 0) {
         XenstoreFree(buffer);
+        return;
     }
 
-    /* XXX HACK: Restrict ourselves to only doing this once every two
-     * minutes or so (we get called about every 4.5 seconds). */
-    if (cntr++ % 26 == 0) {
-        VMData data;
-        BOOLEAN enabled;
-
-        XsLogMsg("Get memory data");
-        memset(&data, 0, sizeof(VMData));
-        GetWMIData(wmi, data);
-
-        if (data.meminfo_free - last_meminfo_free > 1024 ||
-            data.meminfo_free - last_meminfo_free < -1024) {
-            XsLogMsg("update memory data in store");
-            XenstoreDoDump(&data);
-            need_kick = 1;
-            last_meminfo_free = data.meminfo_free;
-        }
+    state->meminfo_valid = FALSE;
+    state->timers->Schedule(&state->meminfoTimer, 0);
+}
 
-        XsLogMsg("Refresh terminal services status");
-        tsInfo->Refresh();
+static void
+processTs(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+    PCHAR buffer;
 
-        XsLogMsg("Get volume mapping data");
+    if (XenstoreRead("data/ts", &buffer) >= 0) {
+        XenstoreFree(buffer);
+        return;
     }
 
-    if (need_kick)
+    state->tsInfo->Invalidate();
+    state->timers->Schedule(&state->tsTimer, 0);
+}
+
+static void
+refreshStoreData(struct store_state *state)
+{
+    EnterCriticalSection(&state->store_context.lock);
+    processInstalled(state);
+    processMeminfo(state);
+    LeaveCriticalSection(&state->store_context.lock);
+
+    EnterCriticalSection(&state->ts_context.lock);
+    processTs(state);
+    LeaveCriticalSection(&state->ts_context.lock);
+}
+
+/* Republish the system attributes after the background hotfix scan
+ * found a different list, trying again later if the store refused. */
+static void
+publishAttributes(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+    int published;
+
+    EnterCriticalSection(&state->store_context.lock);
+    published = AddSystemInfoToStore(wmi);
+    if (published > 0)
+        XenstoreKickXapi();
+    LeaveCriticalSection(&state->store_context.lock);
+
+    if (published < 0)
+        state->timers->Schedule(&state->attrTimer, ATTR_RETRY_MS);
+}
+
+/* Called on the hotfix scan thread */
+static void
+hotfixesChanged(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+
+    state->timers->Schedule(&state->attrTimer, 0);
+}
+
+static void
+refreshNicData(struct store_state *state)
+{
+    EnterCriticalSection(&state->store_context.lock);
+    if (state->nicInfo->Refresh())
         XenstoreKickXapi();
+    LeaveCriticalSection(&state->store_context.lock);
 }
 
 static void
@@ -859,33 +1118,15 @@ processDumpLog(void *ctx)
 //
 // Main loop
 //
-void Run()
+//
+// Startup steps, run by a StartupGraph once the control watches are
+// live.  The slow publishers come last so they never delay shutdown.
+//
+static void
+startSuspend(void *ctx)
 {
-    VMData data;
-    bool exit=false;
-    PCHAR pPVAddonsInstalled = NULL;
-    STARTUPINFO startInfo;
-    PROCESS_INFORMATION processInfo;
+    struct store_state *state = (struct store_state *)ctx;
     HANDLE suspendEvent;
-    MSG msg;
-    int cntr = 0;
-    NicInfo *nicInfo;
-    TSInfo *tsInfo;
-    struct watch_feature_set features;
-    BOOL snap = FALSE;
-
-    XsLogMsg("Guest agent main loop starting");
-
-    memset(&features, 0, sizeof(features));
-
-    GetWindowsVersion();
-
-
-    AddFeature(&features, "control/shutdown", "control/feature-shutdown", 
-               "shutdown", maybeReboot, NULL);
-    AddFeature(&features, "control/ping", NULL, "ping", processPing, NULL);
-    AddFeature(&features, "control/exec/command", NULL, "Exec", processExec, NULL);
-    AddFeature(&features, "control/dumplog", NULL, "dumplog", processDumpLog, NULL);
 
     suspendEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
     if (!suspendEvent) {
@@ -897,39 +1138,154 @@ void Run()
             suspendEvent = NULL;
         }
     }
+    state->suspendEvent = suspendEvent;
+}
 
-
+static void
+startNicInfo(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+    NicInfo *nicInfo;
 
     nicInfo = new NicInfo();
     nicInfo->Prime();
+    state->nicInfo = nicInfo;
+}
+
+static void
+startTsInfo(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+
+    state->tsInfo = new TSInfo();
+}
 
-    tsInfo = new TSInfo();
-    AddFeature(&features,
+/* Watches are established on the main thread, whose WMI session
+   outlives them. */
+static void
+startTsWatch(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+
+    AddFeature(state->wfs,
                "control/ts",
                "control/feature-ts",
                "ts",
                ProcessTsControl,
-               tsInfo);
+               state->tsInfo,
+               &state->ts_context);
+}
+
+static void
+startStoreWatches(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
+
+    AddFeature(state->wfs, "attr/PVAddons/Installed", NULL, "installed",
+               processInstalled, state, &state->store_context);
+    AddFeature(state->wfs, "data/meminfo_free", NULL, "meminfo",
+               processMeminfo, state, &state->store_context);
+    AddFeature(state->wfs, "data/ts", NULL, "data/ts",
+               processTs, state, &state->ts_context);
+}
+
+static void
+startRegister(void *ctx)
+{
+    struct store_state *state = (struct store_state *)ctx;
 
     XenstoreRemove("attr/PVAddons/Installed");
-    refreshStoreData(wmi, nicInfo, tsInfo, &features);
+    refreshStoreData(state);
+    state->timers->Schedule(&state->meminfoTimer, 0);
+    state->timers->Schedule(&state->tsTimer, 0);
+}
+
+//
+// Main loop
+//
+void Run()
+{
+    struct watch_feature_set features;
+    struct store_state state;
+    TimerWheel *timers;
+    StartupGraph *startup;
+    DWORD startTick = GetTickCount();
+
+    StartupTask tasks[] = {
+        { "suspend", startSuspend, &state, FALSE, { NULL } },
+        { "nicinfo", startNicInfo, &state, FALSE, { NULL } },
+        { "tsinfo", startTsInfo, &state, FALSE, { NULL } },
+        { "tswatch", startTsWatch, &state, TRUE, { "tsinfo", NULL } },
+        { "storewatch", startStoreWatches, &state, TRUE,
+          { "nicinfo", "tsinfo", NULL } },
+        { "register", startRegister, &state, FALSE,
+          { "storewatch", "tswatch", NULL } },
+    };
+
+    XsLogMsg("Guest agent main loop starting");
+
+    InitFeatures(&features);
+
+    GetWindowsVersion();
 
+    timers = new TimerWheel(1000);
+
+    memset(&state, 0, sizeof(state));
+    InitDispatchContext(&state.store_context);
+    InitDispatchContext(&state.ts_context);
+    state.wfs = &features;
+    state.timers = timers;
+    TimerWheel::Init(&state.meminfoTimer, sampleMemory, &state);
+    TimerWheel::Init(&state.tsTimer, sampleTs, &state);
+    TimerWheel::Init(&state.attrTimer, publishAttributes, &state);
+
+    /* The control path goes live before anything else. */
+    AddFeature(&features, "control/shutdown", "control/feature-shutdown", 
+               "shutdown", maybeReboot, NULL, NULL);
+    AddFeature(&features, "control/ping", NULL, "ping", processPing, NULL,
+               NULL);
+    AddFeature(&features, "control/exec/command", NULL, "Exec", processExec,
+               NULL, NULL);
+    AddFeature(&features, "control/dumplog", NULL, "dumplog", processDumpLog,
+               NULL, NULL);
+    XsLogMsg("startup: control watches live at +%u ms",
+             GetTickCount() - startTick);
+
+    /* Publish from the cached hotfix list; the slow enumeration runs
+       in the background and republishes if the list changed. */
+    AttrCacheInit();
+    AttrCacheStartHotFixScan(wmi, hotfixesChanged, &state);
+
+    startup = new StartupGraph(tasks, sizeof(tasks) / sizeof(tasks[0]));
+    startup->Start();
+
+    /* Feature watches are dispatched on the thread pool; this thread
+       only waits for exit, NIC and suspend events, runs timers, and
+       runs the startup tasks that need it. */
     while (1)
     {
         DWORD status;
         int nr_handles = 2;
-        HANDLE handles[3 + MAX_FEATURES];
-        unsigned x;
+        HANDLE handles[4];
+        NicInfo *nicInfo = NULL;
+        HANDLE suspendEvent = NULL;
 
         handles[0] = hServiceExitEvent;
-        handles[1] = nicInfo->NicChangeEvent;
-        if (suspendEvent)
-            handles[nr_handles++] = suspendEvent;
-        for (x = 0; x < features.nr_features; x++)
-            handles[nr_handles++] = features.features[x].watch->event;
+        handles[1] = timers->ChangeEvent;
+        if (!startup->Finished()) {
+            handles[nr_handles++] = startup->MainEvent;
+            handles[nr_handles++] = startup->DoneEvent;
+        } else {
+            nicInfo = state.nicInfo;
+            handles[nr_handles++] = nicInfo->NicChangeEvent;
+            suspendEvent = state.suspendEvent;
+            if (suspendEvent)
+                handles[nr_handles++] = suspendEvent;
+        }
 
         XsLogMsg("win agent going to sleep");
-        status = WaitForMultipleObjects(nr_handles, handles, FALSE, 4500);
+        status = WaitForMultipleObjects(nr_handles, handles, FALSE,
+                                        timers->Timeout());
         XsLogMsg("win agent woke up for %d", status);
 
         /* WAIT_OBJECT_0 happens to be 0, so the compiler gets shirty
@@ -937,7 +1293,7 @@ void Run()
            This is more obviously correct than the compiler-friendly
            version, though, so just disable the warning. */
         if (status == WAIT_TIMEOUT) {
-            refreshStoreData(wmi, nicInfo, tsInfo, &features);
+            timers->Expire();
         }
 #pragma warning (disable: 4296)
         else if (status >= WAIT_OBJECT_0 &&
@@ -950,32 +1306,31 @@ void Run()
                 XsLogMsg("service exit event");
                 break;
             }
-            else if (event == nicInfo->NicChangeEvent)
+            else if (event == startup->MainEvent)
+            {
+                startup->RunMainTasks();
+            }
+            else if (event == startup->DoneEvent)
+            {
+                XsLogMsg("startup: finished at +%u ms",
+                         GetTickCount() - startTick);
+            }
+            else if (nicInfo != NULL && event == nicInfo->NicChangeEvent)
             {
                 XsLogMsg("NICs changed");
-                nicInfo->Refresh();
-                XenstoreKickXapi();
+                refreshNicData(&state);
                 XsLogMsg("Handled NIC change");
                 nicInfo->Prime();
             }
-            else if (event == suspendEvent)
+            else if (suspendEvent != NULL && event == suspendEvent)
             {
                 XsLogMsg("Suspend event");
                 finishSuspend();
-                refreshStoreData(wmi, nicInfo, tsInfo, &features);
+                refreshStoreData(&state);
                 XsLogMsg("Handled suspend event");
             }
-            else
-            {
-                for (x = 0; x < features.nr_features; x++) {
-                    if (features.features[x].watch->event == event) {
-                        XsLogMsg("fire feature %s", features.features[x].name);
-                        features.features[x].handler(features.features[x].ctx);
-                        XsLogMsg("fired feature %s",
-                                 features.features[x].name);
-                    }
-                }
-            }
+
+            timers->Expire();
         }
         else
         {
@@ -984,12 +1339,31 @@ void Run()
         }
     }
 
+    startup->Wait();
+    delete startup;
+
+    AttrCacheStopHotFixScan();
+    ReleaseFeatures(&features);
+
     XsLogMsg("Guest agent finishing");
+
+    /* The log flusher and the store sessions use the WMI accessor, so
+       drain and stop the flusher and end the sessions before releasing
+       it.  Anything logged after this only goes to the debugger. */
+    XsStopLogging();
+    ShutdownXSAccessor();
     ReleaseWMIAccessor(wmi);
+    wmi = NULL;
+
 
+    delete timers;
+    delete state.tsInfo;
+    delete state.nicInfo;
+    if (state.suspendEvent)
+        CloseHandle(state.suspendEvent);
 
-    delete tsInfo;
-    delete nicInfo;
+    ReleaseDispatchContext(&state.ts_context);
+    ReleaseDispatchContext(&state.store_context);
 
     ServiceControlManagerUpdate(0, SERVICE_STOPPED);
 
@@ -1039,6 +1413,8 @@ bool ServiceInit()
 
 void WINAPI ServiceMain(int argc, char** argv)
 {
+    DWORD start;
+
     // Perform common initialization
     hServiceExitEvent = CreateEvent(NULL, false, false, NULL);
     if (hServiceExitEvent == NULL)
@@ -1055,9 +1431,15 @@ void WINAPI ServiceMain(int argc, char** argv)
 
     XsInitPerThreadLogging();
 
+    start = GetTickCount();
     ConnectToWMI();
-    InitXSAccessor();
+    if (InitXSAccessor() < 0)
+    {
+        DBGPRINT(("XenSvc: Unable to open a store session\n"));
+        return;
+    }
     XsLog("Guest agent service starting");
+    XsLog("startup: WMI connected in %u ms", GetTickCount() - start);
 
     __try
     {
@@ -1067,8 +1449,8 @@ void WINAPI ServiceMain(int argc, char** argv)
     {
     }
 
+    /* Run() has stopped logging and released WMI by now */
     XsLog("Guest agent service stopped");
-    ShutdownXSAccessor();
 
     return;
 }
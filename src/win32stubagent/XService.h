@@ -44,6 +44,7 @@ void ClipboardConsoleChanged(void);
 
 void XsDumpLogThisThread(void);
 void XsInitPerThreadLogging(void);
+void XsStopLogging(void);
 void XsLogMsg(const char *fmt, ...);
 void DoVolumeDump(void);
 
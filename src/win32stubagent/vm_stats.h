@@ -53,6 +53,11 @@ typedef struct _VMData {
     time_t time;
     int64_t meminfo_free;
     int64_t meminfo_total;
+    /* The fields below are -1 when the collector cannot provide them */
+    int64_t meminfo_commit;
+    int64_t meminfo_commit_limit;
+    int64_t meminfo_cache;
+    int64_t meminfo_pagefile;
 } VMData;
 
 #endif
@@ -0,0 +1,837 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <ntstrsafe.h>
+#include <store_interface.h>
+#include <suspend_interface.h>
+#include <util.h>
+
+#include "driver.h"
+#include "cache.h"
+#include "log.h"
+#include "assert.h"
+
+#define CACHE_POOL 'HCAC'
+
+// Upper bound on the number of values held for any one prefix. The
+// least recently used value is evicted once a prefix is full.
+#define CACHE_MAXIMUM_ENTRIES   64
+
+#define CACHE_VALUE_INFO_SIZE   512
+
+typedef struct _XENIFACE_CACHE_ENTRY {
+    LIST_ENTRY  ListEntry;
+    PCHAR       Value;
+    ULONG       Length;
+    CHAR        Path[1];
+} XENIFACE_CACHE_ENTRY, *PXENIFACE_CACHE_ENTRY;
+
+typedef struct _XENIFACE_CACHE_PREFIX {
+    LIST_ENTRY          ListEntry;
+    PCHAR               Prefix;
+    ULONG               Length;
+    ULONG               Policy;
+    KEVENT              Event;
+    PXENBUS_STORE_WATCH Watch;
+    BOOLEAN             Arming;
+    ULONG               SuspendCount;
+    ULONG               Generation;
+    LIST_ENTRY          Entries;
+    ULONG               Count;
+} XENIFACE_CACHE_PREFIX, *PXENIFACE_CACHE_PREFIX;
+
+// Watches are set and cleared without the lock held, as each is a round
+// trip to the backend. Busy counts those in progress; Idle is signalled
+// when there are none, so that CacheSuspend can wait for them.
+struct _XENIFACE_CACHE {
+    PXENIFACE_FDO   Fdo;
+    FAST_MUTEX      Lock;
+    LIST_ENTRY      Prefixes;
+    ULONG           PrefixCount;
+    BOOLEAN         Suspended;
+    ULONG           Busy;
+    KEVENT          Idle;
+    ULONGLONG       Hits;
+    ULONGLONG       Misses;
+    ULONGLONG       Invalidations;
+};
+
+static FORCEINLINE PVOID
+__CacheAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocateNonPagedPoolWithTag(Length, CACHE_POOL);
+}
+
+static FORCEINLINE VOID
+__CacheFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, CACHE_POOL);
+}
+
+static FORCEINLINE BOOLEAN
+__CacheIsBelow(
+    IN  PCHAR   Path,
+    IN  PCHAR   Prefix,
+    IN  ULONG   Length
+    )
+{
+    if (Length == 0 || strncmp(Path, Prefix, Length) != 0)
+        return FALSE;
+
+    return (Path[Length] == '\0' ||
+            Path[Length] == '/' ||
+            Prefix[Length - 1] == '/') ? TRUE : FALSE;
+}
+
+static VOID
+__CacheRemoveEntry(
+    IN  PXENIFACE_CACHE_PREFIX  Prefix,
+    IN  PXENIFACE_CACHE_ENTRY   Entry
+    )
+{
+    RemoveEntryList(&Entry->ListEntry);
+    ASSERT(Prefix->Count != 0);
+    --Prefix->Count;
+
+    __CacheFree(Entry);
+}
+
+// Only a flush that discards values counts as an invalidation; a watch
+// fires once as it is set, for instance, with nothing yet cached
+static VOID
+__CacheFlushPrefix(
+    IN  PXENIFACE_CACHE         Cache,
+    IN  PXENIFACE_CACHE_PREFIX  Prefix
+    )
+{
+    if (Prefix->Count != 0)
+        Cache->Invalidations++;
+
+    while (!IsListEmpty(&Prefix->Entries)) {
+        PXENIFACE_CACHE_ENTRY   Entry;
+
+        Entry = CONTAINING_RECORD(Prefix->Entries.Flink,
+                                  XENIFACE_CACHE_ENTRY,
+                                  ListEntry);
+        __CacheRemoveEntry(Prefix, Entry);
+    }
+
+    Prefix->Generation++;
+}
+
+static PXENIFACE_CACHE_PREFIX
+__CacheFindPrefix(
+    IN  PXENIFACE_CACHE Cache,
+    IN  PCHAR           Path
+    )
+{
+    PLIST_ENTRY             ListEntry;
+    PXENIFACE_CACHE_PREFIX  Match = NULL;
+
+    // The most specific prefix wins, so that a BYPASS entry can carve
+    // a volatile subtree out of a cached one.
+    for (ListEntry = Cache->Prefixes.Flink;
+         ListEntry != &Cache->Prefixes;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_CACHE_PREFIX  Prefix;
+
+        Prefix = CONTAINING_RECORD(ListEntry, XENIFACE_CACHE_PREFIX, ListEntry);
+        if (!__CacheIsBelow(Path, Prefix->Prefix, Prefix->Length))
+            continue;
+
+        if (Match == NULL || Prefix->Length > Match->Length)
+            Match = Prefix;
+    }
+
+    return Match;
+}
+
+static PXENIFACE_CACHE_ENTRY
+__CacheFindEntry(
+    IN  PXENIFACE_CACHE_PREFIX  Prefix,
+    IN  PCHAR                   Path
+    )
+{
+    PLIST_ENTRY             ListEntry;
+
+    for (ListEntry = Prefix->Entries.Flink;
+         ListEntry != &Prefix->Entries;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_CACHE_ENTRY   Entry;
+
+        Entry = CONTAINING_RECORD(ListEntry, XENIFACE_CACHE_ENTRY, ListEntry);
+        if (strcmp(Entry->Path, Path) == 0)
+            return Entry;
+    }
+
+    return NULL;
+}
+
+// Called with the cache lock held. Returns FALSE if the prefix cannot
+// currently be trusted, in which case the caller must go to the store.
+// A watch left over from before a migration is detached and returned in
+// Stale, for the caller to clear once it has dropped the lock.
+static BOOLEAN
+__CacheSynchronizePrefix(
+    IN  PXENIFACE_CACHE         Cache,
+    IN  PXENIFACE_CACHE_PREFIX  Prefix,
+    OUT PXENBUS_STORE_WATCH     *Stale
+    )
+{
+    PXENIFACE_FDO   Fdo = Cache->Fdo;
+
+    *Stale = NULL;
+
+    if (Cache->Suspended)
+        return FALSE;
+
+    // Anything may have changed across a migration, so the watch is
+    // re-established and the values are discarded.
+    if (Prefix->Watch != NULL &&
+        Prefix->SuspendCount != SUSPEND(Count, Fdo->SuspendInterface)) {
+        *Stale = Prefix->Watch;
+        Prefix->Watch = NULL;
+        __CacheFlushPrefix(Cache, Prefix);
+    }
+
+    if (Prefix->Watch == NULL)
+        return FALSE;
+
+    // The event is cleared before the flush so that a watch firing
+    // while we are working is seen by the next lookup.
+    if (KeReadStateEvent(&Prefix->Event)) {
+        KeClearEvent(&Prefix->Event);
+        __CacheFlushPrefix(Cache, Prefix);
+    }
+
+    return TRUE;
+}
+
+// Called with the cache lock held. Claims the prefix for the caller to
+// arm once it has dropped the lock, unless another thread already has.
+static BOOLEAN
+__CacheClaimPrefix(
+    IN  PXENIFACE_CACHE         Cache,
+    IN  PXENIFACE_CACHE_PREFIX  Prefix
+    )
+{
+    if (Cache->Suspended || Prefix->Watch != NULL || Prefix->Arming)
+        return FALSE;
+
+    Prefix->Arming = TRUE;
+    if (Cache->Busy++ == 0)
+        KeClearEvent(&Cache->Idle);
+
+    return TRUE;
+}
+
+// Clears Stale, if there is one, and sets the watch on a prefix claimed
+// by __CacheClaimPrefix. Called without the cache lock held.
+static VOID
+__CacheArmPrefix(
+    IN  PXENIFACE_CACHE         Cache,
+    IN  PXENIFACE_CACHE_PREFIX  Prefix,
+    IN  PXENBUS_STORE_WATCH     Stale OPTIONAL
+    )
+{
+    PXENIFACE_FDO               Fdo = Cache->Fdo;
+    PXENBUS_STORE_WATCH         Watch;
+    ULONG                       SuspendCount;
+    NTSTATUS                    status;
+
+    if (Stale != NULL)
+        (VOID) STORE(Unwatch, Fdo->StoreInterface, Stale);
+
+    // Nothing is cached for the prefix until the watch is published, so
+    // the event only needs to be clear by then
+    SuspendCount = SUSPEND(Count, Fdo->SuspendInterface);
+    KeClearEvent(&Prefix->Event);
+
+    status = STORE(Watch,
+                   Fdo->StoreInterface,
+                   NULL,
+                   Prefix->Prefix,
+                   &Prefix->Event,
+                   &Watch);
+    if (!NT_SUCCESS(status))
+        Watch = NULL;
+
+    ExAcquireFastMutex(&Cache->Lock);
+
+    Prefix->Arming = FALSE;
+
+    // CacheSuspend may have run meanwhile, and is waiting for us
+    if (Watch != NULL && !Cache->Suspended) {
+        Prefix->Watch = Watch;
+        Prefix->SuspendCount = SuspendCount;
+        Watch = NULL;
+    }
+
+    ExReleaseFastMutex(&Cache->Lock);
+
+    if (Watch != NULL)
+        (VOID) STORE(Unwatch, Fdo->StoreInterface, Watch);
+
+    ExAcquireFastMutex(&Cache->Lock);
+
+    ASSERT(Cache->Busy != 0);
+    if (--Cache->Busy == 0)
+        KeSetEvent(&Cache->Idle, IO_NO_INCREMENT, FALSE);
+
+    ExReleaseFastMutex(&Cache->Lock);
+}
+
+static PCHAR
+__CacheDuplicate(
+    IN  PCHAR   Value,
+    IN  ULONG   Length
+    )
+{
+    PCHAR       Copy;
+
+    Copy = __CacheAllocate(Length + 1);
+    if (Copy == NULL)
+        return NULL;
+
+    RtlCopyMemory(Copy, Value, Length);
+    Copy[Length] = '\0';
+
+    return Copy;
+}
+
+static VOID
+__CacheInsert(
+    IN  PXENIFACE_CACHE_PREFIX  Prefix,
+    IN  PCHAR                   Path,
+    IN  PCHAR                   Value,
+    IN  ULONG                   Length
+    )
+{
+    PXENIFACE_CACHE_ENTRY   Entry;
+    ULONG                   PathLength;
+
+    Entry = __CacheFindEntry(Prefix, Path);
+    if (Entry != NULL)
+        __CacheRemoveEntry(Prefix, Entry);
+
+    if (Prefix->Count == CACHE_MAXIMUM_ENTRIES) {
+        Entry = CONTAINING_RECORD(Prefix->Entries.Blink,
+                                  XENIFACE_CACHE_ENTRY,
+                                  ListEntry);
+        __CacheRemoveEntry(Prefix, Entry);
+    }
+
+    PathLength = (ULONG)strlen(Path);
+
+    Entry = __CacheAllocate(FIELD_OFFSET(XENIFACE_CACHE_ENTRY, Path) +
+                            PathLength + 1 +
+                            Length + 1);
+    if (Entry == NULL)
+        return;
+
+    RtlCopyMemory(Entry->Path, Path, PathLength);
+    Entry->Value = Entry->Path + PathLength + 1;
+    RtlCopyMemory(Entry->Value, Value, Length);
+    Entry->Length = Length;
+
+    InsertHeadList(&Prefix->Entries, &Entry->ListEntry);
+    Prefix->Count++;
+}
+
+NTSTATUS
+CacheRead(
+    IN  PXENIFACE_CACHE             Cache,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Path,
+    OUT PCHAR                       *Value
+    )
+{
+    PXENIFACE_FDO           Fdo = Cache->Fdo;
+    PXENIFACE_CACHE_PREFIX  Prefix;
+    PXENIFACE_CACHE_ENTRY   Entry;
+    PXENBUS_STORE_WATCH     Stale;
+    BOOLEAN                 Arm;
+    ULONG                   Generation;
+    PCHAR                   Buffer;
+    ULONG                   Length;
+    NTSTATUS                status;
+
+    Prefix = NULL;
+    Generation = 0;
+
+    // A transaction has its own view of the store, so it never touches
+    // the cache.
+    if (Transaction != NULL)
+        goto read;
+
+    ExAcquireFastMutex(&Cache->Lock);
+
+    Prefix = __CacheFindPrefix(Cache, Path);
+    if (Prefix == NULL ||
+        Prefix->Policy != CACHE_POLICY_READ_THROUGH) {
+        ExReleaseFastMutex(&Cache->Lock);
+        Prefix = NULL;
+        goto read;
+    }
+
+    // This read goes to the store while the watch is being set, and the
+    // next one can use the cache
+    if (!__CacheSynchronizePrefix(Cache, Prefix, &Stale)) {
+        Arm = __CacheClaimPrefix(Cache, Prefix);
+        ExReleaseFastMutex(&Cache->Lock);
+
+        ASSERT(Stale == NULL || Arm);
+        if (Arm)
+            __CacheArmPrefix(Cache, Prefix, Stale);
+
+        Prefix = NULL;
+        goto read;
+    }
+
+    Entry = __CacheFindEntry(Prefix, Path);
+    if (Entry != NULL) {
+        RemoveEntryList(&Entry->ListEntry);
+        InsertHeadList(&Prefix->Entries, &Entry->ListEntry);
+        Cache->Hits++;
+
+        *Value = __CacheDuplicate(Entry->Value, Entry->Length);
+        ExReleaseFastMutex(&Cache->Lock);
+
+        return (*Value != NULL) ? STATUS_SUCCESS : STATUS_NO_MEMORY;
+    }
+
+    Cache->Misses++;
+    Generation = Prefix->Generation;
+
+    ExReleaseFastMutex(&Cache->Lock);
+
+read:
+    status = STORE(Read, Fdo->StoreInterface, Transaction, NULL, Path, &Buffer);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    Length = (ULONG)strlen(Buffer);
+
+    *Value = __CacheDuplicate(Buffer, Length);
+    if (*Value == NULL) {
+        STORE(Free, Fdo->StoreInterface, Buffer);
+        return STATUS_NO_MEMORY;
+    }
+
+    if (Prefix != NULL) {
+        ExAcquireFastMutex(&Cache->Lock);
+
+        // Only remember the value if nothing invalidated the prefix
+        // while the lock was dropped; otherwise it may already be stale.
+        if (Prefix->Generation == Generation &&
+            Prefix->Watch != NULL &&
+            !KeReadStateEvent(&Prefix->Event))
+            __CacheInsert(Prefix, Path, Buffer, Length);
+
+        ExReleaseFastMutex(&Cache->Lock);
+    }
+
+    STORE(Free, Fdo->StoreInterface, Buffer);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+CacheFree(
+    IN  PCHAR   Value
+    )
+{
+    __CacheFree(Value);
+}
+
+VOID
+CacheInvalidate(
+    IN  PXENIFACE_CACHE Cache,
+    IN  PCHAR           Path
+    )
+{
+    PLIST_ENTRY         ListEntry;
+    BOOLEAN             Removed;
+
+    Removed = FALSE;
+
+    ExAcquireFastMutex(&Cache->Lock);
+
+    for (ListEntry = Cache->Prefixes.Flink;
+         ListEntry != &Cache->Prefixes;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_CACHE_PREFIX  Prefix;
+        PLIST_ENTRY             Next;
+        ULONG                   Length;
+
+        Prefix = CONTAINING_RECORD(ListEntry, XENIFACE_CACHE_PREFIX, ListEntry);
+
+        // Absolute paths may alias relative ones, and a removal above
+        // the prefix takes the whole subtree with it.
+        if (Path[0] == '/' ||
+            __CacheIsBelow(Prefix->Prefix, Path, (ULONG)strlen(Path))) {
+            __CacheFlushPrefix(Cache, Prefix);
+            continue;
+        }
+
+        if (!__CacheIsBelow(Path, Prefix->Prefix, Prefix->Length))
+            continue;
+
+        Length = (ULONG)strlen(Path);
+
+        for (Next = Prefix->Entries.Flink; Next != &Prefix->Entries; ) {
+            PXENIFACE_CACHE_ENTRY   Entry;
+
+            Entry = CONTAINING_RECORD(Next, XENIFACE_CACHE_ENTRY, ListEntry);
+            Next = Next->Flink;
+
+            if (__CacheIsBelow(Entry->Path, Path, Length)) {
+                __CacheRemoveEntry(Prefix, Entry);
+                Removed = TRUE;
+            }
+        }
+
+        Prefix->Generation++;
+    }
+
+    if (Removed)
+        Cache->Invalidations++;
+
+    ExReleaseFastMutex(&Cache->Lock);
+}
+
+VOID
+CacheInvalidateAll(
+    IN  PXENIFACE_CACHE Cache
+    )
+{
+    PLIST_ENTRY         ListEntry;
+
+    ExAcquireFastMutex(&Cache->Lock);
+
+    for (ListEntry = Cache->Prefixes.Flink;
+         ListEntry != &Cache->Prefixes;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_CACHE_PREFIX  Prefix;
+
+        Prefix = CONTAINING_RECORD(ListEntry, XENIFACE_CACHE_PREFIX, ListEntry);
+        __CacheFlushPrefix(Cache, Prefix);
+    }
+
+    ExReleaseFastMutex(&Cache->Lock);
+}
+
+// Once this returns no watch is set, and none will be until CacheResume,
+// so the store interface can be released
+VOID
+CacheSuspend(
+    IN  PXENIFACE_CACHE Cache
+    )
+{
+    PXENIFACE_FDO       Fdo = Cache->Fdo;
+    PLIST_ENTRY         ListEntry;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    ExAcquireFastMutex(&Cache->Lock);
+    Cache->Suspended = TRUE;
+    ExReleaseFastMutex(&Cache->Lock);
+
+    // A prefix being armed drops its watch when it sees Suspended
+    (VOID) KeWaitForSingleObject(&Cache->Idle,
+                                 Executive,
+                                 KernelMode,
+                                 FALSE,
+                                 NULL);
+
+    // The prefix list never changes after initialization, and nothing
+    // else sets or clears watches now
+    for (ListEntry = Cache->Prefixes.Flink;
+         ListEntry != &Cache->Prefixes;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_CACHE_PREFIX  Prefix;
+        PXENBUS_STORE_WATCH     Watch;
+
+        Prefix = CONTAINING_RECORD(ListEntry, XENIFACE_CACHE_PREFIX, ListEntry);
+
+        ExAcquireFastMutex(&Cache->Lock);
+        Watch = Prefix->Watch;
+        Prefix->Watch = NULL;
+        __CacheFlushPrefix(Cache, Prefix);
+        ExReleaseFastMutex(&Cache->Lock);
+
+        if (Watch != NULL)
+            (VOID) STORE(Unwatch, Fdo->StoreInterface, Watch);
+    }
+}
+
+// Called once the store interface is available. Watches are set again
+// as the prefixes are read.
+VOID
+CacheResume(
+    IN  PXENIFACE_CACHE Cache
+    )
+{
+    ExAcquireFastMutex(&Cache->Lock);
+    Cache->Suspended = FALSE;
+    ExReleaseFastMutex(&Cache->Lock);
+}
+
+VOID
+CacheQueryStatistics(
+    IN  PXENIFACE_CACHE                 Cache,
+    OUT PXENIFACE_CACHE_STATISTICS      Statistics
+    )
+{
+    PLIST_ENTRY         ListEntry;
+
+    RtlZeroMemory(Statistics, sizeof (XENIFACE_CACHE_STATISTICS));
+
+    ExAcquireFastMutex(&Cache->Lock);
+
+    Statistics->Hits = Cache->Hits;
+    Statistics->Misses = Cache->Misses;
+    Statistics->Invalidations = Cache->Invalidations;
+    Statistics->Prefixes = Cache->PrefixCount;
+
+    for (ListEntry = Cache->Prefixes.Flink;
+         ListEntry != &Cache->Prefixes;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_CACHE_PREFIX  Prefix;
+
+        Prefix = CONTAINING_RECORD(ListEntry, XENIFACE_CACHE_PREFIX, ListEntry);
+        Statistics->Entries += Prefix->Count;
+    }
+
+    ExReleaseFastMutex(&Cache->Lock);
+}
+
+static NTSTATUS
+__CacheAddPrefix(
+    IN  PXENIFACE_CACHE Cache,
+    IN  PUNICODE_STRING Name,
+    IN  ULONG           Policy
+    )
+{
+    PXENIFACE_CACHE_PREFIX  Prefix;
+    ANSI_STRING             Ansi;
+    NTSTATUS                status;
+
+    status = RtlUnicodeStringToAnsiString(&Ansi, Name, TRUE);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    // Watches and comparisons work on the node name, so any trailing
+    // separators (other than the root itself) are dropped.
+    while (Ansi.Length > 1 && Ansi.Buffer[Ansi.Length - 1] == '/')
+        Ansi.Length--;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Ansi.Length == 0)
+        goto fail2;
+
+    status = STATUS_NO_MEMORY;
+    Prefix = __CacheAllocate(sizeof (XENIFACE_CACHE_PREFIX) + Ansi.Length + 1);
+    if (Prefix == NULL)
+        goto fail2;
+
+    Prefix->Prefix = (PCHAR)(Prefix + 1);
+    RtlCopyMemory(Prefix->Prefix, Ansi.Buffer, Ansi.Length);
+    Prefix->Length = Ansi.Length;
+    Prefix->Policy = Policy;
+    KeInitializeEvent(&Prefix->Event, NotificationEvent, FALSE);
+    InitializeListHead(&Prefix->Entries);
+
+    InsertTailList(&Cache->Prefixes, &Prefix->ListEntry);
+    Cache->PrefixCount++;
+
+    Info("%s -> %s\n",
+         Prefix->Prefix,
+         (Policy == CACHE_POLICY_READ_THROUGH) ? "READ_THROUGH" : "BYPASS");
+
+    RtlFreeAnsiString(&Ansi);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    RtlFreeAnsiString(&Ansi);
+
+fail1:
+    return status;
+}
+
+static VOID
+__CacheReadPolicy(
+    IN  PXENIFACE_CACHE Cache
+    )
+{
+    OBJECT_ATTRIBUTES               Attributes;
+    UNICODE_STRING                  KeyName;
+    HANDLE                          ServiceKey;
+    HANDLE                          CacheKey;
+    PKEY_VALUE_FULL_INFORMATION     Value;
+    ULONG                           Index;
+    NTSTATUS                        status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    InitializeObjectAttributes(&Attributes, &DriverParameters.RegistryPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status = ZwOpenKey(&ServiceKey, KEY_READ, &Attributes);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    RtlInitUnicodeString(&KeyName, L"Cache");
+    InitializeObjectAttributes(&Attributes, &KeyName,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               ServiceKey,
+                               NULL);
+
+    // The cache is opt-in: no key means no cached prefixes.
+    status = ZwOpenKey(&CacheKey, KEY_READ, &Attributes);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = STATUS_NO_MEMORY;
+    Value = __CacheAllocate(CACHE_VALUE_INFO_SIZE);
+    if (Value == NULL)
+        goto fail3;
+
+    for (Index = 0; ; Index++) {
+        UNICODE_STRING  Name;
+        ULONG           Size;
+        ULONG           Policy;
+
+        status = ZwEnumerateValueKey(CacheKey,
+                                     Index,
+                                     KeyValueFullInformation,
+                                     Value,
+                                     CACHE_VALUE_INFO_SIZE,
+                                     &Size);
+        if (status == STATUS_NO_MORE_ENTRIES)
+            break;
+
+        if (!NT_SUCCESS(status))
+            continue;
+
+        if (Value->Type != REG_DWORD || Value->DataLength != sizeof (ULONG))
+            continue;
+
+        Policy = *(PULONG)((PUCHAR)Value + Value->DataOffset);
+        if (Policy != CACHE_POLICY_BYPASS && Policy != CACHE_POLICY_READ_THROUGH)
+            continue;
+
+        Name.Buffer = Value->Name;
+        Name.Length = (USHORT)Value->NameLength;
+        Name.MaximumLength = (USHORT)Value->NameLength;
+
+        (VOID) __CacheAddPrefix(Cache, &Name, Policy);
+    }
+
+    __CacheFree(Value);
+
+    ZwClose(CacheKey);
+    ZwClose(ServiceKey);
+
+    return;
+
+fail3:
+    ZwClose(CacheKey);
+
+fail2:
+    ZwClose(ServiceKey);
+
+fail1:
+    Trace("no cache policy (%08x)\n", status);
+}
+
+NTSTATUS
+CacheInitialize(
+    IN  PXENIFACE_FDO   Fdo,
+    OUT PXENIFACE_CACHE *Cache
+    )
+{
+    NTSTATUS            status;
+
+    *Cache = __CacheAllocate(sizeof (XENIFACE_CACHE));
+
+    status = STATUS_NO_MEMORY;
+    if (*Cache == NULL)
+        goto fail1;
+
+    (*Cache)->Fdo = Fdo;
+    ExInitializeFastMutex(&(*Cache)->Lock);
+    InitializeListHead(&(*Cache)->Prefixes);
+    KeInitializeEvent(&(*Cache)->Idle, NotificationEvent, TRUE);
+
+    // Until the FDO reaches D0
+    (*Cache)->Suspended = TRUE;
+
+    __CacheReadPolicy(*Cache);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+CacheTeardown(
+    IN  PXENIFACE_CACHE Cache
+    )
+{
+    CacheSuspend(Cache);
+
+    while (!IsListEmpty(&Cache->Prefixes)) {
+        PXENIFACE_CACHE_PREFIX  Prefix;
+
+        Prefix = CONTAINING_RECORD(Cache->Prefixes.Flink,
+                                   XENIFACE_CACHE_PREFIX,
+                                   ListEntry);
+        ASSERT(IsListEmpty(&Prefix->Entries));
+        ASSERT3P(Prefix->Watch, ==, NULL);
+
+        RemoveEntryList(&Prefix->ListEntry);
+        __CacheFree(Prefix);
+    }
+
+    __CacheFree(Cache);
+}
@@ -0,0 +1,96 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_CACHE_H
+#define _XENIFACE_CACHE_H
+
+#include <ntddk.h>
+#include <store_interface.h>
+
+#include "fdo.h"
+#include "xeniface_ioctls.h"
+
+// Values of the REG_DWORD entries under the service's Cache key
+#define CACHE_POLICY_BYPASS         0
+#define CACHE_POLICY_READ_THROUGH   1
+
+extern NTSTATUS
+CacheInitialize(
+    IN  PXENIFACE_FDO   Fdo,
+    OUT PXENIFACE_CACHE *Cache
+    );
+
+extern VOID
+CacheTeardown(
+    IN  PXENIFACE_CACHE Cache
+    );
+
+extern NTSTATUS
+CacheRead(
+    IN  PXENIFACE_CACHE             Cache,
+    IN  PXENBUS_STORE_TRANSACTION   Transaction OPTIONAL,
+    IN  PCHAR                       Path,
+    OUT PCHAR                       *Value
+    );
+
+extern VOID
+CacheFree(
+    IN  PCHAR   Value
+    );
+
+extern VOID
+CacheInvalidate(
+    IN  PXENIFACE_CACHE Cache,
+    IN  PCHAR           Path
+    );
+
+extern VOID
+CacheInvalidateAll(
+    IN  PXENIFACE_CACHE Cache
+    );
+
+extern VOID
+CacheSuspend(
+    IN  PXENIFACE_CACHE Cache
+    );
+
+extern VOID
+CacheResume(
+    IN  PXENIFACE_CACHE Cache
+    );
+
+extern VOID
+CacheQueryStatistics(
+    IN  PXENIFACE_CACHE                 Cache,
+    OUT PXENIFACE_CACHE_STATISTICS      Statistics
+    );
+
+#endif  // _XENIFACE_CACHE_H
@@ -0,0 +1,244 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <util.h>
+
+#include "driver.h"
+#include "contention.h"
+#include "log.h"
+#include "assert.h"
+
+#define CONTENTION_POOL 'NOCX'
+
+// An uncontended acquisition only bumps a counter. One in this many is
+// also timed, so the maximum hold time is sampled; contended
+// acquisitions are always timed.
+#define CONTENTION_HOLD_SAMPLE  64
+
+// Counters are kept in QPC ticks and converted when queried. Each
+// processor has its own block, padded so blocks do not share a line.
+typedef struct _XENIFACE_CONTENTION_CPU {
+    ULONGLONG   Acquisitions[XENIFACE_LOCK_CLASSES];
+    ULONGLONG   Contended[XENIFACE_LOCK_CLASSES];
+    ULONGLONG   WaitTicks[XENIFACE_LOCK_CLASSES];
+    ULONGLONG   MaximumHoldTicks[XENIFACE_LOCK_CLASSES];
+    UCHAR       Pad[32];
+} XENIFACE_CONTENTION_CPU, *PXENIFACE_CONTENTION_CPU;
+
+C_ASSERT(sizeof (XENIFACE_CONTENTION_CPU) % 64 == 0);
+
+typedef struct _XENIFACE_CONTENTION {
+    PXENIFACE_CONTENTION_CPU    Cpu;
+    ULONG                       Cpus;
+    ULONGLONG                   Frequency;
+} XENIFACE_CONTENTION, *PXENIFACE_CONTENTION;
+
+static XENIFACE_CONTENTION  ContentionContext;
+
+static FORCEINLINE PXENIFACE_CONTENTION_CPU
+__ContentionCpu(
+    VOID
+    )
+{
+    return &ContentionContext.Cpu[KeGetCurrentProcessorNumber() % ContentionContext.Cpus];
+}
+
+ULONGLONG
+ContentionAcquired(
+    IN  XENIFACE_LOCK_CLASS Class,
+    IN  ULONGLONG           WaitStart
+    )
+{
+    PXENIFACE_CONTENTION_CPU    Cpu;
+    ULONGLONG                   Acquisitions;
+    ULONGLONG                   Now;
+
+    if (ContentionContext.Cpu == NULL)
+        return 0;
+
+    // A thread may move processor at any point, so updates to what is
+    // normally the local block are still interlocked
+    Cpu = __ContentionCpu();
+
+    Acquisitions = (ULONGLONG)InterlockedIncrement64((PLONGLONG)&Cpu->Acquisitions[Class]);
+
+    if (WaitStart == 0 && (Acquisitions % CONTENTION_HOLD_SAMPLE) != 0)
+        return 0;
+
+    Now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    if (WaitStart != 0) {
+        (VOID) InterlockedIncrement64((PLONGLONG)&Cpu->Contended[Class]);
+        (VOID) InterlockedAdd64((PLONGLONG)&Cpu->WaitTicks[Class],
+                                (LONGLONG)(Now - WaitStart));
+    }
+
+    return Now;
+}
+
+VOID
+ContentionReleased(
+    IN  XENIFACE_LOCK_CLASS Class,
+    IN  ULONGLONG           Acquired
+    )
+{
+    PXENIFACE_CONTENTION_CPU    Cpu;
+    LONGLONG                    Hold;
+    LONGLONG                    Maximum;
+
+    if (ContentionContext.Cpu == NULL || Acquired == 0)
+        return;
+
+    Hold = (LONGLONG)(KeQueryPerformanceCounter(NULL).QuadPart - Acquired);
+    Cpu = __ContentionCpu();
+
+    do {
+        Maximum = (LONGLONG)Cpu->MaximumHoldTicks[Class];
+        if (Maximum >= Hold)
+            break;
+    } while (InterlockedCompareExchange64((PLONGLONG)&Cpu->MaximumHoldTicks[Class],
+                                          Hold,
+                                          Maximum) != Maximum);
+}
+
+static FORCEINLINE ULONGLONG
+__ContentionNanoseconds(
+    IN  ULONGLONG   Ticks
+    )
+{
+    return ((Ticks / ContentionContext.Frequency) * 1000000000ull) +
+           (((Ticks % ContentionContext.Frequency) * 1000000000ull) /
+            ContentionContext.Frequency);
+}
+
+VOID
+ContentionQuery(
+    OUT PXENIFACE_CONTENTION_STATISTICS Statistics
+    )
+{
+    ULONG                               Index;
+    ULONG                               Class;
+
+    RtlZeroMemory(Statistics, sizeof (XENIFACE_CONTENTION_STATISTICS));
+
+    Statistics->Classes = XENIFACE_LOCK_CLASSES;
+
+    if (ContentionContext.Cpu == NULL)
+        return;
+
+    for (Index = 0; Index < ContentionContext.Cpus; Index++) {
+        PXENIFACE_CONTENTION_CPU    Cpu = &ContentionContext.Cpu[Index];
+
+        for (Class = 0; Class < XENIFACE_LOCK_CLASSES; Class++) {
+            Statistics->Acquisitions[Class] += Cpu->Acquisitions[Class];
+            Statistics->Contended[Class] += Cpu->Contended[Class];
+            Statistics->WaitTime[Class] += Cpu->WaitTicks[Class];
+            Statistics->MaximumHold[Class] = max(Statistics->MaximumHold[Class],
+                                                 Cpu->MaximumHoldTicks[Class]);
+        }
+    }
+
+    for (Class = 0; Class < XENIFACE_LOCK_CLASSES; Class++) {
+        Statistics->WaitTime[Class] = __ContentionNanoseconds(Statistics->WaitTime[Class]);
+        Statistics->MaximumHold[Class] = __ContentionNanoseconds(Statistics->MaximumHold[Class]);
+    }
+}
+
+VOID
+ContentionReset(
+    VOID
+    )
+{
+    if (ContentionContext.Cpu == NULL)
+        return;
+
+    RtlZeroMemory(ContentionContext.Cpu,
+                  sizeof (XENIFACE_CONTENTION_CPU) * ContentionContext.Cpus);
+
+    Info("reset\n");
+}
+
+NTSTATUS
+ContentionInitialize(
+    VOID
+    )
+{
+    PXENIFACE_CONTENTION_CPU    Cpu;
+    LARGE_INTEGER               Frequency;
+    ULONG                       Cpus;
+    NTSTATUS                    status;
+
+    ASSERT3P(ContentionContext.Cpu, ==, NULL);
+
+    Cpus = KeQueryMaximumProcessorCount();
+
+    Cpu = __AllocateNonPagedPoolWithTag(sizeof (XENIFACE_CONTENTION_CPU) * Cpus,
+                                        CONTENTION_POOL);
+
+    status = STATUS_NO_MEMORY;
+    if (Cpu == NULL)
+        goto fail1;
+
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+
+    ContentionContext.Cpus = Cpus;
+    ContentionContext.Frequency = Frequency.QuadPart;
+
+    KeMemoryBarrier();
+    ContentionContext.Cpu = Cpu;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+ContentionTeardown(
+    VOID
+    )
+{
+    PXENIFACE_CONTENTION_CPU    Cpu;
+
+    Cpu = ContentionContext.Cpu;
+    if (Cpu == NULL)
+        return;
+
+    ContentionContext.Cpu = NULL;
+    KeMemoryBarrier();
+
+    __FreePoolWithTag(Cpu, CONTENTION_POOL);
+
+    RtlZeroMemory(&ContentionContext, sizeof (XENIFACE_CONTENTION));
+}
@@ -0,0 +1,82 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_CONTENTION_H
+#define _XENIFACE_CONTENTION_H
+
+#include <ntddk.h>
+
+#include "xeniface_ioctls.h"
+
+extern NTSTATUS
+ContentionInitialize(
+    VOID
+    );
+
+extern VOID
+ContentionTeardown(
+    VOID
+    );
+
+// Returns the time of acquisition, to be passed to ContentionReleased,
+// or zero if this acquisition is not timed. WaitStart is zero if the
+// lock was taken without waiting.
+extern ULONGLONG
+ContentionAcquired(
+    IN  XENIFACE_LOCK_CLASS Class,
+    IN  ULONGLONG           WaitStart
+    );
+
+extern VOID
+ContentionReleased(
+    IN  XENIFACE_LOCK_CLASS Class,
+    IN  ULONGLONG           Acquired
+    );
+
+static FORCEINLINE ULONGLONG
+ContentionWaitStart(
+    VOID
+    )
+{
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+extern VOID
+ContentionQuery(
+    OUT PXENIFACE_CONTENTION_STATISTICS Statistics
+    );
+
+extern VOID
+ContentionReset(
+    VOID
+    );
+
+#endif  // _XENIFACE_CONTENTION_H
@@ -38,6 +38,10 @@
 
 #include "assert.h"
 #include "wmi.h"
+#include "trace.h"
+#include "latency.h"
+#include "contention.h"
+#include "pool.h"
 extern PULONG       InitSafeBootMode;
 
 PDRIVER_OBJECT      DriverObject;
@@ -46,6 +50,100 @@ DRIVER_UNLOAD       DriverUnload;
 
 XENIFACE_PARAMETERS	DriverParameters;
 
+ULONG               XenIfaceLogMask = XENIFACE_LOG_COMPILE_MASK;
+
+// Reads an optional REG_DWORD under the service key
+NTSTATUS
+DriverReadParameter(
+    IN  PWCHAR                      Name,
+    OUT PULONG                      Data
+    )
+{
+    OBJECT_ATTRIBUTES               Attributes;
+    UNICODE_STRING                  ValueName;
+    HANDLE                          ServiceKey;
+    UCHAR                           Buffer[FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) +
+                                           sizeof (ULONG)];
+    PKEY_VALUE_PARTIAL_INFORMATION  Value;
+    ULONG                           Size;
+    NTSTATUS                        status;
+
+    InitializeObjectAttributes(&Attributes, &DriverParameters.RegistryPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status = ZwOpenKey(&ServiceKey, KEY_READ, &Attributes);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    RtlInitUnicodeString(&ValueName, Name);
+
+    Value = (PKEY_VALUE_PARTIAL_INFORMATION)Buffer;
+    status = ZwQueryValueKey(ServiceKey,
+                             &ValueName,
+                             KeyValuePartialInformation,
+                             Value,
+                             sizeof (Buffer),
+                             &Size);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = STATUS_OBJECT_TYPE_MISMATCH;
+    if (Value->Type != REG_DWORD || Value->DataLength != sizeof (ULONG))
+        goto fail3;
+
+    *Data = *(PULONG)Value->Data;
+
+    ZwClose(ServiceKey);
+
+    return STATUS_SUCCESS;
+
+fail3:
+fail2:
+    ZwClose(ServiceKey);
+
+fail1:
+    return status;
+}
+
+// An optional REG_DWORD LogMask under the service key selects the levels
+// logged at run time: bit 0 ERROR, bit 1 WARNING, bit 2 TRACE, bit 3 INFO.
+// Levels not compiled in stay off whatever the mask says.
+static VOID
+DriverReadLogMask(
+    VOID
+    )
+{
+    ULONG       Mask;
+    NTSTATUS    status;
+
+    status = DriverReadParameter(L"LogMask", &Mask);
+    if (!NT_SUCCESS(status)) {
+        Trace("default LogMask %08x (%08x)\n", XenIfaceLogMask, status);
+        return;
+    }
+
+    XenIfaceLogMask = Mask & XENIFACE_LOG_COMPILE_MASK;
+
+    Info("LogMask %08x\n", XenIfaceLogMask);
+}
+
+// A non-zero REG_DWORD PoolTrack records the caller of every live
+// allocation, for finding leaks in long soak tests
+static BOOLEAN
+DriverReadPoolTrack(
+    VOID
+    )
+{
+    ULONG       Track;
+
+    if (!NT_SUCCESS(DriverReadParameter(L"PoolTrack", &Track)))
+        return FALSE;
+
+    return (Track != 0) ? TRUE : FALSE;
+}
+
 VOID
 DriverUnload(
     IN  PDRIVER_OBJECT  _DriverObject
@@ -58,6 +156,10 @@ DriverUnload(
     if (*InitSafeBootMode > 0)
         goto done;
 
+    ContentionTeardown();
+    LatencyTeardown();
+    TraceTeardown();
+    PoolTeardown();
 
 	if (DriverParameters.RegistryPath.Buffer != NULL) {
 		ExFreePool(DriverParameters.RegistryPath.Buffer);
@@ -168,6 +270,8 @@ DriverEntry(
 	}
 	RtlCopyUnicodeString(&DriverParameters.RegistryPath, RegistryPath);
 
+    DriverReadLogMask();
+
 
     DriverObject = _DriverObject;
     DriverObject->DriverUnload = DriverUnload;
@@ -175,6 +279,12 @@ DriverEntry(
     if (*InitSafeBootMode > 0)
         goto done;
 
+    // Tracing and statistics are best effort; the driver works without them
+    (VOID) PoolInitialize(DriverReadPoolTrack());
+    (VOID) TraceInitialize();
+    (VOID) LatencyInitialize();
+    (VOID) ContentionInitialize();
+
     DriverObject->DriverExtension->AddDevice = AddDevice;
 
     for (Index = 0; Index <= IRP_MJ_MAXIMUM_FUNCTION; Index++) {
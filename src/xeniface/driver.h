@@ -59,6 +59,13 @@ typedef struct _XENIFACE_PARAMETERS {
 
 extern XENIFACE_PARAMETERS DriverParameters;
 
+// Reads an optional REG_DWORD under the service key. PASSIVE_LEVEL only.
+extern NTSTATUS
+DriverReadParameter(
+    IN  PWCHAR  Name,
+    OUT PULONG  Data
+    );
+
 typedef struct _XENIFACE_DX {
     PDEVICE_OBJECT      DeviceObject;
     DEVICE_OBJECT_TYPE  Type;
@@ -50,128 +50,19 @@
 #include "names.h"
 #include "ioctls.h"
 #include "wmi.h"
+#include "cache.h"
+#include "mirror.h"
+#include "pool.h"
 #include "xeniface_ioctls.h"
 
-#define FDO_POOL 'ODF'
-
 #define MAXNAMELEN  128
 
+#define FDO_WORKERS     2
+#define FDO_WORK_DEPTH  1024
 
-static void
-FdoInitialiseXSRegistryEntries(
-    IN PXENIFACE_FDO        Fdo
-    )
-{
-    OBJECT_ATTRIBUTES Attributes;
-    HANDLE RegHandle;
-    UNICODE_STRING UnicodeValueName;
-    UNICODE_STRING UnicodeValue;
-    ANSI_STRING AnsiValue;
-    char *value;
-    NTSTATUS status;
-	NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
-    status = STORE(Read, Fdo->StoreInterface, NULL, NULL, "/mh/boot-time/management-mac-address", &value);
-    if (!NT_SUCCESS(status)){
-        XenIfaceDebugPrint(ERROR, "no such xenstore key\n");
-        goto failXS;
-    }
-
-    InitializeObjectAttributes(&Attributes, &DriverParameters.RegistryPath,
-                                OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-                                NULL,
-                                NULL);
-
-    status = ZwOpenKey(&RegHandle, KEY_WRITE, &Attributes);
-
-    if (!NT_SUCCESS(status)) {
-        XenIfaceDebugPrint(ERROR, "no such registry key %s\n", DriverParameters.RegistryPath);
-        goto failReg;
-    }
-
-    RtlInitUnicodeString(&UnicodeValueName, L"MgmtMacAddr");
-    RtlInitUnicodeString(&UnicodeValue, NULL);
-    RtlInitAnsiString(&AnsiValue, value);
-
-    XenIfaceDebugPrint(ERROR, "About to convert unicode string\n");
-    status = RtlAnsiStringToUnicodeString(&UnicodeValue, &AnsiValue, TRUE);
-    if (!NT_SUCCESS(status)) {
-        XenIfaceDebugPrint(ERROR, "Can't convert string\n");
-        goto failReg;
-    }
-
-    XenIfaceDebugPrint(ERROR, "About to write unicode string\n");
-    status = ZwSetValueKey(RegHandle, &UnicodeValueName, 0, REG_SZ, UnicodeValue.Buffer, UnicodeValue.Length+sizeof(WCHAR));
-    if (!NT_SUCCESS(status)) {
-        XenIfaceDebugPrint(ERROR, "Can't write key\n");
-        goto failWrite;
-    }
-
-    ZwClose(RegHandle);
-    
-    RtlFreeUnicodeString(&UnicodeValue);
-    STORE(Free, Fdo->StoreInterface, value);
-
-    return;
-
-failWrite:
-
-    XenIfaceDebugPrint(ERROR, "Fail : Write\n");
-    ZwClose(RegHandle);
-    RtlFreeUnicodeString(&UnicodeValue);
-
-failReg:
-
-    XenIfaceDebugPrint(ERROR, "Fail : Reg\n");
-    STORE(Free, Fdo->StoreInterface, value);
-failXS:
-    XenIfaceDebugPrint(ERROR, "Failed to initialise registry (%08x)\n", status);
-    return;
-}
-
-
-#define REGISTRY_WRITE_EVENT 0
-#define REGISTRY_THREAD_END_EVENT 1
-#define REGISTRY_EVENTS 2
-
-static NTSTATUS FdoRegistryThreadHandler(IN  PXENIFACE_THREAD  Self, 
-								  IN PVOID StartContext) {
-	KEVENT* threadevents[REGISTRY_EVENTS];
-	PXENIFACE_FDO Fdo = (PXENIFACE_FDO)StartContext;
-	NTSTATUS status;
-
-	PKEVENT             Event;
-
-    Event = ThreadGetEvent(Self);
-
-	threadevents[REGISTRY_WRITE_EVENT] = &Fdo->registryWriteEvent;
-	threadevents[REGISTRY_THREAD_END_EVENT] = Event;
-
-	for(;;) {
-		
-		status = KeWaitForMultipleObjects(REGISTRY_EVENTS, (PVOID *)threadevents, WaitAny, Executive, KernelMode, TRUE, NULL, NULL);
-		if ((status>=STATUS_WAIT_0) && (status < STATUS_WAIT_0+REGISTRY_EVENTS)) {
-			if (status == STATUS_WAIT_0+REGISTRY_WRITE_EVENT) {
-				if (Fdo->StoreInterface) {
-					XenIfaceDebugPrint(ERROR,"WriteRegistry\n");
-					FdoInitialiseXSRegistryEntries(Fdo);
-					KeClearEvent(threadevents[REGISTRY_WRITE_EVENT]);
-				}
-			}
-			if (status == STATUS_WAIT_0+REGISTRY_THREAD_END_EVENT) {
-				if (ThreadIsAlerted(Self))
-					return STATUS_SUCCESS;
-				KeClearEvent(threadevents[REGISTRY_THREAD_END_EVENT]);
-			}
-			
-		}
-		else if (!NT_SUCCESS(status)) {
-			XenIfaceDebugPrint(ERROR, "Registry handler thread failed %x\n", status);
-			return status;
-		}
-	}
-
-}
-
+// WMI watch events are fired, one session at a time, by a worker of
+// their own
+#define FDO_EVENT_DEPTH 256
 
 
 static FORCEINLINE PVOID
@@ -179,7 +70,13 @@ __FdoAllocate(
     IN  ULONG   Length
     )
 {
-    return __AllocateNonPagedPoolWithTag(Length, FDO_POOL);
+    PVOID   Buffer;
+
+    Buffer = PoolAllocate(XENIFACE_POOL_FDO, Length);
+    if (Buffer != NULL)
+        RtlZeroMemory(Buffer, Length);
+
+    return Buffer;
 }
 
 static FORCEINLINE VOID
@@ -187,7 +84,7 @@ __FdoFree(
     IN  PVOID   Buffer
     )
 {
-    __FreePoolWithTag(Buffer, FDO_POOL);
+    PoolFree(Buffer);
 }
 
 static FORCEINLINE VOID
@@ -756,6 +653,8 @@ FdoD3ToD0(
         goto fail2;
 	Fdo->InterfacesAcquired = TRUE;
     KeLowerIrql(Irql);
+
+	CacheResume(Fdo->Cache);
 	
 	
 	
@@ -785,6 +684,8 @@ FdoD0ToD3(
     KIRQL           Irql;
 
     ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+	CacheSuspend(Fdo->Cache);
+	MirrorSuspend(Fdo->Mirror);
 	Fdo->InterfacesAcquired = FALSE;
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
@@ -1293,6 +1194,7 @@ __FdoSetDevicePowerUp(
     ASSERT3U(DeviceState, ==, PowerDeviceD0);
     status = FdoD3ToD0(Fdo);
 	SessionsResumeAll(Fdo);
+	MirrorResume(Fdo->Mirror);
     ASSERT(NT_SUCCESS(status));
 
 done:
@@ -2414,17 +2316,26 @@ FdoCreate(
 	if (!NT_SUCCESS(status))
 		goto fail10;
 
-    InitializeMutex(&Fdo->Mutex);
+    InitializeMutex(&Fdo->Mutex, XENIFACE_LOCK_FDO_MUTEX);
     InitializeListHead(&Dx->ListEntry);
     Fdo->References = 1;
 
-	FdoInitialiseXSRegistryEntries(Fdo);
+	// Registry mirror updates and watch delivery
+	status = WorkQueueCreate(FDO_WORKERS, FDO_WORK_DEPTH, &Fdo->WorkQueue);
+	if (!NT_SUCCESS(status))
+		goto fail11;
+
+	status = WorkQueueCreate(1, FDO_EVENT_DEPTH, &Fdo->EventQueue);
+	if (!NT_SUCCESS(status))
+		goto fail12;
 
-	KeInitializeEvent(&Fdo->registryWriteEvent, NotificationEvent, FALSE);
+	status = MirrorInitialize(Fdo, &Fdo->Mirror);
+	if (!NT_SUCCESS(status))
+		goto fail13;
 
-	status = ThreadCreate(FdoRegistryThreadHandler, Fdo, &Fdo->registryThread);
+	status = CacheInitialize(Fdo, &Fdo->Cache);
 	if (!NT_SUCCESS(status))
-		goto fail11;
+		goto fail14;
 
     Info("%p (%s)\n",
          FunctionDeviceObject,
@@ -2435,7 +2346,21 @@ FdoCreate(
 
     return STATUS_SUCCESS;
 
-	
+fail14:
+	Error("fail14\n");
+	MirrorTeardown(Fdo->Mirror);
+	Fdo->Mirror = NULL;
+
+fail13:
+	Error("fail13\n");
+	WorkQueueDestroy(Fdo->EventQueue);
+	Fdo->EventQueue = NULL;
+
+fail12:
+	Error("fail12\n");
+	WorkQueueDestroy(Fdo->WorkQueue);
+	Fdo->WorkQueue = NULL;
+
 fail11:
 	Error("fail11\n");
 	Fdo->SharedInfoInterface = NULL;
@@ -2523,14 +2448,24 @@ FdoDestroy(
 
     RtlZeroMemory(&Fdo->Mutex, sizeof (XENIFACE_MUTEX));
 
+	// The mirror and the cache drop their watches through the store
+	// interface
+	MirrorTeardown(Fdo->Mirror);
+	Fdo->Mirror = NULL;
+
+	CacheTeardown(Fdo->Cache);
+	Fdo->Cache = NULL;
+
 	Fdo->InterfacesAcquired = FALSE;
     Fdo->SuspendInterface = NULL;
     Fdo->StoreInterface = NULL;
 	Fdo->SharedInfoInterface = NULL;
 
-	ThreadAlert(Fdo->registryThread);
-    ThreadJoin(Fdo->registryThread);
-    Fdo->registryThread = NULL;
+	WorkQueueDestroy(Fdo->EventQueue);
+	Fdo->EventQueue = NULL;
+
+	WorkQueueDestroy(Fdo->WorkQueue);
+	Fdo->WorkQueue = NULL;
 
     ThreadAlert(Fdo->DevicePowerThread);
     ThreadJoin(Fdo->DevicePowerThread);
@@ -2547,9 +2482,8 @@ FdoDestroy(
     Fdo->PhysicalDeviceObject = NULL;
     Fdo->Dx = NULL;
 
-	RtlZeroMemory(&Fdo->SessionLock, sizeof(FAST_MUTEX));
+	RtlZeroMemory(&Fdo->SessionLock, sizeof(XENIFACE_FAST_MUTEX));
 	RtlZeroMemory(&Fdo->SessionHead, sizeof(LIST_ENTRY));
-	RtlZeroMemory(&Fdo->registryWriteEvent, sizeof(KEVENT));
 
 	RtlFreeUnicodeString(&Fdo->InterfaceName);
 	RtlZeroMemory(&Fdo->InterfaceName,sizeof(UNICODE_STRING));
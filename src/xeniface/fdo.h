@@ -41,6 +41,8 @@
 #include "types.h"
 
 #include "thread.h"
+#include "work.h"
+#include "sched.h"
 #include "mutex.h"
 
 typedef enum _FDO_RESOURCE_TYPE {
@@ -49,6 +51,9 @@ typedef enum _FDO_RESOURCE_TYPE {
     RESOURCE_COUNT
 } FDO_RESOURCE_TYPE, *PFDO_RESOURCE_TYPE;
 
+typedef struct _XENIFACE_CACHE XENIFACE_CACHE, *PXENIFACE_CACHE;
+typedef struct _XENIFACE_MIRROR XENIFACE_MIRROR, *PXENIFACE_MIRROR;
+
 typedef struct _FDO_RESOURCE {
     CM_PARTIAL_RESOURCE_DESCRIPTOR Raw;
     CM_PARTIAL_RESOURCE_DESCRIPTOR Translated;
@@ -89,11 +94,18 @@ typedef struct _XENIFACE_FDO {
     int							WmiReady;
 
     USHORT						Sessions;
-    FAST_MUTEX					SessionLock;
+    XENIFACE_FAST_MUTEX			SessionLock;
     LIST_ENTRY					SessionHead;
+	PXENIFACE_THREAD			SessionReaper;
+	ULONG						SessionTtl;
+	PXENIFACE_SCHED				Sched;
+	PXENIFACE_WORK_QUEUE		RearmQueue;
+
+	PXENIFACE_WORK_QUEUE		WorkQueue;
+	PXENIFACE_WORK_QUEUE		EventQueue;
+	PXENIFACE_MIRROR			Mirror;
 
-	PXENIFACE_THREAD			registryThread;
-	KEVENT						registryWriteEvent;
+	PXENIFACE_CACHE				Cache;
 
 
 	UNICODE_STRING				SuggestedInstanceName;
@@ -0,0 +1,568 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <ntstrsafe.h>
+#include <store_interface.h>
+#include <util.h>
+
+#include "filter.h"
+#include "log.h"
+#include "assert.h"
+
+#define FILTER_POOL 'TLIF'
+
+#define FILTER_MAXIMUM_SEGMENTS 16
+
+// Upper bound on the number of nodes a filter tracks. A walk that finds
+// more than this is abandoned and the caller falls back to an
+// unfiltered event.
+#define FILTER_MAXIMUM_NODES    256
+
+#define FILTER_PATH_LENGTH      3072
+
+// Each matching node has a store watch of its own, so only the nodes
+// whose watches fired are read again. Beyond this many a filter stops
+// adding watches, to stay well inside the guest's watch quota, and the
+// remaining nodes are read on every evaluation instead.
+#define FILTER_MAXIMUM_WATCHES  64
+
+typedef struct _XENIFACE_FILTER_SEGMENT {
+    PCHAR       Text;
+    ULONG       Length;
+    BOOLEAN     Wildcard;
+} XENIFACE_FILTER_SEGMENT, *PXENIFACE_FILTER_SEGMENT;
+
+// A node is tracked from the time the walk first reaches its path, even
+// if nothing is there yet, so that its watch reports it appearing.
+// Value is a copy of the last value reported, or NULL if none is held.
+typedef struct _XENIFACE_FILTER_NODE {
+    LIST_ENTRY          ListEntry;
+    PXENBUS_STORE_WATCH Watch;
+    KEVENT              Event;
+    PCHAR               Value;
+    ULONG               Length;
+    BOOLEAN             Present;
+    BOOLEAN             Visited;
+    CHAR                Path[1];
+} XENIFACE_FILTER_NODE, *PXENIFACE_FILTER_NODE;
+
+struct _XENIFACE_FILTER {
+    PCHAR                   Prefix;
+    ULONG                   PrefixLength;
+    XENIFACE_FILTER_SEGMENT Segment[FILTER_MAXIMUM_SEGMENTS];
+    ULONG                   SegmentCount;
+    LIST_ENTRY              Nodes;
+    ULONG                   NodeCount;
+    ULONG                   WatchCount;
+    BOOLEAN                 WatchFailed;
+};
+
+typedef struct _XENIFACE_FILTER_WALK {
+    PXENIFACE_FILTER            Filter;
+    PXENBUS_STORE_INTERFACE     StoreInterface;
+    XENIFACE_FILTER_CALLBACK    Callback;
+    PVOID                       Context;
+    PCHAR                       Path;
+    ULONG                       Visited;
+    BOOLEAN                     Overflow;
+} XENIFACE_FILTER_WALK, *PXENIFACE_FILTER_WALK;
+
+static FORCEINLINE PVOID
+__FilterAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocateNonPagedPoolWithTag(Length, FILTER_POOL);
+}
+
+static FORCEINLINE VOID
+__FilterFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, FILTER_POOL);
+}
+
+static BOOLEAN
+__FilterMatchComponent(
+    IN  PCHAR   Pattern,
+    IN  ULONG   Length,
+    IN  PCHAR   Name
+    )
+{
+    ULONG       Index = 0;
+    ULONG       Star = Length;
+    PCHAR       Resume = NULL;
+
+    while (*Name != '\0') {
+        if (Index < Length &&
+            (Pattern[Index] == '?' || Pattern[Index] == *Name)) {
+            Index++;
+            Name++;
+        } else if (Index < Length && Pattern[Index] == '*') {
+            Star = Index++;
+            Resume = Name;
+        } else if (Star != Length) {
+            Index = Star + 1;
+            Name = ++Resume;
+        } else {
+            return FALSE;
+        }
+    }
+
+    while (Index < Length && Pattern[Index] == '*')
+        Index++;
+
+    return (Index == Length) ? TRUE : FALSE;
+}
+
+static PXENIFACE_FILTER_NODE
+__FilterFindNode(
+    IN  PXENIFACE_FILTER    Filter,
+    IN  PCHAR               Path
+    )
+{
+    PLIST_ENTRY             ListEntry;
+
+    for (ListEntry = Filter->Nodes.Flink;
+         ListEntry != &Filter->Nodes;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_FILTER_NODE   Node;
+
+        Node = CONTAINING_RECORD(ListEntry, XENIFACE_FILTER_NODE, ListEntry);
+        if (strcmp(Node->Path, Path) == 0)
+            return Node;
+    }
+
+    return NULL;
+}
+
+static VOID
+__FilterWatchNode(
+    IN  PXENIFACE_FILTER            Filter,
+    IN  PXENBUS_STORE_INTERFACE     StoreInterface,
+    IN  PXENIFACE_FILTER_NODE       Node
+    )
+{
+    NTSTATUS                        status;
+
+    if (Filter->WatchFailed || Filter->WatchCount >= FILTER_MAXIMUM_WATCHES)
+        return;
+
+    status = STORE(Watch, StoreInterface, NULL, Node->Path, &Node->Event, &Node->Watch);
+    if (!NT_SUCCESS(status)) {
+        // Most likely the watch quota; don't keep asking
+        Node->Watch = NULL;
+        Filter->WatchFailed = TRUE;
+        return;
+    }
+
+    Filter->WatchCount++;
+}
+
+static VOID
+__FilterUnwatchNode(
+    IN  PXENIFACE_FILTER            Filter,
+    IN  PXENBUS_STORE_INTERFACE     StoreInterface,
+    IN  PXENIFACE_FILTER_NODE       Node
+    )
+{
+    if (Node->Watch == NULL)
+        return;
+
+    (VOID) STORE(Unwatch, StoreInterface, Node->Watch);
+    Node->Watch = NULL;
+
+    ASSERT(Filter->WatchCount != 0);
+    --Filter->WatchCount;
+}
+
+static VOID
+__FilterForgetValue(
+    IN  PXENIFACE_FILTER_NODE   Node
+    )
+{
+    if (Node->Value != NULL)
+        __FilterFree(Node->Value);
+
+    Node->Value = NULL;
+    Node->Length = 0;
+}
+
+static VOID
+__FilterVisit(
+    IN  PXENIFACE_FILTER_WALK   Walk
+    )
+{
+    PXENIFACE_FILTER            Filter = Walk->Filter;
+    PXENIFACE_FILTER_NODE       Node;
+    PCHAR                       Value;
+    ULONG                       Length;
+    BOOLEAN                     Read;
+    NTSTATUS                    status;
+
+    if (++Walk->Visited > FILTER_MAXIMUM_NODES) {
+        Walk->Overflow = TRUE;
+        return;
+    }
+
+    Node = __FilterFindNode(Filter, Walk->Path);
+    if (Node == NULL) {
+        ULONG   PathLength = (ULONG)strlen(Walk->Path);
+
+        Node = __FilterAllocate(FIELD_OFFSET(XENIFACE_FILTER_NODE, Path) +
+                                PathLength + 1);
+        if (Node == NULL) {
+            Walk->Overflow = TRUE;
+            return;
+        }
+
+        RtlCopyMemory(Node->Path, Walk->Path, PathLength);
+        KeInitializeEvent(&Node->Event, NotificationEvent, FALSE);
+        InsertTailList(&Filter->Nodes, &Node->ListEntry);
+        Filter->NodeCount++;
+    }
+
+    Node->Visited = TRUE;
+
+    // A node without a watch of its own has to be read every time
+    Read = (Node->Watch == NULL || KeReadStateEvent(&Node->Event)) ? TRUE : FALSE;
+    if (Node->Watch == NULL)
+        __FilterWatchNode(Filter, Walk->StoreInterface, Node);
+
+    if (!Read)
+        return;
+
+    // Cleared before the read, so a change made after it fires again
+    KeClearEvent(&Node->Event);
+
+    status = STORE(Read, Walk->StoreInterface, NULL, NULL, Node->Path, &Value);
+    if (!NT_SUCCESS(status)) {
+        if (Node->Present) {
+            Node->Present = FALSE;
+            __FilterForgetValue(Node);
+
+            Walk->Callback(Walk->Context, Node->Path, NULL);
+        }
+        return;
+    }
+
+    Length = (ULONG)strlen(Value);
+
+    if (Node->Present &&
+        Node->Value != NULL &&
+        Node->Length == Length &&
+        RtlCompareMemory(Node->Value, Value, Length) == Length)
+        goto done;
+
+    // If the copy cannot be made the next read is reported as a change,
+    // which is better than missing one
+    __FilterForgetValue(Node);
+    Node->Value = __FilterAllocate(Length + 1);
+    if (Node->Value != NULL) {
+        RtlCopyMemory(Node->Value, Value, Length);
+        Node->Length = Length;
+    }
+    Node->Present = TRUE;
+
+    Walk->Callback(Walk->Context, Node->Path, Value);
+
+done:
+    STORE(Free, Walk->StoreInterface, Value);
+}
+
+static VOID
+__FilterWalk(
+    IN  PXENIFACE_FILTER_WALK   Walk,
+    IN  ULONG                   Depth,
+    IN  ULONG                   Offset
+    )
+{
+    PXENIFACE_FILTER            Filter = Walk->Filter;
+    PXENIFACE_FILTER_SEGMENT    Segment;
+    PCHAR                       Children;
+    PCHAR                       Child;
+    NTSTATUS                    status;
+
+    if (Walk->Overflow)
+        return;
+
+    if (Depth == Filter->SegmentCount) {
+        __FilterVisit(Walk);
+        return;
+    }
+
+    Segment = &Filter->Segment[Depth];
+
+    if (!Segment->Wildcard) {
+        if (Offset + 1 + Segment->Length >= FILTER_PATH_LENGTH)
+            return;
+
+        Walk->Path[Offset] = '/';
+        RtlCopyMemory(&Walk->Path[Offset + 1], Segment->Text, Segment->Length);
+        Walk->Path[Offset + 1 + Segment->Length] = '\0';
+
+        __FilterWalk(Walk, Depth + 1, Offset + 1 + Segment->Length);
+
+        Walk->Path[Offset] = '\0';
+        return;
+    }
+
+    status = STORE(Directory, Walk->StoreInterface, NULL, NULL, Walk->Path, &Children);
+    if (!NT_SUCCESS(status))
+        return;
+
+    for (Child = Children; *Child != '\0'; Child += strlen(Child) + 1) {
+        ULONG   Length;
+
+        if (!__FilterMatchComponent(Segment->Text, Segment->Length, Child))
+            continue;
+
+        Length = (ULONG)strlen(Child);
+        if (Offset + 1 + Length >= FILTER_PATH_LENGTH)
+            continue;
+
+        Walk->Path[Offset] = '/';
+        RtlCopyMemory(&Walk->Path[Offset + 1], Child, Length);
+        Walk->Path[Offset + 1 + Length] = '\0';
+
+        __FilterWalk(Walk, Depth + 1, Offset + 1 + Length);
+
+        Walk->Path[Offset] = '\0';
+
+        if (Walk->Overflow)
+            break;
+    }
+
+    STORE(Free, Walk->StoreInterface, Children);
+}
+
+BOOLEAN
+FilterEvaluate(
+    IN  PXENIFACE_FILTER            Filter,
+    IN  PXENBUS_STORE_INTERFACE     StoreInterface,
+    IN  XENIFACE_FILTER_CALLBACK    Callback,
+    IN  PVOID                       Context
+    )
+{
+    XENIFACE_FILTER_WALK            Walk;
+    PLIST_ENTRY                     ListEntry;
+
+    RtlZeroMemory(&Walk, sizeof (XENIFACE_FILTER_WALK));
+    Walk.Filter = Filter;
+    Walk.StoreInterface = StoreInterface;
+    Walk.Callback = Callback;
+    Walk.Context = Context;
+
+    Walk.Path = __FilterAllocate(FILTER_PATH_LENGTH);
+    if (Walk.Path == NULL)
+        return FALSE;
+
+    RtlCopyMemory(Walk.Path, Filter->Prefix, Filter->PrefixLength);
+
+    for (ListEntry = Filter->Nodes.Flink;
+         ListEntry != &Filter->Nodes;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_FILTER_NODE   Node;
+
+        Node = CONTAINING_RECORD(ListEntry, XENIFACE_FILTER_NODE, ListEntry);
+        Node->Visited = FALSE;
+    }
+
+    __FilterWalk(&Walk, 0, Filter->PrefixLength);
+
+    __FilterFree(Walk.Path);
+
+    // Nodes not reached by a complete walk are no longer listed by their
+    // parent, so they have gone away
+    if (!Walk.Overflow) {
+        for (ListEntry = Filter->Nodes.Flink; ListEntry != &Filter->Nodes; ) {
+            PXENIFACE_FILTER_NODE   Node;
+
+            Node = CONTAINING_RECORD(ListEntry, XENIFACE_FILTER_NODE, ListEntry);
+            ListEntry = ListEntry->Flink;
+
+            if (Node->Visited)
+                continue;
+
+            if (Node->Present)
+                Callback(Context, Node->Path, NULL);
+
+            RemoveEntryList(&Node->ListEntry);
+            --Filter->NodeCount;
+            __FilterUnwatchNode(Filter, StoreInterface, Node);
+            __FilterForgetValue(Node);
+            __FilterFree(Node);
+        }
+    }
+
+    return !Walk.Overflow;
+}
+
+PCHAR
+FilterGetPrefix(
+    IN  PXENIFACE_FILTER    Filter
+    )
+{
+    return Filter->Prefix;
+}
+
+NTSTATUS
+FilterCreate(
+    IN  PCHAR               Pattern,
+    OUT PXENIFACE_FILTER    *Filter
+    )
+{
+    ULONG                   Length;
+    ULONG                   PrefixLength;
+    ULONG                   Index;
+    PCHAR                   Text;
+    NTSTATUS                status;
+
+    Length = (ULONG)strlen(Pattern);
+
+    // The prefix, which is what the store watch is set on, runs up to
+    // the last separator before the first wildcard.
+    PrefixLength = Length;
+    for (Index = 0; Index < Length; Index++) {
+        if (Pattern[Index] == '*' || Pattern[Index] == '?') {
+            while (Index != 0 && Pattern[Index] != '/')
+                --Index;
+            PrefixLength = Index;
+            break;
+        }
+    }
+
+    status = STATUS_INVALID_PARAMETER;
+    if (PrefixLength == 0 || Length >= FILTER_PATH_LENGTH)
+        goto fail1;
+
+    *Filter = __FilterAllocate(sizeof (XENIFACE_FILTER) + Length + 1 + 1);
+
+    status = STATUS_NO_MEMORY;
+    if (*Filter == NULL)
+        goto fail2;
+
+    InitializeListHead(&(*Filter)->Nodes);
+
+    // Prefix and segment text live after the structure, each NUL
+    // terminated: "<prefix>\0<segment>\0<segment>..."
+    (*Filter)->Prefix = (PCHAR)(*Filter + 1);
+    RtlCopyMemory((*Filter)->Prefix, Pattern, Length);
+    (*Filter)->Prefix[PrefixLength] = '\0';
+    (*Filter)->PrefixLength = PrefixLength;
+
+    Text = (*Filter)->Prefix + PrefixLength + 1;
+    while (*Text != '\0') {
+        PXENIFACE_FILTER_SEGMENT    Segment;
+
+        status = STATUS_INVALID_PARAMETER;
+        if ((*Filter)->SegmentCount == FILTER_MAXIMUM_SEGMENTS)
+            goto fail3;
+
+        Segment = &(*Filter)->Segment[(*Filter)->SegmentCount++];
+        Segment->Text = Text;
+
+        while (*Text != '\0' && *Text != '/') {
+            if (*Text == '*' || *Text == '?')
+                Segment->Wildcard = TRUE;
+            Text++;
+        }
+
+        Segment->Length = (ULONG)(Text - Segment->Text);
+        if (Segment->Length == 0)
+            goto fail3;
+
+        if (*Text == '/')
+            *Text++ = '\0';
+    }
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+    __FilterFree(*Filter);
+    *Filter = NULL;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+FilterSuspend(
+    IN  PXENIFACE_FILTER            Filter,
+    IN  PXENBUS_STORE_INTERFACE     StoreInterface
+    )
+{
+    PLIST_ENTRY                     ListEntry;
+
+    // Every node is read, and re-watched, by the first evaluation after
+    // the resume
+    for (ListEntry = Filter->Nodes.Flink;
+         ListEntry != &Filter->Nodes;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_FILTER_NODE   Node;
+
+        Node = CONTAINING_RECORD(ListEntry, XENIFACE_FILTER_NODE, ListEntry);
+        __FilterUnwatchNode(Filter, StoreInterface, Node);
+    }
+
+    ASSERT3U(Filter->WatchCount, ==, 0);
+    Filter->WatchFailed = FALSE;
+}
+
+VOID
+FilterDestroy(
+    IN  PXENIFACE_FILTER            Filter,
+    IN  PXENBUS_STORE_INTERFACE     StoreInterface
+    )
+{
+    while (!IsListEmpty(&Filter->Nodes)) {
+        PXENIFACE_FILTER_NODE   Node;
+
+        Node = CONTAINING_RECORD(Filter->Nodes.Flink,
+                                 XENIFACE_FILTER_NODE,
+                                 ListEntry);
+        RemoveEntryList(&Node->ListEntry);
+        __FilterUnwatchNode(Filter, StoreInterface, Node);
+        __FilterForgetValue(Node);
+        __FilterFree(Node);
+    }
+
+    __FilterFree(Filter);
+}
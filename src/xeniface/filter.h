@@ -0,0 +1,83 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_FILTER_H
+#define _XENIFACE_FILTER_H
+
+#include <ntddk.h>
+#include <store_interface.h>
+
+// A filter is a compiled xenstore path pattern. Components may contain
+// '*' and '?' wildcards, which match within a single component, so
+// "device/vif" matches only that node, "device/vif/*" its direct
+// children and "device/vif/*/state" the state node of each vif.
+typedef struct _XENIFACE_FILTER XENIFACE_FILTER, *PXENIFACE_FILTER;
+
+// Called for each matching node whose value has appeared, changed or
+// disappeared since the previous evaluation. Value is NULL if the node
+// no longer exists. Each node has a store watch of its own, so an
+// evaluation lists the wildcard directories but reads only the nodes
+// whose watches have fired.
+typedef VOID (*XENIFACE_FILTER_CALLBACK)(PVOID, PCHAR, PCHAR);
+
+extern NTSTATUS
+FilterCreate(
+    IN  PCHAR               Pattern,
+    OUT PXENIFACE_FILTER    *Filter
+    );
+
+extern PCHAR
+FilterGetPrefix(
+    IN  PXENIFACE_FILTER    Filter
+    );
+
+extern BOOLEAN
+FilterEvaluate(
+    IN  PXENIFACE_FILTER            Filter,
+    IN  PXENBUS_STORE_INTERFACE     StoreInterface,
+    IN  XENIFACE_FILTER_CALLBACK    Callback,
+    IN  PVOID                       Context
+    );
+
+// Drops the per-node watches before a suspend
+extern VOID
+FilterSuspend(
+    IN  PXENIFACE_FILTER            Filter,
+    IN  PXENBUS_STORE_INTERFACE     StoreInterface
+    );
+
+extern VOID
+FilterDestroy(
+    IN  PXENIFACE_FILTER            Filter,
+    IN  PXENBUS_STORE_INTERFACE     StoreInterface
+    );
+
+#endif  // _XENIFACE_FILTER_H
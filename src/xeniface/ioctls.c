@@ -33,6 +33,11 @@
 #include "driver.h"
 #include "ioctls.h"
 #include "..\..\include\xeniface_ioctls.h"
+#include "cache.h"
+#include "trace.h"
+#include "latency.h"
+#include "contention.h"
+#include "pool.h"
 #include "log.h"
 
 static FORCEINLINE BOOLEAN
@@ -49,6 +54,16 @@ __IsValidStr(
     }
     return FALSE;
 }
+// Requests that reveal driver internals, or clear statistics that
+// others are collecting, need SeDebugPrivilege
+static FORCEINLINE BOOLEAN
+__IsPrivileged(
+    __in  PIRP              Irp
+    )
+{
+    return SeSinglePrivilegeCheck(RtlConvertLongToLuid(SE_DEBUG_PRIVILEGE),
+                                  Irp->RequestorMode);
+}
 static FORCEINLINE ULONG
 __MultiSzLen(
     __in  PCHAR             Str,
@@ -103,7 +118,7 @@ IoctlRead(
     if (!__IsValidStr(Buffer, InLen))
         goto fail2;
 
-    status = STORE(Read, Fdo->StoreInterface, NULL, NULL, Buffer, &Value);
+    status = CacheRead(Fdo->Cache, NULL, Buffer, &Value);
     if (!NT_SUCCESS(status))
         goto fail3;
 
@@ -111,7 +126,7 @@ IoctlRead(
 
     status = STATUS_BUFFER_OVERFLOW;
     if (OutLen == 0) {
-        XenIfaceDebugPrint(INFO, "|%s: (\"%s\")=(%d)\n", __FUNCTION__, Buffer, Length);
+        TraceEvent(IoctlRead, Buffer, Length, OutLen, (ULONG)status);
         goto done;
     } 
     
@@ -119,7 +134,7 @@ IoctlRead(
     if (OutLen < Length)
         goto fail4;
 
-    XenIfaceDebugPrint(INFO, "|%s: (\"%s\")=(%d)->\"%s\"\n", __FUNCTION__, Buffer, Length, Value);
+    TraceEvent(IoctlRead, Buffer, Length, OutLen, (ULONG)STATUS_SUCCESS);
 
     RtlCopyMemory(Buffer, Value, Length);
     Buffer[Length - 1] = 0;
@@ -127,12 +142,12 @@ IoctlRead(
 
 done:
     *Info = (ULONG_PTR)Length;
-    STORE(Free, Fdo->StoreInterface, Value);
+    CacheFree(Value);
     return status;
 
 fail4:
     XenIfaceDebugPrint(ERROR, "|%s: Fail4 (\"%s\")=(%d < %d)\n", __FUNCTION__, Buffer, OutLen, Length);
-    STORE(Free, Fdo->StoreInterface, Value);
+    CacheFree(Value);
 fail3:
     XenIfaceDebugPrint(ERROR, "|%s: Fail3 (\"%s\")\n", __FUNCTION__, Buffer);
 fail2:
@@ -169,10 +184,11 @@ IoctlWrite(
         goto fail3;
 
     status = STORE(Write, Fdo->StoreInterface, NULL, NULL, Buffer, Value);
+    CacheInvalidate(Fdo->Cache, Buffer);
     if (!NT_SUCCESS(status))
         goto fail4;
 
-    XenIfaceDebugPrint(INFO, "|%s: (\"%s\"=\"%s\")\n", __FUNCTION__, Buffer, Value);
+    TraceEvent(IoctlWrite, Buffer, Length, (ULONG)status, 0);
     return status;
 
 fail4:
@@ -216,7 +232,7 @@ IoctlDirectory(
 
     status = STATUS_BUFFER_OVERFLOW;
     if (OutLen == 0) {
-        XenIfaceDebugPrint(INFO, "|%s: (\"%s\")=(%d)(%d)\n", __FUNCTION__, Buffer, Length, Count);
+        TraceEvent(IoctlDirectory, Buffer, Length, Count, (ULONG)status);
         goto done;
     } 
 
@@ -224,9 +240,10 @@ IoctlDirectory(
     if (OutLen < Length)
         goto fail4;
 
-    XenIfaceDebugPrint(INFO, "|%s: (\"%s\")=(%d)(%d)\n", __FUNCTION__, Buffer, Length, Count);
+    TraceEvent(IoctlDirectory, Buffer, Length, Count, (ULONG)STATUS_SUCCESS);
 #if DBG
-    __DisplayMultiSz(__FUNCTION__, Value);
+    if (LogEnabled(INFO))
+        __DisplayMultiSz(__FUNCTION__, Value);
 #endif
 
     RtlCopyMemory(Buffer, Value, Length);
@@ -270,10 +287,11 @@ IoctlRemove(
         goto fail2;
 
     status = STORE(Remove, Fdo->StoreInterface, NULL, NULL, Buffer);
+    CacheInvalidate(Fdo->Cache, Buffer);
     if (!NT_SUCCESS(status))
         goto fail3;
 
-    XenIfaceDebugPrint(INFO, "|%s: (\"%s\")\n", __FUNCTION__, Buffer);
+    TraceEvent(IoctlRemove, Buffer, (ULONG)status, 0, 0);
     return status;
 
 fail3:
@@ -285,6 +303,228 @@ fail1:
     return status;
 }
 
+static DECLSPEC_NOINLINE NTSTATUS
+IoctlCacheStatistics(
+    __in  PXENIFACE_FDO         Fdo,
+    __in  PCHAR             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS    status;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 || OutLen < sizeof (XENIFACE_CACHE_STATISTICS))
+        goto fail1;
+
+    CacheQueryStatistics(Fdo->Cache, (PXENIFACE_CACHE_STATISTICS)Buffer);
+
+    *Info = sizeof (XENIFACE_CACHE_STATISTICS);
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+IoctlTraceDump(
+    __in  PCHAR             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS    status;
+    ULONG       Length;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0)
+        goto fail1;
+
+    status = TraceDump(Buffer, OutLen, &Length);
+
+    // Only a query for the size reports more than the buffer holds; the
+    // I/O manager would otherwise copy out past the end of it
+    if (status == STATUS_BUFFER_OVERFLOW && OutLen == 0) {
+        *Info = (ULONG_PTR)Length;
+        goto done;
+    }
+
+    if (status == STATUS_BUFFER_OVERFLOW)
+        status = STATUS_BUFFER_TOO_SMALL;
+
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    *Info = (ULONG_PTR)Length;
+
+done:
+    return status;
+
+fail2:
+    *Info = 0;
+    XenIfaceDebugPrint(ERROR, "|%s: Fail2 (%d < %d)\n", __FUNCTION__, OutLen, Length);
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+IoctlLatencyStatistics(
+    __in  PCHAR             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS    status;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 || OutLen < sizeof (XENIFACE_LATENCY_STATISTICS))
+        goto fail1;
+
+    LatencyQuery((PXENIFACE_LATENCY_STATISTICS)Buffer);
+
+    *Info = sizeof (XENIFACE_LATENCY_STATISTICS);
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+IoctlLatencyReset(
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen
+    )
+{
+    NTSTATUS    status;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 || OutLen != 0)
+        goto fail1;
+
+    LatencyReset();
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+IoctlContentionStatistics(
+    __in  PCHAR             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS    status;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 || OutLen < sizeof (XENIFACE_CONTENTION_STATISTICS))
+        goto fail1;
+
+    ContentionQuery((PXENIFACE_CONTENTION_STATISTICS)Buffer);
+
+    *Info = sizeof (XENIFACE_CONTENTION_STATISTICS);
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+IoctlContentionReset(
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen
+    )
+{
+    NTSTATUS    status;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 || OutLen != 0)
+        goto fail1;
+
+    ContentionReset();
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+IoctlPoolStatistics(
+    __in  PCHAR             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS    status;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 || OutLen < sizeof (XENIFACE_POOL_STATISTICS))
+        goto fail1;
+
+    PoolQuery((PXENIFACE_POOL_STATISTICS)Buffer);
+
+    *Info = sizeof (XENIFACE_POOL_STATISTICS);
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+IoctlPoolOutstanding(
+    __in  PCHAR             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS    status;
+    ULONG       Length;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0)
+        goto fail1;
+
+    status = PoolOutstanding(Buffer, OutLen, &Length);
+
+    // As for IoctlTraceDump
+    if (status == STATUS_BUFFER_OVERFLOW && OutLen == 0) {
+        *Info = (ULONG_PTR)Length;
+        goto done;
+    }
+
+    if (status == STATUS_BUFFER_OVERFLOW)
+        status = STATUS_BUFFER_TOO_SMALL;
+
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    *Info = (ULONG_PTR)Length;
+
+done:
+    return status;
+
+fail2:
+    *Info = 0;
+    XenIfaceDebugPrint(ERROR, "|%s: Fail2 (%d < %d)\n", __FUNCTION__, OutLen, Length);
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
 NTSTATUS
 XenIFaceIoctl(
     __in  PXENIFACE_FDO         Fdo,
@@ -296,6 +536,58 @@ XenIFaceIoctl(
     PVOID               Buffer = Irp->AssociatedIrp.SystemBuffer;
     ULONG               InLen = Stack->Parameters.DeviceIoControl.InputBufferLength;
     ULONG               OutLen = Stack->Parameters.DeviceIoControl.OutputBufferLength;
+    ULONGLONG           Start;
+
+    // Diagnostics do not depend on xenstore, so they can be collected
+    // while the store is unavailable
+    switch (Stack->Parameters.DeviceIoControl.IoControlCode) {
+    case IOCTL_XENIFACE_TRACE_DUMP:
+        status = STATUS_PRIVILEGE_NOT_HELD;
+        if (!__IsPrivileged(Irp))
+            goto done;
+
+        status = IoctlTraceDump((PCHAR)Buffer, InLen, OutLen, &Irp->IoStatus.Information);
+        goto done;
+
+    case IOCTL_XENIFACE_LATENCY_STATISTICS:
+        status = IoctlLatencyStatistics((PCHAR)Buffer, InLen, OutLen, &Irp->IoStatus.Information);
+        goto done;
+
+    case IOCTL_XENIFACE_LATENCY_RESET:
+        status = STATUS_PRIVILEGE_NOT_HELD;
+        if (!__IsPrivileged(Irp))
+            goto done;
+
+        status = IoctlLatencyReset(InLen, OutLen);
+        goto done;
+
+    case IOCTL_XENIFACE_CONTENTION_STATISTICS:
+        status = IoctlContentionStatistics((PCHAR)Buffer, InLen, OutLen, &Irp->IoStatus.Information);
+        goto done;
+
+    case IOCTL_XENIFACE_CONTENTION_RESET:
+        status = STATUS_PRIVILEGE_NOT_HELD;
+        if (!__IsPrivileged(Irp))
+            goto done;
+
+        status = IoctlContentionReset(InLen, OutLen);
+        goto done;
+
+    case IOCTL_XENIFACE_POOL_STATISTICS:
+        status = IoctlPoolStatistics((PCHAR)Buffer, InLen, OutLen, &Irp->IoStatus.Information);
+        goto done;
+
+    case IOCTL_XENIFACE_POOL_OUTSTANDING:
+        status = STATUS_PRIVILEGE_NOT_HELD;
+        if (!__IsPrivileged(Irp))
+            goto done;
+
+        status = IoctlPoolOutstanding((PCHAR)Buffer, InLen, OutLen, &Irp->IoStatus.Information);
+        goto done;
+
+    default:
+        break;
+    }
 
     status = STATUS_DEVICE_NOT_READY;
     if (Fdo->StoreInterface == NULL)
@@ -304,21 +596,31 @@ XenIFaceIoctl(
     if (Fdo->InterfacesAcquired == FALSE)
         goto done;
 
+    Start = LatencyStart();
+
     switch (Stack->Parameters.DeviceIoControl.IoControlCode) {
     case IOCTL_XENIFACE_STORE_READ:
         status = IoctlRead(Fdo, (PCHAR)Buffer, InLen, OutLen, &Irp->IoStatus.Information);
+        LatencyRecord(XENIFACE_LATENCY_IOCTL_READ, Start);
         break;
 
     case IOCTL_XENIFACE_STORE_WRITE:
         status = IoctlWrite(Fdo, (PCHAR)Buffer, InLen, OutLen);
+        LatencyRecord(XENIFACE_LATENCY_IOCTL_WRITE, Start);
         break;
 
     case IOCTL_XENIFACE_STORE_DIRECTORY:
         status = IoctlDirectory(Fdo, (PCHAR)Buffer, InLen, OutLen, &Irp->IoStatus.Information);
+        LatencyRecord(XENIFACE_LATENCY_IOCTL_DIRECTORY, Start);
         break;
 
     case IOCTL_XENIFACE_STORE_REMOVE:
         status = IoctlRemove(Fdo, (PCHAR)Buffer, InLen, OutLen);
+        LatencyRecord(XENIFACE_LATENCY_IOCTL_REMOVE, Start);
+        break;
+
+    case IOCTL_XENIFACE_CACHE_STATISTICS:
+        status = IoctlCacheStatistics(Fdo, (PCHAR)Buffer, InLen, OutLen, &Irp->IoStatus.Information);
         break;
 
     default:
@@ -0,0 +1,264 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <util.h>
+
+#include "driver.h"
+#include "latency.h"
+#include "log.h"
+#include "assert.h"
+
+#define LATENCY_POOL 'TALX'
+
+// Each processor records into its own block. Interlocked operations are
+// still used since a thread may be preempted or moved mid-update, but
+// the lines are only ever shared when that happens.
+typedef struct _XENIFACE_LATENCY_CPU {
+    ULONGLONG   Count[XENIFACE_LATENCY_OPERATIONS];
+    ULONGLONG   Total[XENIFACE_LATENCY_OPERATIONS];
+    ULONGLONG   Maximum[XENIFACE_LATENCY_OPERATIONS];
+    ULONGLONG   Histogram[XENIFACE_LATENCY_OPERATIONS][XENIFACE_LATENCY_BUCKETS];
+} XENIFACE_LATENCY_CPU, *PXENIFACE_LATENCY_CPU;
+
+typedef struct _XENIFACE_LATENCY {
+    PXENIFACE_LATENCY_CPU   Cpu;
+    ULONG                   Cpus;
+    ULONGLONG               Frequency;
+} XENIFACE_LATENCY, *PXENIFACE_LATENCY;
+
+static XENIFACE_LATENCY LatencyContext;
+
+static FORCEINLINE ULONG
+__LatencyHighBit(
+    IN  ULONGLONG   Value
+    )
+{
+    ULONG           Index;
+
+    ASSERT(Value != 0);
+
+    if (_BitScanReverse(&Index, (ULONG)(Value >> 32)))
+        return Index + 32;
+
+    (VOID) _BitScanReverse(&Index, (ULONG)Value);
+    return Index;
+}
+
+static FORCEINLINE ULONG
+__LatencyBucket(
+    IN  ULONGLONG   Nanoseconds
+    )
+{
+    ULONG           Bit;
+    ULONG           Bucket;
+
+    if (Nanoseconds < 4)
+        return (ULONG)Nanoseconds;
+
+    Bit = __LatencyHighBit(Nanoseconds);
+    Bucket = ((Bit - 1) * 4) + (ULONG)((Nanoseconds >> (Bit - 2)) & 3);
+
+    return min(Bucket, XENIFACE_LATENCY_BUCKETS - 1);
+}
+
+ULONGLONG
+LatencyStart(
+    VOID
+    )
+{
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+static VOID
+__LatencyRecordNanoseconds(
+    IN  XENIFACE_LATENCY_OPERATION  Operation,
+    IN  ULONGLONG                   Nanoseconds
+    )
+{
+    PXENIFACE_LATENCY_CPU           Cpu;
+    LONGLONG                        Maximum;
+
+    Cpu = &LatencyContext.Cpu[KeGetCurrentProcessorNumber() % LatencyContext.Cpus];
+
+    (VOID) InterlockedIncrement64((PLONGLONG)&Cpu->Count[Operation]);
+    (VOID) InterlockedAdd64((PLONGLONG)&Cpu->Total[Operation], (LONGLONG)Nanoseconds);
+    (VOID) InterlockedIncrement64((PLONGLONG)&Cpu->Histogram[Operation][__LatencyBucket(Nanoseconds)]);
+
+    do {
+        Maximum = (LONGLONG)Cpu->Maximum[Operation];
+        if ((ULONGLONG)Maximum >= Nanoseconds)
+            break;
+    } while (InterlockedCompareExchange64((PLONGLONG)&Cpu->Maximum[Operation],
+                                          (LONGLONG)Nanoseconds,
+                                          Maximum) != Maximum);
+}
+
+VOID
+LatencyRecord(
+    IN  XENIFACE_LATENCY_OPERATION  Operation,
+    IN  ULONGLONG                   Start
+    )
+{
+    ULONGLONG                       Ticks;
+    ULONGLONG                       Nanoseconds;
+
+    ASSERT3U(Operation, <, XENIFACE_LATENCY_OPERATIONS);
+
+    if (LatencyContext.Cpu == NULL)
+        return;
+
+    Ticks = KeQueryPerformanceCounter(NULL).QuadPart - Start;
+
+    // Split to avoid overflowing for long intervals
+    Nanoseconds = ((Ticks / LatencyContext.Frequency) * 1000000000ull) +
+                  (((Ticks % LatencyContext.Frequency) * 1000000000ull) /
+                   LatencyContext.Frequency);
+
+    __LatencyRecordNanoseconds(Operation, Nanoseconds);
+}
+
+VOID
+LatencyRecordImmediate(
+    IN  XENIFACE_LATENCY_OPERATION  Operation
+    )
+{
+    ASSERT3U(Operation, <, XENIFACE_LATENCY_OPERATIONS);
+
+    if (LatencyContext.Cpu == NULL)
+        return;
+
+    __LatencyRecordNanoseconds(Operation, 0);
+}
+
+VOID
+LatencyQuery(
+    OUT PXENIFACE_LATENCY_STATISTICS    Statistics
+    )
+{
+    ULONG                               Index;
+    ULONG                               Operation;
+    ULONG                               Bucket;
+
+    RtlZeroMemory(Statistics, sizeof (XENIFACE_LATENCY_STATISTICS));
+
+    Statistics->Operations = XENIFACE_LATENCY_OPERATIONS;
+    Statistics->Buckets = XENIFACE_LATENCY_BUCKETS;
+    Statistics->Samples = XENIFACE_LATENCY_OPERATIONS * XENIFACE_LATENCY_BUCKETS;
+
+    if (LatencyContext.Cpu == NULL)
+        return;
+
+    // Counters are read without stopping writers, so the totals of a busy
+    // operation may be out by the samples in flight
+    for (Index = 0; Index < LatencyContext.Cpus; Index++) {
+        PXENIFACE_LATENCY_CPU   Cpu = &LatencyContext.Cpu[Index];
+
+        for (Operation = 0; Operation < XENIFACE_LATENCY_OPERATIONS; Operation++) {
+            Statistics->Count[Operation] += Cpu->Count[Operation];
+            Statistics->Total[Operation] += Cpu->Total[Operation];
+            Statistics->Maximum[Operation] = max(Statistics->Maximum[Operation],
+                                                 Cpu->Maximum[Operation]);
+
+            for (Bucket = 0; Bucket < XENIFACE_LATENCY_BUCKETS; Bucket++)
+                Statistics->Histogram[Operation][Bucket] += Cpu->Histogram[Operation][Bucket];
+        }
+    }
+}
+
+VOID
+LatencyReset(
+    VOID
+    )
+{
+    if (LatencyContext.Cpu == NULL)
+        return;
+
+    RtlZeroMemory(LatencyContext.Cpu, sizeof (XENIFACE_LATENCY_CPU) * LatencyContext.Cpus);
+
+    Info("reset\n");
+}
+
+NTSTATUS
+LatencyInitialize(
+    VOID
+    )
+{
+    PXENIFACE_LATENCY_CPU   Cpu;
+    LARGE_INTEGER           Frequency;
+    ULONG                   Cpus;
+    NTSTATUS                status;
+
+    ASSERT3P(LatencyContext.Cpu, ==, NULL);
+
+    Cpus = KeQueryMaximumProcessorCount();
+
+    Cpu = __AllocateNonPagedPoolWithTag(sizeof (XENIFACE_LATENCY_CPU) * Cpus,
+                                        LATENCY_POOL);
+
+    status = STATUS_NO_MEMORY;
+    if (Cpu == NULL)
+        goto fail1;
+
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+
+    LatencyContext.Cpus = Cpus;
+    LatencyContext.Frequency = Frequency.QuadPart;
+
+    KeMemoryBarrier();
+    LatencyContext.Cpu = Cpu;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+LatencyTeardown(
+    VOID
+    )
+{
+    PXENIFACE_LATENCY_CPU   Cpu;
+
+    Cpu = LatencyContext.Cpu;
+    if (Cpu == NULL)
+        return;
+
+    LatencyContext.Cpu = NULL;
+    KeMemoryBarrier();
+
+    __FreePoolWithTag(Cpu, LATENCY_POOL);
+
+    RtlZeroMemory(&LatencyContext, sizeof (XENIFACE_LATENCY));
+}
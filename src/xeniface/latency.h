@@ -0,0 +1,77 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_LATENCY_H
+#define _XENIFACE_LATENCY_H
+
+#include <ntddk.h>
+
+#include "xeniface_ioctls.h"
+
+extern NTSTATUS
+LatencyInitialize(
+    VOID
+    );
+
+extern VOID
+LatencyTeardown(
+    VOID
+    );
+
+extern ULONGLONG
+LatencyStart(
+    VOID
+    );
+
+extern VOID
+LatencyRecord(
+    IN  XENIFACE_LATENCY_OPERATION  Operation,
+    IN  ULONGLONG                   Start
+    );
+
+// Records an operation that completed without waiting, without taking
+// a timestamp
+extern VOID
+LatencyRecordImmediate(
+    IN  XENIFACE_LATENCY_OPERATION  Operation
+    );
+
+extern VOID
+LatencyQuery(
+    OUT PXENIFACE_LATENCY_STATISTICS    Statistics
+    );
+
+extern VOID
+LatencyReset(
+    VOID
+    );
+
+#endif  // _XENIFACE_LATENCY_H
@@ -40,6 +40,29 @@
 #define     TRACE    DPFLTR_TRACE_LEVEL
 #define     INFO     DPFLTR_INFO_LEVEL
 
+#define     LOG_MASK(_Level)    (1ul << (_Level))
+
+// Levels compiled into the driver. Anything outside this mask compiles
+// away, arguments included.
+#ifndef XENIFACE_LOG_COMPILE_MASK
+#if DBG
+#define XENIFACE_LOG_COMPILE_MASK   (LOG_MASK(ERROR) | LOG_MASK(WARNING) | \
+                                     LOG_MASK(TRACE) | LOG_MASK(INFO))
+#else   // DBG
+#define XENIFACE_LOG_COMPILE_MASK   (LOG_MASK(ERROR) | LOG_MASK(WARNING) | \
+                                     LOG_MASK(INFO))
+#endif  // DBG
+#endif  // XENIFACE_LOG_COMPILE_MASK
+
+// Levels enabled at run time, from the LogMask value under the service
+// key (see DriverEntry).
+extern ULONG    XenIfaceLogMask;
+
+// Use to guard code that only exists to produce log output.
+#define LogEnabled(_Level)                                      \
+        ((XENIFACE_LOG_COMPILE_MASK & LOG_MASK(_Level)) &&      \
+         (XenIfaceLogMask & LOG_MASK(_Level)))
+
 #pragma warning(disable:4127)   // conditional expression is constant
 
 static __inline VOID
@@ -62,8 +85,11 @@ __Error(
     va_end(Arguments);
 }
 
-#define Error(...)  \
-        __Error(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__)
+#define Error(...)                                                      \
+        do {                                                            \
+            if (LogEnabled(ERROR))                                      \
+                __Error(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__); \
+        } while (FALSE)
 
 static __inline VOID
 __Warning(
@@ -85,8 +111,11 @@ __Warning(
     va_end(Arguments);
 }
 
-#define Warning(...)  \
-        __Warning(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__)
+#define Warning(...)                                                        \
+        do {                                                                \
+            if (LogEnabled(WARNING))                                        \
+                __Warning(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__);   \
+        } while (FALSE)
 
 #if DBG
 static __inline VOID
@@ -109,10 +138,13 @@ __Trace(
     va_end(Arguments);
 }
 
-#define Trace(...)  \
-        __Trace(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__)
+#define Trace(...)                                                      \
+        do {                                                            \
+            if (LogEnabled(TRACE))                                      \
+                __Trace(__MODULE__ "|" __FUNCTION__ ": ", __VA_ARGS__); \
+        } while (FALSE)
 #else   // DBG
-#define Trace(...)  (VOID)(__VA_ARGS__)
+#define Trace(...)  do { } while (FALSE)
 #endif  // DBG
 
 static __inline VOID
@@ -135,12 +167,18 @@ __Info(
     va_end(Arguments);
 }
 
-#define Info(...)  \
-        __Info(__MODULE__ "|"  __FUNCTION__ ": ", __VA_ARGS__)
+#define Info(...)                                                       \
+        do {                                                            \
+            if (LogEnabled(INFO))                                       \
+                __Info(__MODULE__ "|"  __FUNCTION__ ": ", __VA_ARGS__); \
+        } while (FALSE)
 
 
 #define XenIfaceDebugPrint(LEVEL, ...) \
-	__XenIfaceDebugPrint(__MODULE__ "|" __FUNCTION__ ": ",LEVEL, __VA_ARGS__)
+	do { \
+		if (LogEnabled(LEVEL)) \
+			__XenIfaceDebugPrint(__MODULE__ "|" __FUNCTION__ ": ",LEVEL, __VA_ARGS__); \
+	} while (FALSE)
 
 static __inline VOID
 __XenIfaceDebugPrint    (
@@ -153,11 +191,6 @@ __XenIfaceDebugPrint    (
 {
     va_list    list;
 
-#if !DBG
-    if (DebugPrintLevel == TRACE)
-        return;
-#endif
-
     va_start(list, DebugMessage);
 
     if (DebugMessage)
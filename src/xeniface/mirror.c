@@ -0,0 +1,919 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <ntstrsafe.h>
+#include <store_interface.h>
+#include <suspend_interface.h>
+#include <util.h>
+
+#include "driver.h"
+#include "mirror.h"
+#include "thread.h"
+#include "work.h"
+#include "mutex.h"
+#include "log.h"
+#include "assert.h"
+
+#define MIRROR_POOL 'RRIM'
+
+// Each path has its own watch event, and the thread waits on all of them
+// as well as its own
+#define MIRROR_MAXIMUM_ENTRIES  (MAXIMUM_WAIT_OBJECTS - 1)
+
+#define MIRROR_VALUE_INFO_SIZE  512
+
+// Time allowed for a burst of changes to settle, so that it is written
+// to the registry in one pass
+#define MIRROR_SETTLE_MS        100
+
+// The last value written for a node. Child is empty for a single path.
+typedef struct _XENIFACE_MIRROR_VALUE {
+    LIST_ENTRY  ListEntry;
+    PCHAR       Data;
+    BOOLEAN     Seen;
+    CHAR        Child[1];
+} XENIFACE_MIRROR_VALUE, *PXENIFACE_MIRROR_VALUE;
+
+typedef struct _XENIFACE_MIRROR_ENTRY {
+    LIST_ENTRY          ListEntry;
+    PCHAR               Path;
+    BOOLEAN             Children;
+    UNICODE_STRING      Name;
+    KEVENT              Event;
+    PXENBUS_STORE_WATCH Watch;
+    ULONG               SuspendCount;
+    LONG                Dirty;
+    LIST_ENTRY          Values;
+} XENIFACE_MIRROR_ENTRY, *PXENIFACE_MIRROR_ENTRY;
+
+struct _XENIFACE_MIRROR {
+    PXENIFACE_FDO       Fdo;
+    XENIFACE_MUTEX      Lock;
+    LIST_ENTRY          Entries;
+    ULONG               Count;
+    PXENIFACE_THREAD    Thread;
+    XENIFACE_WORK_ITEM  Work;
+    PKEVENT             Events[MAXIMUM_WAIT_OBJECTS];
+    KWAIT_BLOCK         WaitBlock[MAXIMUM_WAIT_OBJECTS];
+};
+
+static FORCEINLINE PVOID
+__MirrorAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocateNonPagedPoolWithTag(Length, MIRROR_POOL);
+}
+
+static FORCEINLINE VOID
+__MirrorFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, MIRROR_POOL);
+}
+
+static PXENIFACE_MIRROR_VALUE
+__MirrorFindValue(
+    IN  PXENIFACE_MIRROR_ENTRY  Entry,
+    IN  PCHAR                   Child
+    )
+{
+    PLIST_ENTRY                 ListEntry;
+
+    for (ListEntry = Entry->Values.Flink;
+         ListEntry != &Entry->Values;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_MIRROR_VALUE  Value;
+
+        Value = CONTAINING_RECORD(ListEntry, XENIFACE_MIRROR_VALUE, ListEntry);
+        if (strcmp(Value->Child, Child) == 0)
+            return Value;
+    }
+
+    return NULL;
+}
+
+static VOID
+__MirrorRemoveValue(
+    IN  PXENIFACE_MIRROR_VALUE  Value
+    )
+{
+    RemoveEntryList(&Value->ListEntry);
+    __MirrorFree(Value);
+}
+
+static NTSTATUS
+__MirrorOpenKey(
+    OUT PHANDLE         Key
+    )
+{
+    OBJECT_ATTRIBUTES   Attributes;
+
+    InitializeObjectAttributes(&Attributes, &DriverParameters.RegistryPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    return ZwOpenKey(Key, KEY_WRITE, &Attributes);
+}
+
+// Store nodes hold UTF-8, so the registry strings are converted from
+// that rather than from the ANSI code page. Free with __MirrorFree().
+static NTSTATUS
+__MirrorUtf8ToUnicode(
+    IN  PCHAR           Utf8,
+    OUT PUNICODE_STRING Unicode
+    )
+{
+    ULONG               Utf8Length;
+    ULONG               Length;
+    NTSTATUS            status;
+
+    Utf8Length = (ULONG)strlen(Utf8);
+
+    status = RtlUTF8ToUnicodeN(NULL, 0, &Length, Utf8, Utf8Length);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = STATUS_BUFFER_OVERFLOW;
+    if (Length > MAXUSHORT - sizeof (WCHAR))
+        goto fail2;
+
+    Unicode->Length = (USHORT)Length;
+    Unicode->MaximumLength = (USHORT)(Length + sizeof (WCHAR));
+    Unicode->Buffer = __MirrorAllocate(Unicode->MaximumLength);
+
+    status = STATUS_NO_MEMORY;
+    if (Unicode->Buffer == NULL)
+        goto fail3;
+
+    status = RtlUTF8ToUnicodeN(Unicode->Buffer,
+                               Length,
+                               &Length,
+                               Utf8,
+                               Utf8Length);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+
+    __MirrorFree(Unicode->Buffer);
+    Unicode->Buffer = NULL;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Sets, or with no Data deletes, the registry value for a node. The
+// service key is opened by the first write of a pass and then reused.
+static NTSTATUS
+__MirrorWriteValue(
+    IN      PXENIFACE_MIRROR_ENTRY  Entry,
+    IN      PCHAR                   Child,
+    IN      PCHAR                   Data OPTIONAL,
+    IN OUT  PHANDLE                 Key
+    )
+{
+    UNICODE_STRING                  Suffix;
+    UNICODE_STRING                  Name;
+    UNICODE_STRING                  Value;
+    NTSTATUS                        status;
+
+    if (*Key == NULL) {
+        status = __MirrorOpenKey(Key);
+        if (!NT_SUCCESS(status)) {
+            *Key = NULL;
+            goto fail1;
+        }
+    }
+
+    status = __MirrorUtf8ToUnicode(Child, &Suffix);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    Name.Length = 0;
+    Name.MaximumLength = Entry->Name.Length + Suffix.Length;
+    Name.Buffer = __MirrorAllocate(Name.MaximumLength);
+
+    status = STATUS_NO_MEMORY;
+    if (Name.Buffer == NULL)
+        goto fail3;
+
+    RtlCopyUnicodeString(&Name, &Entry->Name);
+    (VOID) RtlAppendUnicodeStringToString(&Name, &Suffix);
+
+    if (Data == NULL) {
+        status = ZwDeleteValueKey(*Key, &Name);
+        if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+            status = STATUS_SUCCESS;
+    } else {
+        status = __MirrorUtf8ToUnicode(Data, &Value);
+        if (NT_SUCCESS(status)) {
+            status = ZwSetValueKey(*Key,
+                                   &Name,
+                                   0,
+                                   REG_SZ,
+                                   Value.Buffer,
+                                   Value.Length + sizeof (WCHAR));
+            __MirrorFree(Value.Buffer);
+        }
+    }
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    Trace("%s%s%s -> %wZ\n", Entry->Path, (*Child != '\0') ? "/" : "", Child, &Name);
+
+    __MirrorFree(Name.Buffer);
+    __MirrorFree(Suffix.Buffer);
+
+    return STATUS_SUCCESS;
+
+fail4:
+    Error("fail4\n");
+
+    __MirrorFree(Name.Buffer);
+
+fail3:
+    Error("fail3\n");
+
+    __MirrorFree(Suffix.Buffer);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Brings one node's registry value in line with Data (NULL if the node
+// is gone), touching the registry only if it differs from what was last
+// written
+static NTSTATUS
+__MirrorUpdateValue(
+    IN      PXENIFACE_MIRROR_ENTRY  Entry,
+    IN      PCHAR                   Child,
+    IN      PCHAR                   Data OPTIONAL,
+    IN OUT  PHANDLE                 Key
+    )
+{
+    PXENIFACE_MIRROR_VALUE          Value;
+    ULONG                           ChildLength;
+    ULONG                           DataLength;
+    NTSTATUS                        status;
+
+    Value = __MirrorFindValue(Entry, Child);
+
+    if (Data == NULL) {
+        if (Value == NULL)
+            return STATUS_SUCCESS;
+
+        status = __MirrorWriteValue(Entry, Child, NULL, Key);
+        if (NT_SUCCESS(status))
+            __MirrorRemoveValue(Value);
+
+        return status;
+    }
+
+    if (Value != NULL && strcmp(Value->Data, Data) == 0) {
+        Value->Seen = TRUE;
+        return STATUS_SUCCESS;
+    }
+
+    status = __MirrorWriteValue(Entry, Child, Data, Key);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    if (Value != NULL)
+        __MirrorRemoveValue(Value);
+
+    ChildLength = (ULONG)strlen(Child);
+    DataLength = (ULONG)strlen(Data);
+
+    // If this fails the value is simply written again next time
+    Value = __MirrorAllocate(sizeof (XENIFACE_MIRROR_VALUE) + ChildLength + DataLength + 1);
+    if (Value == NULL)
+        return STATUS_SUCCESS;
+
+    RtlCopyMemory(Value->Child, Child, ChildLength);
+    Value->Data = Value->Child + ChildLength + 1;
+    RtlCopyMemory(Value->Data, Data, DataLength);
+    Value->Seen = TRUE;
+
+    InsertTailList(&Entry->Values, &Value->ListEntry);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+__MirrorReadNode(
+    IN      PXENIFACE_MIRROR        Mirror,
+    IN      PXENIFACE_MIRROR_ENTRY  Entry,
+    IN      PCHAR                   Path,
+    IN      PCHAR                   Child,
+    IN OUT  PHANDLE                 Key
+    )
+{
+    PXENIFACE_FDO                   Fdo = Mirror->Fdo;
+    PCHAR                           Data;
+    NTSTATUS                        status;
+
+    status = STORE(Read, Fdo->StoreInterface, NULL, NULL, Path, &Data);
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND)
+        return __MirrorUpdateValue(Entry, Child, NULL, Key);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = __MirrorUpdateValue(Entry, Child, Data, Key);
+
+    STORE(Free, Fdo->StoreInterface, Data);
+
+    return status;
+}
+
+static NTSTATUS
+__MirrorUpdateChildren(
+    IN      PXENIFACE_MIRROR        Mirror,
+    IN      PXENIFACE_MIRROR_ENTRY  Entry,
+    IN OUT  PHANDLE                 Key
+    )
+{
+    PXENIFACE_FDO                   Fdo = Mirror->Fdo;
+    PLIST_ENTRY                     ListEntry;
+    PCHAR                           Children;
+    PCHAR                           Child;
+    NTSTATUS                        status;
+
+    status = STORE(Directory, Fdo->StoreInterface, NULL, NULL, Entry->Path, &Children);
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+        // The whole subtree has gone: treat it as an empty listing so
+        // that every child is removed below
+        Children = NULL;
+        status = STATUS_SUCCESS;
+    } else if (!NT_SUCCESS(status))
+        return status;
+
+    for (ListEntry = Entry->Values.Flink;
+         ListEntry != &Entry->Values;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_MIRROR_VALUE  Value;
+
+        Value = CONTAINING_RECORD(ListEntry, XENIFACE_MIRROR_VALUE, ListEntry);
+        Value->Seen = FALSE;
+    }
+
+    for (Child = Children;
+         Child != NULL && *Child != '\0';
+         Child += strlen(Child) + 1) {
+        PCHAR   Path;
+        ULONG   Length;
+
+        Length = (ULONG)(strlen(Entry->Path) + 1 + strlen(Child) + 1);
+        Path = __MirrorAllocate(Length);
+        if (Path == NULL) {
+            status = STATUS_NO_MEMORY;
+            break;
+        }
+
+        (VOID) RtlStringCbPrintfA(Path, Length, "%s/%s", Entry->Path, Child);
+        status = __MirrorReadNode(Mirror, Entry, Path, Child, Key);
+        __MirrorFree(Path);
+
+        if (!NT_SUCCESS(status))
+            break;
+    }
+
+    if (Children != NULL)
+        STORE(Free, Fdo->StoreInterface, Children);
+
+    if (!NT_SUCCESS(status))
+        return status;
+
+    // Whatever was not seen has been removed from the store
+    ListEntry = Entry->Values.Flink;
+    while (ListEntry != &Entry->Values) {
+        PXENIFACE_MIRROR_VALUE  Value;
+
+        Value = CONTAINING_RECORD(ListEntry, XENIFACE_MIRROR_VALUE, ListEntry);
+        ListEntry = ListEntry->Flink;
+
+        if (Value->Seen)
+            continue;
+
+        status = __MirrorWriteValue(Entry, Value->Child, NULL, Key);
+        if (!NT_SUCCESS(status))
+            return status;
+
+        __MirrorRemoveValue(Value);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// Called with the mirror lock held. The lock is a XENIFACE_MUTEX rather
+// than a fast mutex because the pass opens and writes the registry, which
+// must be done at PASSIVE_LEVEL.
+static VOID
+__MirrorSynchronize(
+    IN  PXENIFACE_MIRROR    Mirror
+    )
+{
+    PXENIFACE_FDO           Fdo = Mirror->Fdo;
+    PLIST_ENTRY             ListEntry;
+    HANDLE                  Key;
+    ULONG                   SuspendCount;
+    NTSTATUS                status;
+
+    if (!Fdo->InterfacesAcquired)
+        return;
+
+    SuspendCount = SUSPEND(Count, Fdo->SuspendInterface);
+    Key = NULL;
+
+    for (ListEntry = Mirror->Entries.Flink;
+         ListEntry != &Mirror->Entries;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_MIRROR_ENTRY  Entry;
+
+        Entry = CONTAINING_RECORD(ListEntry, XENIFACE_MIRROR_ENTRY, ListEntry);
+
+        // As for the cache, the watch is re-established after a migration
+        if (Entry->Watch != NULL && Entry->SuspendCount != SuspendCount) {
+            (VOID) STORE(Unwatch, Fdo->StoreInterface, Entry->Watch);
+            Entry->Watch = NULL;
+        }
+
+        if (Entry->Watch == NULL) {
+            status = STORE(Watch,
+                           Fdo->StoreInterface,
+                           NULL,
+                           Entry->Path,
+                           &Entry->Event,
+                           &Entry->Watch);
+            if (!NT_SUCCESS(status))
+                Entry->Watch = NULL;
+            else
+                Entry->SuspendCount = SuspendCount;
+
+            Entry->Dirty = TRUE;
+        }
+
+        if (!InterlockedExchange(&Entry->Dirty, FALSE))
+            continue;
+
+        if (Entry->Children)
+            status = __MirrorUpdateChildren(Mirror, Entry, &Key);
+        else
+            status = __MirrorReadNode(Mirror, Entry, Entry->Path, "", &Key);
+
+        // Try again on the next pass
+        if (!NT_SUCCESS(status)) {
+            Warning("%s: failed (%08x)\n", Entry->Path, status);
+            Entry->Dirty = TRUE;
+        }
+    }
+
+    if (Key != NULL)
+        ZwClose(Key);
+}
+
+static VOID
+MirrorWork(
+    IN  PVOID           Context
+    )
+{
+    PXENIFACE_MIRROR    Mirror = Context;
+
+    AcquireMutex(&Mirror->Lock);
+    __MirrorSynchronize(Mirror);
+    ReleaseMutex(&Mirror->Lock);
+}
+
+// Waits for watches to fire and passes the paths that changed to the
+// FDO's work queue
+static NTSTATUS
+MirrorThread(
+    IN  PXENIFACE_THREAD    Self,
+    IN  PVOID               Context
+    )
+{
+    PXENIFACE_MIRROR        Mirror = Context;
+    PXENIFACE_FDO           Fdo = Mirror->Fdo;
+    LARGE_INTEGER           Timeout;
+    ULONG                   Changed;
+    BOOLEAN                 Pending;
+    NTSTATUS                status;
+
+    Mirror->Events[Mirror->Count] = ThreadGetEvent(Self);
+    Pending = FALSE;
+
+    for (;;) {
+        PLIST_ENTRY ListEntry;
+
+        // Relative, in 100ns units
+        Timeout.QuadPart = -(LONGLONG)MIRROR_SETTLE_MS * 10000;
+
+        // While a pass could not be queued, wake up to try again
+        status = KeWaitForMultipleObjects(Mirror->Count + 1,
+                                          Mirror->Events,
+                                          WaitAny,
+                                          Executive,
+                                          KernelMode,
+                                          FALSE,
+                                          Pending ? &Timeout : NULL,
+                                          Mirror->WaitBlock);
+        if (!NT_SUCCESS(status))
+            break;
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        if (status != STATUS_TIMEOUT) {
+            (VOID) KeWaitForSingleObject(ThreadGetEvent(Self),
+                                         Executive,
+                                         KernelMode,
+                                         FALSE,
+                                         &Timeout);
+
+            if (ThreadIsAlerted(Self))
+                break;
+        }
+
+        Changed = 0;
+        for (ListEntry = Mirror->Entries.Flink;
+             ListEntry != &Mirror->Entries;
+             ListEntry = ListEntry->Flink) {
+            PXENIFACE_MIRROR_ENTRY  Entry;
+
+            Entry = CONTAINING_RECORD(ListEntry, XENIFACE_MIRROR_ENTRY, ListEntry);
+
+            if (KeReadStateEvent(&Entry->Event)) {
+                KeClearEvent(&Entry->Event);
+                (VOID) InterlockedExchange(&Entry->Dirty, TRUE);
+                Changed++;
+            }
+        }
+
+        if (Changed == 0 && !Pending)
+            continue;
+
+        // The entries stay dirty until a pass runs, so nothing is lost
+        // if the queue is full
+        if (WorkQueueInsert(Fdo->WorkQueue, &Mirror->Work)) {
+            Pending = FALSE;
+        } else {
+            if (!Pending)
+                Warning("queue full: retrying\n");
+            Pending = TRUE;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+MirrorResume(
+    IN  PXENIFACE_MIRROR    Mirror
+    )
+{
+    PLIST_ENTRY             ListEntry;
+
+    if (Mirror->Count == 0)
+        return;
+
+    for (ListEntry = Mirror->Entries.Flink;
+         ListEntry != &Mirror->Entries;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_MIRROR_ENTRY  Entry;
+
+        Entry = CONTAINING_RECORD(ListEntry, XENIFACE_MIRROR_ENTRY, ListEntry);
+        (VOID) InterlockedExchange(&Entry->Dirty, TRUE);
+    }
+
+    if (!WorkQueueInsert(Mirror->Fdo->WorkQueue, &Mirror->Work))
+        Warning("not queued\n");
+}
+
+VOID
+MirrorSuspend(
+    IN  PXENIFACE_MIRROR    Mirror
+    )
+{
+    PXENIFACE_FDO           Fdo = Mirror->Fdo;
+    PLIST_ENTRY             ListEntry;
+
+    AcquireMutex(&Mirror->Lock);
+
+    for (ListEntry = Mirror->Entries.Flink;
+         ListEntry != &Mirror->Entries;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_MIRROR_ENTRY  Entry;
+
+        Entry = CONTAINING_RECORD(ListEntry, XENIFACE_MIRROR_ENTRY, ListEntry);
+
+        if (Entry->Watch != NULL) {
+            (VOID) STORE(Unwatch, Fdo->StoreInterface, Entry->Watch);
+            Entry->Watch = NULL;
+        }
+    }
+
+    ReleaseMutex(&Mirror->Lock);
+}
+
+static NTSTATUS
+__MirrorAddEntry(
+    IN  PXENIFACE_MIRROR    Mirror,
+    IN  PUNICODE_STRING     Path,
+    IN  PUNICODE_STRING     Name
+    )
+{
+    PXENIFACE_MIRROR_ENTRY  Entry;
+    ANSI_STRING             Ansi;
+    BOOLEAN                 Children;
+    NTSTATUS                status;
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (Mirror->Count == MIRROR_MAXIMUM_ENTRIES)
+        goto fail1;
+
+    status = RtlUnicodeStringToAnsiString(&Ansi, Path, TRUE);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    // A trailing separator asks for the node's children
+    Children = FALSE;
+    while (Ansi.Length > 1 && Ansi.Buffer[Ansi.Length - 1] == '/') {
+        Ansi.Length--;
+        Children = TRUE;
+    }
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Ansi.Length == 0 || Name->Length == 0)
+        goto fail3;
+
+    status = STATUS_NO_MEMORY;
+    Entry = __MirrorAllocate(sizeof (XENIFACE_MIRROR_ENTRY) +
+                             Ansi.Length + 1 +
+                             Name->Length);
+    if (Entry == NULL)
+        goto fail3;
+
+    Entry->Path = (PCHAR)(Entry + 1);
+    RtlCopyMemory(Entry->Path, Ansi.Buffer, Ansi.Length);
+    Entry->Children = Children;
+
+    Entry->Name.Buffer = (PWCHAR)(Entry->Path + Ansi.Length + 1);
+    Entry->Name.Length = Name->Length;
+    Entry->Name.MaximumLength = Name->Length;
+    RtlCopyMemory(Entry->Name.Buffer, Name->Buffer, Name->Length);
+
+    KeInitializeEvent(&Entry->Event, NotificationEvent, FALSE);
+    InitializeListHead(&Entry->Values);
+
+    Mirror->Events[Mirror->Count] = &Entry->Event;
+    InsertTailList(&Mirror->Entries, &Entry->ListEntry);
+    Mirror->Count++;
+
+    Info("%s%s -> %wZ%s\n",
+         Entry->Path,
+         Children ? "/*" : "",
+         &Entry->Name,
+         Children ? "*" : "");
+
+    RtlFreeAnsiString(&Ansi);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    RtlFreeAnsiString(&Ansi);
+
+fail2:
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Each REG_SZ under the service's Mirror key names a xenstore path, and
+// holds the name of the value under the service key to copy it to. A
+// path ending in '/' mirrors each of the node's children instead, into
+// values named by appending the child's name to the data.
+static VOID
+__MirrorReadConfiguration(
+    IN  PXENIFACE_MIRROR            Mirror
+    )
+{
+    OBJECT_ATTRIBUTES               Attributes;
+    UNICODE_STRING                  KeyName;
+    HANDLE                          ServiceKey;
+    HANDLE                          MirrorKey;
+    PKEY_VALUE_FULL_INFORMATION     Value;
+    UNICODE_STRING                  Path;
+    UNICODE_STRING                  Name;
+    ULONG                           Index;
+    NTSTATUS                        status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    InitializeObjectAttributes(&Attributes, &DriverParameters.RegistryPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status = ZwOpenKey(&ServiceKey, KEY_READ, &Attributes);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    RtlInitUnicodeString(&KeyName, L"Mirror");
+    InitializeObjectAttributes(&Attributes, &KeyName,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               ServiceKey,
+                               NULL);
+
+    status = ZwOpenKey(&MirrorKey, KEY_READ, &Attributes);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = STATUS_NO_MEMORY;
+    Value = __MirrorAllocate(MIRROR_VALUE_INFO_SIZE);
+    if (Value == NULL)
+        goto fail3;
+
+    for (Index = 0; ; Index++) {
+        ULONG   Size;
+
+        status = ZwEnumerateValueKey(MirrorKey,
+                                     Index,
+                                     KeyValueFullInformation,
+                                     Value,
+                                     MIRROR_VALUE_INFO_SIZE,
+                                     &Size);
+        if (status == STATUS_NO_MORE_ENTRIES)
+            break;
+
+        if (!NT_SUCCESS(status))
+            continue;
+
+        if (Value->Type != REG_SZ)
+            continue;
+
+        Path.Buffer = Value->Name;
+        Path.Length = (USHORT)Value->NameLength;
+        Path.MaximumLength = (USHORT)Value->NameLength;
+
+        Name.Buffer = (PWCHAR)((PUCHAR)Value + Value->DataOffset);
+        Name.Length = (USHORT)(Value->DataLength & ~(sizeof (WCHAR) - 1));
+        Name.MaximumLength = Name.Length;
+
+        while (Name.Length != 0 &&
+               Name.Buffer[(Name.Length / sizeof (WCHAR)) - 1] == L'\0')
+            Name.Length -= sizeof (WCHAR);
+
+        (VOID) __MirrorAddEntry(Mirror, &Path, &Name);
+    }
+
+    __MirrorFree(Value);
+
+    ZwClose(MirrorKey);
+    ZwClose(ServiceKey);
+
+    return;
+
+fail3:
+    ZwClose(MirrorKey);
+
+fail2:
+    ZwClose(ServiceKey);
+
+fail1:
+    // Without configuration, keep the one value always mirrored
+    Trace("default mirror (%08x)\n", status);
+
+    RtlInitUnicodeString(&Path, L"/mh/boot-time/management-mac-address");
+    RtlInitUnicodeString(&Name, L"MgmtMacAddr");
+    (VOID) __MirrorAddEntry(Mirror, &Path, &Name);
+}
+
+NTSTATUS
+MirrorInitialize(
+    IN  PXENIFACE_FDO       Fdo,
+    OUT PXENIFACE_MIRROR    *Mirror
+    )
+{
+    NTSTATUS                status;
+
+    *Mirror = __MirrorAllocate(sizeof (XENIFACE_MIRROR));
+
+    status = STATUS_NO_MEMORY;
+    if (*Mirror == NULL)
+        goto fail1;
+
+    (*Mirror)->Fdo = Fdo;
+    InitializeMutex(&(*Mirror)->Lock, XENIFACE_LOCK_MIRROR);
+    InitializeListHead(&(*Mirror)->Entries);
+    WorkItemInitialize(&(*Mirror)->Work, MirrorWork, *Mirror, XENIFACE_WORK_NORMAL);
+
+    __MirrorReadConfiguration(*Mirror);
+
+    if ((*Mirror)->Count == 0)
+        goto done;
+
+    status = ThreadCreate(MirrorThread, *Mirror, &(*Mirror)->Thread);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+done:
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    MirrorTeardown(*Mirror);
+    *Mirror = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+MirrorTeardown(
+    IN  PXENIFACE_MIRROR    Mirror
+    )
+{
+    if (Mirror->Thread != NULL) {
+        ThreadAlert(Mirror->Thread);
+        ThreadJoin(Mirror->Thread);
+        Mirror->Thread = NULL;
+    }
+
+    WorkItemWait(Mirror->Fdo->WorkQueue, &Mirror->Work);
+
+    MirrorSuspend(Mirror);
+
+    while (!IsListEmpty(&Mirror->Entries)) {
+        PXENIFACE_MIRROR_ENTRY  Entry;
+
+        Entry = CONTAINING_RECORD(Mirror->Entries.Flink,
+                                  XENIFACE_MIRROR_ENTRY,
+                                  ListEntry);
+
+        while (!IsListEmpty(&Entry->Values)) {
+            PXENIFACE_MIRROR_VALUE  Value;
+
+            Value = CONTAINING_RECORD(Entry->Values.Flink,
+                                      XENIFACE_MIRROR_VALUE,
+                                      ListEntry);
+            __MirrorRemoveValue(Value);
+        }
+
+        RemoveEntryList(&Entry->ListEntry);
+        __MirrorFree(Entry);
+    }
+
+    __MirrorFree(Mirror);
+}
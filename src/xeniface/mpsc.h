@@ -0,0 +1,157 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_MPSC_H
+#define _XENIFACE_MPSC_H
+
+// A bounded queue of pointers for many producers and one consumer.
+// Producers may run concurrently at up to DISPATCH_LEVEL; callers with
+// several consumers must serialize them. Each slot carries a sequence
+// number, so a producer claims a slot with one compare-exchange on Tail
+// and publishes it by advancing the slot's sequence.
+//
+// Only InterlockedCompareExchange and KeMemoryBarrier are used, so this
+// header builds unchanged in a user mode harness that supplies them.
+
+typedef struct _XENIFACE_MPSC_SLOT {
+    volatile ULONG  Sequence;
+    PVOID           Item;
+} XENIFACE_MPSC_SLOT, *PXENIFACE_MPSC_SLOT;
+
+// Tail and Head are kept on separate lines so producers and the consumer
+// do not share one
+typedef struct _XENIFACE_MPSC {
+    PXENIFACE_MPSC_SLOT Slot;
+    ULONG               Mask;
+    UCHAR               Pad0[64 - sizeof (PVOID) - sizeof (ULONG)];
+    volatile LONG       Tail;
+    UCHAR               Pad1[64 - sizeof (LONG)];
+    ULONG               Head;
+    UCHAR               Pad2[64 - sizeof (ULONG)];
+} XENIFACE_MPSC, *PXENIFACE_MPSC;
+
+// Count must be a power of two
+static FORCEINLINE VOID
+MpscInitialize(
+    IN  PXENIFACE_MPSC      Queue,
+    IN  PXENIFACE_MPSC_SLOT Slot,
+    IN  ULONG               Count
+    )
+{
+    ULONG                   Index;
+
+    Queue->Slot = Slot;
+    Queue->Mask = Count - 1;
+    Queue->Tail = 0;
+    Queue->Head = 0;
+
+    for (Index = 0; Index < Count; Index++) {
+        Slot[Index].Sequence = Index;
+        Slot[Index].Item = NULL;
+    }
+}
+
+// Returns FALSE if the queue is full
+static FORCEINLINE BOOLEAN
+MpscPush(
+    IN  PXENIFACE_MPSC      Queue,
+    IN  PVOID               Item
+    )
+{
+    PXENIFACE_MPSC_SLOT     Slot;
+    ULONG                   Position;
+    ULONG                   Old;
+    LONG                    Difference;
+
+    Position = (ULONG)Queue->Tail;
+    for (;;) {
+        Slot = &Queue->Slot[Position & Queue->Mask];
+        Difference = (LONG)(Slot->Sequence - Position);
+
+        if (Difference == 0) {
+            Old = (ULONG)InterlockedCompareExchange(&Queue->Tail,
+                                                    (LONG)(Position + 1),
+                                                    (LONG)Position);
+            if (Old == Position)
+                break;
+
+            Position = Old;
+        } else if (Difference < 0) {
+            // The consumer has not yet emptied this slot
+            return FALSE;
+        } else {
+            Position = (ULONG)Queue->Tail;
+        }
+    }
+
+    Slot->Item = Item;
+    KeMemoryBarrier();
+    Slot->Sequence = Position + 1;
+
+    return TRUE;
+}
+
+// Returns NULL if the queue is empty, or if the producer of the next
+// item has claimed its slot but not yet published it
+static FORCEINLINE PVOID
+MpscPop(
+    IN  PXENIFACE_MPSC      Queue
+    )
+{
+    PXENIFACE_MPSC_SLOT     Slot;
+    PVOID                   Item;
+
+    Slot = &Queue->Slot[Queue->Head & Queue->Mask];
+    if ((LONG)(Slot->Sequence - (Queue->Head + 1)) < 0)
+        return NULL;
+
+    KeMemoryBarrier();
+    Item = Slot->Item;
+    KeMemoryBarrier();
+
+    Slot->Sequence = Queue->Head + Queue->Mask + 1;
+    Queue->Head++;
+
+    return Item;
+}
+
+static FORCEINLINE BOOLEAN
+MpscIsEmpty(
+    IN  PXENIFACE_MPSC      Queue
+    )
+{
+    PXENIFACE_MPSC_SLOT     Slot;
+
+    Slot = &Queue->Slot[Queue->Head & Queue->Mask];
+    return ((LONG)(Slot->Sequence - (Queue->Head + 1)) < 0) ? TRUE : FALSE;
+}
+
+#endif  // _XENIFACE_MPSC_H
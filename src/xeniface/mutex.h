@@ -35,20 +35,30 @@
 #include <ntddk.h>
 
 #include "assert.h"
+#include "contention.h"
+
+// Both lock types count acquisitions, contention, wait time and hold
+// time per XENIFACE_LOCK_CLASS. An uncontended acquisition costs a
+// successful try-acquire and a counter increment; timestamps are taken
+// only when the lock is contended, and for a sample of the rest.
 
 typedef struct _XENIFACE_MUTEX {
-    PKTHREAD        Owner;
-    KEVENT          Event;
+    PKTHREAD            Owner;
+    KEVENT              Event;
+    XENIFACE_LOCK_CLASS Class;
+    ULONGLONG           Acquired;
 } XENIFACE_MUTEX, *PXENIFACE_MUTEX;
 
 static FORCEINLINE VOID
 InitializeMutex(
-    IN  PXENIFACE_MUTEX   Mutex
+    IN  PXENIFACE_MUTEX     Mutex,
+    IN  XENIFACE_LOCK_CLASS Class
     )
 {
     RtlZeroMemory(Mutex, sizeof (XENIFACE_MUTEX));
 
     KeInitializeEvent(&Mutex->Event, SynchronizationEvent, TRUE);
+    Mutex->Class = Class;
 }
 
 static FORCEINLINE VOID
@@ -57,14 +67,30 @@ AcquireMutex(
     IN  PXENIFACE_MUTEX   Mutex
     )
 {
-    (VOID) KeWaitForSingleObject(&Mutex->Event,
-                                 Executive,
-                                 KernelMode,
-                                 FALSE,
-                                 NULL);
+    LARGE_INTEGER   Timeout;
+    ULONGLONG       WaitStart;
+    NTSTATUS        status;
+
+    Timeout.QuadPart = 0;
+    WaitStart = 0;
+
+    status = KeWaitForSingleObject(&Mutex->Event,
+                                   Executive,
+                                   KernelMode,
+                                   FALSE,
+                                   &Timeout);
+    if (status == STATUS_TIMEOUT) {
+        WaitStart = ContentionWaitStart();
+        (VOID) KeWaitForSingleObject(&Mutex->Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+    }
 
     ASSERT3P(Mutex->Owner, ==, NULL);
     Mutex->Owner = KeGetCurrentThread();
+    Mutex->Acquired = ContentionAcquired(Mutex->Class, WaitStart);
 }
 
 static FORCEINLINE VOID
@@ -76,7 +102,70 @@ ReleaseMutex(
     ASSERT3P(Mutex->Owner, ==, KeGetCurrentThread());
     Mutex->Owner = NULL;
 
+    ContentionReleased(Mutex->Class, Mutex->Acquired);
+
     KeSetEvent(&Mutex->Event, IO_NO_INCREMENT, FALSE);
 }
 
+typedef struct _XENIFACE_FAST_MUTEX {
+    FAST_MUTEX          Mutex;
+    XENIFACE_LOCK_CLASS Class;
+    ULONGLONG           Acquired;
+} XENIFACE_FAST_MUTEX, *PXENIFACE_FAST_MUTEX;
+
+static FORCEINLINE VOID
+InitializeFastMutex(
+    IN  PXENIFACE_FAST_MUTEX    Mutex,
+    IN  XENIFACE_LOCK_CLASS     Class
+    )
+{
+    RtlZeroMemory(Mutex, sizeof (XENIFACE_FAST_MUTEX));
+
+    ExInitializeFastMutex(&Mutex->Mutex);
+    Mutex->Class = Class;
+}
+
+static FORCEINLINE VOID
+__drv_maxIRQL(APC_LEVEL)
+__drv_raisesIRQL(APC_LEVEL)
+AcquireFastMutex(
+    IN  PXENIFACE_FAST_MUTEX    Mutex
+    )
+{
+    ULONGLONG                   WaitStart;
+
+    WaitStart = 0;
+    if (!ExTryToAcquireFastMutex(&Mutex->Mutex)) {
+        WaitStart = ContentionWaitStart();
+        ExAcquireFastMutex(&Mutex->Mutex);
+    }
+
+    Mutex->Acquired = ContentionAcquired(Mutex->Class, WaitStart);
+}
+
+// Returns FALSE, without waiting, if the mutex is held
+static FORCEINLINE BOOLEAN
+__drv_maxIRQL(APC_LEVEL)
+TryAcquireFastMutex(
+    IN  PXENIFACE_FAST_MUTEX    Mutex
+    )
+{
+    if (!ExTryToAcquireFastMutex(&Mutex->Mutex))
+        return FALSE;
+
+    Mutex->Acquired = ContentionAcquired(Mutex->Class, 0);
+    return TRUE;
+}
+
+static FORCEINLINE VOID
+__drv_requiresIRQL(APC_LEVEL)
+ReleaseFastMutex(
+    IN  PXENIFACE_FAST_MUTEX    Mutex
+    )
+{
+    ContentionReleased(Mutex->Class, Mutex->Acquired);
+
+    ExReleaseFastMutex(&Mutex->Mutex);
+}
+
 #endif  // _XENIFACE_MUTEX_H
@@ -0,0 +1,451 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <intrin.h>
+#include <util.h>
+
+#include "driver.h"
+#include "pool.h"
+#include "log.h"
+#include "assert.h"
+
+#define POOL_POOL   'LOPX'
+
+// Prefixed to each allocation. The processor that made the allocation
+// is recorded so the free can be counted against the same block.
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _XENIFACE_POOL_HEADER {
+    LIST_ENTRY  ListEntry;
+    PVOID       Caller;
+    USHORT      Class;
+    USHORT      Cpu;
+    ULONG       Length;
+} XENIFACE_POOL_HEADER, *PXENIFACE_POOL_HEADER;
+
+C_ASSERT(sizeof (XENIFACE_POOL_HEADER) % MEMORY_ALLOCATION_ALIGNMENT == 0);
+
+// Each processor has its own block, padded so blocks do not share a
+// line. Bytes and Objects can go negative on one processor when a
+// charged buffer is uncharged elsewhere; only the sums are meaningful.
+typedef struct _XENIFACE_POOL_CPU {
+    LONGLONG    Allocations[XENIFACE_POOL_CLASSES];
+    LONGLONG    Objects[XENIFACE_POOL_CLASSES];
+    LONGLONG    Bytes[XENIFACE_POOL_CLASSES];
+    LONGLONG    PeakBytes[XENIFACE_POOL_CLASSES];
+    UCHAR       Pad[64 - ((4 * XENIFACE_POOL_CLASSES * sizeof (LONGLONG)) % 64)];
+} XENIFACE_POOL_CPU, *PXENIFACE_POOL_CPU;
+
+C_ASSERT(sizeof (XENIFACE_POOL_CPU) % 64 == 0);
+
+typedef struct _XENIFACE_POOL {
+    PXENIFACE_POOL_CPU  Cpu;
+    ULONG               Cpus;
+    LONGLONG            HighWaterBytes[XENIFACE_POOL_CLASSES];
+    BOOLEAN             Track;
+    KSPIN_LOCK          Lock;
+    LIST_ENTRY          List;
+    ULONG               Outstanding;
+} XENIFACE_POOL, *PXENIFACE_POOL;
+
+static XENIFACE_POOL    PoolContext;
+
+static const ULONG  PoolTags[XENIFACE_POOL_CLASSES] = {
+    'XenP',
+    'XIEV',
+    'ODF'
+};
+
+ULONG
+PoolTag(
+    IN  XENIFACE_POOL_CLASS Class
+    )
+{
+    ASSERT3U(Class, <, XENIFACE_POOL_CLASSES);
+    return PoolTags[Class];
+}
+
+static FORCEINLINE VOID
+__PoolMaximum(
+    IN  PLONGLONG   Maximum,
+    IN  LONGLONG    Value
+    )
+{
+    LONGLONG        Old;
+
+    do {
+        Old = *Maximum;
+        if (Old >= Value)
+            break;
+    } while (InterlockedCompareExchange64(Maximum, Value, Old) != Old);
+}
+
+static LONGLONG
+__PoolLiveBytes(
+    IN  XENIFACE_POOL_CLASS Class
+    )
+{
+    LONGLONG                Bytes;
+    ULONG                   Index;
+
+    Bytes = 0;
+    for (Index = 0; Index < PoolContext.Cpus; Index++)
+        Bytes += PoolContext.Cpu[Index].Bytes[Class];
+
+    return Bytes;
+}
+
+static VOID
+__PoolCount(
+    IN  XENIFACE_POOL_CLASS Class,
+    IN  ULONG               Index,
+    IN  LONG                Objects,
+    IN  LONGLONG            Length
+    )
+{
+    PXENIFACE_POOL_CPU      Cpu = &PoolContext.Cpu[Index];
+    LONGLONG                Bytes;
+
+    if (Objects > 0)
+        (VOID) InterlockedIncrement64(&Cpu->Allocations[Class]);
+
+    (VOID) InterlockedAdd64(&Cpu->Objects[Class], Objects);
+    Bytes = InterlockedAdd64(&Cpu->Bytes[Class], Length);
+
+    // Summing every block on each allocation would defeat the point of
+    // keeping them, so the global high water is only sampled when this
+    // processor passes its own previous peak. It can therefore miss a
+    // peak made up of allocations spread over several processors.
+    if (Objects > 0 && Bytes > Cpu->PeakBytes[Class]) {
+        __PoolMaximum(&Cpu->PeakBytes[Class], Bytes);
+        __PoolMaximum(&PoolContext.HighWaterBytes[Class], __PoolLiveBytes(Class));
+    }
+}
+
+static FORCEINLINE ULONG
+__PoolCpu(
+    VOID
+    )
+{
+    return KeGetCurrentProcessorNumber() % PoolContext.Cpus;
+}
+
+#pragma intrinsic(_ReturnAddress)
+
+PVOID
+PoolAllocate(
+    IN  XENIFACE_POOL_CLASS Class,
+    IN  ULONG               Length
+    )
+{
+    PXENIFACE_POOL_HEADER   Header;
+    KIRQL                   Irql;
+
+    ASSERT3U(Class, <, XENIFACE_POOL_CLASSES);
+
+    if (Length > MAXULONG - sizeof (XENIFACE_POOL_HEADER))
+        return NULL;
+
+    Header = ExAllocatePoolWithTag(NonPagedPool,
+                                   sizeof (XENIFACE_POOL_HEADER) + Length,
+                                   PoolTags[Class]);
+    if (Header == NULL)
+        return NULL;
+
+    Header->Caller = _ReturnAddress();
+    Header->Class = (USHORT)Class;
+    Header->Length = Length;
+    Header->Cpu = 0;
+    InitializeListHead(&Header->ListEntry);
+
+    if (PoolContext.Cpu != NULL) {
+        Header->Cpu = (USHORT)__PoolCpu();
+        __PoolCount(Class, Header->Cpu, 1, Length);
+    }
+
+    if (PoolContext.Track) {
+        KeAcquireSpinLock(&PoolContext.Lock, &Irql);
+        InsertTailList(&PoolContext.List, &Header->ListEntry);
+        PoolContext.Outstanding++;
+        KeReleaseSpinLock(&PoolContext.Lock, Irql);
+    }
+
+    return Header + 1;
+}
+
+VOID
+PoolFree(
+    IN  PVOID               Buffer
+    )
+{
+    PXENIFACE_POOL_HEADER   Header;
+    KIRQL                   Irql;
+
+    Header = (PXENIFACE_POOL_HEADER)Buffer - 1;
+    ASSERT3U(Header->Class, <, XENIFACE_POOL_CLASSES);
+
+    if (PoolContext.Track) {
+        KeAcquireSpinLock(&PoolContext.Lock, &Irql);
+        RemoveEntryList(&Header->ListEntry);
+        --PoolContext.Outstanding;
+        KeReleaseSpinLock(&PoolContext.Lock, Irql);
+    }
+
+    if (PoolContext.Cpu != NULL)
+        __PoolCount(Header->Class, Header->Cpu, -1, -(LONGLONG)Header->Length);
+
+    ExFreePoolWithTag(Header, PoolTags[Header->Class]);
+}
+
+VOID
+PoolCharge(
+    IN  XENIFACE_POOL_CLASS Class,
+    IN  ULONG               Length
+    )
+{
+    if (PoolContext.Cpu == NULL)
+        return;
+
+    __PoolCount(Class, __PoolCpu(), 1, Length);
+}
+
+VOID
+PoolUncharge(
+    IN  XENIFACE_POOL_CLASS Class,
+    IN  ULONG               Length
+    )
+{
+    if (PoolContext.Cpu == NULL)
+        return;
+
+    __PoolCount(Class, __PoolCpu(), -1, -(LONGLONG)Length);
+}
+
+VOID
+PoolQuery(
+    OUT PXENIFACE_POOL_STATISTICS   Statistics
+    )
+{
+    ULONG                           Index;
+    ULONG                           Class;
+
+    RtlZeroMemory(Statistics, sizeof (XENIFACE_POOL_STATISTICS));
+
+    Statistics->Classes = XENIFACE_POOL_CLASSES;
+    for (Class = 0; Class < XENIFACE_POOL_CLASSES; Class++)
+        Statistics->Tag[Class] = PoolTags[Class];
+
+    if (PoolContext.Cpu == NULL)
+        return;
+
+    for (Class = 0; Class < XENIFACE_POOL_CLASSES; Class++) {
+        LONGLONG    Objects = 0;
+        LONGLONG    Bytes = 0;
+
+        for (Index = 0; Index < PoolContext.Cpus; Index++) {
+            PXENIFACE_POOL_CPU  Cpu = &PoolContext.Cpu[Index];
+
+            Statistics->Allocations[Class] += Cpu->Allocations[Class];
+            Objects += Cpu->Objects[Class];
+            Bytes += Cpu->Bytes[Class];
+        }
+
+        // The blocks are read without stopping writers, so a free may be
+        // seen without its allocation
+        Statistics->LiveObjects[Class] = (ULONGLONG)max(Objects, 0);
+        Statistics->LiveBytes[Class] = (ULONGLONG)max(Bytes, 0);
+
+        __PoolMaximum(&PoolContext.HighWaterBytes[Class], Bytes);
+        Statistics->HighWaterBytes[Class] = PoolContext.HighWaterBytes[Class];
+    }
+}
+
+// Callers are reported relative to the driver image, so that the list
+// can be matched against the symbols without revealing where the image
+// was loaded
+static FORCEINLINE ULONGLONG
+__PoolCallerOffset(
+    IN  PVOID   Caller
+    )
+{
+    ULONG_PTR   Start = (ULONG_PTR)DriverObject->DriverStart;
+
+    if ((ULONG_PTR)Caller < Start ||
+        (ULONG_PTR)Caller >= Start + DriverObject->DriverSize)
+        return 0;
+
+    return (ULONGLONG)((ULONG_PTR)Caller - Start);
+}
+
+NTSTATUS
+PoolOutstanding(
+    OUT PVOID                   Buffer,
+    IN  ULONG                   Length,
+    OUT PULONG                  Required
+    )
+{
+    PXENIFACE_POOL_ALLOCATION   Allocation;
+    PLIST_ENTRY                 ListEntry;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    *Required = 0;
+
+    if (!PoolContext.Track)
+        return STATUS_NOT_SUPPORTED;
+
+    KeAcquireSpinLock(&PoolContext.Lock, &Irql);
+
+    *Required = PoolContext.Outstanding * sizeof (XENIFACE_POOL_ALLOCATION);
+
+    status = STATUS_BUFFER_OVERFLOW;
+    if (Length < *Required)
+        goto done;
+
+    Allocation = Buffer;
+    for (ListEntry = PoolContext.List.Flink;
+         ListEntry != &PoolContext.List;
+         ListEntry = ListEntry->Flink) {
+        PXENIFACE_POOL_HEADER   Header;
+
+        Header = CONTAINING_RECORD(ListEntry, XENIFACE_POOL_HEADER, ListEntry);
+
+        Allocation->Caller = __PoolCallerOffset(Header->Caller);
+        Allocation->Class = Header->Class;
+        Allocation->Length = Header->Length;
+        Allocation++;
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+    KeReleaseSpinLock(&PoolContext.Lock, Irql);
+
+    return status;
+}
+
+NTSTATUS
+PoolInitialize(
+    IN  BOOLEAN         Track
+    )
+{
+    PXENIFACE_POOL_CPU  Cpu;
+    ULONG               Cpus;
+    NTSTATUS            status;
+
+    ASSERT3P(PoolContext.Cpu, ==, NULL);
+
+    // Tracking does not depend on the counters, so set it up first
+    KeInitializeSpinLock(&PoolContext.Lock);
+    InitializeListHead(&PoolContext.List);
+    PoolContext.Track = Track;
+
+    if (Track)
+        Info("tracking outstanding allocations\n");
+
+    Cpus = KeQueryMaximumProcessorCount();
+
+    Cpu = __AllocateNonPagedPoolWithTag(sizeof (XENIFACE_POOL_CPU) * Cpus,
+                                        POOL_POOL);
+
+    status = STATUS_NO_MEMORY;
+    if (Cpu == NULL)
+        goto fail1;
+
+    PoolContext.Cpus = Cpus;
+
+    KeMemoryBarrier();
+    PoolContext.Cpu = Cpu;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+PoolTeardown(
+    VOID
+    )
+{
+    PXENIFACE_POOL_CPU  Cpu;
+    ULONG               Class;
+    KIRQL               Irql;
+
+    Cpu = PoolContext.Cpu;
+    if (Cpu != NULL) {
+        XENIFACE_POOL_STATISTICS    Statistics;
+
+        PoolQuery(&Statistics);
+
+        for (Class = 0; Class < XENIFACE_POOL_CLASSES; Class++) {
+            if (Statistics.LiveObjects[Class] != 0)
+                Warning("%c%c%c%c: %llu objects (%llu bytes) outstanding\n",
+                        PoolTags[Class] & 0xff,
+                        (PoolTags[Class] >> 8) & 0xff,
+                        (PoolTags[Class] >> 16) & 0xff,
+                        (PoolTags[Class] >> 24) & 0xff,
+                        Statistics.LiveObjects[Class],
+                        Statistics.LiveBytes[Class]);
+        }
+
+        PoolContext.Cpu = NULL;
+        KeMemoryBarrier();
+
+        __FreePoolWithTag(Cpu, POOL_POOL);
+    }
+
+    if (PoolContext.Track) {
+        KeAcquireSpinLock(&PoolContext.Lock, &Irql);
+
+        // Leave each leaked header self-linked, so a late free does not
+        // touch the list
+        while (!IsListEmpty(&PoolContext.List)) {
+            PLIST_ENTRY             ListEntry;
+            PXENIFACE_POOL_HEADER   Header;
+
+            ListEntry = RemoveHeadList(&PoolContext.List);
+            InitializeListHead(ListEntry);
+
+            Header = CONTAINING_RECORD(ListEntry, XENIFACE_POOL_HEADER, ListEntry);
+            Error("leaked %p: class %u length %u caller %p\n",
+                  Header + 1,
+                  Header->Class,
+                  Header->Length,
+                  Header->Caller);
+        }
+
+        KeReleaseSpinLock(&PoolContext.Lock, Irql);
+    }
+
+    RtlZeroMemory(&PoolContext, sizeof (XENIFACE_POOL));
+}
@@ -0,0 +1,94 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_POOL_H
+#define _XENIFACE_POOL_H
+
+#include <ntddk.h>
+
+#include "xeniface_ioctls.h"
+
+// With Track set, every live allocation is listed along with its
+// caller, at the cost of a global lock on each allocation and free.
+extern NTSTATUS
+PoolInitialize(
+    IN  BOOLEAN             Track
+    );
+
+extern VOID
+PoolTeardown(
+    VOID
+    );
+
+// The buffer is not zeroed and must be released with PoolFree
+extern PVOID
+PoolAllocate(
+    IN  XENIFACE_POOL_CLASS Class,
+    IN  ULONG               Length
+    );
+
+extern VOID
+PoolFree(
+    IN  PVOID               Buffer
+    );
+
+// For buffers whose ownership passes out of the driver (WMI events,
+// which WMI frees): count them from allocation to hand-over.
+extern VOID
+PoolCharge(
+    IN  XENIFACE_POOL_CLASS Class,
+    IN  ULONG               Length
+    );
+
+extern VOID
+PoolUncharge(
+    IN  XENIFACE_POOL_CLASS Class,
+    IN  ULONG               Length
+    );
+
+extern ULONG
+PoolTag(
+    IN  XENIFACE_POOL_CLASS Class
+    );
+
+extern VOID
+PoolQuery(
+    OUT PXENIFACE_POOL_STATISTICS   Statistics
+    );
+
+extern NTSTATUS
+PoolOutstanding(
+    OUT PVOID               Buffer,
+    IN  ULONG               Length,
+    OUT PULONG              Required
+    );
+
+#endif  // _XENIFACE_POOL_H
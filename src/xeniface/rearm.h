@@ -0,0 +1,105 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_REARM_H
+#define _XENIFACE_REARM_H
+
+// Work shared out from a fixed array: the watches to re-arm after a
+// resume. The resuming thread and its helpers claim entries one at a
+// time, so the work spreads evenly however long each entry takes.
+// Helpers count themselves in and out, so the resuming thread, once it
+// finds the array empty, need only wait for helpers part way through an
+// entry.
+//
+// Only InterlockedIncrement and InterlockedDecrement are used, so this
+// header builds unchanged in a user mode harness that supplies them.
+
+typedef VOID (*XENIFACE_REARM_FUNCTION)(PVOID, PVOID);
+
+typedef struct _XENIFACE_REARM {
+    XENIFACE_REARM_FUNCTION Function;
+    PVOID                   Context;
+    PVOID                   *Items;
+    LONG                    Count;
+    volatile LONG           Next;
+    volatile LONG           Busy;
+} XENIFACE_REARM, *PXENIFACE_REARM;
+
+static FORCEINLINE VOID
+RearmInitialize(
+    IN  PXENIFACE_REARM         Rearm,
+    IN  XENIFACE_REARM_FUNCTION Function,
+    IN  PVOID                   Context,
+    IN  PVOID                   *Items,
+    IN  LONG                    Count
+    )
+{
+    Rearm->Function = Function;
+    Rearm->Context = Context;
+    Rearm->Items = Items;
+    Rearm->Count = Count;
+    Rearm->Next = 0;
+    Rearm->Busy = 0;
+}
+
+// Calls Function for each entry not yet claimed
+static FORCEINLINE VOID
+RearmDrain(
+    IN  PXENIFACE_REARM Rearm
+    )
+{
+    LONG                Index;
+
+    while ((Index = InterlockedIncrement(&Rearm->Next) - 1) < Rearm->Count)
+        Rearm->Function(Rearm->Context, Rearm->Items[Index]);
+}
+
+// For a helper. Returns TRUE if no other helper is still busy, in which
+// case the caller should wake the resuming thread.
+static FORCEINLINE BOOLEAN
+RearmHelp(
+    IN  PXENIFACE_REARM Rearm
+    )
+{
+    InterlockedIncrement(&Rearm->Busy);
+    RearmDrain(Rearm);
+    return (InterlockedDecrement(&Rearm->Busy) == 0) ? TRUE : FALSE;
+}
+
+static FORCEINLINE BOOLEAN
+RearmIsBusy(
+    IN  PXENIFACE_REARM Rearm
+    )
+{
+    return (Rearm->Busy != 0) ? TRUE : FALSE;
+}
+
+#endif  // _XENIFACE_REARM_H
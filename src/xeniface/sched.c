@@ -0,0 +1,279 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <util.h>
+
+#include "sched.h"
+#include "log.h"
+#include "assert.h"
+
+#define SCHED_POOL  'DHCS'
+
+struct _XENIFACE_SCHED {
+    KSPIN_LOCK  Lock;
+    ULONG       Slots;
+    ULONG       Busy;
+    LIST_ENTRY  Ready;      // clients with callers waiting, in turn order
+    ULONGLONG   Interval;   // between tokens, in 100ns units; 0 for no limit
+    ULONGLONG   Tolerance;  // how far ahead of its rate a client may run
+};
+
+// The bucket is kept as the time the next call is due at the client's
+// rate (the generic cell rate algorithm): a call may go ahead as long as
+// that is no more than Tolerance in the future.
+struct _XENIFACE_SCHED_CLIENT {
+    PXENIFACE_SCHED Sched;
+    LONG            References;
+    LIST_ENTRY      ListEntry;  // on Ready while there are Waiters
+    LIST_ENTRY      Waiters;
+    ULONGLONG       Due;
+    ULONG           Throttled;
+    ULONG           Queued;
+};
+
+typedef struct _SCHED_WAITER {
+    LIST_ENTRY  ListEntry;
+    KEVENT      Event;
+} SCHED_WAITER, *PSCHED_WAITER;
+
+static FORCEINLINE PVOID
+__SchedAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocateNonPagedPoolWithTag(Length, SCHED_POOL);
+}
+
+static FORCEINLINE VOID
+__SchedFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, SCHED_POOL);
+}
+
+NTSTATUS
+SchedCreate(
+    IN  ULONG               Slots,
+    IN  ULONG               Rate,
+    IN  ULONG               Burst,
+    OUT PXENIFACE_SCHED     *Sched
+    )
+{
+    NTSTATUS                status;
+
+    ASSERT3U(Slots, !=, 0);
+
+    *Sched = __SchedAllocate(sizeof (XENIFACE_SCHED));
+
+    status = STATUS_NO_MEMORY;
+    if (*Sched == NULL)
+        goto fail1;
+
+    KeInitializeSpinLock(&(*Sched)->Lock);
+    InitializeListHead(&(*Sched)->Ready);
+    (*Sched)->Slots = Slots;
+
+    if (Rate != 0) {
+        (*Sched)->Interval = 10000000ull / Rate;
+        (*Sched)->Tolerance = (ULONGLONG)((Burst != 0) ? Burst - 1 : 0) *
+                              (*Sched)->Interval;
+    }
+
+    Info("%u slots, %u calls/s (burst %u)\n", Slots, Rate, Burst);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+SchedDestroy(
+    IN  PXENIFACE_SCHED     Sched
+    )
+{
+    ASSERT3U(Sched->Busy, ==, 0);
+    ASSERT(IsListEmpty(&Sched->Ready));
+
+    __SchedFree(Sched);
+}
+
+NTSTATUS
+SchedClientCreate(
+    IN  PXENIFACE_SCHED         Sched,
+    OUT PXENIFACE_SCHED_CLIENT  *Client
+    )
+{
+    *Client = __SchedAllocate(sizeof (XENIFACE_SCHED_CLIENT));
+    if (*Client == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Client)->Sched = Sched;
+    (*Client)->References = 1;
+    InitializeListHead(&(*Client)->ListEntry);
+    InitializeListHead(&(*Client)->Waiters);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+SchedClientReference(
+    IN  PXENIFACE_SCHED_CLIENT  Client
+    )
+{
+    ASSERT3S(Client->References, >, 0);
+    (VOID) InterlockedIncrement(&Client->References);
+}
+
+VOID
+SchedClientRelease(
+    IN  PXENIFACE_SCHED_CLIENT  Client
+    )
+{
+    if (InterlockedDecrement(&Client->References) != 0)
+        return;
+
+    ASSERT(IsListEmpty(&Client->Waiters));
+    __SchedFree(Client);
+}
+
+VOID
+SchedEnter(
+    IN  PXENIFACE_SCHED_CLIENT  Client
+    )
+{
+    PXENIFACE_SCHED             Sched = Client->Sched;
+    SCHED_WAITER                Waiter;
+    ULONGLONG                   Now;
+    LARGE_INTEGER               Delay;
+    KIRQL                       Irql;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    Delay.QuadPart = 0;
+
+    KeAcquireSpinLock(&Sched->Lock, &Irql);
+
+    if (Sched->Interval != 0) {
+        Now = KeQueryInterruptTime();
+        if (Client->Due < Now)
+            Client->Due = Now;
+
+        if (Client->Due - Now > Sched->Tolerance) {
+            Delay.QuadPart = -(LONGLONG)(Client->Due - Now - Sched->Tolerance);
+            Client->Throttled++;
+        }
+
+        Client->Due += Sched->Interval;
+    }
+
+    KeReleaseSpinLock(&Sched->Lock, Irql);
+
+    if (Delay.QuadPart != 0)
+        (VOID) KeDelayExecutionThread(KernelMode, FALSE, &Delay);
+
+    KeAcquireSpinLock(&Sched->Lock, &Irql);
+
+    // Callers already waiting go first, even if a slot is free now
+    if (Sched->Busy < Sched->Slots && IsListEmpty(&Sched->Ready)) {
+        Sched->Busy++;
+        KeReleaseSpinLock(&Sched->Lock, Irql);
+        return;
+    }
+
+    KeInitializeEvent(&Waiter.Event, NotificationEvent, FALSE);
+    InsertTailList(&Client->Waiters, &Waiter.ListEntry);
+    if (IsListEmpty(&Client->ListEntry))
+        InsertTailList(&Sched->Ready, &Client->ListEntry);
+    Client->Queued++;
+
+    KeReleaseSpinLock(&Sched->Lock, Irql);
+
+    // SchedLeave hands its slot straight over
+    (VOID) KeWaitForSingleObject(&Waiter.Event,
+                                 Executive,
+                                 KernelMode,
+                                 FALSE,
+                                 NULL);
+}
+
+VOID
+SchedLeave(
+    IN  PXENIFACE_SCHED_CLIENT  Client
+    )
+{
+    PXENIFACE_SCHED             Sched = Client->Sched;
+    PXENIFACE_SCHED_CLIENT      Next;
+    PSCHED_WAITER               Waiter;
+    KIRQL                       Irql;
+
+    KeAcquireSpinLock(&Sched->Lock, &Irql);
+
+    if (IsListEmpty(&Sched->Ready)) {
+        ASSERT3U(Sched->Busy, !=, 0);
+        Sched->Busy--;
+        KeReleaseSpinLock(&Sched->Lock, Irql);
+        return;
+    }
+
+    Next = CONTAINING_RECORD(RemoveHeadList(&Sched->Ready),
+                             XENIFACE_SCHED_CLIENT,
+                             ListEntry);
+    InitializeListHead(&Next->ListEntry);
+
+    Waiter = CONTAINING_RECORD(RemoveHeadList(&Next->Waiters),
+                               SCHED_WAITER,
+                               ListEntry);
+
+    // A client with more callers waiting goes behind every other client
+    if (!IsListEmpty(&Next->Waiters))
+        InsertTailList(&Sched->Ready, &Next->ListEntry);
+
+    // The waiter's stack may go as soon as the event is set
+    KeSetEvent(&Waiter->Event, IO_NO_INCREMENT, FALSE);
+
+    KeReleaseSpinLock(&Sched->Lock, Irql);
+}
+
+VOID
+SchedClientQuery(
+    IN  PXENIFACE_SCHED_CLIENT  Client,
+    OUT PULONG                  Throttled,
+    OUT PULONG                  Queued
+    )
+{
+    *Throttled = Client->Throttled;
+    *Queued = Client->Queued;
+}
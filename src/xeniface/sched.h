@@ -0,0 +1,100 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_SCHED_H
+#define _XENIFACE_SCHED_H
+
+#include <ntddk.h>
+
+// Admission of session method calls to the store. Each client (session)
+// has a token bucket limiting its rate of calls, and calls that find all
+// the scheduler's slots busy are queued per client and admitted from
+// the clients in turn, so a client with many callers gets no more turns
+// than one with a single caller.
+
+typedef struct _XENIFACE_SCHED XENIFACE_SCHED, *PXENIFACE_SCHED;
+typedef struct _XENIFACE_SCHED_CLIENT XENIFACE_SCHED_CLIENT, *PXENIFACE_SCHED_CLIENT;
+
+// A Rate of zero means no limit. Burst is the number of calls that can
+// be made at once after the client has been idle.
+extern NTSTATUS
+SchedCreate(
+    IN  ULONG                   Slots,
+    IN  ULONG                   Rate,
+    IN  ULONG                   Burst,
+    OUT PXENIFACE_SCHED         *Sched
+    );
+
+extern VOID
+SchedDestroy(
+    IN  PXENIFACE_SCHED         Sched
+    );
+
+// Clients are reference counted, so that a caller waiting for a turn
+// keeps its client alive if the session goes away meanwhile
+extern NTSTATUS
+SchedClientCreate(
+    IN  PXENIFACE_SCHED         Sched,
+    OUT PXENIFACE_SCHED_CLIENT  *Client
+    );
+
+extern VOID
+SchedClientReference(
+    IN  PXENIFACE_SCHED_CLIENT  Client
+    );
+
+extern VOID
+SchedClientRelease(
+    IN  PXENIFACE_SCHED_CLIENT  Client
+    );
+
+// Waits, at PASSIVE_LEVEL, until the client's bucket has a token and a
+// slot is free. Every SchedEnter must be followed by a SchedLeave.
+extern VOID
+SchedEnter(
+    IN  PXENIFACE_SCHED_CLIENT  Client
+    );
+
+extern VOID
+SchedLeave(
+    IN  PXENIFACE_SCHED_CLIENT  Client
+    );
+
+// Calls delayed by the token bucket, and calls that had to wait for a
+// slot
+extern VOID
+SchedClientQuery(
+    IN  PXENIFACE_SCHED_CLIENT  Client,
+    OUT PULONG                  Throttled,
+    OUT PULONG                  Queued
+    );
+
+#endif  // _XENIFACE_SCHED_H
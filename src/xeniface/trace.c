@@ -0,0 +1,279 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <util.h>
+
+#include "driver.h"
+#include "trace.h"
+#include "log.h"
+#include "assert.h"
+
+#define TRACE_POOL 'CRTX'
+
+// Records kept for each processor; must be a power of two.
+#define TRACE_RECORDS_PER_CPU   1024
+
+C_ASSERT((TRACE_RECORDS_PER_CPU & (TRACE_RECORDS_PER_CPU - 1)) == 0);
+C_ASSERT(sizeof (XENIFACE_TRACE_RECORD) == 64);
+
+// Write cursors are kept apart from the records, one cache line each,
+// so that the record buffer is exactly the dump layout and processors
+// do not share a line.
+typedef struct _XENIFACE_TRACE_CURSOR {
+    LONG    Next;
+    UCHAR   Pad[60];
+} XENIFACE_TRACE_CURSOR, *PXENIFACE_TRACE_CURSOR;
+
+typedef struct _XENIFACE_TRACE {
+    PXENIFACE_TRACE_HEADER          Header;
+    PXENIFACE_TRACE_RECORD          Records;
+    ULONG                           Length;
+    ULONG                           Cpus;
+    PXENIFACE_TRACE_CURSOR          Cursor;
+    KBUGCHECK_REASON_CALLBACK_RECORD    BugCheck;
+    BOOLEAN                         BugCheckRegistered;
+} XENIFACE_TRACE, *PXENIFACE_TRACE;
+
+static XENIFACE_TRACE   TraceContext;
+
+// {A3B9F0C2-61D4-4E8A-9C3E-5B7D12E4F086}
+static const GUID   TraceDumpGuid =
+    { 0xa3b9f0c2, 0x61d4, 0x4e8a, { 0x9c, 0x3e, 0x5b, 0x7d, 0x12, 0xe4, 0xf0, 0x86 } };
+
+VOID
+TraceRecord(
+    IN  XENIFACE_TRACE_EVENT    Event,
+    IN  PCHAR                   Text OPTIONAL,
+    IN  ULONGLONG               Argument0,
+    IN  ULONGLONG               Argument1,
+    IN  ULONGLONG               Argument2
+    )
+{
+    PXENIFACE_TRACE_RECORD      Record;
+    ULONG                       Cpu;
+    ULONG                       Sequence;
+
+    if (TraceContext.Header == NULL)
+        return;
+
+    Cpu = KeGetCurrentProcessorNumber() % TraceContext.Cpus;
+
+    // Claiming a slot is the only shared write, so an interrupted writer
+    // on the same processor simply takes the next one
+    Sequence = (ULONG)InterlockedIncrement(&TraceContext.Cursor[Cpu].Next);
+    if (Sequence == 0)
+        Sequence = (ULONG)InterlockedIncrement(&TraceContext.Cursor[Cpu].Next);
+
+    Record = &TraceContext.Records[(Cpu * TRACE_RECORDS_PER_CPU) +
+                            ((Sequence - 1) & (TRACE_RECORDS_PER_CPU - 1))];
+
+    Record->Sequence = 0;
+    KeMemoryBarrier();
+
+    Record->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+    Record->Event = (USHORT)Event;
+    Record->Cpu = (USHORT)Cpu;
+    Record->Argument[0] = Argument0;
+    Record->Argument[1] = Argument1;
+    Record->Argument[2] = Argument2;
+
+    RtlZeroMemory(Record->Text, sizeof (Record->Text));
+    if (Text != NULL) {
+        size_t  Length = strlen(Text);
+
+        // The tail of a path is the informative part
+        if (Length > sizeof (Record->Text)) {
+            Text += Length - sizeof (Record->Text);
+            Length = sizeof (Record->Text);
+        }
+
+        RtlCopyMemory(Record->Text, Text, Length);
+    }
+
+    KeMemoryBarrier();
+    Record->Sequence = Sequence;
+}
+
+NTSTATUS
+TraceDump(
+    OUT PVOID   Buffer,
+    IN  ULONG   Length,
+    OUT PULONG  Required
+    )
+{
+    PXENIFACE_TRACE_RECORD  Record;
+    ULONG                   Index;
+
+    *Required = TraceContext.Length;
+
+    if (TraceContext.Header == NULL)
+        return STATUS_DEVICE_NOT_READY;
+
+    if (Length < TraceContext.Length)
+        return STATUS_BUFFER_OVERFLOW;
+
+    RtlCopyMemory(Buffer, TraceContext.Header, TraceContext.Length);
+
+    // Writers are not stopped while copying, so discard any record that
+    // changed underneath the copy
+    Record = (PXENIFACE_TRACE_RECORD)((PUCHAR)Buffer + sizeof (XENIFACE_TRACE_HEADER));
+    for (Index = 0; Index < TraceContext.Cpus * TRACE_RECORDS_PER_CPU; Index++) {
+        KeMemoryBarrier();
+        if (Record[Index].Sequence != TraceContext.Records[Index].Sequence)
+            Record[Index].Sequence = 0;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+KBUGCHECK_REASON_CALLBACK_ROUTINE TraceBugCheckCallback;
+
+VOID
+TraceBugCheckCallback(
+    IN  KBUGCHECK_CALLBACK_REASON           Reason,
+    IN  PKBUGCHECK_REASON_CALLBACK_RECORD   Record,
+    IN OUT PVOID                            ReasonSpecificData,
+    IN  ULONG                               ReasonSpecificDataLength
+    )
+{
+    PKBUGCHECK_SECONDARY_DUMP_DATA          Data;
+
+    UNREFERENCED_PARAMETER(Record);
+
+    if (Reason != KbCallbackSecondaryDumpData)
+        return;
+
+    if (ReasonSpecificDataLength < sizeof (KBUGCHECK_SECONDARY_DUMP_DATA))
+        return;
+
+    Data = ReasonSpecificData;
+
+    // The records are already in nonpaged memory in dump layout, so hand
+    // them over as they are
+    if (Data->MaximumAllowed < TraceContext.Length)
+        return;
+
+    Data->Guid = TraceDumpGuid;
+    Data->OutBuffer = TraceContext.Header;
+    Data->OutBufferLength = TraceContext.Length;
+}
+
+NTSTATUS
+TraceInitialize(
+    VOID
+    )
+{
+    PXENIFACE_TRACE_HEADER  Header;
+    LARGE_INTEGER           Frequency;
+    ULONG                   Cpus;
+    ULONG                   Length;
+    NTSTATUS                status;
+
+    ASSERT3P(TraceContext.Header, ==, NULL);
+
+    Cpus = KeQueryMaximumProcessorCount();
+
+    TraceContext.Cursor = __AllocateNonPagedPoolWithTag(sizeof (XENIFACE_TRACE_CURSOR) * Cpus,
+                                                 TRACE_POOL);
+
+    status = STATUS_NO_MEMORY;
+    if (TraceContext.Cursor == NULL)
+        goto fail1;
+
+    Length = sizeof (XENIFACE_TRACE_HEADER) +
+             (sizeof (XENIFACE_TRACE_RECORD) * TRACE_RECORDS_PER_CPU * Cpus);
+
+    Header = __AllocateNonPagedPoolWithTag(Length, TRACE_POOL);
+    if (Header == NULL)
+        goto fail2;
+
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+
+    Header->Version = XENIFACE_TRACE_VERSION;
+    Header->Cpus = Cpus;
+    Header->RecordsPerCpu = TRACE_RECORDS_PER_CPU;
+    Header->RecordSize = sizeof (XENIFACE_TRACE_RECORD);
+    Header->Frequency = Frequency.QuadPart;
+
+    TraceContext.Records = (PXENIFACE_TRACE_RECORD)(Header + 1);
+    TraceContext.Length = Length;
+    TraceContext.Cpus = Cpus;
+
+    KeInitializeCallbackRecord(&TraceContext.BugCheck);
+    TraceContext.BugCheckRegistered = KeRegisterBugCheckReasonCallback(&TraceContext.BugCheck,
+                                                                TraceBugCheckCallback,
+                                                                KbCallbackSecondaryDumpData,
+                                                                (PUCHAR)"xeniface");
+    if (!TraceContext.BugCheckRegistered)
+        Warning("failed to register bugcheck callback\n");
+
+    KeMemoryBarrier();
+    TraceContext.Header = Header;
+
+    Info("%u processors, %u bytes\n", Cpus, Length);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    __FreePoolWithTag(TraceContext.Cursor, TRACE_POOL);
+    TraceContext.Cursor = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+TraceTeardown(
+    VOID
+    )
+{
+    PXENIFACE_TRACE_HEADER  Header;
+
+    Header = TraceContext.Header;
+    if (Header == NULL)
+        return;
+
+    TraceContext.Header = NULL;
+    KeMemoryBarrier();
+
+    if (TraceContext.BugCheckRegistered)
+        (VOID) KeDeregisterBugCheckReasonCallback(&TraceContext.BugCheck);
+
+    __FreePoolWithTag(Header, TRACE_POOL);
+    __FreePoolWithTag(TraceContext.Cursor, TRACE_POOL);
+
+    RtlZeroMemory(&TraceContext, sizeof (XENIFACE_TRACE));
+}
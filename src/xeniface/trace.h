@@ -0,0 +1,74 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_TRACE_H
+#define _XENIFACE_TRACE_H
+
+#include <ntddk.h>
+
+#include "xeniface_trace.h"
+
+extern NTSTATUS
+TraceInitialize(
+    VOID
+    );
+
+extern VOID
+TraceTeardown(
+    VOID
+    );
+
+extern VOID
+TraceRecord(
+    IN  XENIFACE_TRACE_EVENT    Event,
+    IN  PCHAR                   Text OPTIONAL,
+    IN  ULONGLONG               Argument0,
+    IN  ULONGLONG               Argument1,
+    IN  ULONGLONG               Argument2
+    );
+
+extern NTSTATUS
+TraceDump(
+    OUT PVOID   Buffer,
+    IN  ULONG   Length,
+    OUT PULONG  Required
+    );
+
+// Record a binary trace event. Nothing is formatted here; the record
+// is decoded in user mode using the format in xeniface_trace.h.
+#define TraceEvent(_Event, _Text, _Argument0, _Argument1, _Argument2)   \
+        TraceRecord(XENIFACE_TRACE_ ## _Event,                          \
+                    (_Text),                                            \
+                    (ULONGLONG)(ULONG_PTR)(_Argument0),                 \
+                    (ULONGLONG)(ULONG_PTR)(_Argument1),                 \
+                    (ULONGLONG)(ULONG_PTR)(_Argument2))
+
+#endif  // _XENIFACE_TRACE_H
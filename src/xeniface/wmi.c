@@ -44,6 +44,17 @@
 #include "..\..\include\store_interface.h"
 #include "..\..\include\suspend_interface.h"
 #include "log.h"
+#include "cache.h"
+#include "mirror.h"
+#include "filter.h"
+#include "trace.h"
+#include "latency.h"
+#include "contention.h"
+#include "pool.h"
+#include "thread.h"
+#include "work.h"
+#include "rearm.h"
+#include "sched.h"
 #include "xeniface_ioctls.h"
 
 __drv_raisesIRQL(APC_LEVEL)
@@ -51,8 +62,19 @@ __drv_savesIRQLGlobal(OldIrql, fdoData->SessionLock)
 void LockSessions(
         XENIFACE_FDO* fdoData)
 {
+    ULONGLONG start;
+
     ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
-    ExAcquireFastMutex(&fdoData->SessionLock);
+
+    // Only a wait is timed
+    if (TryAcquireFastMutex(&fdoData->SessionLock)) {
+        LatencyRecordImmediate(XENIFACE_LATENCY_SESSION_LOCK);
+        return;
+    }
+
+    start = LatencyStart();
+    AcquireFastMutex(&fdoData->SessionLock);
+    LatencyRecord(XENIFACE_LATENCY_SESSION_LOCK, start);
 }
 
 __drv_requiresIRQL(APC_LEVEL)
@@ -61,7 +83,7 @@ void UnlockSessions(
         XENIFACE_FDO* fdoData)
 {
     ASSERT(KeGetCurrentIrql() == APC_LEVEL);
-    ExReleaseFastMutex(&fdoData->SessionLock);
+    ReleaseFastMutex(&fdoData->SessionLock);
     
 }
 
@@ -259,30 +281,44 @@ USHORT CountBytesUtf16FromUtf8(const UCHAR *utf8) {
     }
     return bytecount * sizeof(WCHAR);
 }
-NTSTATUS GetUTF8String(UTF8_STRING** utf8, USHORT bufsize, LPWSTR ustring)
-{
-    USHORT bytecount = 0;
-    USHORT i;
+// Each UTF-16 unit can take up to three bytes of UTF-8, so the counts
+// are kept in a ULONG even though the input fits a USHORT
+ULONG CountBytesUtf8FromUtf16(const WCHAR *utf16, USHORT bufsize) {
+    ULONG bytecount = 0;
+    USHORT i = 0;
     ULONG utf32;
-    i = 0;
     while (i < (bufsize/sizeof(WCHAR))) {
-        i += Utf32FromUtf16(&utf32, &ustring[i]);
+        i += Utf32FromUtf16(&utf32, &utf16[i]);
         bytecount += CountUtf8FromUtf32(utf32);
     }
+    return bytecount;
+}
+ULONG Utf8FromUtf16(CHAR *dest, const WCHAR *utf16, USHORT bufsize) {
+    ULONG bytecount = 0;
+    USHORT i = 0;
+    ULONG utf32;
+    while (i < (bufsize/sizeof(WCHAR))) {
+        i += Utf32FromUtf16(&utf32, &utf16[i]);
+        bytecount += Utf8FromUtf32(&dest[bytecount], utf32);
+    }
+    return bytecount;
+}
+NTSTATUS GetUTF8String(UTF8_STRING** utf8, USHORT bufsize, LPWSTR ustring)
+{
+    ULONG bytecount;
+
+    bytecount = CountBytesUtf8FromUtf16(ustring, bufsize);
+    if (bytecount > MAXUSHORT)
+        return STATUS_INVALID_PARAMETER;
 
     *utf8 = ExAllocatePoolWithTag(NonPagedPool, sizeof(UTF8_STRING)+bytecount, 'XIU8');
     if ((*utf8) == NULL)
         return STATUS_INSUFFICIENT_RESOURCES;
 
-    (*utf8)->Length = bytecount;
+    (*utf8)->Length = (USHORT)bytecount;
     (*utf8)->Buffer[bytecount]=0;
     
-    bytecount = 0;
-    i=0;
-    while (i < bufsize/sizeof(WCHAR)) {
-        i += Utf32FromUtf16(&utf32, &ustring[i]);
-        bytecount += Utf8FromUtf32(&((*utf8)->Buffer[bytecount]), utf32);
-    }
+    Utf8FromUtf16((*utf8)->Buffer, ustring, bufsize);
 
     return STATUS_SUCCESS;
 }
@@ -666,6 +702,47 @@ WriteInstanceName(XENIFACE_FDO* FdoData, const char *string, UCHAR *location)
 
 #define MAX_WATCH_COUNT (MAXIMUM_WAIT_OBJECTS -1)
 
+// The longest absolute path the store accepts (XENSTORE_ABS_PATH_MAX)
+#define XENSTORE_PATH_MAX 3072
+
+// SetWatchEx flags
+#define WATCH_FLAG_VALUE    0x00000001  // fire CitrixXenStoreWatchValueEvent
+#define WATCH_FLAG_MASK     (WATCH_FLAG_VALUE)
+
+// Internal: the path is a pattern (see filter.h), set by SetFilteredWatch
+#define WATCH_FLAG_FILTER   0x80000000
+
+// AddSessionEx flags
+#define SESSION_FLAG_PERSISTENT 0x00000001  // never ended for being idle
+#define SESSION_FLAG_UNLIMITED  0x00000002  // method calls are not scheduled
+#define SESSION_FLAG_MASK       (SESSION_FLAG_PERSISTENT | SESSION_FLAG_UNLIMITED)
+
+// A session with no watches, no transaction, and no method calls or
+// events delivered for SessionTtl seconds (a REG_DWORD under the service
+// key, 0 to disable) was most likely left behind by a client that went
+// away, so it is ended. Sessions are
+// checked every SESSION_REAP_PERIOD seconds, or every TTL if shorter.
+#define SESSION_TTL_DEFAULT     3600
+#define SESSION_REAP_PERIOD     60
+
+// If SessionRate (a REG_DWORD under the service key) is set, each
+// session may make that many method calls a second, with bursts of up
+// to SessionBurst. Method calls are serialised by the session lock, so
+// a single slot leaves the scheduler to choose, in turn, which session
+// goes next. With no rate, which is the default, calls are not
+// scheduled at all.
+#define SESSION_RATE_DEFAULT    0
+#define SESSION_BURST_DEFAULT   100
+#define SESSION_SCHED_SLOTS     1
+
+// Values longer than this (in UTF-8 bytes) are not embedded in a value
+// event; the event is marked Truncated and the consumer must GetValue.
+#define WATCH_VALUE_LIMIT   1024
+
+// Watch events wait here for the session's emitter. Once this many are
+// pending, further events for new paths are dropped.
+#define SESSION_EVENT_DEPTH 256
+
 typedef struct _XenStoreSession {
     LIST_ENTRY listentry;
     LONG id;
@@ -677,25 +754,67 @@ typedef struct _XenStoreSession {
     KEVENT* watchevents[MAXIMUM_WAIT_OBJECTS];
     KWAIT_BLOCK watchwaitblockarray[MAXIMUM_WAIT_OBJECTS];
     KEVENT SessionChangedEvent;
-    FAST_MUTEX WatchMapLock;
+    XENIFACE_FAST_MUTEX WatchMapLock;
     BOOLEAN mapchanged;
     BOOLEAN closing;
     BOOLEAN suspended;
     PKTHREAD WatchThread;
+
+    ULONG flags;
+    // Interrupt time of the last method call or event delivered. The
+    // emitter updates it without the session lock, so it is only
+    // accessed through SessionTouch and SessionLastActive.
+    LONGLONG lastactive;
+    PXENIFACE_SCHED_CLIENT sched;
+
+    // Events are fired to WMI by the emitter, on the FDO's event queue,
+    // so that a slow consumer does not hold up watch processing
+    XENIFACE_FDO *fdoData;
+    KSPIN_LOCK eventlock;
+    LIST_ENTRY events;
+    ULONG eventcount;
+    LONG eventsmerged;
+    LONG eventsdropped;
+    XENIFACE_WORK_ITEM emitter;
 } XenStoreSession;
 
+// A pending event. The buffer is handed to WmiFireEvent as it is, and
+// starts with the counted path, which is what pending events are
+// merged on.
+typedef struct _XenStoreEvent {
+    LIST_ENTRY listentry;
+    LPCGUID guid;
+    ULONG size;
+    UCHAR *data;
+} XenStoreEvent;
+
+// A watch is a single allocation: the structure is followed by its
+// path, first as the caller's UTF-16 and then as NUL terminated UTF-8.
 typedef struct _XenStoreWatch {
     LIST_ENTRY listentry;
     UNICODE_STRING path;
+    PCHAR utf8path;
     XENIFACE_FDO *fdoData;
+    ULONG flags;
+    PXENIFACE_FILTER filter;
 
     ULONG   suspendcount;
     BOOLEAN finished;
     KEVENT watchevent;
     PXENBUS_STORE_WATCH watchhandle;
 
+    // Events are delivered from the FDO's work queue
+    XenStoreSession *session;
+    XENIFACE_WORK_ITEM work;
+    ULONGLONG signalled;
+
+    ULONG id;   // identifies the watch in trace records
 } XenStoreWatch;
 
+// Trace records name watches by sequence number, as they may be read by
+// less privileged code than should see kernel addresses
+static LONG WatchSequence;
+
 void UnicodeShallowCopy(UNICODE_STRING *dest, UNICODE_STRING *src) {
     dest->Buffer = src->Buffer;
     dest->Length = src->Length;
@@ -736,7 +855,7 @@ SessionFindWatchLocked(XenStoreSession *session,
     XenStoreWatch * watch;
     
     XenIfaceDebugPrint(TRACE,"Wait for session watch lock\n");
-    ExAcquireFastMutex(&session->WatchMapLock);
+    AcquireFastMutex(&session->WatchMapLock);
     XenIfaceDebugPrint(TRACE,"got session watch lock\n");
     watch = (XenStoreWatch *)session->watches.Flink;
 
@@ -754,7 +873,7 @@ SessionFindWatchLocked(XenStoreSession *session,
 
 void FireSuspendEvent(PXENIFACE_FDO fdoData) {
 	XenIfaceDebugPrint(ERROR,"Ready to unsuspend Event\n");
-	KeSetEvent(&fdoData->registryWriteEvent, IO_NO_INCREMENT, FALSE);
+	MirrorResume(fdoData->Mirror);
     if (fdoData->WmiReady) {
         XenIfaceDebugPrint(TRACE,"Fire Suspend Event\n");
         WmiFireEvent(fdoData->Dx->DeviceObject,
@@ -764,34 +883,252 @@ void FireSuspendEvent(PXENIFACE_FDO fdoData) {
                 NULL);
     }
 } 
-void FireWatch(XenStoreWatch* watch) {
+// Events name either the path the watch was set with (UTF-16, as the
+// caller gave it) or, for filtered watches, the UTF-8 path of the node
+// that matched.
+size_t GetCountedEventPathSize(UNICODE_STRING *path, const char *utf8path) {
+    if (path != NULL)
+        return GetCountedUnicodeStringSize(path);
+    return GetCountedUtf8Size(utf8path);
+}
+
+void WriteCountedEventPath(UNICODE_STRING *path, const char *utf8path, UCHAR *location) {
+    if (path != NULL)
+        WriteCountedUnicodeString(path, location);
+    else if (!NT_SUCCESS(WriteCountedUTF8String(utf8path, location)))
+        *(USHORT *)location = 0;
+}
+
+static BOOLEAN SameEventPath(UCHAR *a, UCHAR *b) {
+    USHORT length = *(USHORT *)a;
+
+    if (*(USHORT *)b != length)
+        return FALSE;
+    return (RtlCompareMemory(a + sizeof(USHORT), b + sizeof(USHORT), length) == length) ? TRUE : FALSE;
+}
+
+static FORCEINLINE VOID SessionTouch(XenStoreSession *session) {
+    (VOID) InterlockedExchange64(&session->lastactive, (LONGLONG)KeQueryInterruptTime());
+}
+
+static FORCEINLINE ULONGLONG SessionLastActive(XenStoreSession *session) {
+    return (ULONGLONG)InterlockedCompareExchange64(&session->lastactive, 0, 0);
+}
+
+static VOID FreeEventData(UCHAR *data, ULONG size) {
+    ExFreePoolWithTag(data, 'XIEV');
+    PoolUncharge(XENIFACE_POOL_EVENT, size);
+}
+
+// Runs on the FDO's event queue, with no session locks held
+static VOID SessionEmitEvents(PVOID Context) {
+    XenStoreSession *session = Context;
+    XenStoreEvent *event;
+    KIRQL irql;
+
+    for (;;) {
+        KeAcquireSpinLock(&session->eventlock, &irql);
+        if (IsListEmpty(&session->events)) {
+            KeReleaseSpinLock(&session->eventlock, irql);
+            break;
+        }
+        event = (XenStoreEvent *)RemoveHeadList(&session->events);
+        session->eventcount--;
+        KeReleaseSpinLock(&session->eventlock, irql);
+
+        // WMI frees the buffer, so it is counted only until handed over
+        WmiFireEvent(session->fdoData->Dx->DeviceObject,
+                        (LPGUID)event->guid,
+                        0,
+                        event->size,
+                        event->data);
+        PoolUncharge(XENIFACE_POOL_EVENT, event->size);
+        PoolFree(event);
+
+        // A session whose client is taking events is still in use
+        SessionTouch(session);
+    }
+}
+
+// Takes ownership of data. An event for a path that is still pending
+// replaces the earlier one in its place in the queue, so a consumer that
+// has fallen behind sees only the latest value of each path.
+static VOID SessionQueueEvent(XenStoreSession *session, LPCGUID guid, UCHAR *data, ULONG size) {
+    XenStoreEvent *event;
+    XenStoreEvent *pending;
+    KIRQL irql;
+
+    event = PoolAllocate(XENIFACE_POOL_SESSION, sizeof(XenStoreEvent));
+
+    KeAcquireSpinLock(&session->eventlock, &irql);
+    for (pending = (XenStoreEvent *)session->events.Flink;
+         pending != (XenStoreEvent *)&session->events;
+         pending = (XenStoreEvent *)pending->listentry.Flink) {
+        UCHAR *stale;
+        ULONG stalesize;
+
+        if (pending->guid != guid || !SameEventPath(pending->data, data))
+            continue;
+
+        stale = pending->data;
+        stalesize = pending->size;
+        pending->data = data;
+        pending->size = size;
+        InterlockedIncrement(&session->eventsmerged);
+        KeReleaseSpinLock(&session->eventlock, irql);
+
+        FreeEventData(stale, stalesize);
+        if (event != NULL)
+            PoolFree(event);
+        return;
+    }
+
+    // The emitter is queued before the event is added, under the lock,
+    // so an event is never left on the list with no pass to take it. If
+    // the event queue is full it is dropped like any other overflow.
+    if (event == NULL || session->eventcount == SESSION_EVENT_DEPTH ||
+        !WorkQueueInsert(session->fdoData->EventQueue, &session->emitter)) {
+        InterlockedIncrement(&session->eventsdropped);
+        KeReleaseSpinLock(&session->eventlock, irql);
+
+        TraceEvent(DropEvent, NULL, session->id, session->eventcount, 0);
+        FreeEventData(data, size);
+        if (event != NULL)
+            PoolFree(event);
+        return;
+    }
+
+    event->guid = guid;
+    event->data = data;
+    event->size = size;
+    InsertTailList(&session->events, &event->listentry);
+    session->eventcount++;
+    KeReleaseSpinLock(&session->eventlock, irql);
+}
+
+// Called once the watch thread has gone, so nothing more can be queued
+static VOID SessionFlushEvents(XenStoreSession *session) {
+    XenStoreEvent *event;
+
+    WorkItemWait(session->fdoData->EventQueue, &session->emitter);
+
+    while (!IsListEmpty(&session->events)) {
+        event = (XenStoreEvent *)RemoveHeadList(&session->events);
+        session->eventcount--;
+        FreeEventData(event->data, event->size);
+        PoolFree(event);
+    }
+}
+
+void FireWatchValueEvent(XenStoreSession *session, UNICODE_STRING *path, const char *utf8path, const char *value) {
     UCHAR * eventdata;
     ULONG RequiredSize;
     UCHAR *sesbuf;
+    UCHAR *present;
+    UCHAR *truncated;
+    UCHAR *valbuf;
+    const char *payload = "";
+
+    if (value != NULL && strlen(value) <= WATCH_VALUE_LIMIT)
+        payload = value;
 
     AccessWmiBuffer(0, FALSE, &RequiredSize, 0,
-            WMI_STRING, GetCountedUnicodeStringSize(&watch->path),
+            WMI_STRING, GetCountedEventPathSize(path, utf8path),
+                &sesbuf,
+            WMI_BOOLEAN, &present,
+            WMI_BOOLEAN, &truncated,
+            WMI_STRING, GetCountedUtf8Size(payload),
+                &valbuf,
+            WMI_DONE);
+
+    eventdata = ExAllocatePoolWithTag(NonPagedPool, RequiredSize,'XIEV');
+    if (eventdata!=NULL) {
+        PoolCharge(XENIFACE_POOL_EVENT, RequiredSize);
+        AccessWmiBuffer(eventdata, FALSE, &RequiredSize, RequiredSize,
+            WMI_STRING, GetCountedEventPathSize(path, utf8path),
+                &sesbuf,
+            WMI_BOOLEAN, &present,
+            WMI_BOOLEAN, &truncated,
+            WMI_STRING, GetCountedUtf8Size(payload),
+                &valbuf,
+            WMI_DONE);
+
+        WriteCountedEventPath(path, utf8path, sesbuf); 
+        *present = (value != NULL) ? TRUE : FALSE;
+        *truncated = (value != NULL && payload != value) ? TRUE : FALSE;
+        if (!NT_SUCCESS(WriteCountedUTF8String(payload, valbuf))) {
+            *(USHORT *)valbuf = 0;
+            *truncated = TRUE;
+        }
+
+        SessionQueueEvent(session, &CitrixXenStoreWatchValueEvent_GUID, eventdata, RequiredSize);
+    } else {
+        InterlockedIncrement(&session->eventsdropped);
+    }
+}
+
+void FireWatchEvent(XenStoreSession *session, UNICODE_STRING *path, const char *utf8path) {
+    UCHAR * eventdata;
+    ULONG RequiredSize;
+    UCHAR *sesbuf;
+
+    AccessWmiBuffer(0, FALSE, &RequiredSize, 0,
+            WMI_STRING, GetCountedEventPathSize(path, utf8path),
                 &sesbuf,
             WMI_DONE);
     
     eventdata = ExAllocatePoolWithTag(NonPagedPool, RequiredSize,'XIEV');
     if (eventdata!=NULL) {
+        PoolCharge(XENIFACE_POOL_EVENT, RequiredSize);
         AccessWmiBuffer(eventdata, FALSE, &RequiredSize, RequiredSize,
-            WMI_STRING, GetCountedUnicodeStringSize(&watch->path),
+            WMI_STRING, GetCountedEventPathSize(path, utf8path),
                 &sesbuf,
             WMI_DONE);
 
-        WriteCountedUnicodeString(&watch->path, sesbuf); 
+        WriteCountedEventPath(path, utf8path, sesbuf); 
+
+        SessionQueueEvent(session, &CitrixXenStoreWatchEvent_GUID, eventdata, RequiredSize);
+    } else {
+        InterlockedIncrement(&session->eventsdropped);
     }
+}
 
-    if (eventdata !=NULL) {
-        XenIfaceDebugPrint(TRACE,"Fire Watch Event\n");
-        WmiFireEvent(watch->fdoData->Dx->DeviceObject, 
-                        (LPGUID)&CitrixXenStoreWatchEvent_GUID,
-                        0,
-                        RequiredSize, 
-                        eventdata);
-    } 
+VOID FireFilteredWatch(PVOID Context, PCHAR Path, PCHAR Value) {
+    XenStoreWatch *watch = Context;
+
+    if (watch->flags & WATCH_FLAG_VALUE)
+        FireWatchValueEvent(watch->session, NULL, Path, Value);
+    else
+        FireWatchEvent(watch->session, NULL, Path);
+}
+
+void FireWatch(XenStoreWatch* watch) {
+    XENIFACE_FDO *fdoData = watch->fdoData;
+    char *value;
+    NTSTATUS status;
+
+    TraceEvent(FireWatch, watch->utf8path, watch->flags, 0, 0);
+
+    if (watch->filter != NULL) {
+        // Only nodes matching the pattern whose values have changed are
+        // reported. If the walk could not be completed, fall back to a
+        // single event for the pattern itself.
+        if (!FilterEvaluate(watch->filter, fdoData->StoreInterface, FireFilteredWatch, watch))
+            FireWatchEvent(watch->session, &watch->path, NULL);
+        return;
+    }
+
+    if (watch->flags & WATCH_FLAG_VALUE) {
+        // Read once here, so that consumers need not follow every event
+        // with a GetValue (which could already see a later value).
+        status = STORE(Read, fdoData->StoreInterface, NULL, NULL, watch->utf8path, &value);
+        FireWatchValueEvent(watch->session, &watch->path, NULL, NT_SUCCESS(status) ? value : NULL);
+        if (NT_SUCCESS(status))
+            STORE(Free, fdoData->StoreInterface, value);
+        return;
+    }
+
+    FireWatchEvent(watch->session, &watch->path, NULL);
 }
 
 
@@ -799,44 +1136,98 @@ KSTART_ROUTINE WatchCallbackThread;
 NTSTATUS
 StartWatch(XENIFACE_FDO *fdoData, XenStoreWatch *watch)
 {
-    char *tmppath; 
-    ANSI_STRING ansipath;
     NTSTATUS status;
-    status = RtlUnicodeStringToAnsiString(&ansipath, &watch->path, TRUE);
-    if (!NT_SUCCESS(status)) {
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-    tmppath = ExAllocatePoolWithTag(NonPagedPool, ansipath.Length+1, 'XenP');
-    if (!tmppath) {
-        RtlFreeAnsiString(&ansipath);
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-    RtlZeroMemory(tmppath, ansipath.Length+1);
-    RtlCopyBytes(tmppath,ansipath.Buffer, ansipath.Length);
-    
-    status = STORE(Watch, fdoData->StoreInterface, NULL, tmppath, &watch->watchevent, &watch->watchhandle );
+    ULONGLONG start;
+
+    start = LatencyStart();
+
+    // A filtered watch is set on the fixed part of its pattern
+    status = STORE(Watch, fdoData->StoreInterface, NULL,
+                   (watch->filter != NULL) ? FilterGetPrefix(watch->filter) : watch->utf8path,
+                   &watch->watchevent, &watch->watchhandle );
+    LatencyRecord(XENIFACE_LATENCY_STORE_WATCH, start);
     if (!NT_SUCCESS(status)) {
-        ExFreePool(tmppath);
-        RtlFreeAnsiString(&ansipath);
+        watch->watchhandle = NULL;
         return status;
     }
 
-    XenIfaceDebugPrint(WARNING,"Start Watch %p\n", watch->watchhandle);
-
-    ExFreePool(tmppath);
-    RtlFreeAnsiString(&ansipath);
+    TraceEvent(StartWatch, watch->utf8path, watch->id, (ULONG)status, 0);
 
     return STATUS_SUCCESS;
 }
 
+void FreeWatch(XenStoreWatch *watch) {
+    if (watch->filter != NULL)
+        FilterDestroy(watch->filter, watch->fdoData->StoreInterface);
+    PoolFree(watch);
+}
+
+
+static VOID WatchDeliverLocked(XenStoreWatch *watch) {
+    XenStoreSession *session = watch->session;
+
+    if (!session->suspended) {
+        ULONG suspendcount = SUSPEND(Count, watch->fdoData->SuspendInterface);
+
+        if (watch->suspendcount != suspendcount) {
+            XenIfaceDebugPrint(WARNING,"SessionSuspendResumeUnwatch %p\n", watch->watchhandle);
+            
+            if (watch->watchhandle != NULL)
+                STORE(Unwatch, watch->fdoData->StoreInterface, watch->watchhandle);
+            if (NT_SUCCESS(StartWatch(watch->fdoData, watch)))
+                watch->suspendcount = suspendcount;
+        }
+    }
+    FireWatch(watch);
+    LatencyRecord(XENIFACE_LATENCY_WATCH_DELIVERY, watch->signalled);
+}
+
+static VOID WatchDeliver(PVOID Context) {
+    XenStoreWatch *watch = Context;
+    XenStoreSession *session = watch->session;
+
+    AcquireFastMutex(&session->WatchMapLock);
+    if (!watch->finished)
+        WatchDeliverLocked(watch);
+    ReleaseFastMutex(&session->WatchMapLock);
+}
+
+// The watch must already be off the session's list and marked finished,
+// so that any delivery still queued does nothing
+static VOID WatchRelease(XenStoreWatch *watch) {
+    WorkItemWait(watch->fdoData->WorkQueue, &watch->work);
+    FreeWatch(watch);
+}
 
+// Arms any watch that failed to re-arm after the last resume
+static VOID SessionRetryWatchesLocked(XenStoreSession *session) {
+    XenStoreWatch *watch;
+    ULONG suspendcount;
+
+    if (session->suspended)
+        return;
+
+    for (watch = (XenStoreWatch *)session->watches.Flink;
+         watch != (XenStoreWatch *)&session->watches;
+         watch = (XenStoreWatch *)watch->listentry.Flink) {
+        suspendcount = SUSPEND(Count, watch->fdoData->SuspendInterface);
+        if (watch->finished || watch->suspendcount == suspendcount)
+            continue;
+
+        if (NT_SUCCESS(StartWatch(watch->fdoData, watch)))
+            watch->suspendcount = suspendcount;
+    }
+}
+
+// Waits for the session's watches to fire, and hands them to the work
+// queue for delivery
 VOID WatchCallbackThread(__in PVOID StartContext) {
     NTSTATUS status;
     int i=0;
     XenStoreSession * session = (XenStoreSession*) StartContext;
 
     for(;;) {
-        ExAcquireFastMutex(&session->WatchMapLock);
+        AcquireFastMutex(&session->WatchMapLock);
         if (session->mapchanged) {
             // Construct a new mapping
             XenStoreWatch *watch;
@@ -849,42 +1240,37 @@ VOID WatchCallbackThread(__in PVOID StartContext) {
             session->mapchanged = FALSE;
             session->watchevents[i] = &session->SessionChangedEvent; 
         }
-        ExReleaseFastMutex(&session->WatchMapLock);
+        ReleaseFastMutex(&session->WatchMapLock);
         XenIfaceDebugPrint(TRACE,"Wait for new event\n");
         status = KeWaitForMultipleObjects(i+1, session->watchevents, WaitAny, Executive, KernelMode, TRUE, NULL, session->watchwaitblockarray);
         XenIfaceDebugPrint(TRACE,"got new event\n");
         if ((status >= STATUS_WAIT_0) && (status < STATUS_WAIT_0 +i )) {
             XenStoreWatch *watch;
+            ULONGLONG start = LatencyStart();
             XenIfaceDebugPrint(TRACE,"watch or suspend\n");
             watch = CONTAINING_RECORD(session->watchevents[status-STATUS_WAIT_0], XenStoreWatch, watchevent );
-            ExAcquireFastMutex(&session->WatchMapLock);
+            AcquireFastMutex(&session->WatchMapLock);
             KeClearEvent(&watch->watchevent);
 
 
             if (watch->finished) {
-                FreeUnicodeStringBuffer(&watch->path);
                 RemoveEntryList((LIST_ENTRY*)watch);
-                ExFreePool(watch);
                 session->mapchanged = TRUE;
                 session->watchcount --;
+                ReleaseFastMutex(&session->WatchMapLock);
+                WatchRelease(watch);
             }
             else
             {
-                if (!session->suspended) {
-                    if (watch->suspendcount !=SUSPEND(Count, watch->fdoData->SuspendInterface)) {
-                        watch->suspendcount = SUSPEND(Count, watch->fdoData->SuspendInterface);
-                        XenIfaceDebugPrint(WARNING,"SessionSuspendResumeUnwatch %p\n", watch->watchhandle);
-                        
-                        STORE(Unwatch, watch->fdoData->StoreInterface, watch->watchhandle);
-                        StartWatch(watch->fdoData, watch);
-                    }
-                }
-                FireWatch(watch);
+                // A watch that is already queued is delivered once
+                watch->signalled = start;
+                if (!WorkQueueInsert(watch->fdoData->WorkQueue, &watch->work))
+                    WatchDeliverLocked(watch);
+                ReleaseFastMutex(&session->WatchMapLock);
             }
-            ExReleaseFastMutex(&session->WatchMapLock);
         }
         else if ( status == STATUS_WAIT_0 + i) {
-            ExAcquireFastMutex(&session->WatchMapLock);
+            AcquireFastMutex(&session->WatchMapLock);
             KeClearEvent(&session->SessionChangedEvent); 
             if (session->closing==TRUE) {
                 XenIfaceDebugPrint(TRACE,"Trying to end session thread\n");
@@ -893,21 +1279,23 @@ VOID WatchCallbackThread(__in PVOID StartContext) {
                     for (watch = (XenStoreWatch *)session->watches.Flink; 
                         watch!=(XenStoreWatch *)&session->watches; 
                         watch=(XenStoreWatch *)session->watches.Flink) {
-                            FreeUnicodeStringBuffer(&watch->path);
                             RemoveEntryList((LIST_ENTRY*)watch);
-                            ExFreePool(watch);
+                            watch->finished = TRUE;
                             session->mapchanged = TRUE;
                             session->watchcount --;
+                            ReleaseFastMutex(&session->WatchMapLock);
+                            WatchRelease(watch);
+                            AcquireFastMutex(&session->WatchMapLock);
                     }
                 }
-                ExReleaseFastMutex(&session->WatchMapLock);
+                ReleaseFastMutex(&session->WatchMapLock);
                 XenIfaceDebugPrint(TRACE,"Ending session thread\n");
                 PsTerminateSystemThread(STATUS_SUCCESS);
-                //ExReleaseFastMutex(&session->WatchMapLock);
+                //ReleaseFastMutex(&session->WatchMapLock);
             }
             else {
-                
-                ExReleaseFastMutex(&session->WatchMapLock);
+                SessionRetryWatchesLocked(session);
+                ReleaseFastMutex(&session->WatchMapLock);
             }
         }
 
@@ -918,24 +1306,51 @@ NTSTATUS
 SessionAddWatchLocked(XenStoreSession *session, 
                         XENIFACE_FDO* fdoData, 
                         UNICODE_STRING *path,
+                        ULONG flags,
                         XenStoreWatch **watch) {
 
     
     NTSTATUS status;
-    XenStoreWatch *pwatch;
+    ULONG utf8length;
 
     if (session->watchcount >= MAX_WATCH_COUNT) {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    *watch = ExAllocatePoolWithTag(NonPagedPool, sizeof(XenStoreWatch), 'XenP');
+    utf8length = CountBytesUtf8FromUtf16(path->Buffer, path->Length);
+    if (utf8length > XENSTORE_PATH_MAX) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    *watch = PoolAllocate(XENIFACE_POOL_SESSION, sizeof(XenStoreWatch) + path->Length + utf8length + 1);
     if (*watch == NULL) {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
     (*watch)->finished = FALSE; 
     (*watch)->fdoData = fdoData;
-    UnicodeShallowCopy(&(*watch)->path, path);
+    (*watch)->flags = flags;
+    (*watch)->session = session;
+    (*watch)->id = (ULONG)InterlockedIncrement(&WatchSequence);
+    WorkItemInitialize(&(*watch)->work, WatchDeliver, *watch, XENIFACE_WORK_HIGH);
+
+    (*watch)->path.Buffer = (PWCHAR)((*watch) + 1);
+    (*watch)->path.Length = path->Length;
+    (*watch)->path.MaximumLength = path->Length;
+    RtlCopyMemory((*watch)->path.Buffer, path->Buffer, path->Length);
+
+    (*watch)->utf8path = (PCHAR)(*watch)->path.Buffer + path->Length;
+    Utf8FromUtf16((*watch)->utf8path, path->Buffer, path->Length);
+    (*watch)->utf8path[utf8length] = 0;
+
+    (*watch)->filter = NULL;
+    if (flags & WATCH_FLAG_FILTER) {
+        status = FilterCreate((*watch)->utf8path, &(*watch)->filter);
+        if (!NT_SUCCESS(status)) {
+            FreeWatch(*watch);
+            return status;
+        }
+    }
 
 
    
@@ -947,49 +1362,31 @@ SessionAddWatchLocked(XenStoreSession *session,
     
     status = StartWatch(fdoData, *watch);
     if ((!NT_SUCCESS(status)) || ((*watch)->watchhandle == NULL)) {
-        ExFreePool(*watch);
+        FreeWatch(*watch);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    ExAcquireFastMutex(&session->WatchMapLock);
+    AcquireFastMutex(&session->WatchMapLock);
     session->mapchanged = TRUE;
     KeSetEvent(&session->SessionChangedEvent, IO_NO_INCREMENT,FALSE);
     session->watchcount++;
     InsertHeadList(&session->watches,(PLIST_ENTRY)(*watch));
 
-    XenIfaceDebugPrint(TRACE, "WATCHLIST for session %p-----------\n",session);
-    pwatch = (XenStoreWatch *)session->watches.Flink;
+    TraceEvent(AddWatch, (*watch)->utf8path, session->id, (*watch)->id, session->watchcount);
 
-    while (pwatch != (XenStoreWatch *)&session->watches){
-        XenIfaceDebugPrint(TRACE, "WATCHLIST %p\n",pwatch->watchhandle);
-        pwatch = (XenStoreWatch *)pwatch->listentry.Flink;
-    }
-    XenIfaceDebugPrint(TRACE, "WATCHLIST-------------------\n");
-
-    ExReleaseFastMutex(&session->WatchMapLock);
+    ReleaseFastMutex(&session->WatchMapLock);
     return STATUS_SUCCESS;
 
 }
 
 void SessionRemoveWatchLocked(XenStoreSession *session, XenStoreWatch *watch) {
 
-    XenStoreWatch *pwatch;
-    XenIfaceDebugPrint(TRACE, "Remove watch locked\n");
-    XenIfaceDebugPrint(TRACE, "watch %p\n", watch);
-    XenIfaceDebugPrint(TRACE, "handle %p\n", watch->watchhandle);
+    TraceEvent(RemoveWatch, watch->utf8path, session->id, watch->id, 0);
 
     if (watch->watchhandle) {
         STORE(Unwatch, watch->fdoData->StoreInterface, watch->watchhandle);
         watch->watchhandle=NULL;
         watch->finished = TRUE;
-    XenIfaceDebugPrint(TRACE, "WATCHLIST for session %p-----------\n",session);
-    pwatch = (XenStoreWatch *)session->watches.Flink;
-
-    while (pwatch != (XenStoreWatch *)&session->watches){
-        XenIfaceDebugPrint(TRACE, "WATCHLIST %p\n",pwatch->watchhandle);
-        pwatch = (XenStoreWatch *)pwatch->listentry.Flink;
-    }
-    XenIfaceDebugPrint(TRACE, "WATCHLIST-------------------\n");
         KeSetEvent(&watch->watchevent, IO_NO_INCREMENT,FALSE);
     }
 
@@ -999,7 +1396,7 @@ void SessionRemoveWatchesLocked(XenStoreSession *session) {
     XenStoreWatch *watch;
 
     XenIfaceDebugPrint(TRACE, "wait remove mutex\n");
-    ExAcquireFastMutex(&session->WatchMapLock);
+    AcquireFastMutex(&session->WatchMapLock);
     for (watch = (XenStoreWatch *)session->watches.Flink; 
          watch!=(XenStoreWatch *)&session->watches; 
          watch=(XenStoreWatch *)watch->listentry.Flink) {
@@ -1008,7 +1405,7 @@ void SessionRemoveWatchesLocked(XenStoreSession *session) {
         SessionRemoveWatchLocked(session, watch);
     }
     XenIfaceDebugPrint(TRACE, "release remove mutex\n");
-    ExReleaseFastMutex(&session->WatchMapLock);
+    ReleaseFastMutex(&session->WatchMapLock);
 }
 
 
@@ -1042,6 +1439,9 @@ FindSessionByInstanceAndLock(XENIFACE_FDO *fdoData,
     session = FindSessionByInstanceLocked(fdoData, instance);
     if (session == NULL) {
          UnlockSessions(fdoData);
+    } else {
+        // Only method calls look sessions up this way
+        SessionTouch(session);
     }
     return session;
 }
@@ -1055,16 +1455,16 @@ PSTR Xmasprintf(const char *fmt, ...) {
     va_start(argv, fmt);
     do{
         basesize = basesize * 2;
-        out =  ExAllocatePoolWithTag(NonPagedPool, basesize, 'XenP');
+        out =  PoolAllocate(XENIFACE_POOL_SESSION, basesize);
         if (out == NULL)
             return NULL;
         
         status = RtlStringCbVPrintfExA(out, basesize, NULL, &unused,0, fmt, argv);
 
-        ExFreePool(out);
+        PoolFree(out);
     }while (status != STATUS_SUCCESS);
 
-    out = ExAllocatePoolWithTag(NonPagedPool, basesize-unused +1, 'XenP');
+    out = PoolAllocate(XENIFACE_POOL_SESSION, basesize-unused +1);
     if (out == NULL)
         return NULL;
 
@@ -1077,6 +1477,7 @@ PSTR Xmasprintf(const char *fmt, ...) {
 NTSTATUS 
 CreateNewSession(XENIFACE_FDO *fdoData, 
                     UNICODE_STRING *stringid, 
+                    ULONG flags,
                     ULONG *sessionid) {
     XenStoreSession *session;
     PSTR iname;
@@ -1088,16 +1489,16 @@ CreateNewSession(XENIFACE_FDO *fdoData,
     if (fdoData->Sessions == MAX_SESSIONS) {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
-    session = ExAllocatePoolWithTag(NonPagedPool, sizeof(XenStoreSession), 'XenP');
+    session = PoolAllocate(XENIFACE_POOL_SESSION, sizeof(XenStoreSession));
     if (session == NULL)
         return STATUS_INSUFFICIENT_RESOURCES;
     RtlZeroMemory(session, sizeof(XenStoreSession));
     
-    ExInitializeFastMutex(&session->WatchMapLock);
+    InitializeFastMutex(&session->WatchMapLock, XENIFACE_LOCK_WATCH_MAP);
     session->mapchanged = TRUE;
     status = RtlUnicodeStringToAnsiString(&ansi, stringid, TRUE);
     if (!NT_SUCCESS(status)) {
-        ExFreePool(session);
+        PoolFree(session);
         return status;
     }
     LockSessions(fdoData);
@@ -1109,22 +1510,32 @@ CreateNewSession(XENIFACE_FDO *fdoData,
         if (iname == NULL) {
             UnlockSessions(fdoData);
             RtlFreeAnsiString(&ansi); 
-            ExFreePool(session);
+            PoolFree(session);
             return status;
         }
 
         status = GetInstanceName(&session->instancename ,fdoData,iname);
-        ExFreePool(iname);
+        PoolFree(iname);
         if (!NT_SUCCESS(status)) {
             UnlockSessions(fdoData);
             RtlFreeAnsiString(&ansi); 
-            ExFreePool(session);
+            PoolFree(session);
             return status;
         }
         count++;
         
     } while (FindSessionByInstanceLocked(fdoData, &session->instancename) != NULL);
 
+    if (fdoData->Sched != NULL &&
+        !(flags & SESSION_FLAG_UNLIMITED) &&
+        !NT_SUCCESS(SchedClientCreate(fdoData->Sched, &session->sched))) {
+        UnlockSessions(fdoData);
+        RtlFreeAnsiString(&ansi); 
+        FreeUnicodeStringBuffer(&session->instancename);
+        PoolFree(session);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
     
     
     
@@ -1146,6 +1557,13 @@ CreateNewSession(XENIFACE_FDO *fdoData,
     
     KeInitializeEvent(&session->SessionChangedEvent, NotificationEvent, FALSE);
     session->closing = FALSE;
+    session->flags = flags;
+    SessionTouch(session);
+
+    session->fdoData = fdoData;
+    KeInitializeSpinLock(&session->eventlock);
+    InitializeListHead(&session->events);
+    WorkItemInitialize(&session->emitter, SessionEmitEvents, session, XENIFACE_WORK_NORMAL);
     if (fdoData->InterfacesAcquired){ 
         XenIfaceDebugPrint(TRACE,"Add session unsuspended\n");
         session->suspended=FALSE;
@@ -1178,9 +1596,13 @@ RemoveSessionLocked(XENIFACE_FDO *fdoData,
     KeSetEvent(&session->SessionChangedEvent, IO_NO_INCREMENT, FALSE);
     KeWaitForSingleObject(session->WatchThread, Executive, KernelMode, FALSE, NULL);
     ObDereferenceObject(session->WatchThread);
+    SessionFlushEvents(session);
+    // Callers still waiting for a turn hold their own references
+    if (session->sched != NULL)
+        SchedClientRelease(session->sched);
     FreeUnicodeStringBuffer(&session->stringid);
     FreeUnicodeStringBuffer(&session->instancename);
-    ExFreePool(session);
+    PoolFree(session);
 }
 
 void
@@ -1210,24 +1632,29 @@ void SessionUnwatchWatchesLocked(XenStoreSession *session)
 {
     int i;
     XenStoreWatch *watch;
-    ExAcquireFastMutex(&session->WatchMapLock);
+    AcquireFastMutex(&session->WatchMapLock);
     watch = (XenStoreWatch *)session->watches.Flink;
     for (i=0; watch != (XenStoreWatch *)&session->watches; i++) {
         XenIfaceDebugPrint(TRACE,"Suspend unwatch %p\n", watch->watchhandle);
 
-        STORE(Unwatch, watch->fdoData->StoreInterface, watch->watchhandle);
+        if (watch->watchhandle != NULL)
+            STORE(Unwatch, watch->fdoData->StoreInterface, watch->watchhandle);
+        if (watch->filter != NULL)
+            FilterSuspend(watch->filter, watch->fdoData->StoreInterface);
         watch = (XenStoreWatch *)watch->listentry.Flink;
     }
-    XenIfaceDebugPrint(TRACE, "WATCHLIST for session %p-----------\n",session);
-    watch = (XenStoreWatch *)session->watches.Flink;
+    if (LogEnabled(TRACE)) {
+        XenIfaceDebugPrint(TRACE, "WATCHLIST for session %p-----------\n",session);
+        watch = (XenStoreWatch *)session->watches.Flink;
 
-    while (watch != (XenStoreWatch *)&session->watches){
-        XenIfaceDebugPrint(TRACE, "WATCHLIST %p\n",watch->watchhandle);
-        watch = (XenStoreWatch *)watch->listentry.Flink;
+        while (watch != (XenStoreWatch *)&session->watches){
+            XenIfaceDebugPrint(TRACE, "WATCHLIST %p\n",watch->watchhandle);
+            watch = (XenStoreWatch *)watch->listentry.Flink;
+        }
+        XenIfaceDebugPrint(TRACE, "WATCHLIST-------------------\n");
     }
-    XenIfaceDebugPrint(TRACE, "WATCHLIST-------------------\n");
     session->suspended=1;
-    ExReleaseFastMutex(&session->WatchMapLock);
+    ReleaseFastMutex(&session->WatchMapLock);
 }
 
 void SuspendSessionLocked(XENIFACE_FDO *fdoData, 
@@ -1244,6 +1671,7 @@ void SuspendSessionLocked(XENIFACE_FDO *fdoData,
 
 void SessionsSuspendAll(XENIFACE_FDO *fdoData) {
     XenStoreSession *session;
+    ULONGLONG start = LatencyStart();
     LockSessions(fdoData);
     XenIfaceDebugPrint(TRACE,"Suspend all sessions\n");
     session = (XenStoreSession *)fdoData->SessionHead.Flink;
@@ -1252,53 +1680,246 @@ void SessionsSuspendAll(XENIFACE_FDO *fdoData) {
         session = (XenStoreSession *)session->listentry.Flink;
     }
     UnlockSessions(fdoData);
+    LatencyRecord(XENIFACE_LATENCY_SUSPEND, start);
 }
 
 
+// Watches are re-armed after a resume by the resuming thread together
+// with up to REARM_MAXIMUM_WORKERS helpers (see rearm.h). The helpers
+// run on a queue of their own: the resuming thread holds every session's
+// watch lock, which watch deliveries on the FDO's work queue also take.
+#define REARM_MAXIMUM_WORKERS 8
+
+typedef struct _XenStoreRearm {
+    XENIFACE_FDO *fdoData;
+    ULONG suspendcount;
+    LONG failed;
+    XENIFACE_REARM shared;
+    KEVENT idle;
+    XENIFACE_WORK_ITEM work[REARM_MAXIMUM_WORKERS];
+} XenStoreRearm;
+
+static VOID SessionRearmWatch(PVOID Context, PVOID Item) {
+    XenStoreRearm *rearm = Context;
+    XenStoreWatch *watch = Item;
+
+    // Only a watch that is armed counts as resumed, so one that fails is
+    // tried again when its session's thread next wakes
+    if (NT_SUCCESS(StartWatch(rearm->fdoData, watch)))
+        watch->suspendcount = rearm->suspendcount;
+    else
+        InterlockedIncrement(&rearm->failed);
+}
+
+static VOID SessionRearmWork(PVOID Context) {
+    XenStoreRearm *rearm = Context;
+
+    if (RearmHelp(&rearm->shared))
+        KeSetEvent(&rearm->idle, IO_NO_INCREMENT, FALSE);
+}
+
+// One worker per processor besides the resuming thread's own
+static ULONG SessionRearmWorkers(void) {
+    ULONG processors = KeQueryActiveProcessorCount(NULL);
+
+    return (processors - 1 < REARM_MAXIMUM_WORKERS) ? processors - 1 : REARM_MAXIMUM_WORKERS;
+}
+
 void SessionRenewWatchesLocked(XenStoreSession *session) {
-    int i;
     XenStoreWatch *watch;
-    ExAcquireFastMutex(&session->WatchMapLock);
-    watch = (XenStoreWatch *)session->watches.Flink;
-    for (i=0; watch != (XenStoreWatch *)&session->watches; i++) {
-        if (!watch->finished) {
-            watch->suspendcount = SUSPEND(Count, watch->fdoData->SuspendInterface);
-            StartWatch(watch->fdoData, watch);
-        }
-        watch = (XenStoreWatch *)watch->listentry.Flink;
-    }
-    XenIfaceDebugPrint(TRACE, "WATCHLIST for session %p-----------\n",session);
-    watch = (XenStoreWatch *)session->watches.Flink;
 
-    while (watch != (XenStoreWatch *)&session->watches){
-        XenIfaceDebugPrint(TRACE, "WATCHLIST %p\n",watch->watchhandle);
-        watch = (XenStoreWatch *)watch->listentry.Flink;
+    if (LogEnabled(TRACE)) {
+        XenIfaceDebugPrint(TRACE, "WATCHLIST for session %p-----------\n",session);
+        watch = (XenStoreWatch *)session->watches.Flink;
+
+        while (watch != (XenStoreWatch *)&session->watches){
+            XenIfaceDebugPrint(TRACE, "WATCHLIST %p\n",watch->watchhandle);
+            watch = (XenStoreWatch *)watch->listentry.Flink;
+        }
+        XenIfaceDebugPrint(TRACE, "WATCHLIST-------------------\n");
     }
-    XenIfaceDebugPrint(TRACE, "WATCHLIST-------------------\n");
     session->suspended=0;
     session->mapchanged = TRUE;
     KeSetEvent(&session->SessionChangedEvent, IO_NO_INCREMENT,FALSE);
-    ExReleaseFastMutex(&session->WatchMapLock);
-}
-
-void ResumeSessionLocked(XENIFACE_FDO *fdoData, 
-                         XenStoreSession *session) {
-    SessionRenewWatchesLocked(session);
 }
 
 void SessionsResumeAll(XENIFACE_FDO *fdoData) {
     XenStoreSession *session;
+    XenStoreWatch *watch;
+    XenStoreWatch **watches;
+    XenStoreRearm rearm;
+    ULONG workercount;
+    ULONG sessioncount;
+    LONG watchcount;
+    LONG armed;
+    ULONG i;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    ULONGLONG latency;
+
+    latency = LatencyStart();
+    KeQuerySystemTime(&start);
+
+    RtlZeroMemory(&rearm, sizeof(rearm));
+    rearm.fdoData = fdoData;
+    rearm.suspendcount = SUSPEND(Count, fdoData->SuspendInterface);
+    KeInitializeEvent(&rearm.idle, NotificationEvent, FALSE);
+    for (i = 0; i < REARM_MAXIMUM_WORKERS; i++)
+        WorkItemInitialize(&rearm.work[i], SessionRearmWork, &rearm, XENIFACE_WORK_HIGH);
 
     LockSessions(fdoData);
     XenIfaceDebugPrint(TRACE,"Resume all sessions\n");
+
+    // Every session's watch lock is held until the helpers are done, so
+    // the watch callback threads cannot free a watch underneath them.
+    sessioncount = 0;
+    watchcount = 0;
+    session = (XenStoreSession *)fdoData->SessionHead.Flink;
+    while (session != (XenStoreSession *)&fdoData->SessionHead) {
+        AcquireFastMutex(&session->WatchMapLock);
+        watchcount += session->watchcount;
+        sessioncount++;
+        session=(XenStoreSession *)session->listentry.Flink;
+    }
+
+    watches = NULL;
+    if (watchcount != 0)
+        watches = PoolAllocate(XENIFACE_POOL_SESSION, watchcount * sizeof(XenStoreWatch *));
+
+    armed = 0;
     session = (XenStoreSession *)fdoData->SessionHead.Flink;
     while (session != (XenStoreSession *)&fdoData->SessionHead) {
-        ResumeSessionLocked(fdoData, session );
+        for (watch = (XenStoreWatch *)session->watches.Flink;
+             watch != (XenStoreWatch *)&session->watches;
+             watch = (XenStoreWatch *)watch->listentry.Flink) {
+            if (watch->finished)
+                continue;
+
+            armed++;
+
+            // Without the array fall back to re-arming serially
+            if (watches != NULL)
+                watches[armed - 1] = watch;
+            else
+                SessionRearmWatch(&rearm, watch);
+        }
         session=(XenStoreSession *)session->listentry.Flink;
     }
+
+    RearmInitialize(&rearm.shared,
+                    SessionRearmWatch,
+                    &rearm,
+                    (PVOID *)watches,
+                    (watches != NULL) ? armed : 0);
+
+    // The resuming thread does its share too, so a uniprocessor guest
+    // (which has no rearm queue) queues no helpers
+    workercount = 0;
+    if (fdoData->RearmQueue != NULL && rearm.shared.Count > 1) {
+        ULONG workers = SessionRearmWorkers();
+
+        while (workercount < workers &&
+               workercount < (ULONG)rearm.shared.Count - 1) {
+            if (!WorkQueueInsert(fdoData->RearmQueue, &rearm.work[workercount]))
+                break;
+            workercount++;
+        }
+    }
+
+    RearmDrain(&rearm.shared);
+
+    for (;;) {
+        KeClearEvent(&rearm.idle);
+        KeMemoryBarrier();
+        if (!RearmIsBusy(&rearm.shared))
+            break;
+        (VOID) KeWaitForSingleObject(&rearm.idle, Executive, KernelMode, FALSE, NULL);
+    }
+
+    // Release in the reverse of the order the locks were taken
+    session = (XenStoreSession *)fdoData->SessionHead.Blink;
+    while (session != (XenStoreSession *)&fdoData->SessionHead) {
+        SessionRenewWatchesLocked(session);
+        ReleaseFastMutex(&session->WatchMapLock);
+        session=(XenStoreSession *)session->listentry.Blink;
+    }
     UnlockSessions(fdoData);
+
+    // A helper that started after the array was emptied found nothing to
+    // do, but it still uses rearm, so wait for it
+    for (i = 0; i < workercount; i++)
+        WorkItemWait(fdoData->RearmQueue, &rearm.work[i]);
+
+    if (watches != NULL)
+        PoolFree(watches);
+
+    KeQuerySystemTime(&end);
+    LatencyRecord(XENIFACE_LATENCY_RESUME, latency);
+
+    XenIfaceDebugPrint(INFO, "resumed %u sessions, %d watches (%d failed) with %u helpers in %I64u us\n",
+                       sessioncount,
+                       armed,
+                       rearm.failed,
+                       workercount,
+                       (end.QuadPart - start.QuadPart) / 10);
 }
 
+static void SessionsReapIdle(XENIFACE_FDO *fdoData) {
+    XenStoreSession *session;
+    XenStoreSession *next;
+    ULONGLONG now = KeQueryInterruptTime();
+    ULONGLONG ttl = (ULONGLONG)fdoData->SessionTtl * 10000000ull;
+
+    LockSessions(fdoData);
+    for (session = (XenStoreSession *)fdoData->SessionHead.Flink;
+         session != (XenStoreSession *)&fdoData->SessionHead;
+         session = next) {
+        next = (XenStoreSession *)session->listentry.Flink;
+
+        // Watches and transactions can only be started by method calls,
+        // which need the session lock, so neither can appear under our
+        // feet. A transaction left open is the client's to finish.
+        if ((session->flags & SESSION_FLAG_PERSISTENT) ||
+            session->watchcount != 0 ||
+            session->transaction != NULL ||
+            now - SessionLastActive(session) < ttl)
+            continue;
+
+        XenIfaceDebugPrint(INFO, "ending idle session %wZ (%d)\n",
+                           &session->instancename, session->id);
+        RemoveSessionLocked(fdoData, session);
+    }
+    UnlockSessions(fdoData);
+}
+
+static NTSTATUS SessionReaper(PXENIFACE_THREAD Self, PVOID Context) {
+    XENIFACE_FDO *fdoData = Context;
+    PKEVENT event = ThreadGetEvent(Self);
+    LARGE_INTEGER timeout;
+
+    timeout.QuadPart = -(LONGLONG)min(fdoData->SessionTtl, SESSION_REAP_PERIOD) * 10000000;
+
+    for (;;) {
+        (VOID) KeWaitForSingleObject(event, Executive, KernelMode, FALSE, &timeout);
+        KeClearEvent(event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        SessionsReapIdle(fdoData);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static ULONG SessionReadParameter(PWCHAR name, ULONG value) {
+    ULONG data;
+
+    if (NT_SUCCESS(DriverReadParameter(name, &data)))
+        value = data;
+
+    return value;
+}
 
 NTSTATUS
 WmiInit(
@@ -1306,6 +1927,7 @@ WmiInit(
     ) 
 {
     NTSTATUS status = STATUS_SUCCESS;
+    ULONG rate;
     XenIfaceDebugPrint(TRACE,"%s\n",__FUNCTION__);
     XenIfaceDebugPrint(INFO,"DRV: XenIface WMI Initialisation\n");
    
@@ -1316,7 +1938,34 @@ WmiInit(
                                 &FdoData->SuggestedInstanceName);
     InitializeListHead(&FdoData->SessionHead);
     FdoData->Sessions = 0;
-    ExInitializeFastMutex(&FdoData->SessionLock);
+    InitializeFastMutex(&FdoData->SessionLock, XENIFACE_LOCK_SESSION);
+
+    FdoData->Sched = NULL;
+    rate = SessionReadParameter(L"SessionRate", SESSION_RATE_DEFAULT);
+    if (rate != 0 &&
+        !NT_SUCCESS(SchedCreate(SESSION_SCHED_SLOTS,
+                                rate,
+                                SessionReadParameter(L"SessionBurst", SESSION_BURST_DEFAULT),
+                                &FdoData->Sched))) {
+        XenIfaceDebugPrint(WARNING, "session method calls will not be scheduled\n");
+        FdoData->Sched = NULL;
+    }
+
+    FdoData->RearmQueue = NULL;
+    if (SessionRearmWorkers() != 0 &&
+        !NT_SUCCESS(WorkQueueCreate(SessionRearmWorkers(),
+                                    REARM_MAXIMUM_WORKERS,
+                                    &FdoData->RearmQueue))) {
+        XenIfaceDebugPrint(WARNING, "watches will be re-armed serially\n");
+        FdoData->RearmQueue = NULL;
+    }
+
+    FdoData->SessionTtl = SessionReadParameter(L"SessionTtl", SESSION_TTL_DEFAULT);
+    if (FdoData->SessionTtl != 0 &&
+        !NT_SUCCESS(ThreadCreate(SessionReaper, FdoData, &FdoData->SessionReaper))) {
+        XenIfaceDebugPrint(WARNING, "idle sessions will not be ended\n");
+        FdoData->SessionReaper = NULL;
+    }
     
     status = IoWMIRegistrationControl(FdoData->Dx->DeviceObject, WMIREG_ACTION_REGISTER);
     FdoData->WmiReady = 1;
@@ -1332,9 +1981,23 @@ WmiFinalise(
     if (FdoData->WmiReady) { 
         XenIfaceDebugPrint(INFO,"DRV: XenIface WMI Finalisation\n");
         XenIfaceDebugPrint(TRACE,"%s\n",__FUNCTION__);
+        if (FdoData->SessionReaper != NULL) {
+            ThreadAlert(FdoData->SessionReaper);
+            ThreadJoin(FdoData->SessionReaper);
+            FdoData->SessionReaper = NULL;
+        }
+        FdoData->SessionTtl = 0;
         SessionsRemoveAll(FdoData);
 
         status =IoWMIRegistrationControl(FdoData->Dx->DeviceObject, WMIREG_ACTION_DEREGISTER);
+        if (FdoData->Sched != NULL) {
+            SchedDestroy(FdoData->Sched);
+            FdoData->Sched = NULL;
+        }
+        if (FdoData->RearmQueue != NULL) {
+            WorkQueueDestroy(FdoData->RearmQueue);
+            FdoData->RearmQueue = NULL;
+        }
 		RtlFreeUnicodeString(&FdoData->SuggestedInstanceName);
 		RtlZeroBytes(&FdoData->SuggestedInstanceName, sizeof(UNICODE_STRING));
 
@@ -1465,7 +2128,7 @@ SessionExecuteRemoveValue(UCHAR *InBuffer,
         return status;
 
     status = STATUS_INSUFFICIENT_RESOURCES;
-    tmpbuffer = ExAllocatePoolWithTag(NonPagedPool, pathname->Length+1, 'XenP');
+    tmpbuffer = PoolAllocate(XENIFACE_POOL_SESSION, pathname->Length+1);
     if (!tmpbuffer) {
         goto fail1;
     }
@@ -1478,10 +2141,11 @@ SessionExecuteRemoveValue(UCHAR *InBuffer,
         goto fail2;
     }
     status = STORE(Remove, fdoData->StoreInterface, session->transaction, NULL, tmpbuffer);
+    CacheInvalidate(fdoData->Cache, tmpbuffer);
     UnlockSessions(fdoData);
 
 fail2:
-    ExFreePool(tmpbuffer);
+    PoolFree(tmpbuffer);
 
 fail1:
     FreeUTF8String(pathname);
@@ -1502,12 +2166,110 @@ SessionExecuteRemoveWatch(UCHAR *InBuffer,
     XenStoreWatch* watch;
     UNICODE_STRING unicpath_notbacked;
     XenStoreSession *session;
-
+
+    if (!AccessWmiBuffer(InBuffer, TRUE, &RequiredSize, InBufferSize,
+                            WMI_STRING, &upathname,
+                            WMI_DONE))
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+
+    GetCountedUnicodeString(&unicpath_notbacked, upathname);
+
+    if ((session = FindSessionByInstanceAndLock(fdoData, instance)) ==
+            NULL){
+        return STATUS_WMI_INSTANCE_NOT_FOUND;
+    }
+
+
+    XenIfaceDebugPrint(TRACE, "Find Watch\n"); 
+
+    watch = SessionFindWatchLocked(session, &unicpath_notbacked);
+
+    if (watch) {
+
+        SessionRemoveWatchLocked(session, watch);
+    }
+    else {
+        XenIfaceDebugPrint(WARNING, "No Watch\n"); 
+    }
+    ReleaseFastMutex(&session->WatchMapLock);
+    UnlockSessions(fdoData);
+
+    *byteswritten=0;
+
+ 
+
+    return STATUS_SUCCESS;
+
+}
+
+
+NTSTATUS
+SessionExecuteSetWatch(UCHAR *InBuffer,
+                            ULONG InBufferSize,
+                            UCHAR *OutBuffer,
+                            ULONG OutBufferSize,
+                            XENIFACE_FDO* fdoData,
+                            UNICODE_STRING *instance,
+                            OUT ULONG_PTR *byteswritten) {
+    ULONG RequiredSize;
+    NTSTATUS status;
+    UCHAR* upathname;
+    XenStoreWatch* watch;
+    XenStoreSession *session;
+    UNICODE_STRING unicpath_notbacked;
+    if (!AccessWmiBuffer(InBuffer, TRUE, &RequiredSize, InBufferSize,
+                            WMI_STRING, &upathname,
+                            WMI_DONE))
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+
+    GetCountedUnicodeString(&unicpath_notbacked, upathname);
+
+    if ((session = FindSessionByInstanceAndLock(fdoData, instance)) ==
+            NULL){
+        return STATUS_WMI_INSTANCE_NOT_FOUND;
+    }
+
+    // The watch takes its own copy of the path
+    status = SessionAddWatchLocked(session, fdoData, &unicpath_notbacked, 0, &watch);
+
+    UnlockSessions(fdoData);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    
+
+    *byteswritten=0;
+
+ 
+
+    return STATUS_SUCCESS;
+
+}
+NTSTATUS
+SessionExecuteSetWatchEx(UCHAR *InBuffer,
+                            ULONG InBufferSize,
+                            UCHAR *OutBuffer,
+                            ULONG OutBufferSize,
+                            XENIFACE_FDO* fdoData,
+                            UNICODE_STRING *instance,
+                            OUT ULONG_PTR *byteswritten) {
+    ULONG RequiredSize;
+    NTSTATUS status;
+    UCHAR* upathname;
+    ULONG* flags;
+    XenStoreWatch* watch;
+    XenStoreSession *session;
+    UNICODE_STRING unicpath_notbacked;
     if (!AccessWmiBuffer(InBuffer, TRUE, &RequiredSize, InBufferSize,
                             WMI_STRING, &upathname,
+                            WMI_UINT32, &flags,
                             WMI_DONE))
         return STATUS_INVALID_DEVICE_REQUEST;
 
+    if (*flags & ~WATCH_FLAG_MASK)
+        return STATUS_INVALID_PARAMETER;
 
     GetCountedUnicodeString(&unicpath_notbacked, upathname);
 
@@ -1516,32 +2278,20 @@ SessionExecuteRemoveWatch(UCHAR *InBuffer,
         return STATUS_WMI_INSTANCE_NOT_FOUND;
     }
 
+    status = SessionAddWatchLocked(session, fdoData, &unicpath_notbacked, *flags, &watch);
 
-    XenIfaceDebugPrint(TRACE, "Find Watch\n"); 
-
-    watch = SessionFindWatchLocked(session, &unicpath_notbacked);
-
-    if (watch) {
-
-        SessionRemoveWatchLocked(session, watch);
-    }
-    else {
-        XenIfaceDebugPrint(WARNING, "No Watch\n"); 
-    }
-    ExReleaseFastMutex(&session->WatchMapLock);
     UnlockSessions(fdoData);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
 
     *byteswritten=0;
 
- 
-
     return STATUS_SUCCESS;
 
 }
-
-
 NTSTATUS
-SessionExecuteSetWatch(UCHAR *InBuffer,
+SessionExecuteSetFilteredWatch(UCHAR *InBuffer,
                             ULONG InBufferSize,
                             UCHAR *OutBuffer,
                             ULONG OutBufferSize,
@@ -1550,40 +2300,36 @@ SessionExecuteSetWatch(UCHAR *InBuffer,
                             OUT ULONG_PTR *byteswritten) {
     ULONG RequiredSize;
     NTSTATUS status;
-    UCHAR* upathname;
+    UCHAR* upattern;
+    ULONG* flags;
     XenStoreWatch* watch;
     XenStoreSession *session;
-    UNICODE_STRING unicpath_notbacked;
-    UNICODE_STRING unicpath_backed;
+    UNICODE_STRING unicpattern_notbacked;
     if (!AccessWmiBuffer(InBuffer, TRUE, &RequiredSize, InBufferSize,
-                            WMI_STRING, &upathname,
+                            WMI_STRING, &upattern,
+                            WMI_UINT32, &flags,
                             WMI_DONE))
         return STATUS_INVALID_DEVICE_REQUEST;
 
+    if (*flags & ~WATCH_FLAG_MASK)
+        return STATUS_INVALID_PARAMETER;
 
-    GetCountedUnicodeString(&unicpath_notbacked, upathname);
-    status = CloneUnicodeString(&unicpath_backed, &unicpath_notbacked);
-    if (!NT_SUCCESS(status)) return status;
+    GetCountedUnicodeString(&unicpattern_notbacked, upattern);
 
     if ((session = FindSessionByInstanceAndLock(fdoData, instance)) ==
             NULL){
-        FreeUnicodeStringBuffer(&unicpath_backed);
         return STATUS_WMI_INSTANCE_NOT_FOUND;
     }
 
-    status = SessionAddWatchLocked(session, fdoData, &unicpath_backed, &watch);
+    status = SessionAddWatchLocked(session, fdoData, &unicpattern_notbacked, *flags | WATCH_FLAG_FILTER, &watch);
 
     UnlockSessions(fdoData);
     if (!NT_SUCCESS(status)) {
-        FreeUnicodeStringBuffer(&unicpath_backed);
         return status;
     }
-    
 
     *byteswritten=0;
 
- 
-
     return STATUS_SUCCESS;
 
 }
@@ -1639,7 +2385,7 @@ SessionExecuteSetValue(UCHAR *InBuffer,
         return status;
 
 	status = STATUS_INSUFFICIENT_RESOURCES;
-    tmppath = ExAllocatePoolWithTag(NonPagedPool, pathname->Length+1, 'XenP');
+    tmppath = PoolAllocate(XENIFACE_POOL_SESSION, pathname->Length+1);
     if (!tmppath) {
         goto fail1;
     }
@@ -1650,7 +2396,7 @@ SessionExecuteSetValue(UCHAR *InBuffer,
         goto fail2;
     }
     status = STATUS_INSUFFICIENT_RESOURCES;
-    tmpvalue = ExAllocatePoolWithTag(NonPagedPool,value->Length+1,'XenP');
+    tmpvalue = PoolAllocate(XENIFACE_POOL_SESSION, value->Length+1);
     if (!tmpvalue) {
         goto fail3;
     }
@@ -1663,17 +2409,18 @@ SessionExecuteSetValue(UCHAR *InBuffer,
         goto fail4;
     }
     status = STORE(Write, fdoData->StoreInterface, session->transaction, NULL, tmppath, tmpvalue);
+    CacheInvalidate(fdoData->Cache, tmppath);
     XenIfaceDebugPrint(TRACE, " Write %s to %s (%p)\n", tmpvalue, tmppath, status); 
     UnlockSessions(fdoData);
 
 fail4:
-    ExFreePool(tmpvalue);
+    PoolFree(tmpvalue);
 
 fail3:
     FreeUTF8String(value);
 
 fail2:
-    ExFreePool(tmppath);
+    PoolFree(tmppath);
 
 fail1:
     FreeUTF8String(pathname);
@@ -1715,7 +2462,7 @@ SessionExecuteGetFirstChild(UCHAR *InBuffer,
     }
 
     status = STATUS_INSUFFICIENT_RESOURCES;
-    tmppath = ExAllocatePoolWithTag(NonPagedPool,path->Length+1, 'XenP');
+    tmppath = PoolAllocate(XENIFACE_POOL_SESSION, path->Length+1);
     if (!tmppath) {
         goto fail1;
     }
@@ -1773,7 +2520,7 @@ SessionExecuteGetFirstChild(UCHAR *InBuffer,
 
         WriteCountedUTF8String(fullpath, valuepos);
         valuepos+=GetCountedUtf8Size(fullpath);
-        ExFreePool(fullpath);
+        PoolFree(fullpath);
     }
     else {
         WriteCountedUTF8String("", valuepos);
@@ -1786,7 +2533,7 @@ fail3:
     *byteswritten = RequiredSize;
 
 fail2:
-    ExFreePool(tmppath);
+    PoolFree(tmppath);
 
 fail1:
     FreeUTF8String(path);
@@ -1833,13 +2580,13 @@ SessionExecuteGetNextSibling(UCHAR *InBuffer,
     }
 
     status = STATUS_INSUFFICIENT_RESOURCES;
-    tmppath = ExAllocatePoolWithTag(NonPagedPool,path->Length+1,'XenP');
+    tmppath = PoolAllocate(XENIFACE_POOL_SESSION, path->Length+1);
 
     if (!tmppath) {
         goto fail1;
     }
     RtlZeroMemory(tmppath, path->Length+1);
-    tmpleaf = ExAllocatePoolWithTag(NonPagedPool,path->Length+1,'XenP');
+    tmpleaf = PoolAllocate(XENIFACE_POOL_SESSION, path->Length+1);
     if (!tmpleaf) {
         goto fail2;
     }
@@ -1945,7 +2692,7 @@ SessionExecuteGetNextSibling(UCHAR *InBuffer,
         }
 
         WriteCountedUTF8String(fullpath, valuepos);
-        ExFreePool(fullpath);
+        PoolFree(fullpath);
     }
     else {
         WriteCountedUTF8String("", valuepos);
@@ -1958,10 +2705,10 @@ fail4:
     STORE(Free, fdoData->StoreInterface, listresults);
 
 fail3:
-    ExFreePool(tmpleaf);
+    PoolFree(tmpleaf);
 
 fail2:
-	ExFreePool(tmppath);
+	PoolFree(tmppath);
 
 fail1:
     FreeUTF8String(path);
@@ -2006,7 +2753,7 @@ SessionExecuteGetChildren(UCHAR *InBuffer,
     }
 
     status = STATUS_INSUFFICIENT_RESOURCES;
-    tmppath = ExAllocatePoolWithTag(NonPagedPool,path->Length+1,'XenP');
+    tmppath = PoolAllocate(XENIFACE_POOL_SESSION, path->Length+1);
     if (!tmppath) {
         goto fail1;
     }
@@ -2068,7 +2815,7 @@ SessionExecuteGetChildren(UCHAR *InBuffer,
 
         WriteCountedUTF8String(fullpath, valuepos);
         valuepos+=GetCountedUtf8Size(fullpath);
-        ExFreePool(fullpath);
+        PoolFree(fullpath);
         for (;*nextresults!=0;nextresults++);
         nextresults++;
         i++;
@@ -2082,7 +2829,7 @@ fail3:
     STORE(Free, fdoData->StoreInterface, listresults);
 
 fail2:
-    ExFreePool(tmppath);
+    PoolFree(tmppath);
 
 fail1:
     FreeUTF8String(path);
@@ -2192,6 +2939,11 @@ SessionExecuteCommitTransaction(UCHAR *InBuffer,
     
     session->transaction = NULL;
 
+    // Values read outside the transaction may have been overtaken by
+    // what it has just committed.
+    if (NT_SUCCESS(status))
+        CacheInvalidateAll(fdoData->Cache);
+
 failtransactionnotactive:
     UnlockSessions(fdoData);
 failsessionnotfound:
@@ -2274,7 +3026,7 @@ SessionExecuteGetValue(UCHAR *InBuffer,
         return status;;
     
     status = STATUS_INSUFFICIENT_RESOURCES;
-    tmppath = ExAllocatePoolWithTag(NonPagedPool,path->Length+1,'XenP');
+    tmppath = PoolAllocate(XENIFACE_POOL_SESSION, path->Length+1);
     if (!tmppath) {
         goto fail1;
     }
@@ -2287,7 +3039,7 @@ SessionExecuteGetValue(UCHAR *InBuffer,
             NULL){
         goto fail2;
     }
-    status = STORE(Read, fdoData->StoreInterface, session->transaction, NULL, tmppath, &value);
+    status = CacheRead(fdoData->Cache, session->transaction, tmppath, &value);
     UnlockSessions(fdoData);
                 
     if (!NT_SUCCESS(status)) 
@@ -2303,16 +3055,42 @@ SessionExecuteGetValue(UCHAR *InBuffer,
     WriteCountedUTF8String(value, valuepos);
 
 fail3:
-    STORE(Free, fdoData->StoreInterface, value);
+    CacheFree(value);
     *byteswritten = RequiredSize;
 
 fail2:
-    ExFreePool(tmppath);
+    PoolFree(tmppath);
 
 fail1:
     FreeUTF8String(path);
     return status;
 }
+static NTSTATUS
+BaseAddSession(UCHAR *stringid,
+                ULONG flags,
+                XENIFACE_FDO* fdoData,
+                ULONG *id) {
+    UNICODE_STRING ustring;
+    NTSTATUS status;
+
+    AllocUnicodeStringBuffer(&ustring, *(USHORT*)(stringid));
+    if (ustring.Buffer == NULL)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    status = RtlUnicodeStringCbCopyStringN(&ustring,
+                                            (LPCWSTR)(stringid+sizeof(USHORT)), 
+                                            *(USHORT*)(stringid));
+    if (!NT_SUCCESS(status)) {
+        FreeUnicodeStringBuffer(&ustring);
+        return status;
+    }
+    status = CreateNewSession(fdoData, &ustring, flags, id);
+    if (!NT_SUCCESS(status)) {
+        FreeUnicodeStringBuffer(&ustring);
+        return status;
+    }
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS
 BaseExecuteAddSession(UCHAR *InBuffer,
                         ULONG InBufferSize,
@@ -2321,7 +3099,6 @@ BaseExecuteAddSession(UCHAR *InBuffer,
                         XENIFACE_FDO* fdoData,
                         OUT ULONG_PTR *byteswritten) {
     ULONG RequiredSize;
-    UNICODE_STRING ustring;
     ULONG *id;
     UCHAR* stringid;
     NTSTATUS status;
@@ -2338,21 +3115,47 @@ BaseExecuteAddSession(UCHAR *InBuffer,
         return STATUS_BUFFER_TOO_SMALL;
     }
     
-    AllocUnicodeStringBuffer(&ustring, *(USHORT*)(stringid));
-    if (ustring.Buffer == NULL)
-        return STATUS_INSUFFICIENT_RESOURCES;
-    status = RtlUnicodeStringCbCopyStringN(&ustring,
-                                            (LPCWSTR)(stringid+sizeof(USHORT)), 
-                                            *(USHORT*)(stringid));
-    if (!NT_SUCCESS(status)) {
-        FreeUnicodeStringBuffer(&ustring);
+    status = BaseAddSession(stringid, 0, fdoData, id);
+    if (!NT_SUCCESS(status))
         return status;
+
+    *byteswritten = RequiredSize;
+    return STATUS_SUCCESS;
+
+}
+
+NTSTATUS
+BaseExecuteAddSessionEx(UCHAR *InBuffer,
+                        ULONG InBufferSize,
+                        UCHAR *OutBuffer,
+                        ULONG OutBufferSize,
+                        XENIFACE_FDO* fdoData,
+                        OUT ULONG_PTR *byteswritten) {
+    ULONG RequiredSize;
+    ULONG *id;
+    UCHAR* stringid;
+    ULONG* flags;
+    NTSTATUS status;
+    *byteswritten = 0;
+    if (!AccessWmiBuffer(InBuffer, TRUE, &RequiredSize, InBufferSize,
+                            WMI_STRING, &stringid, 
+                            WMI_UINT32, &flags,
+                            WMI_DONE)){
+        return STATUS_INVALID_DEVICE_REQUEST;
     }
-    status = CreateNewSession(fdoData, &ustring, id);
-    if (!NT_SUCCESS(status)) {
-        FreeUnicodeStringBuffer(&ustring);
-        return status;
+    if (*flags & ~SESSION_FLAG_MASK)
+        return STATUS_INVALID_PARAMETER;
+
+    if (!AccessWmiBuffer(OutBuffer, FALSE, &RequiredSize, OutBufferSize,
+                            WMI_UINT32, &id,
+                            WMI_DONE)) {
+        *byteswritten = RequiredSize;
+        return STATUS_BUFFER_TOO_SMALL;
     }
+    
+    status = BaseAddSession(stringid, *flags, fdoData, id);
+    if (!NT_SUCCESS(status))
+        return status;
 
     *byteswritten = RequiredSize;
     return STATUS_SUCCESS;
@@ -2360,6 +3163,42 @@ BaseExecuteAddSession(UCHAR *InBuffer,
 }
 
 
+static VOID
+SessionQueryCalls(XenStoreSession *session, ULONG *throttled, ULONG *queued) {
+    *throttled = 0;
+    *queued = 0;
+    if (session->sched != NULL)
+        SchedClientQuery(session->sched, throttled, queued);
+}
+
+// Takes a turn for a method call on the session, if it exists; the
+// method itself finds the session again and reports if it has gone.
+static PXENIFACE_SCHED_CLIENT
+SessionSchedEnter(XENIFACE_FDO *fdoData, UNICODE_STRING *instance) {
+    XenStoreSession *session;
+    PXENIFACE_SCHED_CLIENT client = NULL;
+
+    LockSessions(fdoData);
+    session = FindSessionByInstanceLocked(fdoData, instance);
+    if (session != NULL && session->sched != NULL) {
+        client = session->sched;
+        SchedClientReference(client);
+    }
+    UnlockSessions(fdoData);
+
+    if (client != NULL)
+        SchedEnter(client);
+    return client;
+}
+
+static VOID
+SessionSchedLeave(PXENIFACE_SCHED_CLIENT client) {
+    if (client == NULL)
+        return;
+    SchedLeave(client);
+    SchedClientRelease(client);
+}
+
 NTSTATUS 
 SessionExecuteMethod(UCHAR *Buffer,
                     ULONG BufferSize,
@@ -2371,6 +3210,8 @@ SessionExecuteMethod(UCHAR *Buffer,
     NTSTATUS status;
     UNICODE_STRING instance;
     UCHAR *InstStr;
+    ULONGLONG start;
+    PXENIFACE_SCHED_CLIENT client;
     XenIfaceDebugPrint(TRACE,"%s\n",__FUNCTION__);
     if (!AccessWmiBuffer(Buffer, TRUE, &RequiredSize, BufferSize,
                             WMI_BUFFER, sizeof(WNODE_METHOD_ITEM),
@@ -2395,6 +3236,9 @@ SessionExecuteMethod(UCHAR *Buffer,
 
     
     XenIfaceDebugPrint(TRACE,"Method Id %d\n", Method->MethodId);
+    start = LatencyStart();
+    // Ending a session is never held back
+    client = (Method->MethodId != EndSession) ? SessionSchedEnter(fdoData, &instance) : NULL;
     switch (Method->MethodId) {
         case GetValue: 
             status = SessionExecuteGetValue(InBuffer, Method->SizeDataBlock,  
@@ -2428,6 +3272,22 @@ SessionExecuteMethod(UCHAR *Buffer,
                                               &instance, 
                                               byteswritten);
             break;
+        case SetWatchEx: 
+            status = SessionExecuteSetWatchEx(InBuffer, Method->SizeDataBlock,  
+                                              Buffer+Method->DataBlockOffset, 
+                                              BufferSize-Method->DataBlockOffset, 
+                                              fdoData,
+                                              &instance, 
+                                              byteswritten);
+            break;
+        case SetFilteredWatch: 
+            status = SessionExecuteSetFilteredWatch(InBuffer, Method->SizeDataBlock,  
+                                              Buffer+Method->DataBlockOffset, 
+                                              BufferSize-Method->DataBlockOffset, 
+                                              fdoData,
+                                              &instance, 
+                                              byteswritten);
+            break;
         case EndSession:
             status = SessionExecuteEndSession(InBuffer, Method->SizeDataBlock,  
                                               Buffer+Method->DataBlockOffset, 
@@ -2504,8 +3364,11 @@ SessionExecuteMethod(UCHAR *Buffer,
 
         default:
             XenIfaceDebugPrint(INFO,"DRV: Unknown WMI method %d\n", Method->MethodId);
+            SessionSchedLeave(client);
             return STATUS_WMI_ITEMID_NOT_FOUND;
     }
+    SessionSchedLeave(client);
+    LatencyRecord(XENIFACE_LATENCY_WMI_METHOD, start);
     Method->SizeDataBlock = (ULONG)*byteswritten;
     *byteswritten+=Method->DataBlockOffset;
     if (status == STATUS_BUFFER_TOO_SMALL) {
@@ -2546,11 +3409,50 @@ BaseExecuteMethod(UCHAR *Buffer,
             Method->WnodeHeader.BufferSize = (ULONG)*byteswritten;
             return status;
 
+        case AddSessionEx: 
+            status = BaseExecuteAddSessionEx(InBuffer, Method->SizeDataBlock,  
+                                             Buffer+Method->DataBlockOffset, 
+                                             BufferSize-Method->DataBlockOffset, 
+                                             fdoData, 
+                                             byteswritten);
+            Method->SizeDataBlock = (ULONG)*byteswritten;
+            *byteswritten+=Method->DataBlockOffset;
+            Method->WnodeHeader.BufferSize = (ULONG)*byteswritten;
+            return status;
+
         default:
             return STATUS_WMI_ITEMID_NOT_FOUND;
     }
 }
 
+// Statistics blocks have a single method, which resets them
+NTSTATUS 
+StatisticsExecuteMethod(UCHAR *Buffer,
+                    ULONG BufferSize,
+                    ULONG ResetMethodId,
+                    VOID (*Reset)(VOID),
+                    OUT ULONG_PTR *byteswritten) {
+    ULONG RequiredSize;
+    WNODE_METHOD_ITEM *Method;
+    if (!AccessWmiBuffer(Buffer, TRUE, &RequiredSize, BufferSize,
+                            WMI_BUFFER, sizeof(WNODE_METHOD_ITEM),
+                                &Method,
+                            WMI_DONE))
+    {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    if (Method->MethodId != ResetMethodId)
+        return STATUS_WMI_ITEMID_NOT_FOUND;
+
+    Reset();
+    *byteswritten = 0;
+    Method->SizeDataBlock = (ULONG)*byteswritten;
+    *byteswritten+=Method->DataBlockOffset;
+    Method->WnodeHeader.BufferSize = (ULONG)*byteswritten;
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS
 WmiExecuteMethod(
     IN PXENIFACE_FDO fdoData,
@@ -2568,6 +3470,18 @@ WmiExecuteMethod(
                                     stack->Parameters.WMI.BufferSize,  
                                     fdoData,  byteswritten);
     }
+    else if (IsEqualGUID(stack->Parameters.WMI.DataPath, &CitrixXenStoreLatency_GUID)) {
+        return StatisticsExecuteMethod(stack->Parameters.WMI.Buffer,
+                                    stack->Parameters.WMI.BufferSize,  
+                                    ResetLatency, LatencyReset,
+                                    byteswritten);
+    }
+    else if (IsEqualGUID(stack->Parameters.WMI.DataPath, &CitrixXenStoreContention_GUID)) {
+        return StatisticsExecuteMethod(stack->Parameters.WMI.Buffer,
+                                    stack->Parameters.WMI.BufferSize,  
+                                    ResetContention, ContentionReset,
+                                    byteswritten);
+    }
     
     else
         return STATUS_NOT_SUPPORTED;
@@ -2601,6 +3515,11 @@ GenerateSessionBlock(UCHAR *Buffer,
     while (session !=  (XenStoreSession *)&fdoData->SessionHead) {
         ULONG *id;
         UCHAR *sesbuf;
+        ULONG *pending;
+        ULONG *merged;
+        ULONG *dropped;
+        ULONG *throttled;
+        ULONG *queued;
         UCHAR *inamebuf;
 
         AccessWmiBuffer((PUCHAR)nodesizerequired, FALSE, &RequiredSize, 0,
@@ -2608,6 +3527,11 @@ GenerateSessionBlock(UCHAR *Buffer,
                         WMI_STRING, 
                             GetCountedUnicodeStringSize(&session->stringid), 
                             &sesbuf,
+                        WMI_UINT32, &pending,
+                        WMI_UINT32, &merged,
+                        WMI_UINT32, &dropped,
+                        WMI_UINT32, &throttled,
+                        WMI_UINT32, &queued,
                         WMI_DONE);
         nodesizerequired += RequiredSize;
         
@@ -2651,6 +3575,11 @@ GenerateSessionBlock(UCHAR *Buffer,
         while (session !=  (XenStoreSession *)&fdoData->SessionHead){
             ULONG *id;
             UCHAR *sesbuf;
+            ULONG *pending;
+            ULONG *merged;
+            ULONG *dropped;
+            ULONG *throttled;
+            ULONG *queued;
             UCHAR *inamebuf;
 
             AccessWmiBuffer(datapos, FALSE, &RequiredSize, BufferSize+Buffer-datapos,
@@ -2658,6 +3587,11 @@ GenerateSessionBlock(UCHAR *Buffer,
                             WMI_STRING, 
                                 GetCountedUnicodeStringSize(&session->stringid), 
                                 &sesbuf,
+                            WMI_UINT32, &pending,
+                            WMI_UINT32, &merged,
+                            WMI_UINT32, &dropped,
+                            WMI_UINT32, &throttled,
+                            WMI_UINT32, &queued,
                             WMI_DONE);
 
             node->OffsetInstanceDataAndLength[entrynum].OffsetInstanceData = 
@@ -2666,6 +3600,10 @@ GenerateSessionBlock(UCHAR *Buffer,
                 RequiredSize;
             *id = session->id;
             WriteCountedUnicodeString(&session->stringid, sesbuf);
+            *pending = session->eventcount;
+            *merged = (ULONG)session->eventsmerged;
+            *dropped = (ULONG)session->eventsdropped;
+            SessionQueryCalls(session, throttled, queued);
             datapos+=RequiredSize;
 
             AccessWmiBuffer(namepos, FALSE, &RequiredSize, BufferSize+Buffer-namepos,
@@ -2773,6 +3711,94 @@ GenerateBaseInstance(
     return STATUS_SUCCESS;
 }
 
+// Statistics blocks have a single PDO instance holding one fixed size
+// structure, filled in by a query routine.
+typedef VOID (*STATISTICS_QUERY)(PVOID Data);
+
+#define STATISTICS_NODE_SIZE(_node) (ULONG)((sizeof(_node) + 7) & ~7)
+
+NTSTATUS
+GenerateStatisticsBlock(UCHAR *Buffer,
+                        ULONG BufferSize,
+                        ULONG Length,
+                        STATISTICS_QUERY Query,
+                        ULONG_PTR *byteswritten) {
+    WNODE_ALL_DATA *node;
+    ULONG RequiredSize;
+    UCHAR *data;
+    if (!AccessWmiBuffer(Buffer, FALSE, &RequiredSize, BufferSize,
+                            WMI_BUFFER, STATISTICS_NODE_SIZE(WNODE_ALL_DATA), &node,
+                            WMI_BUFFER, Length, &data,
+                            WMI_DONE))
+    {
+        return NodeTooSmall(Buffer, BufferSize, RequiredSize, byteswritten);
+    }
+
+    node->DataBlockOffset =(ULONG)(data-Buffer);
+    node->WnodeHeader.BufferSize = RequiredSize;
+    KeQuerySystemTime(&node->WnodeHeader.TimeStamp);
+    node->WnodeHeader.Flags = WNODE_FLAG_ALL_DATA |
+                                WNODE_FLAG_FIXED_INSTANCE_SIZE |
+                                WNODE_FLAG_PDO_INSTANCE_NAMES;
+    Query(data);
+    node->InstanceCount = 1;
+    node->FixedInstanceSize = Length;
+    *byteswritten = RequiredSize;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+GenerateStatisticsInstance(UCHAR *Buffer,
+                        ULONG BufferSize,
+                        ULONG Length,
+                        STATISTICS_QUERY Query,
+                        ULONG_PTR *byteswritten) {
+    WNODE_SINGLE_INSTANCE *node;
+    ULONG RequiredSize;
+    UCHAR *dbo;
+    if (!AccessWmiBuffer(Buffer, FALSE, &RequiredSize, BufferSize,
+                            WMI_BUFFER, sizeof(WNODE_SINGLE_INSTANCE), &node,
+                            WMI_DONE))
+    {
+        return NodeTooSmall(Buffer, BufferSize, RequiredSize, byteswritten);
+    }
+    if (!AccessWmiBuffer(Buffer, FALSE, &RequiredSize, BufferSize,
+                            WMI_BUFFER, sizeof(WNODE_SINGLE_INSTANCE), &node,
+                            WMI_OFFSET, node->DataBlockOffset, Length, &dbo,
+                            WMI_DONE))
+    {
+        return NodeTooSmall(Buffer, BufferSize, RequiredSize, byteswritten);
+    }
+
+    if (node->InstanceIndex != 0) {
+        return STATUS_WMI_ITEMID_NOT_FOUND;
+    }
+
+    Query(dbo);
+
+    node->WnodeHeader.BufferSize = node->DataBlockOffset+Length;
+    node->SizeDataBlock = Length;
+
+    *byteswritten = node->DataBlockOffset+Length;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+QueryLatency(PVOID Data) {
+    LatencyQuery((PXENIFACE_LATENCY_STATISTICS)Data);
+}
+
+VOID
+QueryContention(PVOID Data) {
+    ContentionQuery((PXENIFACE_CONTENTION_STATISTICS)Data);
+}
+
+VOID
+QueryPool(PVOID Data) {
+    PoolQuery((PXENIFACE_POOL_STATISTICS)Data);
+}
+
 NTSTATUS
 GenerateSessionInstance(UCHAR *Buffer,
                     ULONG BufferSize,
@@ -2786,6 +3812,11 @@ GenerateSessionInstance(UCHAR *Buffer,
     ULONG* id;
     XenStoreSession *session;
     UCHAR *sesbuf;
+    ULONG *pending;
+    ULONG *merged;
+    ULONG *dropped;
+    ULONG *throttled;
+    ULONG *queued;
     
     if (!AccessWmiBuffer(Buffer, TRUE, &RequiredSize, BufferSize,
                             WMI_BUFFER, sizeof(WNODE_SINGLE_INSTANCE), &node,
@@ -2814,6 +3845,11 @@ GenerateSessionInstance(UCHAR *Buffer,
                             WMI_STRING, 
                                 GetCountedUnicodeStringSize(&session->stringid),
                                 &sesbuf,
+                            WMI_UINT32, &pending,
+                            WMI_UINT32, &merged,
+                            WMI_UINT32, &dropped,
+                            WMI_UINT32, &throttled,
+                            WMI_UINT32, &queued,
                             WMI_DONE)) {
         UnlockSessions(fdoData);
         return NodeTooSmall(Buffer, BufferSize, RequiredSize+node->DataBlockOffset,
@@ -2822,6 +3858,10 @@ GenerateSessionInstance(UCHAR *Buffer,
 
     *id = session->id;
     WriteCountedUnicodeString(&session->stringid, sesbuf);
+    *pending = session->eventcount;
+    *merged = (ULONG)session->eventsmerged;
+    *dropped = (ULONG)session->eventsdropped;
+    SessionQueryCalls(session, throttled, queued);
     UnlockSessions(fdoData);
     node->SizeDataBlock = RequiredSize;
     node->WnodeHeader.BufferSize = node->DataBlockOffset + RequiredSize;
@@ -2856,6 +3896,30 @@ WmiQueryAllData(
                                     fdoData,
                                     byteswritten);
     }
+    else if (IsEqualGUID(stack->Parameters.WMI.DataPath, 
+                            &CitrixXenStoreLatency_GUID)) {
+        return GenerateStatisticsBlock(stack->Parameters.WMI.Buffer, 
+                                    stack->Parameters.WMI.BufferSize,
+                                    sizeof(XENIFACE_LATENCY_STATISTICS),
+                                    QueryLatency,
+                                    byteswritten);
+    }
+    else if (IsEqualGUID(stack->Parameters.WMI.DataPath, 
+                            &CitrixXenStoreContention_GUID)) {
+        return GenerateStatisticsBlock(stack->Parameters.WMI.Buffer, 
+                                    stack->Parameters.WMI.BufferSize,
+                                    sizeof(XENIFACE_CONTENTION_STATISTICS),
+                                    QueryContention,
+                                    byteswritten);
+    }
+    else if (IsEqualGUID(stack->Parameters.WMI.DataPath, 
+                            &CitrixXenStorePool_GUID)) {
+        return GenerateStatisticsBlock(stack->Parameters.WMI.Buffer, 
+                                    stack->Parameters.WMI.BufferSize,
+                                    sizeof(XENIFACE_POOL_STATISTICS),
+                                    QueryPool,
+                                    byteswritten);
+    }
     else
         return STATUS_NOT_SUPPORTED;
 
@@ -2881,6 +3945,27 @@ WmiQuerySingleInstance(
                                     fdoData,
                                     byteswritten);
     }
+    else if (IsEqualGUID(stack->Parameters.WMI.DataPath, &CitrixXenStoreLatency_GUID)) {
+        return GenerateStatisticsInstance(stack->Parameters.WMI.Buffer, 
+                                    stack->Parameters.WMI.BufferSize,
+                                    sizeof(XENIFACE_LATENCY_STATISTICS),
+                                    QueryLatency,
+                                    byteswritten);
+    }
+    else if (IsEqualGUID(stack->Parameters.WMI.DataPath, &CitrixXenStoreContention_GUID)) {
+        return GenerateStatisticsInstance(stack->Parameters.WMI.Buffer, 
+                                    stack->Parameters.WMI.BufferSize,
+                                    sizeof(XENIFACE_CONTENTION_STATISTICS),
+                                    QueryContention,
+                                    byteswritten);
+    }
+    else if (IsEqualGUID(stack->Parameters.WMI.DataPath, &CitrixXenStorePool_GUID)) {
+        return GenerateStatisticsInstance(stack->Parameters.WMI.Buffer, 
+                                    stack->Parameters.WMI.BufferSize,
+                                    sizeof(XENIFACE_POOL_STATISTICS),
+                                    QueryPool,
+                                    byteswritten);
+    }
     else
         return STATUS_NOT_SUPPORTED;
 
@@ -2899,7 +3984,7 @@ WmiRegInfo(
     UCHAR *mofnameptr;
     UCHAR *regpath;
     ULONG RequiredSize;
-    int entries = 4;
+    int entries = 8;
     const static UNICODE_STRING mofname = RTL_CONSTANT_STRING(L"XENIFACEMOF");
     
     size_t mofnamesz;
@@ -2966,6 +4051,35 @@ WmiRegInfo(
 	guid->Pdo = (ULONG_PTR)fdoData->PhysicalDeviceObject; 
 	ObReferenceObject(fdoData->PhysicalDeviceObject);
 
+    guid = &reginfo->WmiRegGuid[4];
+    guid->InstanceCount = 1;
+    guid->Guid = CitrixXenStoreWatchValueEvent_GUID;
+    guid->Flags = WMIREG_FLAG_INSTANCE_PDO |
+                WMIREG_FLAG_EVENT_ONLY_GUID ;
+    guid->Pdo = (ULONG_PTR)fdoData->PhysicalDeviceObject; 
+	ObReferenceObject(fdoData->PhysicalDeviceObject);
+
+    guid = &reginfo->WmiRegGuid[5];
+    guid->InstanceCount = 1;
+    guid->Guid = CitrixXenStoreLatency_GUID;
+    guid->Flags = WMIREG_FLAG_INSTANCE_PDO;
+    guid->Pdo = (ULONG_PTR)fdoData->PhysicalDeviceObject; 
+	ObReferenceObject(fdoData->PhysicalDeviceObject);
+
+    guid = &reginfo->WmiRegGuid[6];
+    guid->InstanceCount = 1;
+    guid->Guid = CitrixXenStoreContention_GUID;
+    guid->Flags = WMIREG_FLAG_INSTANCE_PDO;
+    guid->Pdo = (ULONG_PTR)fdoData->PhysicalDeviceObject; 
+	ObReferenceObject(fdoData->PhysicalDeviceObject);
+
+    guid = &reginfo->WmiRegGuid[7];
+    guid->InstanceCount = 1;
+    guid->Guid = CitrixXenStorePool_GUID;
+    guid->Flags = WMIREG_FLAG_INSTANCE_PDO;
+    guid->Pdo = (ULONG_PTR)fdoData->PhysicalDeviceObject; 
+	ObReferenceObject(fdoData->PhysicalDeviceObject);
+
 
     *byteswritten = RequiredSize;
     return STATUS_SUCCESS;
@@ -0,0 +1,373 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <util.h>
+
+#include "work.h"
+#include "mpsc.h"
+#include "thread.h"
+#include "log.h"
+#include "assert.h"
+
+#define WORK_POOL   'KROW'
+
+// Items taken by a worker each time it visits the queue. One place is
+// always left for a normal priority item, so a steady stream of high
+// priority work cannot starve the rest.
+#define WORK_BATCH  16
+
+#define WORK_QUEUED     0x00000001
+#define WORK_RUNNING    0x00000002
+#define WORK_DEFERRED   0x00000004  // Popped while running; run again after
+
+struct _XENIFACE_WORK_QUEUE {
+    XENIFACE_MPSC       Ring[XENIFACE_WORK_PRIORITIES];
+    KEVENT              Work;
+    FAST_MUTEX          Consumer;
+    KSPIN_LOCK          Lock;
+    ULONG               Workers;
+    PXENIFACE_THREAD    Thread[1];
+};
+
+static FORCEINLINE PVOID
+__WorkAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocateNonPagedPoolWithTag(Length, WORK_POOL);
+}
+
+static FORCEINLINE VOID
+__WorkFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, WORK_POOL);
+}
+
+VOID
+WorkItemInitialize(
+    IN  PXENIFACE_WORK_ITEM     Item,
+    IN  XENIFACE_WORK_FUNCTION  Function,
+    IN  PVOID                   Context,
+    IN  XENIFACE_WORK_PRIORITY  Priority
+    )
+{
+    ASSERT3U(Priority, <, XENIFACE_WORK_PRIORITIES);
+
+    Item->Function = Function;
+    Item->Context = Context;
+    Item->Priority = Priority;
+    Item->State = 0;
+    KeInitializeEvent(&Item->Idle, NotificationEvent, TRUE);
+}
+
+BOOLEAN
+WorkQueueInsert(
+    IN  PXENIFACE_WORK_QUEUE    Queue,
+    IN  PXENIFACE_WORK_ITEM     Item
+    )
+{
+    LONG                        State;
+
+    ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
+
+    State = InterlockedOr(&Item->State, WORK_QUEUED);
+    if (State & WORK_QUEUED)
+        return TRUE;
+
+    if (!MpscPush(&Queue->Ring[Item->Priority], Item)) {
+        (VOID) InterlockedAnd(&Item->State, ~WORK_QUEUED);
+        return FALSE;
+    }
+
+    // A worker clears the event before its final look at the rings, so
+    // if it still reads as set the item will be seen without a wake up
+    KeMemoryBarrier();
+    if (KeReadStateEvent(&Queue->Work) == 0)
+        KeSetEvent(&Queue->Work, IO_NO_INCREMENT, FALSE);
+
+    return TRUE;
+}
+
+static ULONG
+__WorkQueueDequeue(
+    IN  PXENIFACE_WORK_QUEUE    Queue,
+    OUT PXENIFACE_WORK_ITEM     Batch[]
+    )
+{
+    PXENIFACE_WORK_ITEM         Item;
+    ULONG                       Count;
+
+    Count = 0;
+
+    ExAcquireFastMutex(&Queue->Consumer);
+
+    while (Count < WORK_BATCH - 1 &&
+           (Item = MpscPop(&Queue->Ring[XENIFACE_WORK_HIGH])) != NULL)
+        Batch[Count++] = Item;
+
+    while (Count < WORK_BATCH &&
+           (Item = MpscPop(&Queue->Ring[XENIFACE_WORK_NORMAL])) != NULL)
+        Batch[Count++] = Item;
+
+    if (Count < WORK_BATCH) {
+        KeClearEvent(&Queue->Work);
+        KeMemoryBarrier();
+
+        // Catch anything pushed before the event was cleared
+        if (!MpscIsEmpty(&Queue->Ring[XENIFACE_WORK_HIGH]) ||
+            !MpscIsEmpty(&Queue->Ring[XENIFACE_WORK_NORMAL]))
+            KeSetEvent(&Queue->Work, IO_NO_INCREMENT, FALSE);
+    }
+
+    ExReleaseFastMutex(&Queue->Consumer);
+
+    return Count;
+}
+
+static VOID
+__WorkItemRun(
+    IN  PXENIFACE_WORK_QUEUE    Queue,
+    IN  PXENIFACE_WORK_ITEM     Item
+    )
+{
+    KIRQL                       Irql;
+    LONG                        State;
+
+    // An item queued again while it runs can be popped by another
+    // worker. That worker leaves it to the one running it, which runs it
+    // again when it finishes, so an item never runs on two workers at
+    // once. The transitions of RUNNING and DEFERRED are made under the
+    // lock; QUEUED is still set without it by WorkQueueInsert.
+    KeAcquireSpinLock(&Queue->Lock, &Irql);
+
+    if (Item->State & WORK_RUNNING) {
+        (VOID) InterlockedOr(&Item->State, WORK_DEFERRED);
+        KeReleaseSpinLock(&Queue->Lock, Irql);
+        return;
+    }
+
+    // Mark it running before it stops being queued, so that it never
+    // looks idle in between
+    (VOID) InterlockedOr(&Item->State, WORK_RUNNING);
+
+    KeReleaseSpinLock(&Queue->Lock, Irql);
+
+    for (;;) {
+        (VOID) InterlockedAnd(&Item->State, ~WORK_QUEUED);
+
+        Item->Function(Item->Context);
+
+        // The item may be freed as soon as a waiter sees it idle, so it
+        // is last touched under the lock the waiter takes
+        KeAcquireSpinLock(&Queue->Lock, &Irql);
+
+        if (Item->State & WORK_DEFERRED) {
+            (VOID) InterlockedAnd(&Item->State, ~WORK_DEFERRED);
+            KeReleaseSpinLock(&Queue->Lock, Irql);
+            continue;
+        }
+
+        State = InterlockedAnd(&Item->State, ~WORK_RUNNING);
+        if ((State & ~WORK_RUNNING) == 0)
+            KeSetEvent(&Item->Idle, IO_NO_INCREMENT, FALSE);
+
+        KeReleaseSpinLock(&Queue->Lock, Irql);
+        break;
+    }
+}
+
+static NTSTATUS
+WorkQueueWorker(
+    IN  PXENIFACE_THREAD        Self,
+    IN  PVOID                   Context
+    )
+{
+    PXENIFACE_WORK_QUEUE        Queue = Context;
+    PVOID                       Events[2];
+    PXENIFACE_WORK_ITEM         Batch[WORK_BATCH];
+    ULONG                       Count;
+    ULONG                       Index;
+
+    Events[0] = ThreadGetEvent(Self);
+    Events[1] = &Queue->Work;
+
+    for (;;) {
+        (VOID) KeWaitForMultipleObjects(ARRAYSIZE(Events),
+                                        Events,
+                                        WaitAny,
+                                        Executive,
+                                        KernelMode,
+                                        FALSE,
+                                        NULL,
+                                        NULL);
+
+        do {
+            Count = __WorkQueueDequeue(Queue, Batch);
+
+            for (Index = 0; Index < Count; Index++)
+                __WorkItemRun(Queue, Batch[Index]);
+        } while (Count == WORK_BATCH);
+
+        if (ThreadIsAlerted(Self))
+            break;
+    }
+
+    // Nothing more can be inserted; run what is left
+    while ((Count = __WorkQueueDequeue(Queue, Batch)) != 0) {
+        for (Index = 0; Index < Count; Index++)
+            __WorkItemRun(Queue, Batch[Index]);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WorkItemWait(
+    IN  PXENIFACE_WORK_QUEUE    Queue,
+    IN  PXENIFACE_WORK_ITEM     Item
+    )
+{
+    KIRQL                       Irql;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    for (;;) {
+        KeAcquireSpinLock(&Queue->Lock, &Irql);
+
+        if (Item->State == 0) {
+            KeReleaseSpinLock(&Queue->Lock, Irql);
+            break;
+        }
+
+        KeClearEvent(&Item->Idle);
+        KeReleaseSpinLock(&Queue->Lock, Irql);
+
+        (VOID) KeWaitForSingleObject(&Item->Idle,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+    }
+}
+
+NTSTATUS
+WorkQueueCreate(
+    IN  ULONG                   Workers,
+    IN  ULONG                   Depth,
+    OUT PXENIFACE_WORK_QUEUE    *Queue
+    )
+{
+    PXENIFACE_MPSC_SLOT         Slot;
+    ULONG                       Length;
+    ULONG                       Priority;
+    ULONG                       Index;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+    ASSERT3U(Workers, !=, 0);
+
+    // Round up to a power of two
+    status = STATUS_INVALID_PARAMETER;
+    if (Depth == 0 || Depth > 0x10000)
+        goto fail1;
+
+    while ((Depth & (Depth - 1)) != 0)
+        Depth += Depth & ~(Depth - 1);
+
+    Length = FIELD_OFFSET(XENIFACE_WORK_QUEUE, Thread) +
+             (Workers * sizeof (PXENIFACE_THREAD));
+    Length = (Length + sizeof (PVOID) - 1) & ~(sizeof (PVOID) - 1);
+
+    *Queue = __WorkAllocate(Length +
+                            (XENIFACE_WORK_PRIORITIES * Depth * sizeof (XENIFACE_MPSC_SLOT)));
+
+    status = STATUS_NO_MEMORY;
+    if (*Queue == NULL)
+        goto fail2;
+
+    Slot = (PXENIFACE_MPSC_SLOT)((PUCHAR)*Queue + Length);
+    for (Priority = 0; Priority < XENIFACE_WORK_PRIORITIES; Priority++)
+        MpscInitialize(&(*Queue)->Ring[Priority], &Slot[Priority * Depth], Depth);
+
+    KeInitializeEvent(&(*Queue)->Work, NotificationEvent, FALSE);
+    ExInitializeFastMutex(&(*Queue)->Consumer);
+    KeInitializeSpinLock(&(*Queue)->Lock);
+
+    for (Index = 0; Index < Workers; Index++) {
+        status = ThreadCreate(WorkQueueWorker, *Queue, &(*Queue)->Thread[Index]);
+        if (!NT_SUCCESS(status))
+            goto fail3;
+
+        (*Queue)->Workers++;
+    }
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+    WorkQueueDestroy(*Queue);
+    *Queue = NULL;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+VOID
+WorkQueueDestroy(
+    IN  PXENIFACE_WORK_QUEUE    Queue
+    )
+{
+    ULONG                       Index;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    for (Index = 0; Index < Queue->Workers; Index++)
+        ThreadAlert(Queue->Thread[Index]);
+
+    for (Index = 0; Index < Queue->Workers; Index++) {
+        ThreadJoin(Queue->Thread[Index]);
+        Queue->Thread[Index] = NULL;
+    }
+
+    ASSERT(MpscIsEmpty(&Queue->Ring[XENIFACE_WORK_HIGH]));
+    ASSERT(MpscIsEmpty(&Queue->Ring[XENIFACE_WORK_NORMAL]));
+
+    __WorkFree(Queue);
+}
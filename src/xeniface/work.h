@@ -0,0 +1,98 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_WORK_H
+#define _XENIFACE_WORK_H
+
+#include <ntddk.h>
+
+typedef struct _XENIFACE_WORK_QUEUE XENIFACE_WORK_QUEUE, *PXENIFACE_WORK_QUEUE;
+
+typedef VOID (*XENIFACE_WORK_FUNCTION)(PVOID);
+
+typedef enum _XENIFACE_WORK_PRIORITY {
+    XENIFACE_WORK_HIGH = 0,
+    XENIFACE_WORK_NORMAL,
+    XENIFACE_WORK_PRIORITIES
+} XENIFACE_WORK_PRIORITY;
+
+// Embedded in whatever the work is for. An item is in the queue at most
+// once: inserting an item that is already queued does nothing, so bursts
+// of requests are merged. An item inserted while it runs is queued again,
+// but never runs on two workers at once: it runs again once the current
+// run has finished.
+typedef struct _XENIFACE_WORK_ITEM {
+    XENIFACE_WORK_FUNCTION  Function;
+    PVOID                   Context;
+    XENIFACE_WORK_PRIORITY  Priority;
+    volatile LONG           State;
+    KEVENT                  Idle;
+} XENIFACE_WORK_ITEM, *PXENIFACE_WORK_ITEM;
+
+extern VOID
+WorkItemInitialize(
+    IN  PXENIFACE_WORK_ITEM     Item,
+    IN  XENIFACE_WORK_FUNCTION  Function,
+    IN  PVOID                   Context,
+    IN  XENIFACE_WORK_PRIORITY  Priority
+    );
+
+extern NTSTATUS
+WorkQueueCreate(
+    IN  ULONG                   Workers,
+    IN  ULONG                   Depth,
+    OUT PXENIFACE_WORK_QUEUE    *Queue
+    );
+
+// Runs anything still queued before returning
+extern VOID
+WorkQueueDestroy(
+    IN  PXENIFACE_WORK_QUEUE    Queue
+    );
+
+// May be called at up to DISPATCH_LEVEL. Returns FALSE, without queueing
+// the item, if the queue is full; the caller must then do the work some
+// other way.
+extern BOOLEAN
+WorkQueueInsert(
+    IN  PXENIFACE_WORK_QUEUE    Queue,
+    IN  PXENIFACE_WORK_ITEM     Item
+    );
+
+// Waits until the item is neither queued nor running, so that it can be
+// freed. The caller must stop inserting the item first.
+extern VOID
+WorkItemWait(
+    IN  PXENIFACE_WORK_QUEUE    Queue,
+    IN  PXENIFACE_WORK_ITEM     Item
+    );
+
+#endif  // _XENIFACE_WORK_H
@@ -0,0 +1,394 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Per-call overhead of the agent's two xenstore backends (XSAccessor.cpp)
+// with the driver replaced by a stand-in store.  Both backends reach the
+// same stand-in, so the difference is the marshalling each path does:
+//
+//   IOCTL  the request buffer the agent builds, the copy in and out of
+//          the I/O manager's system buffer, and the result allocation.
+//   WMI    the argument BSTRs (WmiString.h, as the agent builds them),
+//          a clone of the method's in-parameters, the copies WMI makes
+//          on Put, on the way to the provider and back, the conversion
+//          to and from the driver's UTF-8, the out-parameters and the
+//          result conversion.
+//
+// The cross-process hops to the WMI service are not modelled, so the
+// WMI figures are a lower bound.
+//
+//   backend_bench          check both paths agree
+//   backend_bench bench    also time them
+
+#include <windows.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+
+#define MAX_XENBUS_PATH 256
+
+void *XsAlloc(size_t size);
+void XsFree(const void *buf);
+
+#include "../src/win32stubagent/WmiString.h"
+
+unsigned long ShimAllocations;
+int ShimCounting = 1;
+
+static int Failures;
+
+#define CHECK(_cond)                                                \
+    do {                                                            \
+        if (!(_cond)) {                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_cond); \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+void *XsAlloc(size_t size)
+{
+    void *buf = calloc(1, size);
+
+    if (buf != NULL)
+        ShimCount();
+    return buf;
+}
+
+void XsFree(const void *buf)
+{
+    free((void *)buf);
+}
+
+// As XSAccessor.cpp
+#define XS_IOCTL_BUFFER (4096 + 2)
+
+// The stand-in driver: a flat store keyed by path
+static std::map<std::string, std::string> Store;
+
+static int DriverRead(const char *path, char *out, size_t outlen, size_t *len)
+{
+    std::map<std::string, std::string>::const_iterator it = Store.find(path);
+
+    if (it == Store.end() || it->second.size() + 1 > outlen)
+        return -1;
+    memcpy(out, it->second.c_str(), it->second.size() + 1);
+    *len = it->second.size();
+    return 0;
+}
+
+static int DriverWrite(const char *path, const char *value, size_t len)
+{
+    Store[path].assign(value, len);
+    return 0;
+}
+
+// DeviceIoControl with METHOD_BUFFERED: one system buffer, big enough for
+// input and output, copied in before and out after the driver runs
+static int StandInIoctl(int write, const char *in, size_t inlen, char *out,
+                        size_t outlen, size_t *returned)
+{
+    size_t size = (inlen > outlen) ? inlen : outlen;
+    char *system = (char *)malloc(size);
+    size_t len = 0;
+    int err;
+
+    ShimCount();
+    memcpy(system, in, inlen);
+    if (write) {
+        size_t pathlen = strlen(system) + 1;
+
+        err = DriverWrite(system, system + pathlen, inlen - pathlen - 1);
+    } else {
+        err = DriverRead(system, system, size, &len);
+        if (err == 0) {
+            len++;
+            memcpy(out, system, len);
+        }
+    }
+    free(system);
+
+    *returned = len;
+    return err;
+}
+
+// As IoctlBackendRead
+static ssize_t IoctlRead(const char *path, char **value)
+{
+    size_t returned;
+
+    *value = (char *)XsAlloc(XS_IOCTL_BUFFER);
+    if (*value == NULL)
+        return -1;
+
+    if (StandInIoctl(0, path, strlen(path) + 1, *value, XS_IOCTL_BUFFER,
+                     &returned) != 0 || returned == 0) {
+        XsFree(*value);
+        *value = NULL;
+        return -1;
+    }
+    return returned - 1;
+}
+
+// As IoctlBackendWrite
+static int IoctlWrite(const char *path, const char *data, size_t len)
+{
+    size_t pathlen = strlen(path) + 1;
+    size_t returned;
+    char *buf;
+    int err;
+
+    buf = (char *)malloc(pathlen + len + 1);
+    if (buf == NULL)
+        return -1;
+    ShimCount();
+
+    memcpy(buf, path, pathlen);
+    memcpy(buf + pathlen, data, len);
+    buf[pathlen + len] = 0;
+
+    err = StandInIoctl(1, buf, pathlen + len + 1, NULL, 0, &returned);
+    free(buf);
+    return err;
+}
+
+// The COM side of a method call: the in-parameter instance cloned from
+// the cached template, and the copies WMI takes of each argument
+struct StandInParams {
+    BSTR arg[2];
+    unsigned count;
+};
+
+static StandInParams *StandInClone(void)
+{
+    StandInParams *params = (StandInParams *)calloc(1, sizeof (StandInParams));
+
+    ShimCount();
+    return params;
+}
+
+static void StandInPut(StandInParams *params, VARIANT *var)
+{
+    params->arg[params->count++] =
+        SysAllocStringLen(var->bstrVal, SysStringLen(var->bstrVal));
+}
+
+static void StandInRelease(StandInParams *params)
+{
+    unsigned i;
+
+    for (i = 0; i < params->count; i++)
+        SysFreeString(params->arg[i]);
+    free(params);
+}
+
+// What goes to the provider is a copy of the parameters, which it turns
+// back into UTF-8 for the store
+static char *StandInToDriver(BSTR arg)
+{
+    BSTR copy = SysAllocStringLen(arg, SysStringLen(arg));
+    int n = WideCharToMultiByte(CP_UTF8, 0, copy, SysStringLen(copy), NULL, 0,
+                                NULL, NULL);
+    char *utf8 = (char *)malloc(n + 1);
+
+    ShimCount();
+    WideCharToMultiByte(CP_UTF8, 0, copy, SysStringLen(copy), utf8, n, NULL,
+                        NULL);
+    utf8[n] = '\0';
+    SysFreeString(copy);
+    return utf8;
+}
+
+// As WmiSessionGetEntry
+static char *WmiRead(const char *path, size_t *len)
+{
+    struct WmiStringArg vpath;
+    StandInParams *in;
+    char *driverpath;
+    char driverout[XS_IOCTL_BUFFER];
+    size_t driverlen;
+    BSTR out;
+    VARIANT outval;
+    char *space = NULL;
+
+    *len = 0;
+    if (setStringArg(&vpath, path))
+        return NULL;
+
+    in = StandInClone();
+    StandInPut(in, &vpath.var);
+
+    // ExecMethod: to the provider, the driver, and a value in the
+    // out-parameters on the way back
+    driverpath = StandInToDriver(in->arg[0]);
+    StandInRelease(in);
+    if (DriverRead(driverpath, driverout, sizeof (driverout), &driverlen) != 0)
+        goto fail;
+    out = mkBstr(driverout, driverlen);
+
+    // Get copies the value out of the out-parameters
+    VariantInit(&outval);
+    outval.vt = VT_BSTR;
+    outval.bstrVal = SysAllocStringLen(out, SysStringLen(out));
+    SysFreeString(out);
+
+    space = bstrToChar(outval.bstrVal, len);
+    SysFreeString(outval.bstrVal);
+
+fail:
+    free(driverpath);
+    releaseStringArg(&vpath);
+    return space;
+}
+
+// As WmiSessionSetEntry
+static int WmiWrite(const char *path, const char *value, size_t len)
+{
+    struct WmiStringArg vpath;
+    struct WmiStringArg vvalue;
+    StandInParams *in;
+    char *driverpath;
+    char *drivervalue;
+    int err = -1;
+
+    if (setStringArg(&vpath, path))
+        goto setvpath;
+    if (setStringArg(&vvalue, value, len))
+        goto setvvalue;
+
+    in = StandInClone();
+    StandInPut(in, &vpath.var);
+    StandInPut(in, &vvalue.var);
+
+    driverpath = StandInToDriver(in->arg[0]);
+    drivervalue = StandInToDriver(in->arg[1]);
+    StandInRelease(in);
+
+    err = DriverWrite(driverpath, drivervalue, strlen(drivervalue));
+    free(drivervalue);
+    free(driverpath);
+
+    releaseStringArg(&vvalue);
+setvvalue:
+    releaseStringArg(&vpath);
+setvpath:
+    return err;
+}
+
+static void TestAgree(void)
+{
+    char *value;
+    size_t len;
+
+    CHECK(IoctlWrite("data/meminfo_free", "1048576", 7) == 0);
+    CHECK(WmiWrite("data/meminfo_total", "2097152", 7) == 0);
+
+    value = WmiRead("data/meminfo_free", &len);
+    CHECK(value != NULL && len == 7 && strcmp(value, "1048576") == 0);
+    XsFree(value);
+
+    CHECK(IoctlRead("data/meminfo_total", &value) == 7);
+    CHECK(value != NULL && strcmp(value, "2097152") == 0);
+    XsFree(value);
+
+    CHECK(WmiRead("data/missing", &len) == NULL);
+    CHECK(IoctlRead("data/missing", &value) == -1 && value == NULL);
+}
+
+static double Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (double)Time.tv_sec + (double)Time.tv_nsec / 1e9;
+}
+
+#define ITERATIONS 200000
+
+static void Report(const char *name, double start, unsigned long allocations)
+{
+    double elapsed = Now() - start;
+
+    printf("backend: %-12s %7.1f ns/call, %.2f allocations/call\n",
+           name, elapsed * 1e9 / ITERATIONS,
+           (double)allocations / ITERATIONS);
+}
+
+static void Benchmark(void)
+{
+    unsigned long allocations;
+    char *value;
+    double start;
+    size_t len;
+    int i;
+
+    allocations = ShimAllocations;
+    start = Now();
+    for (i = 0; i < ITERATIONS; i++)
+        (void)IoctlWrite("data/meminfo_free", "1048576", 7);
+    Report("IOCTL write", start, ShimAllocations - allocations);
+
+    allocations = ShimAllocations;
+    start = Now();
+    for (i = 0; i < ITERATIONS; i++)
+        (void)WmiWrite("data/meminfo_free", "1048576", 7);
+    Report("WMI write", start, ShimAllocations - allocations);
+
+    allocations = ShimAllocations;
+    start = Now();
+    for (i = 0; i < ITERATIONS; i++) {
+        (void)IoctlRead("data/meminfo_free", &value);
+        XsFree(value);
+    }
+    Report("IOCTL read", start, ShimAllocations - allocations);
+
+    allocations = ShimAllocations;
+    start = Now();
+    for (i = 0; i < ITERATIONS; i++)
+        XsFree(WmiRead("data/meminfo_free", &len));
+    Report("WMI read", start, ShimAllocations - allocations);
+}
+
+int main(int argc, char **argv)
+{
+    TestAgree();
+
+    if (Failures != 0) {
+        fprintf(stderr, "backend: %d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("backend: ok\n");
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        Benchmark();
+
+    return 0;
+}
@@ -0,0 +1,587 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// User mode simulation of the driver's read cache (cache.c) against a
+// stand-in store, checking that no read returns a value older than the
+// last write whose watch has fired.
+//
+//   cache_test         run the tests
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The driver's own headers are replaced by the definitions below
+#define _XENIFACE_DRIVER_H
+#define _XENIFACE_FDO_H
+#define _XENIFACE_LOG_H
+#define _XENIFACE_ASSERT_H
+
+#include "ntddk.h"
+#include <store_interface.h>
+#include <suspend_interface.h>
+
+// The interface headers rely on the MSVC preprocessor dropping the comma
+// before an empty __VA_ARGS__
+#undef SUSPEND
+#define SUSPEND(_Operation, _Interface, ...) \
+        (*SUSPEND_OPERATIONS(_Interface))->SUSPEND_ ## _Operation((*SUSPEND_CONTEXT(_Interface)), ##__VA_ARGS__)
+
+typedef struct _XENIFACE_CACHE XENIFACE_CACHE, *PXENIFACE_CACHE;
+
+typedef struct _XENIFACE_FDO {
+    BOOLEAN     InterfacesAcquired;
+    PVOID       StoreInterface;
+    PVOID       SuspendInterface;
+} XENIFACE_FDO, *PXENIFACE_FDO;
+
+static struct {
+    UNICODE_STRING  RegistryPath;
+} DriverParameters;
+
+#define Trace(...)      ((void)0)
+#define Info(...)       ((void)0)
+#define Warning(...)    ((void)0)
+#define Error(...)      ((void)0)
+
+#define ASSERT(_cond)                                               \
+    do {                                                            \
+        if (!(_cond)) {                                             \
+            fprintf(stderr, "%s:%d: ASSERT(%s)\n", __FILE__, __LINE__, #_cond); \
+            abort();                                                \
+        }                                                           \
+    } while (0)
+
+#define ASSERT3U(_x, _op, _y)   ASSERT((_x) _op (_y))
+#define ASSERT3P(_x, _op, _y)   ASSERT((_x) _op (_y))
+
+#include "../src/xeniface/cache.c"
+
+#define READERS     2
+#define WRITES      20000
+
+static int Failures;
+
+#define CHECK(_cond)                                                \
+    do {                                                            \
+        if (!(_cond)) {                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_cond); \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+// The stand-in store: a few nodes, and watches which fire when a node at
+// or below theirs is written, and once as they are set
+#define NODES       8
+#define WATCHES     8
+#define NAME_LENGTH 64
+
+typedef struct _NODE {
+    CHAR    Path[NAME_LENGTH];
+    CHAR    Value[NAME_LENGTH];
+} NODE;
+
+struct _XENBUS_STORE_WATCH {
+    CHAR    Node[NAME_LENGTH];
+    PKEVENT Event;
+    BOOLEAN Live;
+};
+
+static pthread_mutex_t      StoreLock = PTHREAD_MUTEX_INITIALIZER;
+static NODE                 Node[NODES];
+static XENBUS_STORE_WATCH   Watch[WATCHES];
+static LONG                 LiveWatches;
+static ULONG                SuspendCount;
+static BOOLEAN              ReadYield;
+
+// The cache under test, so the store can check the lock is not held
+static PXENIFACE_CACHE      TheCache;
+static LONG                 LockedCalls;
+
+static BOOLEAN
+IsBelow(
+    const CHAR  *Path,
+    const CHAR  *Node
+    )
+{
+    size_t      Length = strlen(Node);
+
+    return (strncmp(Path, Node, Length) == 0 &&
+            (Path[Length] == '\0' || Path[Length] == '/')) ? TRUE : FALSE;
+}
+
+// Writes a node and fires its watches, as the backend would. With Fire
+// clear the write is missed, as across a migration.
+static VOID
+StoreWrite(
+    const CHAR  *Path,
+    ULONG       Value,
+    BOOLEAN     Fire
+    )
+{
+    ULONG       Index;
+
+    pthread_mutex_lock(&StoreLock);
+
+    for (Index = 0; Index < NODES; Index++)
+        if (Node[Index].Path[0] == '\0' || strcmp(Node[Index].Path, Path) == 0)
+            break;
+
+    if (Index == NODES)
+        abort();
+
+    snprintf(Node[Index].Path, NAME_LENGTH, "%s", Path);
+    snprintf(Node[Index].Value, NAME_LENGTH, "%u", Value);
+
+    for (Index = 0; Fire && Index < WATCHES; Index++)
+        if (Watch[Index].Live && IsBelow(Path, Watch[Index].Node))
+            KeSetEvent(Watch[Index].Event, IO_NO_INCREMENT, FALSE);
+
+    pthread_mutex_unlock(&StoreLock);
+}
+
+static NTSTATUS
+StoreRead(
+    PXENBUS_STORE_CONTEXT       Context,
+    PXENBUS_STORE_TRANSACTION   Transaction,
+    PCHAR                       Prefix,
+    PCHAR                       Path,
+    PCHAR                       *Value
+    )
+{
+    NTSTATUS                    status;
+    ULONG                       Index;
+
+    (VOID) Context;
+    (VOID) Transaction;
+    (VOID) Prefix;
+
+    status = STATUS_OBJECT_NAME_NOT_FOUND;
+    *Value = NULL;
+
+    pthread_mutex_lock(&StoreLock);
+
+    for (Index = 0; Index < NODES; Index++) {
+        if (strcmp(Node[Index].Path, Path) == 0) {
+            *Value = strdup(Node[Index].Value);
+            status = (*Value != NULL) ? STATUS_SUCCESS : STATUS_NO_MEMORY;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&StoreLock);
+
+    // Widen the window between reading a value and caching it
+    if (ReadYield)
+        sched_yield();
+
+    return status;
+}
+
+static VOID
+StoreFree(
+    PXENBUS_STORE_CONTEXT   Context,
+    PCHAR                   Value
+    )
+{
+    (VOID) Context;
+    free(Value);
+}
+
+static NTSTATUS
+StoreWatch(
+    PXENBUS_STORE_CONTEXT   Context,
+    PCHAR                   Prefix,
+    PCHAR                   Path,
+    PKEVENT                 Event,
+    PXENBUS_STORE_WATCH     *Handle
+    )
+{
+    ULONG                   Index;
+
+    (VOID) Context;
+    (VOID) Prefix;
+
+    if (TheCache->Lock.Held)
+        InterlockedIncrement(&LockedCalls);
+
+    pthread_mutex_lock(&StoreLock);
+
+    for (Index = 0; Index < WATCHES; Index++)
+        if (!Watch[Index].Live)
+            break;
+
+    if (Index == WATCHES) {
+        pthread_mutex_unlock(&StoreLock);
+        return STATUS_NO_MEMORY;
+    }
+
+    snprintf(Watch[Index].Node, NAME_LENGTH, "%s", Path);
+    Watch[Index].Event = Event;
+    Watch[Index].Live = TRUE;
+    LiveWatches++;
+
+    KeSetEvent(Event, IO_NO_INCREMENT, FALSE);
+
+    pthread_mutex_unlock(&StoreLock);
+
+    *Handle = &Watch[Index];
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+StoreUnwatch(
+    PXENBUS_STORE_CONTEXT   Context,
+    PXENBUS_STORE_WATCH     Handle
+    )
+{
+    (VOID) Context;
+
+    if (TheCache->Lock.Held)
+        InterlockedIncrement(&LockedCalls);
+
+    pthread_mutex_lock(&StoreLock);
+
+    CHECK(Handle->Live);
+    Handle->Live = FALSE;
+    LiveWatches--;
+
+    pthread_mutex_unlock(&StoreLock);
+
+    return STATUS_SUCCESS;
+}
+
+static ULONG
+SuspendGetCount(
+    PXENBUS_SUSPEND_CONTEXT Context
+    )
+{
+    (VOID) Context;
+    return __atomic_load_n(&SuspendCount, __ATOMIC_SEQ_CST);
+}
+
+static XENBUS_STORE_OPERATIONS  StoreOperations;
+static XENBUS_SUSPEND_OPERATIONS SuspendOperations;
+
+// Laid out as the STORE() and SUSPEND() macros expect
+static struct {
+    PVOID   Operations;
+    PVOID   Context;
+} StoreInterface = { &StoreOperations, NULL },
+  SuspendInterface = { &SuspendOperations, NULL };
+
+static XENIFACE_FDO Fdo;
+
+static PXENIFACE_CACHE
+CreateCache(
+    const CHAR      *Prefix
+    )
+{
+    PXENIFACE_CACHE Cache;
+    UNICODE_STRING  Name;
+    WCHAR           Buffer[NAME_LENGTH];
+    USHORT          Index;
+
+    memset(Node, 0, sizeof (Node));
+    memset(Watch, 0, sizeof (Watch));
+    LiveWatches = 0;
+    LockedCalls = 0;
+    SuspendCount = 0;
+    ReadYield = FALSE;
+
+    StoreOperations.STORE_Read = StoreRead;
+    StoreOperations.STORE_Free = StoreFree;
+    StoreOperations.STORE_Watch = StoreWatch;
+    StoreOperations.STORE_Unwatch = StoreUnwatch;
+    SuspendOperations.SUSPEND_Count = SuspendGetCount;
+
+    Fdo.InterfacesAcquired = TRUE;
+    Fdo.StoreInterface = &StoreInterface;
+    Fdo.SuspendInterface = &SuspendInterface;
+
+    if (!NT_SUCCESS(CacheInitialize(&Fdo, &Cache)))
+        abort();
+
+    for (Index = 0; Prefix[Index] != '\0'; Index++)
+        Buffer[Index] = (WCHAR)Prefix[Index];
+
+    Name.Buffer = Buffer;
+    Name.Length = Index * sizeof (WCHAR);
+    Name.MaximumLength = Name.Length;
+
+    if (!NT_SUCCESS(__CacheAddPrefix(Cache, &Name, CACHE_POLICY_READ_THROUGH)))
+        abort();
+
+    TheCache = Cache;
+    return Cache;
+}
+
+static VOID
+DestroyCache(
+    PXENIFACE_CACHE Cache
+    )
+{
+    CacheTeardown(Cache);
+
+    CHECK(LiveWatches == 0);
+    CHECK(LockedCalls == 0);
+}
+
+// Reads Path through the cache and returns its value as a number
+static ULONG
+Read(
+    PXENIFACE_CACHE             Cache,
+    PXENBUS_STORE_TRANSACTION   Transaction,
+    const CHAR                  *Path
+    )
+{
+    PCHAR                       Value;
+    ULONG                       Number;
+
+    if (!NT_SUCCESS(CacheRead(Cache, Transaction, (PCHAR)Path, &Value))) {
+        CHECK(!"read failed");
+        return 0;
+    }
+
+    Number = (ULONG)strtoul(Value, NULL, 10);
+    CacheFree(Value);
+
+    return Number;
+}
+
+static VOID
+TestCounters(void)
+{
+    PXENIFACE_CACHE             Cache;
+    XENIFACE_CACHE_STATISTICS   Statistics;
+
+    Cache = CreateCache("data");
+
+    // Nothing is cached until the FDO reaches D0
+    StoreWrite("data/ts", 1, TRUE);
+    CHECK(Read(Cache, NULL, "data/ts") == 1);
+    CHECK(LiveWatches == 0);
+
+    CacheResume(Cache);
+
+    // The first read sets the watch, the second caches the value. The
+    // watch firing as it is set discards nothing, so is not counted.
+    CHECK(Read(Cache, NULL, "data/ts") == 1);
+    CHECK(LiveWatches == 1);
+    CHECK(Read(Cache, NULL, "data/ts") == 1);
+    CHECK(Read(Cache, NULL, "data/ts") == 1);
+
+    CacheQueryStatistics(Cache, &Statistics);
+    CHECK(Statistics.Hits == 1);
+    CHECK(Statistics.Misses == 1);
+    CHECK(Statistics.Invalidations == 0);
+    CHECK(Statistics.Entries == 1);
+
+    // A write elsewhere leaves the value cached
+    StoreWrite("attr/ts", 7, TRUE);
+    CHECK(Read(Cache, NULL, "data/ts") == 1);
+
+    StoreWrite("data/ts", 2, TRUE);
+    CHECK(Read(Cache, NULL, "data/ts") == 2);
+
+    CacheQueryStatistics(Cache, &Statistics);
+    CHECK(Statistics.Hits == 2);
+    CHECK(Statistics.Misses == 2);
+    CHECK(Statistics.Invalidations == 1);
+
+    // A transaction goes to the store without touching the cache
+    CHECK(Read(Cache, (PXENBUS_STORE_TRANSACTION)&Statistics, "data/ts") == 2);
+
+    CacheQueryStatistics(Cache, &Statistics);
+    CHECK(Statistics.Hits == 2);
+    CHECK(Statistics.Misses == 2);
+
+    // Only an invalidation that discards something is counted
+    CacheInvalidate(Cache, "data/other");
+    CacheQueryStatistics(Cache, &Statistics);
+    CHECK(Statistics.Invalidations == 1);
+
+    CacheInvalidate(Cache, "data/ts");
+    CacheQueryStatistics(Cache, &Statistics);
+    CHECK(Statistics.Invalidations == 2);
+    CHECK(Statistics.Entries == 0);
+
+    DestroyCache(Cache);
+}
+
+static VOID
+TestSuspend(void)
+{
+    PXENIFACE_CACHE             Cache;
+    XENIFACE_CACHE_STATISTICS   Statistics;
+
+    Cache = CreateCache("data");
+    CacheResume(Cache);
+
+    StoreWrite("data/ts", 1, TRUE);
+    (VOID) Read(Cache, NULL, "data/ts");
+    CHECK(Read(Cache, NULL, "data/ts") == 1);
+
+    // Suspending drops the watch and the values; writes made meanwhile
+    // fire nothing
+    CacheSuspend(Cache);
+    CHECK(LiveWatches == 0);
+
+    StoreWrite("data/ts", 2, TRUE);
+    CHECK(Read(Cache, NULL, "data/ts") == 2);
+    CHECK(LiveWatches == 0);
+
+    CacheResume(Cache);
+    CHECK(Read(Cache, NULL, "data/ts") == 2);
+    CHECK(Read(Cache, NULL, "data/ts") == 2);
+    CHECK(LiveWatches == 1);
+
+    // A write missed across a migration is still seen, as the watch is
+    // set again and the values discarded
+    __atomic_add_fetch(&SuspendCount, 1, __ATOMIC_SEQ_CST);
+    StoreWrite("data/ts", 3, FALSE);
+    CHECK(Read(Cache, NULL, "data/ts") == 3);
+    CHECK(LiveWatches == 1);
+    CHECK(Read(Cache, NULL, "data/ts") == 3);
+
+    CacheQueryStatistics(Cache, &Statistics);
+    CHECK(Statistics.Invalidations == 2);
+
+    DestroyCache(Cache);
+}
+
+static volatile ULONG   Committed;
+static volatile LONG    Stop;
+
+static void *
+WriterThread(
+    void    *Argument
+    )
+{
+    ULONG   Value;
+
+    (void) Argument;
+
+    for (Value = 1; Value <= WRITES; Value++) {
+        StoreWrite("data/counter", Value, TRUE);
+        __atomic_store_n(&Committed, Value, __ATOMIC_SEQ_CST);
+
+        // Now and then, a migration which loses nothing
+        if (Value % 1000 == 0)
+            __atomic_add_fetch(&SuspendCount, 1, __ATOMIC_SEQ_CST);
+
+        if (Value % 16 == 0)
+            sched_yield();
+    }
+
+    __atomic_store_n(&Stop, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void *
+ReaderThread(
+    void            *Argument
+    )
+{
+    PXENIFACE_CACHE Cache = Argument;
+
+    while (!__atomic_load_n(&Stop, __ATOMIC_SEQ_CST)) {
+        ULONG   Floor = __atomic_load_n(&Committed, __ATOMIC_SEQ_CST);
+        ULONG   Value = Read(Cache, NULL, "data/counter");
+
+        CHECK(Value >= Floor);
+        if (Value < Floor)
+            break;
+    }
+
+    return NULL;
+}
+
+// Readers race a writer; every read must see at least the last write
+// that had completed, and so fired its watch, before the read began
+static VOID
+TestNoStaleReads(void)
+{
+    PXENIFACE_CACHE             Cache;
+    XENIFACE_CACHE_STATISTICS   Statistics;
+    pthread_t                   Writer;
+    pthread_t                   Reader[READERS];
+    ULONG                       Index;
+
+    Cache = CreateCache("data");
+    CacheResume(Cache);
+    ReadYield = TRUE;
+
+    StoreWrite("data/counter", 0, TRUE);
+    Committed = 0;
+    Stop = 0;
+
+    for (Index = 0; Index < READERS; Index++)
+        pthread_create(&Reader[Index], NULL, ReaderThread, Cache);
+    pthread_create(&Writer, NULL, WriterThread, NULL);
+
+    pthread_join(Writer, NULL);
+    for (Index = 0; Index < READERS; Index++)
+        pthread_join(Reader[Index], NULL);
+
+    CHECK(Read(Cache, NULL, "data/counter") == WRITES);
+    CHECK(LiveWatches == 1);
+
+    CacheQueryStatistics(Cache, &Statistics);
+    CHECK(Statistics.Hits + Statistics.Misses != 0);
+
+    DestroyCache(Cache);
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    (void) argc;
+    (void) argv;
+
+    TestCounters();
+    TestSuspend();
+    TestNoStaleReads();
+
+    if (Failures != 0) {
+        fprintf(stderr, "cache: %d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("cache: ok\n");
+
+    return 0;
+}
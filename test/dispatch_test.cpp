@@ -0,0 +1,286 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Unit test of the agent's dispatch core (Dispatch.cpp): handlers run on
+// pool threads when their event is signalled, handlers sharing a context
+// never overlap, a slow handler does not hold up one with its own
+// context, signals are coalesced, the hooks bracket each run and can
+// skip it, and unregistering waits for a running handler.
+
+#include <windows.h>
+
+#include "../src/win32stubagent/Dispatch.h"
+
+unsigned long ShimAllocations;
+int ShimCounting;
+
+static int Failures;
+
+#define CHECK(_cond)                                                \
+    do {                                                            \
+        if (!(_cond)) {                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_cond); \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static LONG Read(volatile LONG *counter)
+{
+    return __sync_add_and_fetch(counter, 0);
+}
+
+// Poll for up to a second
+static BOOL WaitFor(volatile LONG *counter, LONG value)
+{
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        if (Read(counter) >= value)
+            return TRUE;
+        Sleep(1);
+    }
+    return FALSE;
+}
+
+struct probe {
+    volatile LONG runs;
+    volatile LONG inside;
+    volatile LONG most;
+    volatile LONG *shared_inside;
+    volatile LONG hold;
+    DWORD ms;
+};
+
+static void Probe(void *ctx)
+{
+    struct probe *p = (struct probe *)ctx;
+    volatile LONG *inside = (p->shared_inside != NULL) ? p->shared_inside : &p->inside;
+    LONG now = __sync_add_and_fetch(inside, 1);
+    LONG most;
+
+    while ((most = p->most) < now &&
+           !__sync_bool_compare_and_swap(&p->most, most, now))
+        ;
+
+    __sync_add_and_fetch(&p->runs, 1);
+    if (p->ms != 0)
+        Sleep(p->ms);
+    while (Read(&p->hold) != 0)
+        Sleep(1);
+
+    __sync_sub_and_fetch(inside, 1);
+}
+
+static void TestRuns(void)
+{
+    struct dispatch_handler dh;
+    struct probe p;
+    HANDLE event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    memset(&p, 0, sizeof (p));
+    CHECK(RegisterDispatch(&dh, event, "runs", Probe, &p, NULL));
+
+    SetEvent(event);
+    CHECK(WaitFor(&p.runs, 1));
+    SetEvent(event);
+    CHECK(WaitFor(&p.runs, 2));
+
+    UnregisterDispatch(&dh);
+    CloseHandle(event);
+}
+
+static void TestSharedContext(void)
+{
+    struct dispatch_context context;
+    struct dispatch_handler dh[2];
+    struct probe p[2];
+    HANDLE event[2];
+    volatile LONG inside = 0;
+    int round;
+    int i;
+
+    InitDispatchContext(&context);
+    memset(p, 0, sizeof (p));
+    for (i = 0; i < 2; i++) {
+        event[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        p[i].shared_inside = &inside;
+        p[i].ms = 2;
+        CHECK(RegisterDispatch(&dh[i], event[i], "shared", Probe, &p[i],
+                               &context));
+    }
+
+    for (round = 1; round <= 20; round++) {
+        SetEvent(event[0]);
+        SetEvent(event[1]);
+        CHECK(WaitFor(&p[0].runs, round));
+        CHECK(WaitFor(&p[1].runs, round));
+    }
+
+    for (i = 0; i < 2; i++) {
+        UnregisterDispatch(&dh[i]);
+        CloseHandle(event[i]);
+        CHECK(p[i].most == 1);
+    }
+    ReleaseDispatchContext(&context);
+}
+
+static void TestOwnContext(void)
+{
+    struct dispatch_handler slow;
+    struct dispatch_handler fast;
+    struct probe ps;
+    struct probe pf;
+    HANDLE es = CreateEvent(NULL, FALSE, FALSE, NULL);
+    HANDLE ef = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    memset(&ps, 0, sizeof (ps));
+    memset(&pf, 0, sizeof (pf));
+    ps.hold = 1;
+
+    CHECK(RegisterDispatch(&slow, es, "slow", Probe, &ps, NULL));
+    CHECK(RegisterDispatch(&fast, ef, "fast", Probe, &pf, NULL));
+
+    // The fast handler runs while the slow one is still inside
+    SetEvent(es);
+    CHECK(WaitFor(&ps.inside, 1));
+    SetEvent(ef);
+    CHECK(WaitFor(&pf.runs, 1));
+    CHECK(Read(&ps.inside) == 1);
+
+    // Signals arriving meanwhile are coalesced into one more run
+    SetEvent(es);
+    SetEvent(es);
+    SetEvent(es);
+    __sync_sub_and_fetch(&ps.hold, 1);
+    CHECK(WaitFor(&ps.runs, 2));
+    Sleep(20);
+    CHECK(Read(&ps.runs) == 2);
+
+    UnregisterDispatch(&slow);
+    UnregisterDispatch(&fast);
+    CloseHandle(es);
+    CloseHandle(ef);
+}
+
+static void TestUnregisterWaits(void)
+{
+    struct dispatch_handler dh;
+    struct probe p;
+    HANDLE event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    memset(&p, 0, sizeof (p));
+    p.ms = 50;
+    CHECK(RegisterDispatch(&dh, event, "teardown", Probe, &p, NULL));
+
+    SetEvent(event);
+    CHECK(WaitFor(&p.inside, 1));
+    UnregisterDispatch(&dh);
+    CHECK(Read(&p.inside) == 0);
+    CHECK(Read(&p.runs) == 1);
+
+    CloseHandle(event);
+}
+
+static volatile LONG Entered;
+static volatile LONG Left;
+static volatile LONG Refuse;
+static const char *EnteredName;
+
+static BOOL HookEnter(struct dispatch_handler *dh)
+{
+    EnteredName = dh->name;
+    __sync_add_and_fetch(&Entered, 1);
+    return Read(&Refuse) == 0;
+}
+
+static void HookLeave(struct dispatch_handler *dh)
+{
+    (void)dh;
+    __sync_add_and_fetch(&Left, 1);
+}
+
+static const struct dispatch_hooks Hooks = {
+    HookEnter,
+    HookLeave
+};
+
+static void TestHooks(void)
+{
+    struct dispatch_handler dh;
+    struct probe p;
+    HANDLE event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    memset(&p, 0, sizeof (p));
+    SetDispatchHooks(&Hooks);
+    CHECK(RegisterDispatch(&dh, event, "hooked", Probe, &p, NULL));
+
+    SetEvent(event);
+    CHECK(WaitFor(&Left, 1));
+    CHECK(Read(&Entered) == 1 && Read(&p.runs) == 1);
+    CHECK(EnteredName != NULL && strcmp(EnteredName, "hooked") == 0);
+
+    // A refused run (e.g. no store session) is skipped, not fatal
+    __sync_add_and_fetch(&Refuse, 1);
+    SetEvent(event);
+    CHECK(WaitFor(&Entered, 2));
+    Sleep(20);
+    CHECK(Read(&p.runs) == 1 && Read(&Left) == 1);
+
+    // and the next signal runs the handler again
+    __sync_sub_and_fetch(&Refuse, 1);
+    SetEvent(event);
+    CHECK(WaitFor(&p.runs, 2));
+    CHECK(WaitFor(&Left, 2));
+
+    UnregisterDispatch(&dh);
+    SetDispatchHooks(NULL);
+    CloseHandle(event);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    TestRuns();
+    TestSharedContext();
+    TestOwnContext();
+    TestUnregisterWaits();
+    TestHooks();
+
+    if (Failures != 0) {
+        fprintf(stderr, "dispatch: %d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("dispatch: ok\n");
+    return 0;
+}
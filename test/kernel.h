@@ -0,0 +1,89 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_TEST_KERNEL_H
+#define _XENIFACE_TEST_KERNEL_H
+
+// Just enough of the kernel's types and primitives for the driver's
+// portable headers (mpsc.h, rearm.h) to build in a user mode harness.
+
+#include <stdint.h>
+
+typedef uint8_t         UCHAR;
+typedef int32_t         LONG;
+typedef uint32_t        ULONG;
+typedef uint64_t        ULONGLONG;
+typedef UCHAR           BOOLEAN;
+typedef void            VOID;
+typedef void            *PVOID;
+
+#define TRUE    1
+#define FALSE   0
+
+#define IN
+#define OUT
+#define FORCEINLINE inline __attribute__((always_inline))
+
+static FORCEINLINE LONG
+InterlockedCompareExchange(
+    volatile LONG   *Destination,
+    LONG            Exchange,
+    LONG            Comparand
+    )
+{
+    return __sync_val_compare_and_swap(Destination, Comparand, Exchange);
+}
+
+static FORCEINLINE LONG
+InterlockedIncrement(
+    volatile LONG   *Addend
+    )
+{
+    return __sync_add_and_fetch(Addend, 1);
+}
+
+static FORCEINLINE LONG
+InterlockedDecrement(
+    volatile LONG   *Addend
+    )
+{
+    return __sync_sub_and_fetch(Addend, 1);
+}
+
+static FORCEINLINE VOID
+KeMemoryBarrier(
+    VOID
+    )
+{
+    __sync_synchronize();
+}
+
+#endif  // _XENIFACE_TEST_KERNEL_H
@@ -0,0 +1,376 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// User mode test and benchmark of the driver's logging (log.h) on the
+// IOCTL path. The read and directory handlers below follow IoctlRead and
+// IoctlDirectory in ioctls.c, log statements included, with the store
+// replaced by fixed values.
+//
+//   log_bench          run the tests
+//   log_bench bench    also time IOCTLs with each log level enabled in
+//                      turn
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ntddk.h"
+
+// A checked build, so every level is compiled in and the runtime mask
+// decides
+#define DBG         1
+#define __MODULE__  "XENIFACE"
+
+// gcc's __FUNCTION__ is not a string literal, so cannot be pasted into
+// the prefix as log.h does
+#define __FUNCTION__    "Ioctl"
+
+#include "../src/xeniface/log.h"
+
+#define ENTRIES     16
+#define IOCTLS      200000
+
+ULONG           XenIfaceLogMask;
+
+static int      Failures;
+
+#define CHECK(_cond)                                                \
+    do {                                                            \
+        if (!(_cond)) {                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_cond); \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+// Messages are formatted as DbgPrint would before handing them to the
+// debugger, then discarded
+static ULONG    Messages;
+static CHAR     Sink[512];
+
+ULONG
+vDbgPrintExWithPrefix(
+    IN  PCCHAR  Prefix,
+    IN  ULONG   ComponentId,
+    IN  ULONG   Level,
+    IN  PCCHAR  Format,
+    IN  va_list Arguments
+    )
+{
+    int         Length;
+
+    (VOID) ComponentId;
+    (VOID) Level;
+
+    Length = snprintf(Sink, sizeof (Sink), "%s", Prefix);
+    (VOID) vsnprintf(Sink + Length, sizeof (Sink) - Length, Format, Arguments);
+
+    Messages++;
+    return 0;
+}
+
+static CHAR     Value[] = "0123456789abcdef";
+static CHAR     Directory[ENTRIES * 8 + 1];
+
+static BOOLEAN
+__IsValidStr(
+    __in  PCHAR             Str,
+    __in  ULONG             Len
+    )
+{
+    for ( ; Len--; ++Str) {
+        if (*Str == '\0')
+            return TRUE;
+        if (!isprint((unsigned char)*Str))
+            break;
+    }
+    return FALSE;
+}
+
+static ULONG
+__MultiSzLen(
+    __in  PCHAR             Str,
+    __out PULONG            Count
+    )
+{
+    ULONG Length = 0;
+    if (Count)  *Count = 0;
+    do {
+        for ( ; *Str; ++Str, ++Length) ;
+        ++Str; ++Length;
+        if (Count) ++(*Count);
+    } while (*Str);
+    return Length;
+}
+
+static VOID
+__DisplayMultiSz(
+    __in PCHAR              Caller,
+    __in PCHAR              Str
+    )
+{
+    PCHAR   Ptr;
+    ULONG   Idx;
+    ULONG   Len;
+
+    for (Ptr = Str, Idx = 0; *Ptr; ++Idx) {
+        Len = (ULONG)strlen(Ptr);
+        XenIfaceDebugPrint(INFO, "|%s: [%d]=(%d)->\"%s\"\n", Caller, Idx, Len, Ptr);
+        Ptr += (Len + 1);
+    }
+}
+
+static __attribute__((noinline)) NTSTATUS
+IoctlRead(
+    __in  PCHAR             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS    status;
+    ULONG       Length;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen == 0)
+        goto fail1;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (!__IsValidStr(Buffer, InLen))
+        goto fail2;
+
+    Length = (ULONG)strlen(Value) + 1;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (OutLen < Length)
+        goto fail3;
+
+    RtlCopyMemory(Buffer, Value, Length);
+    *Info = (ULONG_PTR)Length;
+    return STATUS_SUCCESS;
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail3 (\"%s\")=(%d < %d)\n", __FUNCTION__, Buffer, OutLen, Length);
+fail2:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail2\n", __FUNCTION__);
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
+static __attribute__((noinline)) NTSTATUS
+IoctlDirectory(
+    __in  PCHAR             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS    status;
+    ULONG       Length;
+    ULONG       Count;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen == 0)
+        goto fail1;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (!__IsValidStr(Buffer, InLen))
+        goto fail2;
+
+    Length = __MultiSzLen(Directory, &Count) + 1;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (OutLen < Length)
+        goto fail3;
+
+#if DBG
+    if (LogEnabled(INFO))
+        __DisplayMultiSz(__FUNCTION__, Directory);
+#endif
+
+    RtlCopyMemory(Buffer, Directory, Length);
+    *Info = (ULONG_PTR)Length;
+    return STATUS_SUCCESS;
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail3 (\"%s\")=(%d < %d)\n", __FUNCTION__, Buffer, OutLen, Length);
+fail2:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail2\n", __FUNCTION__);
+fail1:
+    XenIfaceDebugPrint(ERROR, "|%s: Fail1 (%08x)\n", __FUNCTION__, status);
+    return status;
+}
+
+// One round: a read, a directory listing and, every Failing rounds, a
+// read that is refused. Returns the number of IOCTLs made.
+static ULONG
+Round(
+    ULONG       Index,
+    ULONG       Failing
+    )
+{
+    CHAR        Buffer[sizeof (Directory) + 1];
+    ULONG_PTR   Info;
+    ULONG       Ioctls = 2;
+
+    strcpy(Buffer, "data/ts");
+    CHECK(NT_SUCCESS(IoctlRead(Buffer, sizeof (Buffer), sizeof (Buffer), &Info)));
+
+    strcpy(Buffer, "data");
+    CHECK(NT_SUCCESS(IoctlDirectory(Buffer, sizeof (Buffer), sizeof (Buffer), &Info)));
+
+    if (Failing != 0 && Index % Failing == 0) {
+        CHECK(!NT_SUCCESS(IoctlRead(Buffer, 0, sizeof (Buffer), &Info)));
+        Ioctls++;
+    }
+
+    return Ioctls;
+}
+
+static ULONG    Evaluated;
+
+static ULONG
+Evaluate(void)
+{
+    return ++Evaluated;
+}
+
+static VOID
+TestLevels(void)
+{
+    // Nothing is formatted with logging off
+    XenIfaceLogMask = 0;
+    Messages = 0;
+    (VOID) Round(0, 1);
+    CHECK(Messages == 0);
+
+    // A refused read logs once at ERROR; listings stay quiet
+    XenIfaceLogMask = LOG_MASK(ERROR);
+    Messages = 0;
+    (VOID) Round(0, 1);
+    CHECK(Messages == 1);
+
+    // Each entry of a listing is logged at INFO
+    XenIfaceLogMask = LOG_MASK(ERROR) | LOG_MASK(INFO);
+    Messages = 0;
+    (VOID) Round(0, 1);
+    CHECK(Messages == 1 + ENTRIES);
+
+    // The arguments of a disabled message are not evaluated
+    XenIfaceLogMask = LOG_MASK(ERROR);
+    Evaluated = 0;
+    XenIfaceDebugPrint(INFO, "%u\n", Evaluate());
+    Trace("%u\n", Evaluate());
+    CHECK(Evaluated == 0);
+
+    XenIfaceDebugPrint(ERROR, "%u\n", Evaluate());
+    CHECK(Evaluated == 1);
+}
+
+static double
+Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (double)Time.tv_sec + (double)Time.tv_nsec / 1e9;
+}
+
+static VOID
+Benchmark(void)
+{
+    static const struct {
+        const CHAR  *Name;
+        ULONG       Mask;
+    } Level[] = {
+        { "none",       0 },
+        { "ERROR",      LOG_MASK(ERROR) },
+        { "WARNING",    LOG_MASK(ERROR) | LOG_MASK(WARNING) },
+        { "INFO",       LOG_MASK(ERROR) | LOG_MASK(WARNING) | LOG_MASK(INFO) },
+        { "TRACE",      LOG_MASK(ERROR) | LOG_MASK(WARNING) | LOG_MASK(INFO) |
+                        LOG_MASK(TRACE) },
+    };
+    double  Baseline = 0.0;
+    ULONG   Index;
+
+    for (Index = 0; Index < sizeof (Level) / sizeof (Level[0]); Index++) {
+        ULONG   Ioctls = 0;
+        ULONG   Count;
+        double  Start;
+        double  Rate;
+
+        XenIfaceLogMask = Level[Index].Mask;
+        Messages = 0;
+
+        Start = Now();
+        for (Count = 0; Count < IOCTLS / 2; Count++)
+            Ioctls += Round(Count, 16);
+        Rate = Ioctls / (Now() - Start);
+
+        if (Index == 0)
+            Baseline = Rate;
+
+        printf("log: %-7s %5.2f messages/IOCTL: %.2f M IOCTLs/s, %.2fx\n",
+               Level[Index].Name,
+               (double)Messages / Ioctls,
+               Rate / 1e6,
+               Rate / Baseline);
+    }
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    ULONG   Index;
+    PCHAR   Ptr = Directory;
+
+    for (Index = 0; Index < ENTRIES; Index++)
+        Ptr += sprintf(Ptr, "node%02u", Index) + 1;
+    *Ptr = '\0';
+
+    TestLevels();
+
+    if (Failures != 0) {
+        fprintf(stderr, "log: %d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("log: ok\n");
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        Benchmark();
+
+    return 0;
+}
@@ -0,0 +1,266 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// User mode test and benchmark of the driver's MPSC queue (mpsc.h).
+//
+//   mpsc_test          run the tests
+//   mpsc_test bench    also time pushes and pops with 1, 2 and 4 producers
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernel.h"
+#include "../src/xeniface/mpsc.h"
+
+#define DEPTH       1024
+#define ITEMS       200000
+#define PRODUCERS   4
+
+static int Failures;
+
+#define CHECK(_cond)                                                \
+    do {                                                            \
+        if (!(_cond)) {                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_cond); \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+// Items are never dereferenced, so encode the producer and a sequence
+// number in the pointer. Zero is avoided as it means empty.
+#define ITEM(_producer, _sequence) \
+    ((PVOID)(uintptr_t)(((uintptr_t)(_producer) << 32) | ((_sequence) + 1)))
+#define ITEM_PRODUCER(_item)   ((ULONG)((uintptr_t)(_item) >> 32))
+#define ITEM_SEQUENCE(_item)   ((ULONG)((uintptr_t)(_item) & 0xFFFFFFFF) - 1)
+
+static void
+TestEmpty(void)
+{
+    XENIFACE_MPSC       Queue;
+    XENIFACE_MPSC_SLOT  Slot[4];
+
+    MpscInitialize(&Queue, Slot, 4);
+
+    CHECK(MpscIsEmpty(&Queue));
+    CHECK(MpscPop(&Queue) == NULL);
+}
+
+static void
+TestFullAndWrap(void)
+{
+    XENIFACE_MPSC       Queue;
+    XENIFACE_MPSC_SLOT  Slot[8];
+    ULONG               Round;
+    ULONG               Index;
+
+    MpscInitialize(&Queue, Slot, 8);
+
+    // Go round the ring enough times for the sequences to wrap the slots
+    for (Round = 0; Round < 100; Round++) {
+        for (Index = 0; Index < 8; Index++)
+            CHECK(MpscPush(&Queue, ITEM(0, Round * 8 + Index)));
+
+        CHECK(!MpscPush(&Queue, ITEM(0, 0)));
+        CHECK(!MpscIsEmpty(&Queue));
+
+        for (Index = 0; Index < 8; Index++)
+            CHECK(MpscPop(&Queue) == ITEM(0, Round * 8 + Index));
+
+        CHECK(MpscIsEmpty(&Queue));
+        CHECK(MpscPop(&Queue) == NULL);
+    }
+}
+
+static void
+TestInterleaved(void)
+{
+    XENIFACE_MPSC       Queue;
+    XENIFACE_MPSC_SLOT  Slot[4];
+    ULONG               Pushed;
+    ULONG               Popped;
+
+    MpscInitialize(&Queue, Slot, 4);
+
+    // Keep the ring part full so head and tail chase each other
+    Pushed = Popped = 0;
+    while (Popped < 1000) {
+        while (Pushed - Popped < 3)
+            CHECK(MpscPush(&Queue, ITEM(0, Pushed++)));
+
+        CHECK(MpscPop(&Queue) == ITEM(0, Popped));
+        Popped++;
+    }
+}
+
+typedef struct _PRODUCER {
+    pthread_t       Thread;
+    PXENIFACE_MPSC  Queue;
+    ULONG           Index;
+    ULONG           Count;
+    ULONG           Full;
+} PRODUCER;
+
+static void *
+ProducerThread(
+    void        *Argument
+    )
+{
+    PRODUCER    *Producer = Argument;
+    ULONG       Sequence;
+
+    for (Sequence = 0; Sequence < Producer->Count; Sequence++) {
+        // Yield rather than spin so that the test still makes progress
+        // on a single processor
+        while (!MpscPush(Producer->Queue, ITEM(Producer->Index, Sequence))) {
+            Producer->Full++;
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static double
+Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (double)Time.tv_sec + (double)Time.tv_nsec / 1e9;
+}
+
+// Every item arrives exactly once, and each producer's items arrive in
+// the order they were pushed. Returns the elapsed time.
+static double
+RunProducers(
+    ULONG       Producers,
+    ULONG       Count
+    )
+{
+    XENIFACE_MPSC       Queue;
+    XENIFACE_MPSC_SLOT  *Slot;
+    PRODUCER            Producer[PRODUCERS];
+    ULONG               Next[PRODUCERS];
+    ULONG               Total;
+    ULONG               Index;
+    double              Start;
+
+    Slot = calloc(DEPTH, sizeof (XENIFACE_MPSC_SLOT));
+    if (Slot == NULL)
+        abort();
+
+    MpscInitialize(&Queue, Slot, DEPTH);
+    memset(Next, 0, sizeof (Next));
+
+    Start = Now();
+
+    for (Index = 0; Index < Producers; Index++) {
+        Producer[Index].Queue = &Queue;
+        Producer[Index].Index = Index;
+        Producer[Index].Count = Count;
+        Producer[Index].Full = 0;
+        pthread_create(&Producer[Index].Thread, NULL, ProducerThread, &Producer[Index]);
+    }
+
+    Total = 0;
+    while (Total < Producers * Count) {
+        PVOID   Item = MpscPop(&Queue);
+        ULONG   Which;
+
+        if (Item == NULL) {
+            sched_yield();
+            continue;
+        }
+
+        Which = ITEM_PRODUCER(Item);
+        CHECK(Which < Producers);
+        if (Which >= Producers)
+            break;
+
+        CHECK(ITEM_SEQUENCE(Item) == Next[Which]);
+        Next[Which] = ITEM_SEQUENCE(Item) + 1;
+        Total++;
+    }
+
+    for (Index = 0; Index < Producers; Index++)
+        pthread_join(Producer[Index].Thread, NULL);
+
+    CHECK(MpscIsEmpty(&Queue));
+
+    free(Slot);
+
+    return Now() - Start;
+}
+
+static void
+Benchmark(void)
+{
+    ULONG   Producers;
+
+    for (Producers = 1; Producers <= PRODUCERS; Producers *= 2) {
+        double  Elapsed = RunProducers(Producers, ITEMS * 5);
+        double  Items = (double)Producers * ITEMS * 5;
+
+        printf("mpsc: %u producer(s): %.1f M items/s, %.1f ns/item\n",
+               Producers,
+               Items / Elapsed / 1e6,
+               Elapsed * 1e9 / Items);
+    }
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    TestEmpty();
+    TestFullAndWrap();
+    TestInterleaved();
+    (void) RunProducers(1, ITEMS);
+    (void) RunProducers(PRODUCERS, ITEMS);
+
+    if (Failures != 0) {
+        fprintf(stderr, "mpsc: %d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("mpsc: ok\n");
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        Benchmark();
+
+    return 0;
+}
@@ -0,0 +1,430 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_TEST_NTDDK_H
+#define _XENIFACE_TEST_NTDDK_H
+
+// Just enough of <ntddk.h> for cache.c and log.h to build in a user mode
+// harness. Fast mutexes and events are built on pthreads; the registry is
+// always empty; debug output goes to whatever vDbgPrintExWithPrefix the
+// harness defines.
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernel.h"
+
+typedef char            CHAR, *PCHAR;
+typedef const char      *PCCHAR;
+typedef uint16_t        USHORT;
+typedef uint16_t        WCHAR, *PWCHAR;
+typedef ULONG           *PULONG;
+typedef UCHAR           *PUCHAR;
+typedef int64_t         LONGLONG;
+typedef uintptr_t       ULONG_PTR, *PULONG_PTR;
+typedef LONG            NTSTATUS;
+typedef PVOID           HANDLE, *PHANDLE;
+typedef UCHAR           KIRQL;
+
+#define OPTIONAL
+#define __in
+#define __out
+#define DEFINE_GUID(...)
+
+#define NT_SUCCESS(_status)             ((NTSTATUS)(_status) >= 0)
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES          ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_MEMORY                ((NTSTATUS)0xC0000017L)
+#define STATUS_OBJECT_NAME_NOT_FOUND    ((NTSTATUS)0xC0000034L)
+#define STATUS_INVALID_BUFFER_SIZE      ((NTSTATUS)0xC0000206L)
+
+#define DPFLTR_IHVDRIVER_ID     77
+
+#define DPFLTR_ERROR_LEVEL      0
+#define DPFLTR_WARNING_LEVEL    1
+#define DPFLTR_TRACE_LEVEL      2
+#define DPFLTR_INFO_LEVEL       3
+
+extern ULONG
+vDbgPrintExWithPrefix(
+    IN  PCCHAR  Prefix,
+    IN  ULONG   ComponentId,
+    IN  ULONG   Level,
+    IN  PCCHAR  Format,
+    IN  va_list Arguments
+    );
+
+#define PASSIVE_LEVEL   0
+
+static FORCEINLINE KIRQL
+KeGetCurrentIrql(
+    VOID
+    )
+{
+    return PASSIVE_LEVEL;
+}
+
+#define FIELD_OFFSET(_type, _field)     offsetof(_type, _field)
+#define CONTAINING_RECORD(_address, _type, _field) \
+        ((_type *)((PUCHAR)(_address) - offsetof(_type, _field)))
+
+#define RtlCopyMemory(_d, _s, _l)   memcpy((_d), (_s), (_l))
+#define RtlZeroMemory(_d, _l)       memset((_d), 0, (_l))
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY  *Flink;
+    struct _LIST_ENTRY  *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+static FORCEINLINE VOID
+InitializeListHead(
+    IN  PLIST_ENTRY Head
+    )
+{
+    Head->Flink = Head->Blink = Head;
+}
+
+static FORCEINLINE BOOLEAN
+IsListEmpty(
+    IN  PLIST_ENTRY Head
+    )
+{
+    return (Head->Flink == Head) ? TRUE : FALSE;
+}
+
+static FORCEINLINE BOOLEAN
+RemoveEntryList(
+    IN  PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY     Flink = Entry->Flink;
+    PLIST_ENTRY     Blink = Entry->Blink;
+
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+    return (Flink == Blink) ? TRUE : FALSE;
+}
+
+static FORCEINLINE VOID
+InsertHeadList(
+    IN  PLIST_ENTRY Head,
+    IN  PLIST_ENTRY Entry
+    )
+{
+    Entry->Flink = Head->Flink;
+    Entry->Blink = Head;
+    Head->Flink->Blink = Entry;
+    Head->Flink = Entry;
+}
+
+static FORCEINLINE VOID
+InsertTailList(
+    IN  PLIST_ENTRY Head,
+    IN  PLIST_ENTRY Entry
+    )
+{
+    Entry->Flink = Head;
+    Entry->Blink = Head->Blink;
+    Head->Blink->Flink = Entry;
+    Head->Blink = Entry;
+}
+
+// Held lets a harness check which calls are made under the mutex
+typedef struct _FAST_MUTEX {
+    pthread_mutex_t Mutex;
+    volatile LONG   Held;
+} FAST_MUTEX, *PFAST_MUTEX;
+
+static FORCEINLINE VOID
+ExInitializeFastMutex(
+    IN  PFAST_MUTEX Mutex
+    )
+{
+    pthread_mutex_init(&Mutex->Mutex, NULL);
+    Mutex->Held = 0;
+}
+
+static FORCEINLINE VOID
+ExAcquireFastMutex(
+    IN  PFAST_MUTEX Mutex
+    )
+{
+    pthread_mutex_lock(&Mutex->Mutex);
+    Mutex->Held = 1;
+}
+
+static FORCEINLINE VOID
+ExReleaseFastMutex(
+    IN  PFAST_MUTEX Mutex
+    )
+{
+    Mutex->Held = 0;
+    pthread_mutex_unlock(&Mutex->Mutex);
+}
+
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef struct _KEVENT {
+    pthread_mutex_t Mutex;
+    pthread_cond_t  Condition;
+    EVENT_TYPE      Type;
+    LONG            State;
+} KEVENT, *PKEVENT;
+
+#define IO_NO_INCREMENT 0
+#define Executive       0
+#define KernelMode      0
+
+static FORCEINLINE VOID
+KeInitializeEvent(
+    IN  PKEVENT     Event,
+    IN  EVENT_TYPE  Type,
+    IN  BOOLEAN     State
+    )
+{
+    pthread_mutex_init(&Event->Mutex, NULL);
+    pthread_cond_init(&Event->Condition, NULL);
+    Event->Type = Type;
+    Event->State = State;
+}
+
+static FORCEINLINE LONG
+KeSetEvent(
+    IN  PKEVENT     Event,
+    IN  LONG        Increment,
+    IN  BOOLEAN     Wait
+    )
+{
+    LONG            State;
+
+    (VOID) Increment;
+    (VOID) Wait;
+
+    pthread_mutex_lock(&Event->Mutex);
+    State = Event->State;
+    Event->State = 1;
+    pthread_cond_broadcast(&Event->Condition);
+    pthread_mutex_unlock(&Event->Mutex);
+
+    return State;
+}
+
+static FORCEINLINE VOID
+KeClearEvent(
+    IN  PKEVENT     Event
+    )
+{
+    pthread_mutex_lock(&Event->Mutex);
+    Event->State = 0;
+    pthread_mutex_unlock(&Event->Mutex);
+}
+
+static FORCEINLINE LONG
+KeReadStateEvent(
+    IN  PKEVENT     Event
+    )
+{
+    LONG            State;
+
+    pthread_mutex_lock(&Event->Mutex);
+    State = Event->State;
+    pthread_mutex_unlock(&Event->Mutex);
+
+    return State;
+}
+
+// No timeouts: callers in the harness always wait indefinitely
+static FORCEINLINE NTSTATUS
+KeWaitForSingleObject(
+    IN  PVOID       Object,
+    IN  int         Reason,
+    IN  int         Mode,
+    IN  BOOLEAN     Alertable,
+    IN  PVOID       Timeout
+    )
+{
+    PKEVENT         Event = Object;
+
+    (VOID) Reason;
+    (VOID) Mode;
+    (VOID) Alertable;
+    (VOID) Timeout;
+
+    pthread_mutex_lock(&Event->Mutex);
+    while (Event->State == 0)
+        pthread_cond_wait(&Event->Condition, &Event->Mutex);
+    if (Event->Type == SynchronizationEvent)
+        Event->State = 0;
+    pthread_mutex_unlock(&Event->Mutex);
+
+    return STATUS_SUCCESS;
+}
+
+typedef struct _ANSI_STRING {
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PCHAR   Buffer;
+} ANSI_STRING, *PANSI_STRING;
+
+typedef struct _UNICODE_STRING {
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PWCHAR  Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+// ASCII only
+static FORCEINLINE NTSTATUS
+RtlUnicodeStringToAnsiString(
+    OUT PANSI_STRING    Ansi,
+    IN  PUNICODE_STRING Unicode,
+    IN  BOOLEAN         Allocate
+    )
+{
+    USHORT              Index;
+
+    (VOID) Allocate;
+
+    Ansi->Length = Unicode->Length / sizeof (WCHAR);
+    Ansi->MaximumLength = Ansi->Length + 1;
+    Ansi->Buffer = calloc(1, Ansi->MaximumLength);
+    if (Ansi->Buffer == NULL)
+        return STATUS_NO_MEMORY;
+
+    for (Index = 0; Index < Ansi->Length; Index++)
+        Ansi->Buffer[Index] = (CHAR)Unicode->Buffer[Index];
+
+    return STATUS_SUCCESS;
+}
+
+static FORCEINLINE VOID
+RtlFreeAnsiString(
+    IN  PANSI_STRING    Ansi
+    )
+{
+    free(Ansi->Buffer);
+    Ansi->Buffer = NULL;
+}
+
+static FORCEINLINE VOID
+RtlInitUnicodeString(
+    OUT PUNICODE_STRING Unicode,
+    IN  const WCHAR     *Source
+    )
+{
+    USHORT              Length = 0;
+
+    while (Source[Length] != 0)
+        Length++;
+
+    Unicode->Buffer = (PWCHAR)Source;
+    Unicode->Length = Length * sizeof (WCHAR);
+    Unicode->MaximumLength = Unicode->Length + sizeof (WCHAR);
+}
+
+// The registry holds nothing
+#define OBJ_CASE_INSENSITIVE    0x00000040
+#define OBJ_KERNEL_HANDLE       0x00000200
+#define KEY_READ                0x00020019
+#define REG_DWORD               4
+
+typedef struct _OBJECT_ATTRIBUTES {
+    PUNICODE_STRING ObjectName;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define InitializeObjectAttributes(_a, _n, _f, _r, _s) \
+        ((_a)->ObjectName = (_n))
+
+typedef enum _KEY_VALUE_INFORMATION_CLASS {
+    KeyValueFullInformation = 1
+} KEY_VALUE_INFORMATION_CLASS;
+
+typedef struct _KEY_VALUE_FULL_INFORMATION {
+    ULONG   TitleIndex;
+    ULONG   Type;
+    ULONG   DataOffset;
+    ULONG   DataLength;
+    ULONG   NameLength;
+    WCHAR   Name[1];
+} KEY_VALUE_FULL_INFORMATION, *PKEY_VALUE_FULL_INFORMATION;
+
+static FORCEINLINE NTSTATUS
+ZwOpenKey(
+    OUT PHANDLE             Key,
+    IN  ULONG               Access,
+    IN  POBJECT_ATTRIBUTES  Attributes
+    )
+{
+    (VOID) Access;
+    (VOID) Attributes;
+
+    *Key = NULL;
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+static FORCEINLINE NTSTATUS
+ZwEnumerateValueKey(
+    IN  HANDLE                      Key,
+    IN  ULONG                       Index,
+    IN  KEY_VALUE_INFORMATION_CLASS Class,
+    OUT PVOID                       Information,
+    IN  ULONG                       Length,
+    OUT PULONG                      Required
+    )
+{
+    (VOID) Key;
+    (VOID) Index;
+    (VOID) Class;
+    (VOID) Information;
+    (VOID) Length;
+
+    *Required = 0;
+    return STATUS_NO_MORE_ENTRIES;
+}
+
+static FORCEINLINE NTSTATUS
+ZwClose(
+    IN  HANDLE  Key
+    )
+{
+    (VOID) Key;
+    return STATUS_SUCCESS;
+}
+
+#endif  // _XENIFACE_TEST_NTDDK_H
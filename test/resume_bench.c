@@ -0,0 +1,243 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// User mode test and benchmark of re-arming watches after a resume
+// (rearm.h), as SessionsResumeAll does it.
+//
+//   resume_bench          run the tests
+//   resume_bench bench    also time re-arming 10000 watches with 0, 1, 3
+//                         and 7 helpers
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernel.h"
+#include "../src/xeniface/rearm.h"
+
+#define WATCHES     10000
+#define HELPERS     7
+
+// Re-arming a watch is a round trip to the store backend, so the bench
+// waits this long for each one rather than spinning
+#define ROUND_TRIP_US   20
+
+static int Failures;
+
+#define CHECK(_cond)                                                \
+    do {                                                            \
+        if (!(_cond)) {                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_cond); \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+// The stand-in for a watch: the number of times it was re-armed
+typedef struct _WATCH {
+    volatile LONG   Armed;
+} WATCH;
+
+typedef struct _RESUME {
+    XENIFACE_REARM  Rearm;
+    WATCH           *Watch;
+    PVOID           *Items;
+    ULONG           Delay;
+    volatile LONG   Woken;
+} RESUME;
+
+static VOID
+ArmWatch(
+    PVOID       Context,
+    PVOID       Item
+    )
+{
+    RESUME      *Resume = Context;
+    WATCH       *Watch = Item;
+
+    if (Resume->Delay != 0) {
+        struct timespec Time;
+
+        Time.tv_sec = 0;
+        Time.tv_nsec = (long)Resume->Delay * 1000;
+        nanosleep(&Time, NULL);
+    }
+
+    (VOID) InterlockedIncrement(&Watch->Armed);
+}
+
+// As SessionRearmWork
+static void *
+HelperThread(
+    void        *Argument
+    )
+{
+    RESUME      *Resume = Argument;
+
+    if (RearmHelp(&Resume->Rearm))
+        (VOID) InterlockedIncrement(&Resume->Woken);
+
+    return NULL;
+}
+
+static double
+Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (double)Time.tv_sec + (double)Time.tv_nsec / 1e9;
+}
+
+// Every watch is re-armed exactly once, and the resuming thread is left
+// with no helper busy. Returns the elapsed time.
+static double
+RunResume(
+    ULONG       Watches,
+    ULONG       Helpers,
+    ULONG       Delay
+    )
+{
+    RESUME      Resume;
+    pthread_t   Thread[HELPERS];
+    ULONG       Index;
+    double      Start;
+    double      Elapsed;
+
+    Resume.Watch = calloc(Watches + 1, sizeof (WATCH));
+    Resume.Items = calloc(Watches + 1, sizeof (PVOID));
+    if (Resume.Watch == NULL || Resume.Items == NULL)
+        abort();
+
+    for (Index = 0; Index < Watches; Index++)
+        Resume.Items[Index] = &Resume.Watch[Index];
+
+    Resume.Delay = Delay;
+    Resume.Woken = 0;
+    RearmInitialize(&Resume.Rearm, ArmWatch, &Resume, Resume.Items, (LONG)Watches);
+
+    Start = Now();
+
+    for (Index = 0; Index < Helpers; Index++)
+        pthread_create(&Thread[Index], NULL, HelperThread, &Resume);
+
+    RearmDrain(&Resume.Rearm);
+
+    // The driver waits on an event set by the last helper out; the
+    // threads are joined here only so that they can be counted
+    for (Index = 0; Index < Helpers; Index++)
+        pthread_join(Thread[Index], NULL);
+
+    Elapsed = Now() - Start;
+
+    CHECK(!RearmIsBusy(&Resume.Rearm));
+    if (Helpers != 0)
+        CHECK(Resume.Woken != 0);
+
+    for (Index = 0; Index < Watches; Index++)
+        CHECK(Resume.Watch[Index].Armed == 1);
+    CHECK(Resume.Watch[Watches].Armed == 0);
+
+    free(Resume.Items);
+    free(Resume.Watch);
+
+    return Elapsed;
+}
+
+// A helper that runs after the array is empty does nothing, and reports
+// that no other helper is busy
+static void
+TestLateHelper(void)
+{
+    RESUME      Resume;
+    WATCH       Watch[2];
+    PVOID       Items[2];
+
+    memset(Watch, 0, sizeof (Watch));
+    Items[0] = &Watch[0];
+    Items[1] = &Watch[1];
+
+    Resume.Delay = 0;
+    RearmInitialize(&Resume.Rearm, ArmWatch, &Resume, Items, 2);
+
+    RearmDrain(&Resume.Rearm);
+    CHECK(RearmHelp(&Resume.Rearm));
+    CHECK(!RearmIsBusy(&Resume.Rearm));
+
+    CHECK(Watch[0].Armed == 1);
+    CHECK(Watch[1].Armed == 1);
+}
+
+static void
+Benchmark(void)
+{
+    double  Serial = 0.0;
+    ULONG   Helpers;
+
+    for (Helpers = 0; Helpers <= HELPERS; Helpers = Helpers * 2 + 1) {
+        double  Elapsed = RunResume(WATCHES, Helpers, ROUND_TRIP_US);
+
+        if (Helpers == 0)
+            Serial = Elapsed;
+
+        printf("resume: %u watches, %u helper(s): %.1f ms, %.2fx\n",
+               WATCHES,
+               Helpers,
+               Elapsed * 1e3,
+               Serial / Elapsed);
+    }
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    TestLateHelper();
+    (void) RunResume(0, 0, 0);
+    (void) RunResume(1, HELPERS, 0);
+    (void) RunResume(WATCHES, 0, 0);
+    (void) RunResume(WATCHES, HELPERS, 0);
+
+    if (Failures != 0) {
+        fprintf(stderr, "resume: %d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("resume: ok\n");
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        Benchmark();
+
+    return 0;
+}
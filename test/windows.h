@@ -0,0 +1,405 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Just enough of <windows.h> and OLE automation to build the agent's
+// portable pieces with g++ on Linux.  Heap allocations made through
+// XsAlloc and SysAllocStringLen are counted in ShimAllocations.  Events,
+// critical sections and thread pool waits are built on pthreads.
+
+#ifndef _XENIFACE_TEST_WINDOWS_H
+#define _XENIFACE_TEST_WINDOWS_H
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef int             BOOL;
+typedef uint8_t         BYTE;
+typedef uint16_t        WCHAR;
+typedef uint16_t        VARTYPE;
+typedef uint32_t        DWORD;
+typedef int32_t         LONG;
+typedef uint32_t        UINT;
+typedef uint64_t        ULONGLONG;
+typedef WCHAR           *BSTR;
+typedef void            VOID;
+typedef void            *PVOID;
+typedef void            *HANDLE;
+typedef uint8_t         BOOLEAN;
+
+#define TRUE            1
+#define FALSE           0
+
+#define __declspec(_x)  __declspec_ ## _x
+#define __declspec_thread __thread
+
+#define CALLBACK
+#define INFINITE        0xFFFFFFFF
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+
+#define CP_UTF8         65001
+
+#define VT_EMPTY        0
+#define VT_BSTR         8
+
+typedef struct tagVARIANT {
+    VARTYPE vt;
+    BSTR    bstrVal;
+} VARIANT;
+
+extern unsigned long ShimAllocations;
+extern int ShimCounting;
+
+static inline void
+ShimCount(void)
+{
+    if (ShimCounting)
+        ShimAllocations++;
+}
+
+static inline void
+VariantInit(VARIANT *var)
+{
+    var->vt = VT_EMPTY;
+    var->bstrVal = NULL;
+}
+
+// BSTRs carry their byte length in the DWORD before the text
+static inline BSTR
+SysAllocStringLen(const WCHAR *text, UINT len)
+{
+    DWORD *prefix;
+    BSTR bstr;
+
+    prefix = (DWORD *)malloc(sizeof (DWORD) + (len + 1) * sizeof (WCHAR));
+    if (prefix == NULL)
+        return NULL;
+    ShimCount();
+
+    *prefix = len * sizeof (WCHAR);
+    bstr = (BSTR)(prefix + 1);
+    if (text != NULL)
+        memcpy(bstr, text, len * sizeof (WCHAR));
+    bstr[len] = 0;
+    return bstr;
+}
+
+static inline UINT
+SysStringLen(BSTR bstr)
+{
+    return (bstr == NULL) ? 0 : ((DWORD *)bstr)[-1] / sizeof (WCHAR);
+}
+
+static inline void
+SysFreeString(BSTR bstr)
+{
+    if (bstr != NULL)
+        free((DWORD *)bstr - 1);
+}
+
+// UTF-8 to UTF-16 and back; enough for the agent, which only ever asks
+// for CP_UTF8 and either sizes (out == NULL) or converts.
+static inline int
+MultiByteToWideChar(UINT codepage, DWORD flags, const char *in, int inlen,
+                    WCHAR *out, int outlen)
+{
+    const unsigned char *p = (const unsigned char *)in;
+    const unsigned char *end = p + inlen;
+    int n = 0;
+
+    (void)codepage;
+    (void)flags;
+
+    while (p < end) {
+        uint32_t c = *p++;
+        int extra = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+        int units;
+
+        c &= (extra == 0) ? 0x7F : (0x3F >> extra);
+        while (extra-- > 0 && p < end)
+            c = (c << 6) | (*p++ & 0x3F);
+
+        units = (c >= 0x10000) ? 2 : 1;
+        if (out != NULL) {
+            if (n + units > outlen)
+                return 0;
+            if (units == 2) {
+                out[n] = (WCHAR)(0xD800 + ((c - 0x10000) >> 10));
+                out[n + 1] = (WCHAR)(0xDC00 + ((c - 0x10000) & 0x3FF));
+            } else {
+                out[n] = (WCHAR)c;
+            }
+        }
+        n += units;
+    }
+    return n;
+}
+
+static inline int
+WideCharToMultiByte(UINT codepage, DWORD flags, const WCHAR *in, int inlen,
+                    char *out, int outlen, const char *defchar, BOOL *used)
+{
+    unsigned char buf[4];
+    int n = 0;
+    int i;
+
+    (void)codepage;
+    (void)flags;
+    (void)defchar;
+    (void)used;
+
+    for (i = 0; i < inlen; i++) {
+        uint32_t c = in[i];
+        int len;
+
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < inlen)
+            c = 0x10000 + ((c - 0xD800) << 10) + (in[++i] - 0xDC00);
+
+        if (c < 0x80) {
+            buf[0] = (unsigned char)c;
+            len = 1;
+        } else if (c < 0x800) {
+            buf[0] = (unsigned char)(0xC0 | (c >> 6));
+            buf[1] = (unsigned char)(0x80 | (c & 0x3F));
+            len = 2;
+        } else if (c < 0x10000) {
+            buf[0] = (unsigned char)(0xE0 | (c >> 12));
+            buf[1] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+            buf[2] = (unsigned char)(0x80 | (c & 0x3F));
+            len = 3;
+        } else {
+            buf[0] = (unsigned char)(0xF0 | (c >> 18));
+            buf[1] = (unsigned char)(0x80 | ((c >> 12) & 0x3F));
+            buf[2] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+            buf[3] = (unsigned char)(0x80 | (c & 0x3F));
+            len = 4;
+        }
+
+        if (out != NULL) {
+            if (n + len > outlen)
+                return 0;
+            memcpy(out + n, buf, len);
+        }
+        n += len;
+    }
+    return n;
+}
+
+static inline int
+_vscprintf(const char *fmt, va_list args)
+{
+    va_list copy;
+    int n;
+
+    va_copy(copy, args);
+    n = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    return n;
+}
+
+#define _vsnprintf vsnprintf
+
+// Critical sections are recursive, as on Windows
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+static inline void
+InitializeCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(cs, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static inline void
+DeleteCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_destroy(cs);
+}
+
+static inline void
+EnterCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_lock(cs);
+}
+
+static inline void
+LeaveCriticalSection(CRITICAL_SECTION *cs)
+{
+    pthread_mutex_unlock(cs);
+}
+
+static inline void
+Sleep(DWORD ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+// Events: the only kind of handle the shim has
+typedef struct _SHIM_EVENT {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    BOOL            manual;
+    BOOL            signalled;
+} SHIM_EVENT;
+
+static inline HANDLE
+CreateEvent(void *attributes, BOOL manual, BOOL initial, const char *name)
+{
+    SHIM_EVENT *event = (SHIM_EVENT *)calloc(1, sizeof (SHIM_EVENT));
+
+    (void)attributes;
+    (void)name;
+
+    if (event == NULL)
+        return NULL;
+    pthread_mutex_init(&event->mutex, NULL);
+    pthread_cond_init(&event->cond, NULL);
+    event->manual = manual;
+    event->signalled = initial;
+    return event;
+}
+
+static inline BOOL
+SetEvent(HANDLE handle)
+{
+    SHIM_EVENT *event = (SHIM_EVENT *)handle;
+
+    pthread_mutex_lock(&event->mutex);
+    event->signalled = TRUE;
+    pthread_cond_broadcast(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+    return TRUE;
+}
+
+static inline BOOL
+CloseHandle(HANDLE handle)
+{
+    SHIM_EVENT *event = (SHIM_EVENT *)handle;
+
+    pthread_cond_destroy(&event->cond);
+    pthread_mutex_destroy(&event->mutex);
+    free(event);
+    return TRUE;
+}
+
+// A thread pool wait: a thread per registration runs the callback each
+// time the event is signalled, so unlike on Windows one registration's
+// callbacks never overlap.
+typedef VOID (CALLBACK *WAITORTIMERCALLBACK)(PVOID, BOOLEAN);
+
+#define WT_EXECUTEDEFAULT       0x00000000
+#define WT_EXECUTELONGFUNCTION  0x00000010
+
+typedef struct _SHIM_WAIT {
+    pthread_t           thread;
+    SHIM_EVENT          *event;
+    WAITORTIMERCALLBACK callback;
+    PVOID               context;
+    BOOL                stop;
+} SHIM_WAIT;
+
+static inline void *
+ShimWaitThread(void *argument)
+{
+    SHIM_WAIT *wait = (SHIM_WAIT *)argument;
+    SHIM_EVENT *event = wait->event;
+
+    for (;;) {
+        pthread_mutex_lock(&event->mutex);
+        while (!event->signalled && !wait->stop)
+            pthread_cond_wait(&event->cond, &event->mutex);
+        if (wait->stop) {
+            pthread_mutex_unlock(&event->mutex);
+            break;
+        }
+        if (!event->manual)
+            event->signalled = FALSE;
+        pthread_mutex_unlock(&event->mutex);
+
+        wait->callback(wait->context, FALSE);
+    }
+    return NULL;
+}
+
+static inline BOOL
+RegisterWaitForSingleObject(HANDLE *handle, HANDLE object,
+                            WAITORTIMERCALLBACK callback, PVOID context,
+                            DWORD timeout, DWORD flags)
+{
+    SHIM_WAIT *wait = (SHIM_WAIT *)calloc(1, sizeof (SHIM_WAIT));
+
+    (void)timeout;
+    (void)flags;
+
+    if (wait == NULL)
+        return FALSE;
+    wait->event = (SHIM_EVENT *)object;
+    wait->callback = callback;
+    wait->context = context;
+    if (pthread_create(&wait->thread, NULL, ShimWaitThread, wait) != 0) {
+        free(wait);
+        return FALSE;
+    }
+    *handle = wait;
+    return TRUE;
+}
+
+// Only the blocking form (INVALID_HANDLE_VALUE) is supported
+static inline BOOL
+UnregisterWaitEx(HANDLE handle, HANDLE completion)
+{
+    SHIM_WAIT *wait = (SHIM_WAIT *)handle;
+    SHIM_EVENT *event = wait->event;
+
+    (void)completion;
+
+    pthread_mutex_lock(&event->mutex);
+    wait->stop = TRUE;
+    pthread_cond_broadcast(&event->cond);
+    pthread_mutex_unlock(&event->mutex);
+
+    pthread_join(wait->thread, NULL);
+    free(wait);
+    return TRUE;
+}
+
+#endif
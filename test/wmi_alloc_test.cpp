@@ -0,0 +1,349 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Allocation counting test and benchmark of the agent's WMI string
+// marshalling (WmiString.h) on the read, write, list and log paths.
+// Each path is driven the way WmiAccessor.cpp drives it, with the WMI
+// method call replaced by a stand-in that hands back what the provider
+// would.  Allocations made by the stand-in belong to WMI and are not
+// counted.
+//
+//   wmi_alloc_test          check the allocations made per call
+//   wmi_alloc_test bench    also time each path
+
+#include <windows.h>
+#include <time.h>
+
+#define MAX_XENBUS_PATH 256
+
+void *XsAlloc(size_t size);
+void XsFree(const void *buf);
+
+#include "../src/win32stubagent/WmiString.h"
+
+unsigned long ShimAllocations;
+int ShimCounting = 1;
+
+static int Failures;
+
+#define CHECK(_cond)                                                \
+    do {                                                            \
+        if (!(_cond)) {                                             \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #_cond); \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+void *XsAlloc(size_t size)
+{
+    void *buf = calloc(1, size);
+
+    if (buf != NULL)
+        ShimCount();
+    return buf;
+}
+
+void XsFree(const void *buf)
+{
+    free((void *)buf);
+}
+
+// What the provider hands back, allocated on WMI's account
+static BSTR StandInBstr(const char *string)
+{
+    BSTR bstr;
+
+    ShimCounting = 0;
+    bstr = mkBstr(string, strlen(string));
+    ShimCounting = 1;
+    return bstr;
+}
+
+static char LongValue[4096];
+static char HugeValue[WMI_SCRATCH_SIZE + 1];
+
+// As WmiSessionGetEntry
+static char *ReadPath(const char *path, const char *value, size_t *len)
+{
+    struct WmiStringArg vpath;
+    VARIANT outval;
+    char *space;
+
+    if (setStringArg(&vpath, path))
+        return NULL;
+
+    // GetValue
+    VariantInit(&outval);
+    outval.vt = VT_BSTR;
+    outval.bstrVal = StandInBstr(value);
+
+    space = bstrToChar(outval.bstrVal, len);
+
+    SysFreeString(outval.bstrVal);
+    releaseStringArg(&vpath);
+    return space;
+}
+
+// As WmiSessionSetEntry; the stand-in checks what would be Put
+static int WritePath(const char *path, const char *value, size_t len)
+{
+    struct WmiStringArg vpath;
+    struct WmiStringArg vvalue;
+    int err = -1;
+
+    if (setStringArg(&vpath, path))
+        goto setvpath;
+    if (setStringArg(&vvalue, value, len))
+        goto setvvalue;
+
+    // SetValue
+    if (SysStringLen(vvalue.var.bstrVal) == len &&
+        SysStringLen(vpath.var.bstrVal) == strlen(path))
+        err = 0;
+
+    releaseStringArg(&vvalue);
+setvvalue:
+    releaseStringArg(&vpath);
+setvpath:
+    return err;
+}
+
+// As WmiSessionGetChildren
+static char **ListPath(const char *path, unsigned count)
+{
+    struct WmiStringArg vpath;
+    BSTR entries[16];
+    char **outarray;
+    char child[MAX_XENBUS_PATH];
+    unsigned i;
+
+    if (setStringArg(&vpath, path))
+        return NULL;
+
+    // GetChildren
+    for (i = 0; i < count; i++) {
+        snprintf(child, sizeof (child), "%s/%u", path, i);
+        entries[i] = StandInBstr(child);
+    }
+
+    outarray = (char **)XsAlloc(sizeof (char *) * count);
+    for (i = 0; outarray != NULL && i < count; i++)
+        outarray[i] = bstrToChar(entries[i]);
+
+    for (i = 0; i < count; i++)
+        SysFreeString(entries[i]);
+    releaseStringArg(&vpath);
+    return outarray;
+}
+
+// As WmiSessionLog
+static int LogMessage(const char *fmt, ...)
+{
+    struct WmiStringArg vmessage;
+    size_t mark = ScratchMark();
+    char *message;
+    va_list args;
+    int err = -1;
+
+    va_start(args, fmt);
+    message = formatScratchStr(fmt, args);
+    va_end(args);
+    if (message == NULL)
+        return -1;
+
+    if (setStringArg(&vmessage, message))
+        goto setvmessage;
+
+    // Log
+    if (SysStringLen(vmessage.var.bstrVal) == strlen(message))
+        err = 0;
+
+    releaseStringArg(&vmessage);
+setvmessage:
+    freeScratchStr(message, mark);
+    return err;
+}
+
+static void FreeList(char **entries, unsigned count)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+        XsFree(entries[i]);
+    XsFree(entries);
+}
+
+static unsigned long Counted;
+
+static void Start(void)
+{
+    Counted = ShimAllocations;
+}
+
+static unsigned long Stop(void)
+{
+    CHECK(ScratchMark() == 0);
+    return ShimAllocations - Counted;
+}
+
+static void TestRead(void)
+{
+    size_t len;
+    char *value;
+
+    // Only the result the caller keeps is allocated
+    Start();
+    value = ReadPath("data/meminfo_free", "1048576", &len);
+    CHECK(Stop() == 1);
+    CHECK(value != NULL && len == 7 && strcmp(value, "1048576") == 0);
+    XsFree(value);
+
+    Start();
+    value = ReadPath("attr/PVAddons/\xc3\xa9t\xc3\xa9", "caf\xc3\xa9 \xf0\x9f\x98\x80", &len);
+    CHECK(Stop() == 1);
+    CHECK(value != NULL && strcmp(value, "caf\xc3\xa9 \xf0\x9f\x98\x80") == 0);
+    XsFree(value);
+
+    // Too big for the arena: converted straight into the result
+    Start();
+    value = ReadPath("data/huge", HugeValue, &len);
+    CHECK(Stop() == 1);
+    CHECK(value != NULL && len == sizeof (HugeValue) - 1);
+    XsFree(value);
+}
+
+static void TestWrite(void)
+{
+    // Paths fit the small-string buffer, longer values the arena
+    Start();
+    CHECK(WritePath("data/meminfo_free", "1048576", 7) == 0);
+    CHECK(WritePath("data/ts", LongValue, strlen(LongValue)) == 0);
+    CHECK(Stop() == 0);
+
+    // Only a value bigger than the arena reaches the heap
+    Start();
+    CHECK(WritePath("data/huge", HugeValue, strlen(HugeValue)) == 0);
+    CHECK(Stop() == 1);
+}
+
+static void TestList(void)
+{
+    char **entries;
+
+    // The array and one string per child, which the caller keeps
+    Start();
+    entries = ListPath("data/vif", 4);
+    CHECK(Stop() == 1 + 4);
+    CHECK(entries != NULL && strcmp(entries[3], "data/vif/3") == 0);
+    FreeList(entries, 4);
+}
+
+static void TestLog(void)
+{
+    Start();
+    CHECK(LogMessage("win agent %s (%d)", "woke up", 42) == 0);
+    CHECK(LogMessage("%s", LongValue) == 0);
+    CHECK(Stop() == 0);
+}
+
+static double Now(void)
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (double)Time.tv_sec + (double)Time.tv_nsec / 1e9;
+}
+
+#define ITERATIONS 200000
+
+static void Report(const char *name, double start, unsigned long allocations)
+{
+    double elapsed = Now() - start;
+
+    printf("wmi_alloc: %-6s %7.1f ns/call, %.2f allocations/call\n",
+           name, elapsed * 1e9 / ITERATIONS,
+           (double)allocations / ITERATIONS);
+}
+
+static void Benchmark(void)
+{
+    unsigned long allocations;
+    double start;
+    size_t len;
+    int i;
+
+    allocations = ShimAllocations;
+    start = Now();
+    for (i = 0; i < ITERATIONS; i++)
+        XsFree(ReadPath("data/meminfo_free", "1048576", &len));
+    Report("read", start, ShimAllocations - allocations);
+
+    allocations = ShimAllocations;
+    start = Now();
+    for (i = 0; i < ITERATIONS; i++)
+        (void)WritePath("data/meminfo_free", "1048576", 7);
+    Report("write", start, ShimAllocations - allocations);
+
+    allocations = ShimAllocations;
+    start = Now();
+    for (i = 0; i < ITERATIONS; i++)
+        FreeList(ListPath("data/vif", 4), 4);
+    Report("list", start, ShimAllocations - allocations);
+
+    allocations = ShimAllocations;
+    start = Now();
+    for (i = 0; i < ITERATIONS; i++)
+        (void)LogMessage("win agent %s (%d)", "woke up", i);
+    Report("log", start, ShimAllocations - allocations);
+}
+
+int main(int argc, char **argv)
+{
+    memset(LongValue, 'x', sizeof (LongValue) - 1);
+    memset(HugeValue, 'y', sizeof (HugeValue) - 1);
+
+    TestRead();
+    TestWrite();
+    TestList();
+    TestLog();
+
+    if (Failures != 0) {
+        fprintf(stderr, "wmi_alloc: %d failure(s)\n", Failures);
+        return 1;
+    }
+
+    printf("wmi_alloc: ok\n");
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        Benchmark();
+
+    return 0;
+}
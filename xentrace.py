@@ -0,0 +1,166 @@
+#!python -u
+
+# Decode the binary trace kept by xeniface.
+#
+# usage: xentrace.py [dump-file]
+#
+# With a file argument, decode a trace saved earlier (the output of
+# IOCTL_XENIFACE_TRACE_DUMP, or the secondary crash dump data written
+# out with .enumtag). Without one, fetch the live trace from the driver
+# (Windows only).
+
+import os, sys
+import re
+import struct
+
+HEADER = struct.Struct('<IIIIQ')
+RECORD = struct.Struct('<QIHH3Q24s')
+VERSION = 2
+
+IOCTL_XENIFACE_TRACE_DUMP = (0x22 << 16) | (0x805 << 2)
+GUID_INTERFACE_XENIFACE = '{b2cfb085-aa5e-47e1-8bf7-9793f3154565}'
+
+def load_events(header):
+	events = { 0: None }
+	index = 1
+	for line in open(header):
+		match = re.match(r'\s*XENIFACE_TRACE_EVENT\((\w+),\s*"([^"]*)"\)', line)
+		if match:
+			events[index] = match.group(2)
+			index += 1
+	return events
+
+def format_record(format, text, arguments):
+	values = []
+	arguments = list(arguments)
+	for conversion in re.findall(r'%[0-9]*([dusx])', format):
+		if conversion == 's':
+			values.append(text)
+		else:
+			values.append(arguments.pop(0))
+	return format.replace('%u', '%d') % tuple(values)
+
+def decode(data, events):
+	(version, cpus, per_cpu, size, frequency) = HEADER.unpack_from(data, 0)
+	if version != VERSION or size != RECORD.size:
+		raise Exception('unsupported trace version %d (record size %d)' % (version, size))
+
+	records = []
+	offset = HEADER.size
+	for index in range(cpus * per_cpu):
+		(timestamp, sequence, event, cpu, a0, a1, a2, text) = RECORD.unpack_from(data, offset)
+		offset += RECORD.size
+		if sequence == 0 or event not in events or events[event] is None:
+			continue
+		text = text.split(b'\0', 1)[0].decode('utf-8', 'replace')
+		records.append((timestamp, cpu, sequence, events[event], text, (a0, a1, a2)))
+
+	records.sort()
+	if len(records) == 0:
+		return
+
+	start = records[0][0]
+	for (timestamp, cpu, sequence, format, text, arguments) in records:
+		usec = (timestamp - start) * 1000000 // frequency
+		print('%12d.%06d %3d %s' % (usec // 1000000, usec % 1000000, cpu,
+		                            format_record(format, text, arguments)))
+
+def fetch():
+	import ctypes
+	from ctypes import wintypes
+
+	class GUID(ctypes.Structure):
+		_fields_ = [('Data1', wintypes.DWORD), ('Data2', wintypes.WORD),
+		            ('Data3', wintypes.WORD), ('Data4', ctypes.c_ubyte * 8)]
+
+	class SP_DEVICE_INTERFACE_DATA(ctypes.Structure):
+		_fields_ = [('cbSize', wintypes.DWORD), ('InterfaceClassGuid', GUID),
+		            ('Flags', wintypes.DWORD), ('Reserved', ctypes.c_void_p)]
+
+	setupapi = ctypes.windll.setupapi
+	kernel32 = ctypes.windll.kernel32
+
+	guid = GUID()
+	ctypes.windll.ole32.CLSIDFromString(GUID_INTERFACE_XENIFACE, ctypes.byref(guid))
+
+	DIGCF_PRESENT = 0x2
+	DIGCF_DEVICEINTERFACE = 0x10
+	setupapi.SetupDiGetClassDevsW.restype = ctypes.c_void_p
+	devs = setupapi.SetupDiGetClassDevsW(ctypes.byref(guid), None, None,
+	                                     DIGCF_PRESENT | DIGCF_DEVICEINTERFACE)
+
+	interface = SP_DEVICE_INTERFACE_DATA()
+	interface.cbSize = ctypes.sizeof(interface)
+	if not setupapi.SetupDiEnumDeviceInterfaces(ctypes.c_void_p(devs), None, ctypes.byref(guid),
+	                                            0, ctypes.byref(interface)):
+		raise Exception('xeniface device not found')
+
+	required = wintypes.DWORD()
+	setupapi.SetupDiGetDeviceInterfaceDetailW(ctypes.c_void_p(devs), ctypes.byref(interface),
+	                                          None, 0, ctypes.byref(required), None)
+	detail = ctypes.create_string_buffer(required.value)
+	# cbSize of SP_DEVICE_INTERFACE_DETAIL_DATA_W, not of the whole buffer
+	struct.pack_into('<I', detail, 0, 8 if ctypes.sizeof(ctypes.c_void_p) == 8 else 6)
+	if not setupapi.SetupDiGetDeviceInterfaceDetailW(ctypes.c_void_p(devs), ctypes.byref(interface),
+	                                                 detail, required, None, None):
+		raise Exception('SetupDiGetDeviceInterfaceDetail failed')
+	setupapi.SetupDiDestroyDeviceInfoList(ctypes.c_void_p(devs))
+	path = ctypes.wstring_at(ctypes.addressof(detail) + 4)
+
+	# The dump is refused unless SeDebugPrivilege is enabled
+	class LUID_AND_ATTRIBUTES(ctypes.Structure):
+		_fields_ = [('LowPart', wintypes.DWORD), ('HighPart', wintypes.LONG),
+		            ('Attributes', wintypes.DWORD)]
+
+	class TOKEN_PRIVILEGES(ctypes.Structure):
+		_fields_ = [('PrivilegeCount', wintypes.DWORD), ('Privileges', LUID_AND_ATTRIBUTES * 1)]
+
+	advapi32 = ctypes.windll.advapi32
+	TOKEN_ADJUST_PRIVILEGES = 0x20
+	SE_PRIVILEGE_ENABLED = 0x2
+	kernel32.GetCurrentProcess.restype = ctypes.c_void_p
+	token = ctypes.c_void_p()
+	privileges = TOKEN_PRIVILEGES()
+	privileges.PrivilegeCount = 1
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED
+	if (not advapi32.OpenProcessToken(ctypes.c_void_p(kernel32.GetCurrentProcess()),
+	                                  TOKEN_ADJUST_PRIVILEGES, ctypes.byref(token)) or
+	    not advapi32.LookupPrivilegeValueW(None, 'SeDebugPrivilege',
+	                                       ctypes.byref(privileges.Privileges[0]))):
+		raise Exception('cannot open the process token')
+	advapi32.AdjustTokenPrivileges(token, False, ctypes.byref(privileges), 0, None, None)
+	error = kernel32.GetLastError()
+	kernel32.CloseHandle(token)
+	if error != 0:
+		raise Exception('SeDebugPrivilege is not held; run as an administrator')
+
+	GENERIC_READ_WRITE = 0xc0000000
+	OPEN_EXISTING = 3
+	kernel32.CreateFileW.restype = ctypes.c_void_p
+	handle = kernel32.CreateFileW(path, GENERIC_READ_WRITE, 3, None, OPEN_EXISTING, 0, None)
+	if handle is None or handle == ctypes.c_void_p(-1).value:
+		raise Exception('cannot open %s' % path)
+
+	# A zero length request returns the size required
+	returned = wintypes.DWORD()
+	kernel32.DeviceIoControl(ctypes.c_void_p(handle), IOCTL_XENIFACE_TRACE_DUMP, None, 0,
+	                         None, 0, ctypes.byref(returned), None)
+	buffer = ctypes.create_string_buffer(returned.value)
+	ok = kernel32.DeviceIoControl(ctypes.c_void_p(handle), IOCTL_XENIFACE_TRACE_DUMP, None, 0,
+	                              buffer, returned.value, ctypes.byref(returned), None)
+	kernel32.CloseHandle(ctypes.c_void_p(handle))
+	if not ok:
+		raise Exception('IOCTL_XENIFACE_TRACE_DUMP failed')
+
+	return buffer.raw[:returned.value]
+
+if __name__ == '__main__':
+	events = load_events(os.path.join(os.path.dirname(os.path.abspath(__file__)),
+	                                  'include', 'xeniface_trace.h'))
+
+	if len(sys.argv) > 1:
+		data = open(sys.argv[1], 'rb').read()
+	else:
+		data = fetch()
+
+	decode(data, events)